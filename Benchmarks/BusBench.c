@@ -0,0 +1,169 @@
+/*
+ * BusBench.c
+ *
+ *  How fairly the Qik dispatcher shares one serial bus between several Qiks
+ *  when every one of them has a full query lane. The serial port is
+ *  QikUartModel's UART with the Qiks on the other end answering every
+ *  query on the shared line, and the bytes each device gets on the wire
+ *  are counted.
+ *
+ *  Usage: BusBench [devices] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Qik2s9v1.h"
+#include "SerialPort.h"
+#include "QikUartModel.h"
+
+#define DEFAULT_DEVICES   4
+#define DEFAULT_SECONDS   2
+#define FIRST_DEVICE      10   /*!< ID of the first modelled Qik */
+
+uint64_t wireBytes[QIK_MAX_BUS_DEVICES]; /*!< Bytes sent to each Qik */
+bool counting = false; /*!< Set while the bytes are being counted */
+uint8_t numDevices = DEFAULT_DEVICES;
+volatile int32_t running = 1; /*!< Cleared to stop the load threads */
+
+/* Function prototypes */
+uint64_t getCurrentTime(void);
+void countFrame(const uint8_t* frame, uint32_t len, uint64_t wireTime);
+void* querier(void* vp);
+
+/**
+ * A modelled Qik got a whole command, count it against its device
+ *
+ * @param frame    The command
+ * @param len      Its length
+ * @param wireTime unused
+ */
+void countFrame(const uint8_t* frame, uint32_t len,
+                __attribute__((unused)) uint64_t wireTime)
+{
+    uint32_t slot = frame[1] - FIRST_DEVICE;
+
+    if(__atomic_load_n(&counting, __ATOMIC_RELAXED) && slot < numDevices)
+    {
+        wireBytes[slot] += len;
+    }
+}
+
+/**
+ * Keeps one Qik's query lane full, the queue drops what doesn't fit
+ *
+ * @param vp The device ID, cast to a pointer
+ */
+void* querier(void* vp)
+{
+    uint8_t deviceId = (uint8_t)(uintptr_t) vp;
+    uint32_t i = 0;
+
+    while(running)
+    {
+        getConfigurationParameter(deviceId,
+                                  (config_parameter_t)(i++ % NUM_CONFIG_PARAMS),
+                                  NULL, NULL);
+        getErrorByte(deviceId, NULL, NULL);
+        usleep(100);
+    }
+    return NULL;
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [devices] [seconds]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    pthread_t threads[QIK_MAX_BUS_DEVICES];
+    uint32_t seconds = DEFAULT_SECONDS;
+    uint64_t start, elapsed, total, least, most;
+    double lineRate;
+    uint32_t i;
+
+    if(argc > 1)
+    {
+        numDevices = strtoul(argv[1], NULL, 10);
+    }
+    if(argc > 2)
+    {
+        seconds = strtoul(argv[2], NULL, 10);
+    }
+    if(numDevices < 1 || numDevices > QIK_MAX_BUS_DEVICES || seconds < 1)
+    {
+        fprintf(stderr, "Usage: %s [devices 1-%d] [seconds]\n", argv[0],
+                QIK_MAX_BUS_DEVICES);
+        return 1;
+    }
+
+    if(0 == initializeQikDispatcher())
+    {
+        fprintf(stderr, "Error setting up\n");
+        return 1;
+    }
+    for(i = 0; i < numDevices; i++)
+    {
+        if(0 == addQikDevice(FIRST_DEVICE + i))
+        {
+            fprintf(stderr, "Error adding device %u\n", FIRST_DEVICE + i);
+            return 1;
+        }
+    }
+
+    if(0 == startQikUartModel(countFrame))
+    {
+        fprintf(stderr, "Error creating threads\n");
+        return 1;
+    }
+    for(i = 0; i < numDevices; i++)
+    {
+        if(pthread_create(&threads[i], NULL, querier,
+                          (void*)(uintptr_t)(FIRST_DEVICE + i)))
+        {
+            fprintf(stderr, "Error creating threads\n");
+            return 1;
+        }
+    }
+
+    /* Let the lanes fill up, then count */
+    usleep(200000);
+    start = getCurrentTime();
+    __atomic_store_n(&counting, true, __ATOMIC_RELAXED);
+    sleep(seconds);
+    __atomic_store_n(&counting, false, __ATOMIC_RELAXED);
+    elapsed = getCurrentTime() - start;
+    running = 0;
+    stopQikUartModel();
+
+    /* Bytes a second the line can carry */
+    lineRate = 1000000.0 / SERIAL_BYTE_USEC;
+    total = 0;
+    least = UINT64_MAX;
+    most = 0;
+    printf("%u Qiks at %d baud with every query lane saturated\n", numDevices,
+           SERIAL_BAUD);
+    for(i = 0; i < numDevices; i++)
+    {
+        printf("device %3u  %7.0f B/s  %5.1f%% of the line\n", FIRST_DEVICE + i,
+               wireBytes[i] * 1000000.0 / elapsed,
+               wireBytes[i] * 1000000.0 / elapsed * 100.0 / lineRate);
+        total += wireBytes[i];
+        least = (wireBytes[i] < least) ? wireBytes[i] : least;
+        most = (wireBytes[i] > most) ? wireBytes[i] : most;
+    }
+    printf("total       %7.0f B/s  %5.1f%% of the line, ideal share %.1f%%\n",
+           total * 1000000.0 / elapsed,
+           total * 1000000.0 / elapsed * 100.0 / lineRate,
+           100.0 / numDevices);
+    printf("fairness    least/most %.3f\n", most ? (double) least / most : 0.0);
+
+    return 0;
+}
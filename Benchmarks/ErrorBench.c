@@ -0,0 +1,262 @@
+/*
+ * ErrorBench.c
+ *
+ *  Latency from the error pin rising to the GET_ERROR_BYTE that asks why,
+ *  while the motion and query lanes are kept saturated. The pin is the mock
+ *  GPIO backend's, raised from this thread the way pigpio's callback
+ *  thread would raise it, and its watch function calls signalQikError() as
+ *  MotorDriver's does. For comparison the same number of error bytes are
+ *  then asked for the old way, an emergencyStop() and a getErrorByte()
+ *  through the device's queue. The serial port is QikUartModel's UART and
+ *  Qik, and the latency is measured to the moment the query's last byte
+ *  would leave the wire.
+ *
+ *  Usage: ErrorBench [edges]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Qik2s9v1.h"
+#include "SerialPort.h"
+#include "Gpio.h"
+#include "QikUartModel.h"
+
+#define DEFAULT_EDGES     500
+#define DEVICE            DEFAULT_DEVICE_ID
+#define ERROR_PIN         4
+#define MOTION_USEC       1000   /*!< Gap between teleop setpoints */
+#define GIVE_UP_USEC      500000 /*!< A query this late was dropped */
+
+/* The query being timed */
+uint64_t queryRequested = 0; /*!< When the error was raised, 0 if idle */
+uint64_t queryLatency = 0; /*!< Filled in when the query is on the wire */
+volatile int32_t running = 1; /*!< Cleared to stop the load threads */
+
+/* Function prototypes */
+uint64_t getCurrentTime(void);
+void queryFrame(const uint8_t* frame, uint32_t len, uint64_t wireTime);
+void errorEdge(uint32_t pin, uint32_t level);
+void* teleop(void* vp);
+void* querier(void* vp);
+uint32_t timeQueries(uint64_t* latency, uint32_t count, bool signalled);
+void report(const char* name, uint64_t* latency, uint32_t count,
+            uint32_t dropped);
+
+/**
+ * The modelled Qik got a whole command
+ *
+ * @param frame    The command
+ * @param len      unused
+ * @param wireTime When its last byte left the wire
+ */
+void queryFrame(const uint8_t* frame, __attribute__((unused)) uint32_t len,
+                uint64_t wireTime)
+{
+    uint64_t requested;
+
+    /* Only the query being timed asks for the error byte */
+    requested = __atomic_load_n(&queryRequested, __ATOMIC_ACQUIRE);
+    if(requested != 0 && frame[2] == 0x02)
+    {
+        __atomic_store_n(&queryLatency, wireTime - requested,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&queryRequested, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * The error pin's watch function, like MotorDriver's errorFunc()
+ *
+ * @param pin   unused
+ * @param level unused
+ */
+void errorEdge(__attribute__((unused)) uint32_t pin,
+               __attribute__((unused)) uint32_t level)
+{
+    signalQikError();
+}
+
+/**
+ * Keeps the motion lane busy with a new pair of setpoints every MOTION_USEC
+ */
+void* teleop(__attribute__((unused)) void* vp)
+{
+    uint8_t speed = 1;
+
+    while(running)
+    {
+        speed = (speed % 126) + 1;
+        setM0Forward(DEVICE, speed);
+        setM1Reverse(DEVICE, speed);
+        usleep(MOTION_USEC);
+    }
+    return NULL;
+}
+
+/**
+ * Keeps the query lane full, with everything but GET_ERROR_BYTE
+ */
+void* querier(__attribute__((unused)) void* vp)
+{
+    uint32_t i = 0;
+
+    while(running)
+    {
+        getConfigurationParameter(DEVICE, (config_parameter_t)(i++ % NUM_CONFIG_PARAMS),
+                                  NULL, NULL);
+        setConfigurationParameter(DEVICE, SHUTDOWN_MOTOR_ON_ERROR, 1, NULL, NULL);
+        getFirmwareVersion(DEVICE, NULL, NULL);
+        usleep(200);
+    }
+    return NULL;
+}
+
+/**
+ * Ask for the error byte at odd moments and time each query to the wire
+ *
+ * @param latency Filled in with the latencies of the queries that were sent
+ * @param count How many to ask for
+ * @param signalled true to raise the error pin, false to call getErrorByte()
+ * @return How many were sent, the rest were turned away or too late
+ */
+uint32_t timeQueries(uint64_t* latency, uint32_t count, bool signalled)
+{
+    qikQueueStats_t before, after;
+    uint64_t start;
+    uint32_t sent = 0;
+    uint32_t i;
+
+    for(i = 0; i < count; i++)
+    {
+        usleep(2000 + rand() % 5000);
+
+        __atomic_store_n(&queryLatency, 0, __ATOMIC_RELAXED);
+        start = getCurrentTime();
+        __atomic_store_n(&queryRequested, start, __ATOMIC_RELEASE);
+        if(signalled)
+        {
+            setMockGpio(ERROR_PIN, 1);
+        }
+        else
+        {
+            /* What the error pin's watch function used to do */
+            getQikQueueStats(DEVICE, &before);
+            emergencyStop(DEVICE);
+            getErrorByte(DEVICE, NULL, NULL);
+            getQikQueueStats(DEVICE, &after);
+
+            /* Turned away by the full queue, it'll never be sent */
+            if(after.full != before.full)
+            {
+                __atomic_store_n(&queryRequested, 0, __ATOMIC_RELEASE);
+                continue;
+            }
+        }
+
+        while(__atomic_load_n(&queryRequested, __ATOMIC_ACQUIRE) != 0 &&
+                getCurrentTime() - start < GIVE_UP_USEC)
+        {
+            usleep(100);
+        }
+        if(__atomic_exchange_n(&queryRequested, 0, __ATOMIC_ACQ_REL) == 0)
+        {
+            latency[sent++] = __atomic_load_n(&queryLatency, __ATOMIC_ACQUIRE);
+        }
+        setMockGpio(ERROR_PIN, 0);
+    }
+    return sent;
+}
+
+/**
+ * Print the percentiles of a set of latencies
+ *
+ * @param name    How the queries were asked for
+ * @param latency The latencies, in us, sorted in place
+ * @param count   The number of latencies
+ * @param dropped How many queries never went out
+ */
+void report(const char* name, uint64_t* latency, uint32_t count,
+            uint32_t dropped)
+{
+    if(count == 0)
+    {
+        printf("%-18s  all %u dropped\n", name, dropped);
+        return;
+    }
+
+    printLatencies(name, latency, count);
+    if(dropped > 0)
+    {
+        printf("%-18s  %u dropped\n", "", dropped);
+    }
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [edges]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    pthread_t threads[2];
+    qikErrorStats_t stats;
+    uint64_t* latency;
+    uint32_t edges = DEFAULT_EDGES;
+    uint32_t sent;
+
+    if(argc > 1)
+    {
+        edges = strtoul(argv[1], NULL, 10);
+    }
+    if(edges < 1)
+    {
+        fprintf(stderr, "Usage: %s [edges]\n", argv[0]);
+        return 1;
+    }
+
+    latency = malloc(edges * sizeof(uint64_t));
+    if(latency == NULL || 0 == initializeQikDispatcher() ||
+            0 == addQikDevice(DEVICE) || 0 == openGpio() ||
+            0 == watchGpioEdge(ERROR_PIN, GPIO_RISING_EDGE, errorEdge))
+    {
+        fprintf(stderr, "Error setting up\n");
+        return 1;
+    }
+
+    if(0 == startQikUartModel(queryFrame) ||
+            pthread_create(&threads[0], NULL, teleop, NULL) ||
+            pthread_create(&threads[1], NULL, querier, NULL))
+    {
+        fprintf(stderr, "Error creating threads\n");
+        return 1;
+    }
+
+    /* Let the lanes fill up, then raise the error at odd moments */
+    usleep(200000);
+    printf("%u error bytes at %d baud with motion and queries saturated\n",
+           edges, SERIAL_BAUD);
+    printf("each waits for a stop, %d us on the wire, and takes %d us itself\n",
+           8 * SERIAL_BYTE_USEC, 3 * SERIAL_BYTE_USEC);
+
+    sent = timeQueries(latency, edges, true);
+    getQikErrorStats(&stats);
+    report("error pin to wire", latency, sent, edges - sent);
+    printf("%-18s  mean %5lu us  max %6lu us\n", "error pin to batch",
+           (unsigned long)(stats.queries ? stats.sumUsec / stats.queries : 0),
+           (unsigned long) stats.maxUsec);
+
+    sent = timeQueries(latency, edges, false);
+    report("getErrorByte()", latency, sent, edges - sent);
+    running = 0;
+    stopQikUartModel();
+
+    free(latency);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * FlightBench.c
+ *
+ *  What the flight recorder adds to the serial path. A motor command and a
+ *  GET_ERROR_BYTE query are written to /dev/null with writev(), as
+ *  writevToSerialPort() does, then recorded, and the query's answer is
+ *  recorded as readSerial() would. Each writev() and each record is timed,
+ *  so the recorder's cost can be read against the system call it follows.
+ *
+ *  Usage: FlightBench [frames] [ring file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "FlightRecorder.h"
+
+#define DEFAULT_FRAMES 200000
+#define DEFAULT_PATH   "/tmp/FlightBench.flight"
+
+/* Function prototypes */
+uint64_t nowNs(void);
+int compareU32(const void* a, const void* b);
+void report(const char* name, uint32_t* samples, uint32_t count);
+
+/**
+ * @return Nanoseconds on the monotonic clock
+ */
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * qsort() comparison for latency samples
+ */
+int compareU32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort and print the percentiles of a set of latency samples
+ *
+ * @param name    What was measured
+ * @param samples The samples, in ns, sorted in place
+ * @param count   The number of samples
+ */
+void report(const char* name, uint32_t* samples, uint32_t count)
+{
+    qsort(samples, count, sizeof(uint32_t), compareU32);
+
+    printf("%-20s p50 %6u ns  p99 %6u ns  p99.9 %7u ns  max %8u ns\n",
+           name, samples[count / 2], samples[count * 99 / 100],
+           samples[count * 999 / 1000], samples[count - 1]);
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [frames] [ring file]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    uint8_t motorFrame[4] = {0xAA, 0x0A, 0x08, 0x7F};
+    uint8_t queryFrame[3] = {0xAA, 0x0A, 0x02};
+    uint8_t answer = 0x00;
+    uint32_t frames = DEFAULT_FRAMES;
+    const char* path = DEFAULT_PATH;
+    uint32_t* writes;
+    uint32_t* txRecords;
+    uint32_t* rxRecords;
+    struct iovec iov;
+    uint64_t start;
+    ssize_t numWritten;
+    int32_t fd;
+    uint32_t i;
+
+    if(argc > 1)
+    {
+        frames = strtoul(argv[1], NULL, 10);
+    }
+    if(argc > 2)
+    {
+        path = argv[2];
+    }
+    if(frames < 1)
+    {
+        fprintf(stderr, "Usage: %s [frames] [ring file]\n", argv[0]);
+        return 1;
+    }
+
+    writes = malloc(2 * frames * sizeof(uint32_t));
+    txRecords = malloc(2 * frames * sizeof(uint32_t));
+    rxRecords = malloc(frames * sizeof(uint32_t));
+    if(writes == NULL || txRecords == NULL || rxRecords == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    fd = open("/dev/null", O_WRONLY);
+    if(fd == -1 || openFlightRecorder(path) == 0)
+    {
+        fprintf(stderr, "Can't open /dev/null or %s\n", path);
+        return 1;
+    }
+
+    for(i = 0; i < frames; i++)
+    {
+        iov.iov_base = motorFrame;
+        iov.iov_len = sizeof(motorFrame);
+        start = nowNs();
+        numWritten = writev(fd, &iov, 1);
+        writes[2 * i] = (uint32_t)(nowNs() - start);
+        start = nowNs();
+        recordSerialTx(&iov, 1, numWritten);
+        txRecords[2 * i] = (uint32_t)(nowNs() - start);
+
+        iov.iov_base = queryFrame;
+        iov.iov_len = sizeof(queryFrame);
+        start = nowNs();
+        numWritten = writev(fd, &iov, 1);
+        writes[2 * i + 1] = (uint32_t)(nowNs() - start);
+        start = nowNs();
+        recordSerialTx(&iov, 1, numWritten);
+        txRecords[2 * i + 1] = (uint32_t)(nowNs() - start);
+
+        start = nowNs();
+        recordSerialRx(&answer, 1);
+        rxRecords[i] = (uint32_t)(nowNs() - start);
+    }
+
+    printf("%lu frames written and recorded in %s\n",
+           (unsigned long)(2 * frames), path);
+    report("writev()", writes, 2 * frames);
+    report("recordSerialTx()", txRecords, 2 * frames);
+    report("recordSerialRx()", rxRecords, frames);
+
+    close(fd);
+    free(writes);
+    free(txRecords);
+    free(rxRecords);
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * LogBench.c
+ *
+ *  What a log message costs the thread that logs it. A number of threads
+ *  log in bursts, first through logMessage() while this thread drains the
+ *  rings, then through printf() like the daemon used to, and each call is
+ *  timed. The bursts are small enough for a ring to hold, so the time is
+ *  that of writing a record rather than of finding the ring full.
+ *  Everything logged goes to /dev/null, so printf() is only ever held up
+ *  by the stdout lock, never by a slow reader.
+ *
+ *  Usage: LogBench [threads] [messages per thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Log.h"
+
+#define DEFAULT_THREADS  3
+#define DEFAULT_MESSAGES 100000
+#define BURST            32   /*!< Messages between pauses, a quarter ring */
+#define PAUSE_USEC       500  /*!< Long enough for the rings to be drained */
+#define MAX_THREADS      15   /*!< Leaves this thread a ring of its own */
+
+uint32_t messagesPerThread = DEFAULT_MESSAGES; /*!< Logged by each thread */
+uint32_t* logLatency[MAX_THREADS]; /*!< Per thread logMessage() times, ns */
+uint32_t* printfLatency[MAX_THREADS]; /*!< Per thread printf() times, ns */
+volatile int32_t startFlag = 0; /*!< Releases every thread at once */
+
+/* Function prototypes */
+uint64_t nowNs(void);
+void* logger(void* vp);
+int compareU32(const void* a, const void* b);
+void report(FILE* out, const char* name, uint32_t* samples, uint64_t count);
+
+/**
+ * @return Nanoseconds on the monotonic clock
+ */
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Log messagesPerThread messages each way, timing every call
+ *
+ * @param vp The thread's index
+ */
+void* logger(void* vp)
+{
+    int32_t id = (int32_t)(intptr_t) vp;
+    uint64_t start;
+    uint32_t i;
+
+    while(!__atomic_load_n(&startFlag, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+
+    for(i = 0; i < messagesPerThread; i++)
+    {
+        start = nowNs();
+        logMessage(LOG_LEVEL_INFO, "processMotorControl (%d %s) %s", id,
+                   "UP", "START");
+        logLatency[id][i] = (uint32_t)(nowNs() - start);
+        if(i % BURST == BURST - 1)
+        {
+            usleep(PAUSE_USEC);
+        }
+    }
+
+    for(i = 0; i < messagesPerThread; i++)
+    {
+        start = nowNs();
+        printf("processMotorControl (%d %s) %s\n", id, "UP", "START");
+        printfLatency[id][i] = (uint32_t)(nowNs() - start);
+        if(i % BURST == BURST - 1)
+        {
+            usleep(PAUSE_USEC);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * qsort() comparison for latency samples
+ */
+int compareU32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort and print the percentiles of a set of latency samples
+ *
+ * @param out     Where to print them
+ * @param name    What was measured
+ * @param samples The samples, in ns, sorted in place
+ * @param count   The number of samples
+ */
+void report(FILE* out, const char* name, uint32_t* samples, uint64_t count)
+{
+    qsort(samples, count, sizeof(uint32_t), compareU32);
+
+    fprintf(out, "%-16s p50 %6u ns  p99 %6u ns  p99.9 %7u ns  max %8u ns\n",
+            name, samples[count / 2], samples[count * 99 / 100],
+            samples[count * 999 / 1000], samples[count - 1]);
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [threads] [messages per thread]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    int32_t threads = DEFAULT_THREADS;
+    pthread_t thread[MAX_THREADS];
+    uint32_t* allLogs;
+    uint32_t* allPrintfs;
+    uint64_t total;
+    logStats_t stats;
+    FILE* out;
+    int32_t i;
+
+    if(argc > 1)
+    {
+        threads = atoi(argv[1]);
+    }
+    if(argc > 2)
+    {
+        messagesPerThread = strtoul(argv[2], NULL, 10);
+    }
+    if(threads < 1 || threads > MAX_THREADS || messagesPerThread < 1)
+    {
+        fprintf(stderr, "Usage: %s [threads 1-%d] [messages]\n", argv[0],
+                MAX_THREADS);
+        return 1;
+    }
+
+    total = (uint64_t) threads * messagesPerThread;
+    allLogs = malloc(total * sizeof(uint32_t));
+    allPrintfs = malloc(total * sizeof(uint32_t));
+    if(allLogs == NULL || allPrintfs == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* The results go where stdout was, the messages go nowhere */
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if(out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        fprintf(stderr, "Can't send stdout to /dev/null\n");
+        return 1;
+    }
+
+    /* Every message is written, or dropped because its ring was full */
+    setLogRateLimit(0);
+
+    for(i = 0; i < threads; i++)
+    {
+        logLatency[i] = allLogs + (uint64_t) i * messagesPerThread;
+        printfLatency[i] = allPrintfs + (uint64_t) i * messagesPerThread;
+        if(pthread_create(&thread[i], NULL, logger, (void*)(intptr_t) i))
+        {
+            fprintf(stderr, "Error creating logging thread\n");
+            return 1;
+        }
+    }
+
+    /* This thread plays the log thread, draining as fast as it can */
+    __atomic_store_n(&startFlag, 1, __ATOMIC_RELEASE);
+    for(i = 0; i < threads; i++)
+    {
+        while(pthread_tryjoin_np(thread[i], NULL) != 0)
+        {
+            if(drainLogs() == 0)
+            {
+                sched_yield();
+            }
+        }
+    }
+    drainLogs();
+    getLogStats(&stats);
+
+    fprintf(out, "%d threads, %lu messages each way\n", threads,
+            (unsigned long) total);
+    fprintf(out, "logMessage()     %lu written, %lu dropped to full rings\n",
+            (unsigned long) stats.written, (unsigned long) stats.full);
+    report(out, "logMessage()", allLogs, total);
+    report(out, "printf()", allPrintfs, total);
+
+    fclose(out);
+    free(allLogs);
+    free(allPrintfs);
+    return 0;
+}
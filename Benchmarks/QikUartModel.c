@@ -0,0 +1,249 @@
+/*
+ * QikUartModel.c
+ *
+ *  The serial port, as the dispatcher benchmarks see it. Every byte the
+ *  dispatcher writes is clocked out at SERIAL_BAUD after the ones before
+ *  it, and each whole command is handed to the benchmark's frame function
+ *  when its last byte would arrive. Queries are answered ANSWER_USEC later
+ *  by a thread playing the serial thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "Qik2s9v1.h"
+#include "SerialPort.h"
+#include "QikUartModel.h"
+
+#define ANSWER_USEC 300 /*!< How long a modelled Qik takes to answer */
+#define MAX_ANSWERS 64  /*!< Answers that can be pending on the line */
+
+/* An answer a modelled Qik will send */
+typedef struct
+{
+    uint64_t due;  /*!< When it reaches the serial thread */
+    uint8_t byte;  /*!< What it says */
+} answer_t;
+
+/* The modelled UART, only touched by the dispatcher through writev */
+uint64_t uartIdleTime = 0; /*!< When the last byte written leaves the wire */
+uint8_t frame[8]; /*!< The command the Qiks are receiving */
+uint32_t frameLen = 0; /*!< Bytes of frame[] received */
+qikFrameFunc_t frameFunc = NULL; /*!< The benchmark's, may be NULL */
+
+/* Answers on their way back, from the dispatcher to the answer thread */
+pthread_mutex_t answerLock = PTHREAD_MUTEX_INITIALIZER;
+answer_t answers[MAX_ANSWERS];
+uint32_t answerHead = 0;
+uint32_t answerTail = 0;
+volatile int32_t answering = 1; /*!< Cleared to stop the answer thread */
+
+/* Function prototypes */
+uint64_t getCurrentTime(void);
+uint32_t commandLength(uint8_t command);
+void receiveFrame(void);
+void* dispatcher(void* vp);
+void* answerer(void* vp);
+int compareU64(const void* a, const void* b);
+
+/**
+ * The length of a Pololu protocol command, from its command byte
+ *
+ * @param command The command byte
+ * @return The whole packet's length
+ */
+uint32_t commandLength(uint8_t command)
+{
+    switch(command)
+    {
+        case 0x03:
+            return 4;
+        case 0x04:
+            return 7;
+        case 0x01:
+        case 0x02:
+        case 0x06:
+        case 0x07:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+/**
+ * Stands in for the serial port. Every byte is clocked out at SERIAL_BAUD
+ * after the ones before it, and each whole command is acted on when its
+ * last byte would arrive.
+ */
+ssize_t writevToSerialPort(const struct iovec* iov, int iovcnt)
+{
+    uint64_t now = getCurrentTime();
+    ssize_t total = 0;
+    size_t j;
+    int i;
+
+    if(uartIdleTime < now)
+    {
+        uartIdleTime = now;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+    {
+        for(j = 0; j < iov[i].iov_len; j++)
+        {
+            uartIdleTime += SERIAL_BYTE_USEC;
+            frame[frameLen++] = ((const uint8_t*) iov[i].iov_base)[j];
+            if(frameLen >= 3 && frameLen == commandLength(frame[2]))
+            {
+                receiveFrame();
+                frameLen = 0;
+            }
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * The modelled UART never fills up, so it's never polled
+ */
+int32_t getSerialPortFd(void)
+{
+    return -1;
+}
+
+/**
+ * The modelled Qiks got a whole command at uartIdleTime
+ */
+void receiveFrame(void)
+{
+    if(frameFunc != NULL)
+    {
+        frameFunc(frame, frameLen, uartIdleTime);
+    }
+
+    /* Queries, GET_FIRMWARE_VERSION to SET_CONFIG_PARAM, get an answer */
+    if(frame[2] <= 0x04)
+    {
+        pthread_mutex_lock(&answerLock);
+        if(answerTail - answerHead < MAX_ANSWERS)
+        {
+            answers[answerTail % MAX_ANSWERS].due = uartIdleTime + ANSWER_USEC +
+                                                    SERIAL_BYTE_USEC;
+            answers[answerTail % MAX_ANSWERS].byte = 0;
+            answerTail++;
+        }
+        pthread_mutex_unlock(&answerLock);
+    }
+}
+
+/**
+ * Runs the dispatcher like main() does
+ */
+void* dispatcher(__attribute__((unused)) void* vp)
+{
+    while(1)
+    {
+        processQikState();
+    }
+    return NULL;
+}
+
+/**
+ * Plays the serial thread, delivering answers as they come off the line
+ */
+void* answerer(__attribute__((unused)) void* vp)
+{
+    answer_t answer;
+    uint64_t now;
+    bool ready;
+
+    while(answering)
+    {
+        pthread_mutex_lock(&answerLock);
+        ready = (answerHead != answerTail);
+        if(ready)
+        {
+            answer = answers[answerHead % MAX_ANSWERS];
+        }
+        pthread_mutex_unlock(&answerLock);
+
+        if(!ready)
+        {
+            usleep(100);
+            continue;
+        }
+
+        now = getCurrentTime();
+        if(now < answer.due)
+        {
+            usleep(answer.due - now);
+        }
+
+        pthread_mutex_lock(&answerLock);
+        answerHead++;
+        pthread_mutex_unlock(&answerLock);
+        processResponses(&answer.byte, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Start the dispatcher and the modelled Qiks' answers. The dispatcher and
+ * the devices must already be set up.
+ *
+ * @param onFrame Called with every whole command, may be NULL
+ * @return 0 if the threads can't be created, 1 for success
+ */
+uint8_t startQikUartModel(qikFrameFunc_t onFrame)
+{
+    pthread_t thread;
+
+    frameFunc = onFrame;
+    if(pthread_create(&thread, NULL, dispatcher, NULL) ||
+            pthread_create(&thread, NULL, answerer, NULL))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Stop answering, the dispatcher runs until the benchmark exits
+ */
+void stopQikUartModel(void)
+{
+    answering = 0;
+}
+
+/**
+ * qsort() comparison for latency samples
+ */
+int compareU64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort and print the percentiles of a set of latencies
+ *
+ * @param name    What was measured
+ * @param latency The latencies, in us, sorted in place
+ * @param count   The number of latencies, at least 1
+ */
+void printLatencies(const char* name, uint64_t* latency, uint32_t count)
+{
+    qsort(latency, count, sizeof(uint64_t), compareU64);
+    printf("%-18s  p50 %6lu us  p99 %6lu us  max %6lu us\n", name,
+           (unsigned long) latency[count / 2],
+           (unsigned long) latency[count * 99 / 100],
+           (unsigned long) latency[count - 1]);
+}
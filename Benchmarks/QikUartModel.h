@@ -0,0 +1,26 @@
+/*
+ * QikUartModel.h
+ *
+ *  A model of the serial port for the dispatcher benchmarks: a UART at
+ *  SERIAL_BAUD with Qiks on the other end that answer every query on the
+ *  shared line. It replaces SerialPort.o, so the dispatcher's writes are
+ *  clocked out here and the answers come back through processResponses()
+ *  as the serial thread would deliver them.
+ */
+
+#ifndef _QIK_UART_MODEL_H_
+#define _QIK_UART_MODEL_H_
+
+#include <stdint.h>
+
+/* Called on the dispatcher's thread when a whole command has reached the
+ * modelled Qiks, wireTime is when its last byte left the wire in
+ * getCurrentTime() microseconds */
+typedef void (*qikFrameFunc_t)(const uint8_t* frame, uint32_t len,
+                               uint64_t wireTime);
+
+uint8_t startQikUartModel(qikFrameFunc_t onFrame);
+void stopQikUartModel(void);
+void printLatencies(const char* name, uint64_t* latency, uint32_t count);
+
+#endif /* _QIK_UART_MODEL_H_ */
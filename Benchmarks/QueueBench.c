@@ -0,0 +1,204 @@
+/*
+ * QueueBench.c
+ *
+ *  Throughput and latency of the Qik command queue. A number of producer
+ *  threads hammer the ring while a single consumer drains it, like the HTTP
+ *  threads and ISR feeding the serial thread.
+ *
+ *  Usage: QueueBench [producers] [commands per producer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "QikQueue.h"
+
+#define DEFAULT_PRODUCERS 3
+#define DEFAULT_COMMANDS  1000000
+#define MAX_PRODUCERS     64
+
+qikQueue_t queue; /*!< The ring under test */
+uint32_t commandsPerProducer = DEFAULT_COMMANDS; /*!< Pushed by each producer */
+uint32_t* pushLatency[MAX_PRODUCERS]; /*!< Per producer push times, ns */
+uint64_t fullCount[MAX_PRODUCERS]; /*!< Per producer pushes refused */
+volatile int32_t startFlag = 0; /*!< Releases every thread at once */
+
+/* Function prototypes */
+uint64_t nowNs(void);
+void* producer(void* vp);
+int compareU32(const void* a, const void* b);
+void report(const char* name, uint32_t* samples, uint64_t count);
+
+/**
+ * @return Nanoseconds on the monotonic clock
+ */
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Push commandsPerProducer timestamped commands, timing each push
+ *
+ * @param vp The producer's index
+ */
+void* producer(void* vp)
+{
+    int32_t id = (int32_t)(intptr_t) vp;
+    qikCommand_t cmd;
+    uint64_t stamp, done;
+    uint32_t i;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.len = sizeof(stamp);
+
+    while(!__atomic_load_n(&startFlag, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+
+    for(i = 0; i < commandsPerProducer; i++)
+    {
+        /* The timestamp rides in the payload to time the trip through */
+        stamp = nowNs();
+        memcpy(cmd.data, &stamp, sizeof(stamp));
+
+        while(!qikQueuePush(&queue, &cmd))
+        {
+            /* Let the consumer run, it may share this CPU */
+            fullCount[id]++;
+            sched_yield();
+            stamp = nowNs();
+            memcpy(cmd.data, &stamp, sizeof(stamp));
+        }
+
+        done = nowNs();
+        pushLatency[id][i] = (uint32_t)(done - stamp);
+    }
+
+    return NULL;
+}
+
+/**
+ * qsort() comparison for latency samples
+ */
+int compareU32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort and print the percentiles of a set of latency samples
+ *
+ * @param name    What was measured
+ * @param samples The samples, in ns, sorted in place
+ * @param count   The number of samples
+ */
+void report(const char* name, uint32_t* samples, uint64_t count)
+{
+    qsort(samples, count, sizeof(uint32_t), compareU32);
+
+    printf("%-16s p50 %6u ns  p99 %6u ns  p99.9 %7u ns  max %8u ns\n", name,
+           samples[count / 2], samples[count * 99 / 100],
+           samples[count * 999 / 1000], samples[count - 1]);
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [producers] [commands per producer]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    int32_t producers = DEFAULT_PRODUCERS;
+    pthread_t threads[MAX_PRODUCERS];
+    uint32_t* queueLatency;
+    uint32_t* allPushes;
+    uint64_t total, popped = 0, fulls = 0, start, elapsed;
+    qikCommand_t cmd;
+    uint64_t stamp;
+    int32_t i;
+
+    if(argc > 1)
+    {
+        producers = atoi(argv[1]);
+    }
+    if(argc > 2)
+    {
+        commandsPerProducer = strtoul(argv[2], NULL, 10);
+    }
+    if(producers < 1 || producers > MAX_PRODUCERS || commandsPerProducer < 1)
+    {
+        fprintf(stderr, "Usage: %s [producers 1-%d] [commands]\n", argv[0],
+                MAX_PRODUCERS);
+        return 1;
+    }
+
+    total = (uint64_t) producers * commandsPerProducer;
+    queueLatency = malloc(total * sizeof(uint32_t));
+    allPushes = malloc(total * sizeof(uint32_t));
+    if(queueLatency == NULL || allPushes == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    qikQueueInit(&queue);
+
+    for(i = 0; i < producers; i++)
+    {
+        pushLatency[i] = allPushes + (uint64_t) i * commandsPerProducer;
+        if(pthread_create(&threads[i], NULL, producer, (void*)(intptr_t) i))
+        {
+            fprintf(stderr, "Error creating producer thread\n");
+            return 1;
+        }
+    }
+
+    /* This thread is the consumer */
+    start = nowNs();
+    __atomic_store_n(&startFlag, 1, __ATOMIC_RELEASE);
+    while(popped < total)
+    {
+        if(qikQueuePop(&queue, &cmd))
+        {
+            memcpy(&stamp, cmd.data, sizeof(stamp));
+            queueLatency[popped++] = (uint32_t)(nowNs() - stamp);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    elapsed = nowNs() - start;
+
+    for(i = 0; i < producers; i++)
+    {
+        pthread_join(threads[i], NULL);
+        fulls += fullCount[i];
+    }
+
+    printf("%d producers, %lu commands, %u slot ring\n", producers,
+           (unsigned long) total, QIK_QUEUE_SIZE);
+    printf("throughput       %.2f M commands/s, %lu pushes found it full\n",
+           total * 1000.0 / elapsed, (unsigned long) fulls);
+    report("push", allPushes, total);
+    report("push to pop", queueLatency, total);
+
+    free(queueLatency);
+    free(allPushes);
+    return 0;
+}
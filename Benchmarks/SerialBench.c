@@ -0,0 +1,341 @@
+/*
+ * SerialBench.c
+ *
+ *  Response byte latency, wakeups and CPU of the serial reader, over a pty
+ *  loopback. Bytes written to the pty master stand in for the Qik, and
+ *  readSerial() reads them from the slave like it would the UART. They are
+ *  written in bursts, one byte every SERIAL_BYTE_USEC like the UART would
+ *  deliver them, so a read profile that waits for several bytes shows what
+ *  it costs in latency against what it saves in wakeups. A burst whose last
+ *  bytes are left waiting for a batch to fill up is counted as stranded,
+ *  and they go through with the next burst. Each read profile runs in its
+ *  own process, with a fresh reader. The old non-blocking read loop is kept
+ *  here as the baseline.
+ *
+ *  Usage: SerialBench [poll|spin] [bursts] [vmin,vtime ...]
+ *
+ *  The poll reader runs the default 1,0 profile and 8,0 unless profiles
+ *  are given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "SerialPort.h"
+
+#define DEFAULT_BURSTS 250
+#define BURST_BYTES    8       /*!< Bytes in a burst, like a batch of answers */
+#define BURST_GAP_USEC 5000    /*!< Quiet line between bursts */
+#define STRAND_USEC    20000   /*!< A burst not through by then is stranded */
+#define TAIL_USEC      3000000 /*!< Longest wait for the last stranded bytes */
+#define IDLE_USEC      2000000 /*!< How long to measure idle CPU for */
+
+extern int SerialPortFileDescrptor;
+
+uint64_t* sentAt; /*!< When each test byte was written, ns */
+uint32_t* latency; /*!< Write to processResponses() time per byte, ns */
+volatile uint32_t received = 0; /*!< Test bytes seen so far */
+volatile uint32_t wakeups = 0; /*!< processResponses() calls so far */
+volatile int spinning = 1; /*!< Keeps the spin baseline going */
+
+/* Function prototypes */
+uint64_t nowNs(void);
+void* spinSerial(void* vp);
+int compareU32(const void* a, const void* b);
+uint64_t threadCpuNs(clockid_t clock);
+int runProfile(int spin, uint32_t bursts, const char* profile);
+
+/**
+ * @return Nanoseconds on the monotonic clock
+ */
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Stands in for the Qik driver, timestamping every byte that arrives
+ *
+ * @param buf The bytes read
+ * @param len The number of bytes
+ */
+void processResponses(const uint8_t * buf, size_t len)
+{
+    uint64_t now = nowNs();
+    size_t i;
+
+    (void) buf;
+    __atomic_store_n(&wakeups, wakeups + 1, __ATOMIC_RELAXED);
+    for(i = 0; i < len; i++)
+    {
+        latency[received] = (uint32_t)(now - sentAt[received]);
+        __atomic_store_n(&received, received + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * There's no Qik driver, so no devices to stop if the port goes away
+ *
+ * @param deviceIds unused
+ * @return 0
+ */
+uint8_t getQikDevices(__attribute__((unused)) uint8_t* deviceIds)
+{
+    return 0;
+}
+
+/**
+ * Never called, there are no devices
+ *
+ * @param deviceId unused
+ */
+void emergencyStop(__attribute__((unused)) uint8_t deviceId)
+{
+}
+
+/**
+ * The reader as it was, spinning on a non-blocking read
+ *
+ * @param vp The path to the serial port
+ */
+void* spinSerial(void* vp)
+{
+    uint8_t incBuf[1024];
+    int numRead;
+
+    initializeSerialPort((char*)vp);
+    fcntl(SerialPortFileDescrptor, F_SETFL, O_RDWR | O_NONBLOCK);
+
+    while(spinning)
+    {
+        numRead = read(SerialPortFileDescrptor, incBuf, sizeof(incBuf));
+        if(numRead > 0)
+        {
+            processResponses(incBuf, numRead);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * qsort() comparison for latency samples
+ */
+int compareU32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @param clock A thread's CPU clock
+ * @return The CPU time the thread has used, ns
+ */
+uint64_t threadCpuNs(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Measure one reader with the read profile that's been set
+ *
+ * @param spin    1 for the spin baseline, 0 for readSerial()
+ * @param bursts  The number of bursts to send
+ * @param profile The profile, for the report
+ * @return 0 for success, 1 for an error
+ */
+int runProfile(int spin, uint32_t bursts, const char* profile)
+{
+    uint32_t bytes = bursts * BURST_BYTES;
+    pthread_t reader;
+    clockid_t readerClock;
+    uint64_t cpuStart, idleNs, busyNs, busyStart, deadline;
+    uint32_t stranded = 0;
+    struct timespec next;
+    uint8_t byte = 0x55;
+    int32_t masterFd;
+    uint32_t i, j;
+
+    sentAt = malloc(bytes * sizeof(uint64_t));
+    latency = malloc(bytes * sizeof(uint32_t));
+    masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(sentAt == NULL || latency == NULL || masterFd == -1 ||
+            grantpt(masterFd) || unlockpt(masterFd))
+    {
+        fprintf(stderr, "Can't set up the pty\n");
+        return 1;
+    }
+
+    if(pthread_create(&reader, NULL, spin ? spinSerial : readSerial,
+                      ptsname(masterFd)))
+    {
+        fprintf(stderr, "Error creating reader thread\n");
+        return 1;
+    }
+    pthread_getcpuclockid(reader, &readerClock);
+    while(__atomic_load_n(&SerialPortFileDescrptor, __ATOMIC_ACQUIRE) == -1)
+    {
+        usleep(1000);
+    }
+    usleep(100000);
+
+    /* How much CPU does the reader burn with nothing to read? */
+    cpuStart = threadCpuNs(readerClock);
+    usleep(IDLE_USEC);
+    idleNs = threadCpuNs(readerClock) - cpuStart;
+
+    /* Then how long each byte of a burst takes to get through, with the
+     * bytes as far apart as the UART would put them
+     */
+    cpuStart = threadCpuNs(readerClock);
+    busyStart = nowNs();
+    for(i = 0; i < bursts; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for(j = 0; j < BURST_BYTES; j++)
+        {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            sentAt[i * BURST_BYTES + j] = nowNs();
+            if(write(masterFd, &byte, 1) != 1)
+            {
+                fprintf(stderr, "Error writing to the pty\n");
+                return 1;
+            }
+            next.tv_nsec += SERIAL_BYTE_USEC * 1000;
+            if(next.tv_nsec >= 1000000000)
+            {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+        }
+        deadline = nowNs() + (uint64_t) STRAND_USEC * 1000;
+        while(__atomic_load_n(&received, __ATOMIC_ACQUIRE) <
+                (i + 1) * BURST_BYTES)
+        {
+            if(nowNs() > deadline)
+            {
+                stranded++;
+                break;
+            }
+            usleep(100);
+        }
+        usleep(BURST_GAP_USEC);
+    }
+    busyNs = threadCpuNs(readerClock) - cpuStart;
+
+    /* readSerial() picks up what the last burst stranded on its timeout */
+    deadline = nowNs() + (uint64_t) TAIL_USEC * 1000;
+    while(__atomic_load_n(&received, __ATOMIC_ACQUIRE) < bytes &&
+            nowNs() < deadline)
+    {
+        usleep(1000);
+    }
+    if(received < bytes)
+    {
+        fprintf(stderr, "%u bytes never arrived\n", bytes - received);
+        return 1;
+    }
+
+    qsort(latency, bytes, sizeof(uint32_t), compareU32);
+    if(spin)
+    {
+        printf("spin reader, %u bursts of %u bytes over a pty\n", bursts,
+               BURST_BYTES);
+    }
+    else
+    {
+        printf("poll reader, profile %s, %u bursts of %u bytes over a pty\n",
+               profile, bursts, BURST_BYTES);
+    }
+    printf("idle CPU         %.1f%%\n", idleNs * 100.0 / (IDLE_USEC * 1000.0));
+    printf("busy CPU         %.1f%%\n",
+           busyNs * 100.0 / (double)(nowNs() - busyStart));
+    printf("wakeups          %.2f per burst, %u of %u bursts stranded\n",
+           (double) wakeups / bursts, stranded, bursts);
+    printf("byte latency     p50 %6u ns  p99 %7u ns  p99.9 %7u ns  max %8u ns\n",
+           latency[bytes / 2], latency[bytes * 99 / 100],
+           latency[bytes * 999 / 1000], latency[bytes - 1]);
+
+    spinning = 0;
+    stopSerial();
+    pthread_join(reader, NULL);
+    return 0;
+}
+
+/**
+ * Run the benchmark, each profile in a child process of its own
+ *
+ * @param argc The number of arguments
+ * @param argv [poll|spin] [bursts] [vmin,vtime ...]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    const char* defaultProfiles[2] = {"1,0", "8,0"};
+    const char** profiles = defaultProfiles;
+    int numProfiles = 2;
+    int spin = (argc > 1 && strcmp(argv[1], "spin") == 0);
+    uint32_t bursts = (argc > 2) ? strtoul(argv[2], NULL, 10) :
+                      DEFAULT_BURSTS;
+    int status;
+    pid_t child;
+    int i;
+
+    if(argc > 3)
+    {
+        profiles = (const char**) &argv[3];
+        numProfiles = argc - 3;
+    }
+    if(spin)
+    {
+        /* O_NONBLOCK reads ignore VMIN and VTIME */
+        numProfiles = 1;
+    }
+
+    for(i = 0; i < numProfiles; i++)
+    {
+        /* readSerial() opens the port with it, in the child */
+        if(bursts == 0 || !parseSerialReadProfile(profiles[i]))
+        {
+            fprintf(stderr, "Usage: %s [poll|spin] [bursts] "
+                    "[vmin,vtime ...]\n", argv[0]);
+            return 1;
+        }
+
+        fflush(stdout);
+        child = fork();
+        if(child == -1)
+        {
+            perror("fork");
+            return 1;
+        }
+        if(child == 0)
+        {
+            exit(runProfile(spin, bursts, profiles[i]));
+        }
+        if(waitpid(child, &status, 0) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+        {
+            return 1;
+        }
+        if(i + 1 < numProfiles)
+        {
+            printf("\n");
+        }
+    }
+    return 0;
+}
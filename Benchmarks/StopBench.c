@@ -0,0 +1,161 @@
+/*
+ * StopBench.c
+ *
+ *  Worst case latency of an emergency stop through the Qik dispatcher while
+ *  the motion and query lanes are kept saturated. The serial port is
+ *  QikUartModel's UART with a Qik on the other end that answers every
+ *  query, so the latency is measured to the moment the last byte of the
+ *  stop would leave the wire.
+ *
+ *  Usage: StopBench [stops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Qik2s9v1.h"
+#include "SerialPort.h"
+#include "QikUartModel.h"
+
+#define DEFAULT_STOPS     500
+#define DEVICE            DEFAULT_DEVICE_ID
+#define MOTION_USEC       1000 /*!< Gap between teleop setpoints */
+
+/* The stop being timed */
+uint64_t stopRequested = 0; /*!< When emergencyStop() was called, 0 if idle */
+uint64_t stopLatency = 0; /*!< Filled in when the stop is on the wire */
+volatile int32_t running = 1; /*!< Cleared to stop the load threads */
+
+/* Function prototypes */
+uint64_t getCurrentTime(void);
+void stopFrame(const uint8_t* frame, uint32_t len, uint64_t wireTime);
+void* teleop(void* vp);
+void* querier(void* vp);
+
+/**
+ * The modelled Qik got a whole command
+ *
+ * @param frame    The command
+ * @param len      unused
+ * @param wireTime When its last byte left the wire
+ */
+void stopFrame(const uint8_t* frame, __attribute__((unused)) uint32_t len,
+               uint64_t wireTime)
+{
+    uint64_t requested;
+
+    /* A stop is done once M1's brake, M1_FORWARD at 0, is on the wire */
+    requested = __atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE);
+    if(requested != 0 && frame[2] == 0x0C && frame[3] == 0)
+    {
+        __atomic_store_n(&stopLatency, wireTime - requested,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&stopRequested, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Keeps the motion lane busy with a new pair of setpoints every MOTION_USEC
+ */
+void* teleop(__attribute__((unused)) void* vp)
+{
+    uint8_t speed = 1;
+
+    while(running)
+    {
+        speed = (speed % 126) + 1;
+        setM0Forward(DEVICE, speed);
+        setM1Reverse(DEVICE, speed);
+        usleep(MOTION_USEC);
+    }
+    return NULL;
+}
+
+/**
+ * Keeps the query lane full
+ */
+void* querier(__attribute__((unused)) void* vp)
+{
+    uint32_t i = 0;
+
+    while(running)
+    {
+        getConfigurationParameter(DEVICE, (config_parameter_t)(i++ % NUM_CONFIG_PARAMS),
+                                  NULL, NULL);
+        setConfigurationParameter(DEVICE, SHUTDOWN_MOTOR_ON_ERROR, 1, NULL, NULL);
+        getErrorByte(DEVICE, NULL, NULL);
+        usleep(200);
+    }
+    return NULL;
+}
+
+/**
+ * Run the benchmark
+ *
+ * @param argc The number of arguments
+ * @param argv [stops]
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    pthread_t threads[2];
+    uint64_t* latency;
+    uint32_t stops = DEFAULT_STOPS;
+    uint32_t i;
+
+    if(argc > 1)
+    {
+        stops = strtoul(argv[1], NULL, 10);
+    }
+    if(stops < 1)
+    {
+        fprintf(stderr, "Usage: %s [stops]\n", argv[0]);
+        return 1;
+    }
+
+    latency = malloc(stops * sizeof(uint64_t));
+    if(latency == NULL || 0 == initializeQikDispatcher() ||
+            0 == addQikDevice(DEVICE))
+    {
+        fprintf(stderr, "Error setting up\n");
+        return 1;
+    }
+
+    if(0 == startQikUartModel(stopFrame) ||
+            pthread_create(&threads[0], NULL, teleop, NULL) ||
+            pthread_create(&threads[1], NULL, querier, NULL))
+    {
+        fprintf(stderr, "Error creating threads\n");
+        return 1;
+    }
+
+    /* Let the lanes fill up, then stop at odd moments */
+    usleep(200000);
+    for(i = 0; i < stops; i++)
+    {
+        usleep(2000 + rand() % 5000);
+
+        __atomic_store_n(&stopLatency, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stopRequested, getCurrentTime(), __ATOMIC_RELEASE);
+        emergencyStop(DEVICE);
+
+        while(__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE) != 0)
+        {
+            usleep(100);
+        }
+        latency[i] = __atomic_load_n(&stopLatency, __ATOMIC_ACQUIRE);
+    }
+    running = 0;
+    stopQikUartModel();
+
+    printf("%u stops at %d baud with motion and queries saturated\n", stops,
+           SERIAL_BAUD);
+    printf("the stop alone takes %d us on the wire\n", 8 * SERIAL_BYTE_USEC);
+    printLatencies("request to on wire", latency, stops);
+
+    free(latency);
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * FlightDecoder.c
+ *
+ *  Prints the serial traffic MotorDriver recorded in its flight recorder
+ *  ring file, oldest first, with every Qik command and response decoded.
+ *  It only reads the file, so it can be pointed at the ring of a daemon
+ *  that's still running, or at a copy taken after a crash.
+ *
+ *  Usage: FlightDecoder [-n records] [file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FlightRecorder.h"
+
+#define START_BYTE   0xAA /*!< Starts every Pololu protocol frame */
+#define NUM_COMMANDS 16   /*!< Command bytes 0x00 to 0x0F */
+#define NUM_PARAMS   4    /*!< Configuration parameters */
+
+/* Names, by command byte, NULL for bytes that aren't commands */
+const char* commandNames[NUM_COMMANDS] =
+{
+    NULL, "GET_FIRMWARE_VERSION", "GET_ERROR_BYTE", "GET_CONFIG_PARAM",
+    "SET_CONFIG_PARAM", NULL, "M0_COAST", "M1_COAST", "M0_FORWARD",
+    "M0_FORWARD_128", "M0_REVERSE", "M0_REVERSE_128", "M1_FORWARD",
+    "M1_FORWARD_128", "M1_REVERSE", "M1_REVERSE_128"
+};
+
+/* Names, by configuration parameter */
+const char* paramNames[NUM_PARAMS] =
+{
+    "DEVICE_ID", "PWM_PARAMETER", "SHUTDOWN_MOTOR_ON_ERROR", "SERIAL_TIMEOUT"
+};
+
+/* Names of the error byte's bits, from bit 3 up */
+const char* errorNames[5] =
+{
+    "DATA_OVERRUN_ERROR", "FRAME_ERROR", "CRC_ERROR", "FORMAT_ERROR",
+    "TIMEOUT"
+};
+
+/* What SET_CONFIG_PARAM answers with */
+const char* setResultNames[4] =
+{
+    "OK", "BAD_PARAMETER", "BAD_VALUE", "BAD_FORMAT"
+};
+
+const flightRecord_t* records; /*!< The ring, mapped from the file */
+uint32_t next; /*!< The sequence number the next record would have got */
+
+/* Function prototypes */
+void usage(const char* name);
+const char* commandName(uint8_t command);
+int compareRecords(const void* a, const void* b);
+void decodeTx(const flightRecord_t* record, char* buf);
+void decodeRx(const flightRecord_t* record, char* buf);
+
+/**
+ * Print the usage
+ *
+ * @param name The program name
+ */
+void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n records] [file]\n"
+            "  -n records  Only print the newest records\n"
+            "  file        The ring file (%s)\n", name, FLIGHT_PATH);
+}
+
+/**
+ * @param command A command byte
+ * @return What it's called, or "UNKNOWN"
+ */
+const char* commandName(uint8_t command)
+{
+    return (command < NUM_COMMANDS && commandNames[command] != NULL) ?
+           commandNames[command] : "UNKNOWN";
+}
+
+/**
+ * qsort() comparison for record indexes, oldest first. Sequence numbers
+ * wrap, so they're compared by how far behind next they are.
+ */
+int compareRecords(const void* a, const void* b)
+{
+    uint32_t x = next - records[*(const uint32_t*) a].sequence;
+    uint32_t y = next - records[*(const uint32_t*) b].sequence;
+
+    return (x < y) - (x > y);
+}
+
+/**
+ * Describe bytes that were written to the Qiks
+ *
+ * @param record Their record
+ * @param buf Where the description goes, 128 bytes
+ */
+void decodeTx(const flightRecord_t* record, char* buf)
+{
+    const uint8_t* data = record->data;
+    uint8_t command = (record->len >= 3) ? data[2] : 0;
+
+    if(data[0] != START_BYTE)
+    {
+        sprintf(buf, "rest of %s", commandName(record->command));
+        return;
+    }
+    if(record->len < 3)
+    {
+        sprintf(buf, "cut short");
+        return;
+    }
+
+    switch(command)
+    {
+        case 0x03:
+        {
+            sprintf(buf, "%s %s", commandName(command), (record->len < 4) ?
+                    "cut short" : (data[3] < NUM_PARAMS) ?
+                    paramNames[data[3]] : "UNKNOWN");
+            break;
+        }
+        case 0x04:
+        {
+            if(record->len < 7)
+            {
+                sprintf(buf, "%s cut short", commandName(command));
+            }
+            else
+            {
+                sprintf(buf, "%s %s = %u%s", commandName(command),
+                        (data[3] < NUM_PARAMS) ? paramNames[data[3]] :
+                        "UNKNOWN", data[4],
+                        (data[5] == 0x55 && data[6] == 0x2A) ? "" :
+                        " BAD FORMAT BYTES");
+            }
+            break;
+        }
+        case 0x08:
+        case 0x0A:
+        case 0x0C:
+        case 0x0E:
+        {
+            if(record->len < 4)
+            {
+                sprintf(buf, "%s cut short", commandName(command));
+            }
+            else
+            {
+                sprintf(buf, "%s %u%s", commandName(command), data[3],
+                        (data[3] == 0) ? " (stop)" : "");
+            }
+            break;
+        }
+        case 0x09:
+        case 0x0B:
+        case 0x0D:
+        case 0x0F:
+        {
+            /* The speed byte only holds 7 bits, these add 128 to it */
+            if(record->len < 4)
+            {
+                sprintf(buf, "%s cut short", commandName(command));
+            }
+            else
+            {
+                sprintf(buf, "%s speed %u", commandName(command), data[3] + 128);
+            }
+            break;
+        }
+        default:
+        {
+            sprintf(buf, "%s", commandName(command));
+            break;
+        }
+    }
+}
+
+/**
+ * Describe bytes that were read from the Qiks
+ *
+ * @param record Their record
+ * @param buf Where the description goes, 128 bytes
+ */
+void decodeRx(const flightRecord_t* record, char* buf)
+{
+    uint8_t byte = record->data[0];
+    size_t used;
+    uint8_t i;
+
+    switch(record->command)
+    {
+        case 0x01:
+        {
+            sprintf(buf, "%s -> '%c'", commandName(record->command),
+                    (byte >= 0x20 && byte < 0x7F) ? byte : '?');
+            break;
+        }
+        case 0x02:
+        {
+            used = sprintf(buf, "%s ->", commandName(record->command));
+            for(i = 0; i < 5; i++)
+            {
+                if(byte & (0x08 << i))
+                {
+                    used += sprintf(buf + used, " %s", errorNames[i]);
+                }
+            }
+            if(byte == 0)
+            {
+                sprintf(buf + used, " no errors");
+            }
+            break;
+        }
+        case 0x03:
+        {
+            sprintf(buf, "%s -> %u", commandName(record->command), byte);
+            break;
+        }
+        case 0x04:
+        {
+            sprintf(buf, "%s -> %s", commandName(record->command),
+                    (byte < 4) ? setResultNames[byte] : "UNKNOWN");
+            break;
+        }
+        default:
+        {
+            sprintf(buf, "unexpected, no query was waiting");
+            break;
+        }
+    }
+}
+
+/**
+ * Decode a flight recorder ring file
+ *
+ * @param argc The number of arguments
+ * @param argv The options, see usage()
+ * @return 0 for success, 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    const char* path = FLIGHT_PATH;
+    const flightHeader_t* header;
+    const flightRecord_t* record;
+    uint32_t* order;
+    uint32_t limit = 0;
+    uint32_t count = 0;
+    uint32_t i, j;
+    uint64_t previous = 0;
+    char hex[FLIGHT_MAX_DATA * 3 + 1];
+    char description[128];
+    struct stat st;
+    void* map;
+    int32_t fd;
+    int32_t opt;
+
+    while((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+            {
+                limit = strtoul(optarg, NULL, 10);
+                break;
+            }
+            default:
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if(optind < argc)
+    {
+        path = argv[optind];
+    }
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        return 1;
+    }
+    if((size_t) st.st_size < FLIGHT_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s is too short to be a flight recording\n", path);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    header = (const flightHeader_t*) map;
+    if(memcmp(header->magic, FLIGHT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->recordSize != sizeof(flightRecord_t) ||
+            header->numRecords == 0 ||
+            (header->numRecords & (header->numRecords - 1)) != 0 ||
+            header->headerSize + (size_t) header->numRecords *
+            header->recordSize > (size_t) st.st_size)
+    {
+        fprintf(stderr, "%s isn't a flight recording this can read\n", path);
+        return 1;
+    }
+    records = (const flightRecord_t*)((const uint8_t*) map +
+                                      header->headerSize);
+    next = header->next;
+
+    /* Only records that were finished, in the slot their number says */
+    order = malloc(header->numRecords * sizeof(uint32_t));
+    if(order == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < header->numRecords; i++)
+    {
+        if(records[i].sequence != 0 &&
+                ((records[i].sequence - 1) & (header->numRecords - 1)) == i &&
+                records[i].len <= FLIGHT_MAX_DATA)
+        {
+            order[count++] = i;
+        }
+    }
+    qsort(order, count, sizeof(uint32_t), compareRecords);
+
+    printf("%u records in %s\n", count, path);
+    printf("%17s %9s %-5s %3s  %-24s %s\n", "time (s)", "delta us", "dir",
+           "dev", "bytes", "decoded");
+    for(i = (limit != 0 && limit < count) ? count - limit : 0; i < count; i++)
+    {
+        record = &records[order[i]];
+
+        hex[0] = '\0';
+        for(j = 0; j < record->len; j++)
+        {
+            sprintf(hex + j * 3, "%02X ", record->data[j]);
+        }
+
+        if(record->direction == FLIGHT_START)
+        {
+            sprintf(description, "MotorDriver started");
+        }
+        else if(record->direction == FLIGHT_TX)
+        {
+            decodeTx(record, description);
+        }
+        else
+        {
+            decodeRx(record, description);
+        }
+
+        printf("%10lu.%06lu %9.0f %-5s %3u  %-24s %s\n",
+               (unsigned long)(record->time / 1000000),
+               (unsigned long)(record->time % 1000000),
+               (previous == 0 || record->time < previous) ? 0.0 :
+               (double)(record->time - previous),
+               (record->direction == FLIGHT_START) ? "START" :
+               (record->direction == FLIGHT_TX) ? "TX" : "RX",
+               record->deviceId, hex, description);
+        previous = record->time;
+    }
+
+    free(order);
+    return 0;
+}
@@ -0,0 +1,357 @@
+/*
+ * FlightRecorder.c
+ *
+ *  Keeps the last FLIGHT_NUM_RECORDS stretches of serial traffic in a ring
+ *  file, so there's something to look at after a crash or a motor stop
+ *  nobody asked for. The file is mapped shared, so every record is in the
+ *  page cache the moment it's written and the kernel writes it out even if
+ *  the process dies straight after. A new run carries on where the last
+ *  one stopped, marking the join with a FLIGHT_START record.
+ *
+ *  Recording is a clock read, an atomic add to claim a slot and a few
+ *  stores, with no system calls and no locks, so any thread can record.
+ *  Written bytes are split into a record per frame, at the START_BYTE every
+ *  Pololu protocol frame begins with. Each byte read is matched to the
+ *  oldest query written that is still waiting, the same way the dispatcher
+ *  matches them, so its record says which command it answers.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FlightRecorder.h"
+
+#define FLIGHT_START_BYTE  0xAA   /*!< Starts every Pololu protocol frame */
+#define FLIGHT_MAX_QUERIES 16     /*!< Queries waiting for an answer, a
+                                       power of two */
+#define FLIGHT_QUERY_USEC  100000 /*!< When a query stops waiting, like the
+                                       dispatcher's longest timeout */
+
+/* A query that was written and hasn't been answered */
+typedef struct
+{
+    uint64_t time;     /*!< When it was written */
+    uint8_t deviceId;  /*!< Who it was asked of */
+    uint8_t command;   /*!< What was asked */
+} flightQuery_t;
+
+flightHeader_t* flightHeader = NULL; /*!< The mapped file, NULL if it isn't */
+flightRecord_t* flightRecords = NULL; /*!< The ring in it */
+
+/* The frame being written, for records that carry on one cut short */
+uint8_t flightTxDeviceId = 0;
+uint8_t flightTxCommand = 0;
+
+/* Queries waiting, pushed by the dispatcher and taken by the serial thread */
+flightQuery_t flightQueries[FLIGHT_MAX_QUERIES];
+uint32_t flightQueryHead = 0;
+uint32_t flightQueryTail = 0;
+
+/* Function prototypes */
+uint64_t flightTime(void);
+flightRecord_t* beginFlightRecord(uint64_t now, flightDirection_t direction,
+                                  uint32_t* sequence);
+void endFlightRecord(flightRecord_t* record, uint32_t sequence);
+void pushFlightQuery(uint64_t now, uint8_t deviceId, uint8_t command);
+uint8_t popFlightQuery(uint64_t now, flightQuery_t* query);
+
+/**
+ * @return The monotonic time in microseconds, what records are stamped with
+ */
+uint64_t flightTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Map the ring file, making it if it isn't there or was made for another
+ * layout. This must be called before the serial port is used, nothing is
+ * recorded until it is.
+ *
+ * @param path Where the ring file is kept
+ * @return 0 if it can't be made or mapped, 1 for success
+ */
+uint8_t openFlightRecorder(const char* path)
+{
+    size_t size = FLIGHT_HEADER_SIZE +
+                  FLIGHT_NUM_RECORDS * sizeof(flightRecord_t);
+    flightHeader_t* header;
+    flightRecord_t* record;
+    uint32_t sequence;
+    struct stat st;
+    void* map;
+    int32_t fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1)
+    {
+        return 0;
+    }
+
+    /* Allocate every block now, a write to a hole could fault later */
+    if(fstat(fd, &st) == -1 || ((size_t) st.st_size != size &&
+                                (ftruncate(fd, 0) == -1 ||
+                                 posix_fallocate(fd, 0, size) != 0)))
+    {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    /* Keep what the last run recorded, unless it isn't a ring of ours */
+    header = (flightHeader_t*) map;
+    if(memcmp(header->magic, FLIGHT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->recordSize != sizeof(flightRecord_t) ||
+            header->headerSize != FLIGHT_HEADER_SIZE ||
+            header->numRecords != FLIGHT_NUM_RECORDS)
+    {
+        memset(map, 0, size);
+        memcpy(header->magic, FLIGHT_MAGIC, sizeof(header->magic));
+        header->recordSize = sizeof(flightRecord_t);
+        header->headerSize = FLIGHT_HEADER_SIZE;
+        header->numRecords = FLIGHT_NUM_RECORDS;
+        header->next = 1;
+    }
+    flightRecords = (flightRecord_t*)((uint8_t*) map + FLIGHT_HEADER_SIZE);
+    __atomic_store_n(&flightHeader, header, __ATOMIC_RELEASE);
+
+    record = beginFlightRecord(flightTime(), FLIGHT_START, &sequence);
+    endFlightRecord(record, sequence);
+    return 1;
+}
+
+/**
+ * Claim the next slot in the ring and start a record in it. The slot is
+ * marked unused until endFlightRecord(), so a record cut short by a crash
+ * is never mistaken for a whole one.
+ *
+ * @param now When the bytes went
+ * @param direction Which way they went
+ * @param sequence Set to the record's sequence number
+ * @return The record, with no data yet
+ */
+flightRecord_t* beginFlightRecord(uint64_t now, flightDirection_t direction,
+                                  uint32_t* sequence)
+{
+    flightRecord_t* record;
+
+    /* 0 means unused, skip it when the count wraps */
+    do
+    {
+        *sequence = __atomic_fetch_add(&flightHeader->next, 1,
+                                       __ATOMIC_RELAXED);
+    }
+    while(*sequence == 0);
+
+    record = &flightRecords[(*sequence - 1) & (FLIGHT_NUM_RECORDS - 1)];
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->time = now;
+    record->direction = direction;
+    record->len = 0;
+    record->deviceId = 0;
+    record->command = 0;
+    return record;
+}
+
+/**
+ * Finish a record begun with beginFlightRecord()
+ *
+ * @param record The record
+ * @param sequence Its sequence number
+ */
+void endFlightRecord(flightRecord_t* record, uint32_t sequence)
+{
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remember a query that was written, so its answer can be matched to it
+ *
+ * @param now When it was written
+ * @param deviceId Who it was asked of
+ * @param command What was asked
+ */
+void pushFlightQuery(uint64_t now, uint8_t deviceId, uint8_t command)
+{
+    uint32_t tail = flightQueryTail;
+    flightQuery_t* query;
+
+    /* Unanswered queries time out long before this fills up */
+    if(tail - __atomic_load_n(&flightQueryHead, __ATOMIC_ACQUIRE) ==
+            FLIGHT_MAX_QUERIES)
+    {
+        return;
+    }
+    query = &flightQueries[tail & (FLIGHT_MAX_QUERIES - 1)];
+    query->time = now;
+    query->deviceId = deviceId;
+    query->command = command;
+    __atomic_store_n(&flightQueryTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the oldest query still waiting for an answer, forgetting any that
+ * waited too long
+ *
+ * @param now When the answer arrived
+ * @param query Filled in with the query
+ * @return 1 if there was one, 0 if none is waiting
+ */
+uint8_t popFlightQuery(uint64_t now, flightQuery_t* query)
+{
+    uint32_t head = flightQueryHead;
+    uint32_t tail = __atomic_load_n(&flightQueryTail, __ATOMIC_ACQUIRE);
+    uint8_t found = 0;
+
+    while(head != tail && !found)
+    {
+        *query = flightQueries[head & (FLIGHT_MAX_QUERIES - 1)];
+        found = (query->time + FLIGHT_QUERY_USEC >= now);
+        head++;
+    }
+    __atomic_store_n(&flightQueryHead, head, __ATOMIC_RELEASE);
+    return found;
+}
+
+/**
+ * Record bytes that were just written to the serial port. Safe from any
+ * thread, but queries are only matched to their answers if one thread
+ * writes them.
+ *
+ * @param iov The buffers that were written from, in order
+ * @param iovcnt The number of buffers
+ * @param len How many of their bytes were written
+ */
+void recordSerialTx(const struct iovec* iov, int iovcnt, size_t len)
+{
+    flightRecord_t* record = NULL;
+    const uint8_t* bytes;
+    uint32_t sequence = 0;
+    uint64_t now;
+    size_t i;
+    int v;
+
+    if(__atomic_load_n(&flightHeader, __ATOMIC_ACQUIRE) == NULL)
+    {
+        return;
+    }
+    now = flightTime();
+
+    for(v = 0; v < iovcnt && len > 0; v++)
+    {
+        bytes = (const uint8_t*) iov[v].iov_base;
+        for(i = 0; i < iov[v].iov_len && len > 0; i++, len--)
+        {
+            /* A record per frame, or per piece of a long run of bytes */
+            if(record == NULL || bytes[i] == FLIGHT_START_BYTE ||
+                    record->len == FLIGHT_MAX_DATA)
+            {
+                if(record != NULL)
+                {
+                    endFlightRecord(record, sequence);
+                }
+                record = beginFlightRecord(now, FLIGHT_TX, &sequence);
+                record->deviceId = flightTxDeviceId;
+                record->command = flightTxCommand;
+            }
+            record->data[record->len++] = bytes[i];
+
+            /* Learn the frame's device and command as they go past */
+            if(record->data[0] != FLIGHT_START_BYTE || record->len > 3)
+            {
+                continue;
+            }
+            if(record->len == 1)
+            {
+                flightTxDeviceId = 0;
+                flightTxCommand = 0;
+            }
+            else if(record->len == 2)
+            {
+                flightTxDeviceId = bytes[i];
+            }
+            else
+            {
+                flightTxCommand = bytes[i];
+
+                /* GET_FIRMWARE_VERSION to SET_CONFIG_PARAM each get a byte */
+                if(bytes[i] >= 0x01 && bytes[i] <= 0x04)
+                {
+                    pushFlightQuery(now, flightTxDeviceId, bytes[i]);
+                }
+            }
+            record->deviceId = flightTxDeviceId;
+            record->command = flightTxCommand;
+        }
+    }
+
+    if(record != NULL)
+    {
+        endFlightRecord(record, sequence);
+    }
+}
+
+/**
+ * Record bytes that were just read from the serial port. Only the serial
+ * thread may call this.
+ *
+ * @param buf The bytes
+ * @param len The number of bytes
+ */
+void recordSerialRx(const uint8_t* buf, size_t len)
+{
+    flightRecord_t* record = NULL;
+    flightQuery_t query;
+    uint32_t sequence = 0;
+    uint8_t answer;
+    uint64_t now;
+    size_t i;
+
+    if(__atomic_load_n(&flightHeader, __ATOMIC_ACQUIRE) == NULL)
+    {
+        return;
+    }
+    now = flightTime();
+
+    for(i = 0; i < len; i++)
+    {
+        /* An answer gets a record of its own, anything else is lumped */
+        answer = popFlightQuery(now, &query);
+        if(record != NULL && (answer || record->len == FLIGHT_MAX_DATA))
+        {
+            endFlightRecord(record, sequence);
+            record = NULL;
+        }
+        if(record == NULL)
+        {
+            record = beginFlightRecord(now, FLIGHT_RX, &sequence);
+        }
+        record->data[record->len++] = buf[i];
+
+        if(answer)
+        {
+            record->deviceId = query.deviceId;
+            record->command = query.command;
+            endFlightRecord(record, sequence);
+            record = NULL;
+        }
+    }
+
+    if(record != NULL)
+    {
+        endFlightRecord(record, sequence);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * FlightRecorder.h
+ *
+ *  Every byte that crosses the serial port, kept in a memory mapped ring
+ *  file that outlives the process. The layout is shared with the offline
+ *  decoder, FlightDecoder.
+ */
+
+#ifndef _FLIGHT_RECORDER_H_
+#define _FLIGHT_RECORDER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define FLIGHT_PATH        "qik.flight" /*!< Where the ring file is kept */
+#define FLIGHT_MAGIC       "QFR1"
+#define FLIGHT_NUM_RECORDS 8192  /*!< Records in a new ring, a power of two */
+#define FLIGHT_HEADER_SIZE 64    /*!< The records start this far in */
+#define FLIGHT_MAX_DATA    16    /*!< Bytes a record holds */
+
+/* Which way a record's bytes went */
+typedef enum
+{
+    FLIGHT_START = 0, /*!< The daemon opened the ring, no bytes */
+    FLIGHT_TX,        /*!< Written to the Qik, a frame or the rest of one */
+    FLIGHT_RX         /*!< Read from the Qik */
+} flightDirection_t;
+
+/* The start of the file */
+typedef struct
+{
+    char magic[4];        /*!< FLIGHT_MAGIC */
+    uint16_t recordSize;  /*!< sizeof(flightRecord_t) */
+    uint16_t headerSize;  /*!< FLIGHT_HEADER_SIZE */
+    uint32_t numRecords;  /*!< Slots in the ring, a power of two */
+    uint32_t next;        /*!< The sequence number the next record gets */
+} flightHeader_t;
+
+/* One record, in slot (sequence - 1) % numRecords */
+typedef struct
+{
+    uint64_t time;        /*!< CLOCK_MONOTONIC microseconds */
+    uint32_t sequence;    /*!< 1 and up as recorded, 0 while being written */
+    uint8_t direction;    /*!< A flightDirection_t */
+    uint8_t len;          /*!< Bytes of data used */
+    uint8_t deviceId;     /*!< The Qik the bytes were for or from */
+    uint8_t command;      /*!< The command sent, or the query the bytes
+                               answer, 0 if there isn't one */
+    uint8_t data[FLIGHT_MAX_DATA];
+} flightRecord_t;
+
+uint8_t openFlightRecorder(const char* path);
+void recordSerialTx(const struct iovec* iov, int iovcnt, size_t len);
+void recordSerialRx(const uint8_t* buf, size_t len);
+
+#endif /* _FLIGHT_RECORDER_H_ */
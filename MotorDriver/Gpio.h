@@ -0,0 +1,38 @@
+/*
+ * Gpio.h
+ *
+ *  The few GPIO operations the daemon needs, over pigpio on a Raspberry Pi
+ *  or over a mock anywhere else. The backend is picked when building,
+ *  "make GPIO=mock" builds the mock and doesn't link pigpio.
+ */
+
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include <stdint.h>
+
+#define GPIO_NUM_PINS 54 /*!< BCM GPIO numbers 0 to 53 */
+
+/* Which changes of a pin to be told about */
+typedef enum
+{
+    GPIO_RISING_EDGE = 0,
+    GPIO_FALLING_EDGE,
+    GPIO_EITHER_EDGE
+} gpioEdge_t;
+
+/* Called when a watched pin changes, on whatever thread the backend uses.
+ * For the mock that can be a signal handler, so it must only do what is
+ * safe in one. */
+typedef void (*gpioEdgeFunc_t)(uint32_t pin, uint32_t level);
+
+uint8_t openGpio(void);
+void closeGpio(void);
+uint8_t setGpioInput(uint32_t pin);
+uint8_t watchGpioEdge(uint32_t pin, gpioEdge_t edge, gpioEdgeFunc_t func);
+int32_t readGpio(uint32_t pin);
+
+/* Mock backend only */
+void setMockGpio(uint32_t pin, uint32_t level);
+
+#endif /* _GPIO_H_ */
@@ -0,0 +1,150 @@
+/*
+ * GpioMock.c
+ *
+ *  A GPIO backend for machines without pins. Levels are kept in memory and
+ *  setMockGpio() changes them, calling the watch function on the caller's
+ *  thread when a watched edge happens, like pigpio's callback thread would.
+ *  A running daemon can have its pins driven from outside: SIGUSR1 raises
+ *  every watched pin and SIGUSR2 lowers them, so "kill -USR1" plays a Qik
+ *  raising its error line.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <string.h>
+
+#include "Gpio.h"
+
+/* The pins, only touched through __atomic builtins */
+uint32_t gpioMockLevels[GPIO_NUM_PINS];
+gpioEdgeFunc_t gpioMockFuncs[GPIO_NUM_PINS]; /*!< NULL if it isn't watched */
+gpioEdge_t gpioMockEdges[GPIO_NUM_PINS];
+
+/* Function prototypes */
+void gpioMockSignal(int sig);
+
+/**
+ * SIGUSR1 and SIGUSR2 handler, raises or lowers every watched pin
+ *
+ * @param sig The signal
+ */
+void gpioMockSignal(int sig)
+{
+    uint32_t pin;
+
+    for(pin = 0; pin < GPIO_NUM_PINS; pin++)
+    {
+        if(__atomic_load_n(&gpioMockFuncs[pin], __ATOMIC_ACQUIRE) != NULL)
+        {
+            setMockGpio(pin, sig == SIGUSR1);
+        }
+    }
+}
+
+/**
+ * Start with every pin low, and take SIGUSR1 and SIGUSR2
+ *
+ * @return 0 if the signals can't be taken, 1 for success
+ */
+uint8_t openGpio(void)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = gpioMockSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGUSR1, &action, NULL) == -1 ||
+            sigaction(SIGUSR2, &action, NULL) == -1)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Stop taking the signals
+ */
+void closeGpio(void)
+{
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+}
+
+/**
+ * Nothing to set up, every pin is an input
+ *
+ * @param pin The pin
+ * @return 0 if there's no such pin, 1 for success
+ */
+uint8_t setGpioInput(uint32_t pin)
+{
+    return (pin < GPIO_NUM_PINS) ? 1 : 0;
+}
+
+/**
+ * Call a function whenever setMockGpio() changes a pin
+ *
+ * @param pin The pin
+ * @param edge Which changes to call it for
+ * @param func The function
+ * @return 0 if there's no such pin, 1 for success
+ */
+uint8_t watchGpioEdge(uint32_t pin, gpioEdge_t edge, gpioEdgeFunc_t func)
+{
+    if(pin >= GPIO_NUM_PINS)
+    {
+        return 0;
+    }
+    gpioMockEdges[pin] = edge;
+    __atomic_store_n(&gpioMockFuncs[pin], func, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @param pin The pin
+ * @return Its level, or -1 if there's no such pin
+ */
+int32_t readGpio(uint32_t pin)
+{
+    if(pin >= GPIO_NUM_PINS)
+    {
+        return -1;
+    }
+    return __atomic_load_n(&gpioMockLevels[pin], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Drive a pin, calling its watch function if that makes an edge it's
+ * watching for. This is safe from any thread and from signal handlers, as
+ * long as the watch function is.
+ *
+ * @param pin The pin
+ * @param level 0 for low, anything else for high
+ */
+void setMockGpio(uint32_t pin, uint32_t level)
+{
+    gpioEdgeFunc_t func;
+    gpioEdge_t edge;
+
+    if(pin >= GPIO_NUM_PINS)
+    {
+        return;
+    }
+
+    level = (level != 0);
+    if(__atomic_exchange_n(&gpioMockLevels[pin], level, __ATOMIC_ACQ_REL) ==
+            level)
+    {
+        return;
+    }
+
+    func = __atomic_load_n(&gpioMockFuncs[pin], __ATOMIC_ACQUIRE);
+    edge = gpioMockEdges[pin];
+    if(func != NULL && (edge == GPIO_EITHER_EDGE ||
+                        (edge == GPIO_RISING_EDGE) == (level == 1)))
+    {
+        func(pin, level);
+    }
+}
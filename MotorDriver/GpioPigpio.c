@@ -0,0 +1,103 @@
+/*
+ * GpioPigpio.c
+ *
+ *  The GPIO backend for a Raspberry Pi, over pigpio. Edges are handed on
+ *  from pigpio's callback thread.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pigpio.h>
+
+#include "Gpio.h"
+
+gpioEdgeFunc_t gpioEdgeFuncs[GPIO_NUM_PINS]; /*!< Indexed by pin */
+
+/* Function prototypes */
+void pigpioEdge(int gpio, int level, uint32_t tick);
+
+/**
+ * Called by pigpio when a watched pin changes
+ *
+ * @param gpio  The pin
+ * @param level Its new level, or 2 if pigpio's timeout expired
+ * @param tick  unused
+ */
+void pigpioEdge(int gpio, int level, __attribute__((unused)) uint32_t tick)
+{
+    if(gpio >= 0 && gpio < GPIO_NUM_PINS && level != 2 &&
+            gpioEdgeFuncs[gpio] != NULL)
+    {
+        gpioEdgeFuncs[gpio]((uint32_t) gpio, (uint32_t) level);
+    }
+}
+
+/**
+ * Start pigpio
+ *
+ * @return 0 if it can't be started, 1 for success
+ */
+uint8_t openGpio(void)
+{
+    return (PI_INIT_FAILED == gpioInitialise()) ? 0 : 1;
+}
+
+/**
+ * Stop pigpio
+ */
+void closeGpio(void)
+{
+    gpioTerminate();
+}
+
+/**
+ * Make a pin an input with a pulldown
+ *
+ * @param pin The pin
+ * @return 0 if something failed, 1 for success
+ */
+uint8_t setGpioInput(uint32_t pin)
+{
+    if(0 != gpioSetMode(pin, PI_INPUT))
+    {
+        return 0;
+    }
+    if(0 != gpioSetPullUpDown(pin, PI_PUD_DOWN))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Call a function whenever a pin changes
+ *
+ * @param pin The pin
+ * @param edge Which changes to call it for
+ * @param func The function
+ * @return 0 if something failed, 1 for success
+ */
+uint8_t watchGpioEdge(uint32_t pin, gpioEdge_t edge, gpioEdgeFunc_t func)
+{
+    unsigned pigpioEdges[3] = {RISING_EDGE, FALLING_EDGE, EITHER_EDGE};
+
+    if(pin >= GPIO_NUM_PINS)
+    {
+        return 0;
+    }
+    gpioEdgeFuncs[pin] = func;
+    if(0 != gpioSetISRFunc(pin, pigpioEdges[edge], 0, pigpioEdge))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @param pin The pin
+ * @return Its level, or a negative pigpio error
+ */
+int32_t readGpio(uint32_t pin)
+{
+    return gpioRead(pin);
+}
@@ -0,0 +1,567 @@
+/*
+ * Log.c
+ *
+ *  Keeps stdio off the control path. printf() takes the stdout lock and
+ *  blocks whenever the terminal or journald is slow to read, which would
+ *  stall whichever thread was logging. Instead each thread gets a ring of
+ *  fixed-size records of its own, the first time it logs, so logging is a
+ *  clock read, a walk of the format string and a few stores with no locks
+ *  and no system calls. The arguments are copied into the record as they
+ *  are, with %s strings copied into the record itself, and only the log
+ *  thread turns them into text, merging the rings by time.
+ *
+ *  Nothing ever waits for the log thread. A message that finds its ring
+ *  full is dropped, and each format string has a budget of messages a
+ *  second past which they're dropped too. Both are counted and the log
+ *  thread says how many were lost.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Log.h"
+#include "RealTime.h"
+
+#define LOG_RING_SIZE    128   /*!< Records per thread, a power of two */
+#define LOG_MAX_THREADS  16    /*!< Threads that can have a ring */
+#define LOG_MAX_ARGS     6     /*!< Conversions a message can have */
+#define LOG_MAX_TEXT     48    /*!< Bytes of %s arguments a record holds */
+#define LOG_BUDGET_BITS  6     /*!< 64 rate limit budgets, by format string */
+#define LOG_RATE_LIMIT   50    /*!< Messages a second for each budget */
+#define LOG_FLUSH_USEC   20000 /*!< How often the log thread drains the rings */
+#define LOG_MAX_LINE     512   /*!< Longest line written */
+#define LOG_CACHE_LINE   64    /*!< Keeps the producer and consumer apart */
+
+/* One message, as it was logged */
+typedef struct
+{
+    uint64_t time;              /*!< When, in monotonic microseconds */
+    const char* format;         /*!< The caller's format, which has to last,
+                                     a string literal in practice */
+    uint8_t level;              /*!< Its logLevel_t */
+    uint8_t numArgs;            /*!< Conversions captured */
+    long args[LOG_MAX_ARGS];    /*!< Each argument, or for a %s where it
+                                     starts in text */
+    char text[LOG_MAX_TEXT];    /*!< %s arguments, each NUL terminated */
+} logRecord_t;
+
+/* A thread's messages. Only the thread writes tail and full, and only the
+ * log thread writes head
+ */
+typedef struct
+{
+    uint32_t head __attribute__((aligned(LOG_CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(LOG_CACHE_LINE)));
+    uint32_t full;  /*!< Messages dropped because the ring was full */
+    int32_t tid;    /*!< The kernel thread ID, 0 until it's claimed */
+    logRecord_t records[LOG_RING_SIZE];
+} logRing_t;
+
+/* How many messages a format string has logged this second */
+typedef struct
+{
+    uint32_t second; /*!< The monotonic second being counted */
+    uint32_t count;  /*!< Messages in it so far */
+} logBudget_t;
+
+/* What each level is written as */
+const char* logLevelNames[LOG_NUM_LEVELS] =
+{
+    "DEBUG", "INFO", "WARN", "ERROR"
+};
+
+logRing_t logRings[LOG_MAX_THREADS]; /*!< Claimed in order */
+uint32_t logNumRings = 0; /*!< Claims made, more than there are once they
+                               run out */
+__thread logRing_t* logOwnRing = NULL; /*!< This thread's ring */
+__thread uint8_t logRingless = 0; /*!< This thread found none left */
+
+logLevel_t logMinLevel = LOG_LEVEL_INFO;
+uint32_t logRateLimit = LOG_RATE_LIMIT;
+logBudget_t logBudgets[1 << LOG_BUDGET_BITS];
+
+/* Drop counts that aren't in the rings */
+uint32_t logSuppressed = 0; /*!< Over the rate limit */
+uint32_t logRinglessDrops = 0; /*!< From threads that didn't get a ring */
+uint32_t logWritten = 0; /*!< Written out by drainLogs() */
+logStats_t logReported = {0, 0, 0}; /*!< The drops already reported */
+
+/* Function prototypes */
+uint64_t logTime(void);
+logRing_t* claimLogRing(void);
+const char* nextLogConversion(const char* p, uint8_t* isLong);
+void captureLogArgs(logRecord_t* record, va_list args);
+size_t appendLogText(char* buf, size_t len, size_t used, const char* from,
+                     const char* to);
+size_t formatLogRecord(const logRing_t* ring, const logRecord_t* record,
+                       char* buf, size_t len);
+
+/**
+ * @return The monotonic time in microseconds
+ */
+uint64_t logTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Only log messages at or above a level. Safe from any thread.
+ *
+ * @param level The least a message has to matter, LOG_LEVEL_INFO to start
+ */
+void setLogLevel(logLevel_t level)
+{
+    __atomic_store_n(&logMinLevel, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change how many messages a second each format string may log
+ *
+ * @param perSecond The budget, 0 for no limit
+ */
+void setLogRateLimit(uint32_t perSecond)
+{
+    __atomic_store_n(&logRateLimit, perSecond, __ATOMIC_RELAXED);
+}
+
+/**
+ * Log a message from any thread, without blocking. The format is kept
+ * rather than copied, so it has to outlive the message. It takes up to
+ * LOG_MAX_ARGS of the integer conversions, %s and %p, without '*' widths,
+ * and %s arguments are cut short past LOG_MAX_TEXT bytes between them.
+ *
+ * @param level How much it matters
+ * @param format A printf() format, normally a string literal
+ */
+void logMessage(logLevel_t level, const char* format, ...)
+{
+    logRing_t* ring;
+    logRecord_t* record;
+    logBudget_t* budget;
+    uint64_t now;
+    uint32_t tail, second, limit;
+    va_list args;
+
+    if(level < __atomic_load_n(&logMinLevel, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    now = logTime();
+
+    /* Messages that repeat too often share a budget with their format */
+    limit = __atomic_load_n(&logRateLimit, __ATOMIC_RELAXED);
+    if(limit != 0)
+    {
+        budget = &logBudgets[(uint32_t)((uintptr_t) format * 2654435761u) >>
+                             (32 - LOG_BUDGET_BITS)];
+        second = (uint32_t)(now / 1000000);
+        if(__atomic_load_n(&budget->second, __ATOMIC_RELAXED) != second)
+        {
+            /* Threads racing into a new second only miscount a few */
+            __atomic_store_n(&budget->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&budget->second, second, __ATOMIC_RELAXED);
+        }
+        if(__atomic_fetch_add(&budget->count, 1, __ATOMIC_RELAXED) >= limit)
+        {
+            __atomic_fetch_add(&logSuppressed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    ring = claimLogRing();
+    if(ring == NULL)
+    {
+        __atomic_fetch_add(&logRinglessDrops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    tail = ring->tail;
+    if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->full, ring->full + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[tail % LOG_RING_SIZE];
+    record->time = now;
+    record->format = format;
+    record->level = level;
+    va_start(args, format);
+    captureLogArgs(record, args);
+    va_end(args);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return The calling thread's ring, claimed the first time it logs, or
+ *         NULL if they've all been claimed
+ */
+logRing_t* claimLogRing(void)
+{
+    uint32_t slot;
+
+    if(logOwnRing != NULL || logRingless)
+    {
+        return logOwnRing;
+    }
+
+    slot = __atomic_fetch_add(&logNumRings, 1, __ATOMIC_RELAXED);
+    if(slot >= LOG_MAX_THREADS)
+    {
+        logRingless = 1;
+        return NULL;
+    }
+    logOwnRing = &logRings[slot];
+    __atomic_store_n(&logOwnRing->tid, (int32_t) syscall(SYS_gettid),
+                     __ATOMIC_RELEASE);
+    return logOwnRing;
+}
+
+/**
+ * Find the next conversion in a printf() format
+ *
+ * @param p Where to start looking
+ * @param isLong Set if it has an 'l' length modifier
+ * @return Its conversion character, or NULL if there are no more
+ */
+const char* nextLogConversion(const char* p, uint8_t* isLong)
+{
+    while(*p != '\0')
+    {
+        if(*p++ != '%')
+        {
+            continue;
+        }
+        if(*p == '%')
+        {
+            p++;
+            continue;
+        }
+
+        /* Flags, width and precision don't change the argument */
+        while(*p != '\0' && strchr("-+ #0123456789.", *p) != NULL)
+        {
+            p++;
+        }
+        *isLong = (*p == 'l');
+        if(*isLong)
+        {
+            p++;
+        }
+        return (*p != '\0') ? p : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Copy a message's arguments into its record, by its format
+ *
+ * @param record The record, with its format set
+ * @param args The arguments
+ */
+void captureLogArgs(logRecord_t* record, va_list args)
+{
+    const char* p = record->format;
+    const char* s;
+    uint32_t textLen = 0;
+    uint32_t n;
+    uint8_t isLong;
+
+    record->numArgs = 0;
+    while(record->numArgs < LOG_MAX_ARGS &&
+            (p = nextLogConversion(p, &isLong)) != NULL)
+    {
+        switch(*p)
+        {
+            case 's':
+            {
+                /* Once the text is full, the rest point at its last NUL */
+                s = va_arg(args, const char*);
+                s = (s == NULL) ? "(null)" : s;
+                n = 0;
+                while(s[n] != '\0' && textLen + n < LOG_MAX_TEXT - 1)
+                {
+                    record->text[textLen + n] = s[n];
+                    n++;
+                }
+                record->text[textLen + n] = '\0';
+                record->args[record->numArgs] = textLen;
+                textLen += n + (textLen + n < LOG_MAX_TEXT - 1);
+                break;
+            }
+            case 'c':
+            case 'd':
+            case 'i':
+            {
+                record->args[record->numArgs] = isLong ? va_arg(args, long) :
+                                                va_arg(args, int);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            {
+                record->args[record->numArgs] =
+                    isLong ? (long) va_arg(args, unsigned long) :
+                    (long) va_arg(args, unsigned int);
+                break;
+            }
+            case 'p':
+            {
+                record->args[record->numArgs] =
+                    (long)(uintptr_t) va_arg(args, void*);
+                break;
+            }
+            default:
+            {
+                /* The argument's size isn't known, so nothing after it is */
+                return;
+            }
+        }
+        record->numArgs++;
+        p++;
+    }
+}
+
+/**
+ * Copy the text between conversions onto the end of a line, turning each
+ * %% into a %
+ *
+ * @param buf The line
+ * @param len Its size
+ * @param used How much of it is already used
+ * @param from The start of the text
+ * @param to Where it ends
+ * @return How much of the line is used now, len or more if it's truncated
+ */
+size_t appendLogText(char* buf, size_t len, size_t used, const char* from,
+                     const char* to)
+{
+    while(from < to)
+    {
+        if(from[0] == '%' && from + 1 < to && from[1] == '%')
+        {
+            from++;
+        }
+        if(used + 1 < len)
+        {
+            buf[used] = *from;
+            buf[used + 1] = '\0';
+        }
+        used++;
+        from++;
+    }
+    return used;
+}
+
+/**
+ * Turn a record into a line of text
+ *
+ * @param ring The ring it came from
+ * @param record The record
+ * @param buf Where the line goes
+ * @param len The size of buf
+ * @return The length of the line, which was truncated if it's len or more
+ */
+size_t formatLogRecord(const logRing_t* ring, const logRecord_t* record,
+                       char* buf, size_t len)
+{
+    const char* p = record->format;
+    const char* conversion;
+    const char* start;
+    const char* name = getRealTimeThreadName(ring->tid);
+    char spec[16];
+    size_t used = 0;
+    uint8_t isLong;
+    uint8_t i = 0;
+    long arg;
+
+    used = appendStats(buf, len, used, "%lu.%06lu %-5s ",
+                       (unsigned long)(record->time / 1000000),
+                       (unsigned long)(record->time % 1000000),
+                       logLevelNames[record->level]);
+    used = (name != NULL) ? appendStats(buf, len, used, "%s: ", name) :
+           appendStats(buf, len, used, "%d: ", ring->tid);
+
+    while(i < record->numArgs &&
+            (conversion = nextLogConversion(p, &isLong)) != NULL)
+    {
+        /* Flags and widths have no '%', so the last one starts it */
+        start = conversion;
+        while(*start != '%')
+        {
+            start--;
+        }
+        used = appendLogText(buf, len, used, p, start);
+        p = conversion + 1;
+        if((size_t)(p - start) >= sizeof(spec))
+        {
+            break;
+        }
+        memcpy(spec, start, p - start);
+        spec[p - start] = '\0';
+
+        arg = record->args[i++];
+        switch(*conversion)
+        {
+            case 's':
+            {
+                used = appendStats(buf, len, used, spec, record->text + arg);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            {
+                used = isLong ? appendStats(buf, len, used, spec,
+                                            (unsigned long) arg) :
+                       appendStats(buf, len, used, spec, (unsigned int) arg);
+                break;
+            }
+            case 'p':
+            {
+                used = appendStats(buf, len, used, spec,
+                                   (void*)(uintptr_t) arg);
+                break;
+            }
+            default:
+            {
+                used = isLong ? appendStats(buf, len, used, spec, arg) :
+                       appendStats(buf, len, used, spec, (int) arg);
+                break;
+            }
+        }
+    }
+    used = appendLogText(buf, len, used, p, p + strlen(p));
+
+    /* A truncated line still ends its line */
+    if(used + 1 >= len)
+    {
+        used = len - 2;
+    }
+    buf[used++] = '\n';
+    buf[used] = '\0';
+    return used;
+}
+
+/**
+ * Write out every message waiting in the rings, oldest first, and say how
+ * many were dropped since the last time. Only one thread may drain them,
+ * the log thread once it's running.
+ *
+ * @return The number of messages written
+ */
+uint32_t drainLogs(void)
+{
+    char line[LOG_MAX_LINE];
+    logRing_t* oldest;
+    logRing_t* ring;
+    logStats_t stats;
+    uint32_t numRings = __atomic_load_n(&logNumRings, __ATOMIC_RELAXED);
+    uint32_t count = 0;
+    uint32_t i;
+    size_t len;
+
+    numRings = (numRings < LOG_MAX_THREADS) ? numRings : LOG_MAX_THREADS;
+    while(1)
+    {
+        /* Each ring is in order, so the oldest message is at a head */
+        oldest = NULL;
+        for(i = 0; i < numRings; i++)
+        {
+            ring = &logRings[i];
+            if(__atomic_load_n(&ring->tid, __ATOMIC_ACQUIRE) == 0 ||
+                    ring->head == __atomic_load_n(&ring->tail,
+                                                  __ATOMIC_ACQUIRE))
+            {
+                continue;
+            }
+            if(oldest == NULL ||
+                    ring->records[ring->head % LOG_RING_SIZE].time <
+                    oldest->records[oldest->head % LOG_RING_SIZE].time)
+            {
+                oldest = ring;
+            }
+        }
+        if(oldest == NULL)
+        {
+            break;
+        }
+
+        len = formatLogRecord(oldest,
+                              &oldest->records[oldest->head % LOG_RING_SIZE],
+                              line, sizeof(line));
+        fwrite(line, 1, len, stdout);
+        __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+    __atomic_store_n(&logWritten, logWritten + count, __ATOMIC_RELAXED);
+
+    getLogStats(&stats);
+    if(stats.full != logReported.full ||
+            stats.suppressed != logReported.suppressed)
+    {
+        printf("Dropped %u log messages, %u to full rings and %u to the "
+               "rate limit\n",
+               (stats.full - logReported.full) +
+               (stats.suppressed - logReported.suppressed),
+               stats.full - logReported.full,
+               stats.suppressed - logReported.suppressed);
+        logReported = stats;
+        count++;
+    }
+
+    if(count > 0)
+    {
+        fflush(stdout);
+    }
+    return count;
+}
+
+/**
+ * The log thread, drains the rings every LOG_FLUSH_USEC
+ *
+ * @param vp unused
+ */
+void* logThread(__attribute__((unused)) void* vp)
+{
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = LOG_FLUSH_USEC * 1000L;
+    while(1)
+    {
+        drainLogs();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Count what's happened to the messages logged so far. Safe from any
+ * thread.
+ *
+ * @param stats Filled in with the counts
+ */
+void getLogStats(logStats_t* stats)
+{
+    uint32_t numRings = __atomic_load_n(&logNumRings, __ATOMIC_RELAXED);
+    uint32_t i;
+
+    numRings = (numRings < LOG_MAX_THREADS) ? numRings : LOG_MAX_THREADS;
+    stats->written = __atomic_load_n(&logWritten, __ATOMIC_RELAXED);
+    stats->suppressed = __atomic_load_n(&logSuppressed, __ATOMIC_RELAXED);
+    stats->full = __atomic_load_n(&logRinglessDrops, __ATOMIC_RELAXED);
+    for(i = 0; i < numRings; i++)
+    {
+        stats->full += __atomic_load_n(&logRings[i].full, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * Log.h
+ *
+ *  Logging that never blocks the thread doing it. Messages are queued as
+ *  binary records and formatted by a thread of their own.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+/* How much a message matters, it's only logged at or above the level set */
+typedef enum
+{
+    LOG_LEVEL_DEBUG = 0, /*!< Every request and response, for following along */
+    LOG_LEVEL_INFO,      /*!< What the daemon is doing */
+    LOG_LEVEL_WARN,      /*!< Something went wrong and was dealt with */
+    LOG_LEVEL_ERROR,     /*!< Something went wrong and wasn't */
+    LOG_NUM_LEVELS
+} logLevel_t;
+
+/* What happened to the messages logged so far */
+typedef struct
+{
+    uint32_t written;    /*!< Formatted and written out */
+    uint32_t full;       /*!< Dropped because their thread's ring was full */
+    uint32_t suppressed; /*!< Dropped by the rate limit */
+} logStats_t;
+
+void setLogLevel(logLevel_t level);
+void setLogRateLimit(uint32_t perSecond);
+void logMessage(logLevel_t level, const char* format, ...);
+uint32_t drainLogs(void);
+void* logThread(void* vp);
+void getLogStats(logStats_t* stats);
+
+#endif /* _LOG_H_ */
@@ -0,0 +1,497 @@
+/*
+ * Metrics.c
+ *
+ *  Everything worth counting, from the web server to the UART. Each value
+ *  is a 64 bit word bumped with a relaxed atomic add, so recording one on
+ *  the control path costs a single uncontended instruction sequence and
+ *  never takes a lock. A scrape only reads the words, on the web server's
+ *  thread, so it can't hold up the control threads either. Values the Qik
+ *  dispatcher already keeps, like queue depths and stop counts, are read
+ *  from it when scraped instead of being counted twice.
+ *
+ *  The output is the Prometheus text exposition format, made a metric
+ *  family at a time so it streams out in chunks.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Metrics.h"
+#include "Qik2s9v1.h"
+#include "RealTime.h"
+#include "Log.h"
+
+#define METRIC_NUM_STATUSES  8  /*!< Status codes counted, the last is other */
+#define METRIC_NUM_COMMANDS  16 /*!< Qik command bytes 0x00 to 0x0F */
+#define METRIC_NUM_ERROR_BITS 8 /*!< Bits of the Qik's error byte */
+#define METRIC_NUM_BUCKETS   9  /*!< Response time buckets, the last is +Inf */
+
+/* How each family is made, in the order they're served */
+typedef enum
+{
+    FAMILY_HTTP_CONNECTIONS = 0,
+    FAMILY_HTTP_REQUESTS,
+    FAMILY_SERIAL,
+    FAMILY_QIK_COMMANDS,
+    FAMILY_QIK_QUEUES,
+    FAMILY_QIK_STOPS,
+    FAMILY_QIK_ERRORS,
+    FAMILY_QIK_RESPONSES,
+    FAMILY_LOG,
+    NUM_FAMILIES
+} metricFamily_t;
+
+/* Names, by metricRoute_t */
+const char* metricRouteNames[METRIC_NUM_ROUTES] =
+{
+    "other", "file", "motor_control", "websocket", "rt_stats", "trace",
+    "metrics"
+};
+
+/* The status codes the web server sends, 0 for any other */
+const uint16_t metricStatuses[METRIC_NUM_STATUSES] =
+{
+    101, 200, 304, 400, 404, 500, 501, 0
+};
+
+/* Names, by command byte, NULL for bytes that aren't commands */
+const char* metricCommandNames[METRIC_NUM_COMMANDS] =
+{
+    NULL, "GET_FIRMWARE_VERSION", "GET_ERROR_BYTE", "GET_CONFIG_PARAM",
+    "SET_CONFIG_PARAM", NULL, "M0_COAST", "M1_COAST", "M0_FORWARD",
+    "M0_FORWARD_128", "M0_REVERSE", "M0_REVERSE_128", "M1_FORWARD",
+    "M1_FORWARD_128", "M1_REVERSE", "M1_REVERSE_128"
+};
+
+/* Names, by bit of the error byte, NULL for unused bits */
+const char* metricErrorBitNames[METRIC_NUM_ERROR_BITS] =
+{
+    NULL, NULL, NULL, "DATA_OVERRUN_ERROR", "FRAME_ERROR", "CRC_ERROR",
+    "FORMAT_ERROR", "TIMEOUT"
+};
+
+/* Upper bounds of the response time buckets, in microseconds */
+const uint32_t metricBucketUsec[METRIC_NUM_BUCKETS - 1] =
+{
+    500, 1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+/* The values, only touched through __atomic builtins */
+uint64_t metricValues[METRIC_NUM];
+uint64_t metricRequests[METRIC_NUM_ROUTES][METRIC_NUM_STATUSES];
+uint64_t metricCommands[METRIC_NUM_COMMANDS];
+uint64_t metricErrorBits[METRIC_NUM_ERROR_BITS];
+uint64_t metricBuckets[METRIC_NUM_BUCKETS]; /*!< Not cumulative, by bucket */
+uint64_t metricResponseSumUsec = 0;
+
+/* Function prototypes */
+double readMetric(uint64_t* value);
+size_t formatMetricFamily(char* buf, size_t len, metricFamily_t family);
+
+/**
+ * Add to a counter, or move a gauge. Safe from any thread.
+ *
+ * @param id The counter or gauge
+ * @param delta How much to add, negative only for gauges
+ */
+void metricAdd(metricId_t id, int32_t delta)
+{
+    __atomic_fetch_add(&metricValues[id], (uint64_t)(int64_t) delta,
+                       __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a request the web server answered
+ *
+ * @param route What it was for
+ * @param status The status code it was answered with
+ */
+void metricCountRequest(metricRoute_t route, uint16_t status)
+{
+    uint32_t i = 0;
+
+    while(i < METRIC_NUM_STATUSES - 1 && metricStatuses[i] != status)
+    {
+        i++;
+    }
+    __atomic_fetch_add(&metricRequests[route][i], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a command sent to the Qik
+ *
+ * @param command Its command byte
+ */
+void metricCountCommand(uint8_t command)
+{
+    __atomic_fetch_add(&metricCommands[command % METRIC_NUM_COMMANDS], 1,
+                       __ATOMIC_RELAXED);
+}
+
+/**
+ * Count the bits set in an error byte the Qik sent back
+ *
+ * @param errorByte The error byte
+ */
+void metricCountErrorBits(uint8_t errorByte)
+{
+    uint32_t bit;
+
+    for(bit = 0; bit < METRIC_NUM_ERROR_BITS; bit++)
+    {
+        if(errorByte & (1 << bit))
+        {
+            __atomic_fetch_add(&metricErrorBits[bit], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Record how long the Qik took to answer a query
+ *
+ * @param usec From when it could have answered to when the answer arrived
+ */
+void metricObserveResponse(uint32_t usec)
+{
+    uint32_t i = 0;
+
+    while(i < METRIC_NUM_BUCKETS - 1 && usec > metricBucketUsec[i])
+    {
+        i++;
+    }
+    __atomic_fetch_add(&metricBuckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metricResponseSumUsec, usec, __ATOMIC_RELAXED);
+}
+
+/**
+ * @param value A metric
+ * @return Its value, as Prometheus sees it. A double holds any count
+ *         exactly up to 2^53, where a 32 bit long would wrap.
+ */
+double readMetric(uint64_t* value)
+{
+    return (double) __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write one family of metrics, with its HELP and TYPE lines
+ *
+ * @param buf Where the text goes
+ * @param len The size of buf
+ * @param family Which family
+ * @return The length of the text, which was truncated if it's len or more
+ */
+size_t formatMetricFamily(char* buf, size_t len, metricFamily_t family)
+{
+    qikWatchdogStats_t watchdog;
+    qikQueueStats_t queue;
+    qikErrorStats_t errors;
+    logStats_t logCounts;
+    uint8_t deviceIds[QIK_MAX_BUS_DEVICES];
+    uint8_t numDevices;
+    uint64_t count;
+    size_t used = 0;
+    uint32_t i, j;
+
+    switch(family)
+    {
+        case FAMILY_HTTP_CONNECTIONS:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_http_connections_accepted_total "
+                               "Connections the web server accepted.\n"
+                               "# TYPE motordriver_http_connections_accepted_total counter\n"
+                               "motordriver_http_connections_accepted_total %.0f\n"
+                               "# HELP motordriver_http_connections_active "
+                               "Connections open now.\n"
+                               "# TYPE motordriver_http_connections_active gauge\n"
+                               "motordriver_http_connections_active %.0f\n",
+                               readMetric(&metricValues[METRIC_HTTP_ACCEPTED]),
+                               (double)(int64_t) __atomic_load_n(
+                                   &metricValues[METRIC_HTTP_ACTIVE],
+                                   __ATOMIC_RELAXED));
+            break;
+        }
+        case FAMILY_HTTP_REQUESTS:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_http_requests_total "
+                               "Requests answered, by route and status code.\n"
+                               "# TYPE motordriver_http_requests_total counter\n");
+            for(i = 0; i < METRIC_NUM_ROUTES; i++)
+            {
+                for(j = 0; j < METRIC_NUM_STATUSES; j++)
+                {
+                    if(__atomic_load_n(&metricRequests[i][j], __ATOMIC_RELAXED) == 0)
+                    {
+                        continue;
+                    }
+                    if(metricStatuses[j] == 0)
+                    {
+                        used = appendStats(buf, len, used,
+                                           "motordriver_http_requests_total"
+                                           "{route=\"%s\",code=\"other\"} %.0f\n",
+                                           metricRouteNames[i],
+                                           readMetric(&metricRequests[i][j]));
+                    }
+                    else
+                    {
+                        used = appendStats(buf, len, used,
+                                           "motordriver_http_requests_total"
+                                           "{route=\"%s\",code=\"%u\"} %.0f\n",
+                                           metricRouteNames[i],
+                                           metricStatuses[j],
+                                           readMetric(&metricRequests[i][j]));
+                    }
+                }
+            }
+            break;
+        }
+        case FAMILY_SERIAL:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_serial_tx_bytes_total "
+                               "Bytes written to the Qiks.\n"
+                               "# TYPE motordriver_serial_tx_bytes_total counter\n"
+                               "motordriver_serial_tx_bytes_total %.0f\n"
+                               "# HELP motordriver_serial_rx_bytes_total "
+                               "Bytes read from the Qiks.\n"
+                               "# TYPE motordriver_serial_rx_bytes_total counter\n"
+                               "motordriver_serial_rx_bytes_total %.0f\n",
+                               readMetric(&metricValues[METRIC_SERIAL_TX_BYTES]),
+                               readMetric(&metricValues[METRIC_SERIAL_RX_BYTES]));
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_dropped_commands_total "
+                               "Commands dropped because the serial port was backed up.\n"
+                               "# TYPE motordriver_qik_dropped_commands_total counter\n"
+                               "motordriver_qik_dropped_commands_total %.0f\n",
+                               readMetric(&metricValues[METRIC_QIK_DROPPED]));
+            break;
+        }
+        case FAMILY_QIK_COMMANDS:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_commands_sent_total "
+                               "Commands sent to the Qiks, by command.\n"
+                               "# TYPE motordriver_qik_commands_sent_total counter\n");
+            for(i = 0; i < METRIC_NUM_COMMANDS; i++)
+            {
+                if(metricCommandNames[i] != NULL)
+                {
+                    used = appendStats(buf, len, used,
+                                       "motordriver_qik_commands_sent_total"
+                                       "{command=\"%s\"} %.0f\n",
+                                       metricCommandNames[i],
+                                       readMetric(&metricCommands[i]));
+                }
+            }
+            break;
+        }
+        case FAMILY_QIK_QUEUES:
+        {
+            /* The queues are lock-free, so contention shows up as producers
+             * retrying for a slot, or finding the queue full
+             */
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_queue_depth "
+                               "Queries waiting in a Qik's command queue.\n"
+                               "# TYPE motordriver_qik_queue_depth gauge\n");
+            numDevices = getQikDevices(deviceIds);
+            for(i = 0; i < numDevices; i++)
+            {
+                getQikQueueStats(deviceIds[i], &queue);
+                used = appendStats(buf, len, used,
+                                   "motordriver_qik_queue_depth{device=\"%u\"} %lu\n",
+                                   deviceIds[i], (unsigned long) queue.depth);
+            }
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_queue_high_water "
+                               "Most queries ever waiting in a Qik's command queue.\n"
+                               "# TYPE motordriver_qik_queue_high_water gauge\n");
+            for(i = 0; i < numDevices; i++)
+            {
+                getQikQueueStats(deviceIds[i], &queue);
+                used = appendStats(buf, len, used,
+                                   "motordriver_qik_queue_high_water{device=\"%u\"} %lu\n",
+                                   deviceIds[i], (unsigned long) queue.highWater);
+            }
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_queue_full_total "
+                               "Queries turned away because the queue was full.\n"
+                               "# TYPE motordriver_qik_queue_full_total counter\n");
+            for(i = 0; i < numDevices; i++)
+            {
+                getQikQueueStats(deviceIds[i], &queue);
+                used = appendStats(buf, len, used,
+                                   "motordriver_qik_queue_full_total{device=\"%u\"} %lu\n",
+                                   deviceIds[i], (unsigned long) queue.full);
+            }
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_queue_contention_total "
+                               "Times a producer lost the race for a queue slot and retried.\n"
+                               "# TYPE motordriver_qik_queue_contention_total counter\n");
+            for(i = 0; i < numDevices; i++)
+            {
+                getQikQueueStats(deviceIds[i], &queue);
+                used = appendStats(buf, len, used,
+                                   "motordriver_qik_queue_contention_total{device=\"%u\"} %lu\n",
+                                   deviceIds[i], (unsigned long) queue.retries);
+            }
+            break;
+        }
+        case FAMILY_QIK_STOPS:
+        {
+            getQikWatchdogStats(&watchdog);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_timeouts_total "
+                               "Queries the Qiks never answered.\n"
+                               "# TYPE motordriver_qik_timeouts_total counter\n"
+                               "motordriver_qik_timeouts_total %.0f\n"
+                               "# HELP motordriver_qik_shutoffs_total "
+                               "Times motors were stopped for want of commands.\n"
+                               "# TYPE motordriver_qik_shutoffs_total counter\n"
+                               "motordriver_qik_shutoffs_total %.0f\n",
+                               readMetric(&metricValues[METRIC_QIK_TIMEOUTS]),
+                               readMetric(&metricValues[METRIC_QIK_SHUTOFFS]));
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_watchdog_trips_total "
+                               "Times the watchdog stopped the motors for a stuck dispatcher.\n"
+                               "# TYPE motordriver_qik_watchdog_trips_total counter\n"
+                               "motordriver_qik_watchdog_trips_total %lu\n",
+                               (unsigned long) watchdog.watchdogTrips);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_heartbeats_total "
+                               "Keepalives sent to the Qiks on an idle bus.\n"
+                               "# TYPE motordriver_qik_heartbeats_total counter\n"
+                               "motordriver_qik_heartbeats_total %lu\n"
+                               "# HELP motordriver_qik_heartbeat_bytes_total "
+                               "Bytes the keepalives took on the wire.\n"
+                               "# TYPE motordriver_qik_heartbeat_bytes_total counter\n"
+                               "motordriver_qik_heartbeat_bytes_total %lu\n",
+                               (unsigned long) watchdog.heartbeats,
+                               (unsigned long) watchdog.heartbeatBytes);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_stops_total "
+                               "Stops sent to a Qik, for any reason.\n"
+                               "# TYPE motordriver_qik_stops_total counter\n");
+            numDevices = getQikDevices(deviceIds);
+            for(i = 0; i < numDevices; i++)
+            {
+                used = appendStats(buf, len, used,
+                                   "motordriver_qik_stops_total{device=\"%u\"} %lu\n",
+                                   deviceIds[i],
+                                   (unsigned long) getQikStopCount(deviceIds[i]));
+            }
+            break;
+        }
+        case FAMILY_QIK_ERRORS:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_error_bits_total "
+                               "Error bits the Qiks reported, by bit.\n"
+                               "# TYPE motordriver_qik_error_bits_total counter\n");
+            for(i = 0; i < METRIC_NUM_ERROR_BITS; i++)
+            {
+                if(metricErrorBitNames[i] != NULL)
+                {
+                    used = appendStats(buf, len, used,
+                                       "motordriver_qik_error_bits_total"
+                                       "{bit=\"%s\"} %.0f\n",
+                                       metricErrorBitNames[i],
+                                       readMetric(&metricErrorBits[i]));
+                }
+            }
+            getQikErrorStats(&errors);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_error_edges_total "
+                               "Times the error pin rose.\n"
+                               "# TYPE motordriver_qik_error_edges_total counter\n"
+                               "motordriver_qik_error_edges_total %lu\n",
+                               (unsigned long) errors.edges);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_error_query_seconds "
+                               "Time from the error pin rising to each error byte query.\n"
+                               "# TYPE motordriver_qik_error_query_seconds summary\n"
+                               "motordriver_qik_error_query_seconds_sum %f\n"
+                               "motordriver_qik_error_query_seconds_count %lu\n"
+                               "# HELP motordriver_qik_error_query_max_seconds "
+                               "Longest time from the error pin rising to a query.\n"
+                               "# TYPE motordriver_qik_error_query_max_seconds gauge\n"
+                               "motordriver_qik_error_query_max_seconds %f\n",
+                               errors.sumUsec / 1e6,
+                               (unsigned long) errors.queries,
+                               errors.maxUsec / 1e6);
+            break;
+        }
+        case FAMILY_QIK_RESPONSES:
+        {
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_qik_response_seconds "
+                               "How long the Qiks took to answer queries.\n"
+                               "# TYPE motordriver_qik_response_seconds histogram\n");
+            count = 0;
+            for(i = 0; i < METRIC_NUM_BUCKETS; i++)
+            {
+                count += __atomic_load_n(&metricBuckets[i], __ATOMIC_RELAXED);
+                if(i < METRIC_NUM_BUCKETS - 1)
+                {
+                    used = appendStats(buf, len, used,
+                                       "motordriver_qik_response_seconds_bucket"
+                                       "{le=\"%g\"} %.0f\n",
+                                       metricBucketUsec[i] / 1e6, (double) count);
+                }
+            }
+            used = appendStats(buf, len, used,
+                               "motordriver_qik_response_seconds_bucket{le=\"+Inf\"} %.0f\n"
+                               "motordriver_qik_response_seconds_sum %f\n"
+                               "motordriver_qik_response_seconds_count %.0f\n",
+                               (double) count,
+                               readMetric(&metricResponseSumUsec) / 1e6,
+                               (double) count);
+            break;
+        }
+        case FAMILY_LOG:
+        {
+            getLogStats(&logCounts);
+            used = appendStats(buf, len, used,
+                               "# HELP motordriver_log_messages_total "
+                               "Log messages, by what became of them.\n"
+                               "# TYPE motordriver_log_messages_total counter\n"
+                               "motordriver_log_messages_total{outcome=\"written\"} %lu\n"
+                               "motordriver_log_messages_total{outcome=\"ring_full\"} %lu\n"
+                               "motordriver_log_messages_total{outcome=\"rate_limited\"} %lu\n",
+                               (unsigned long) logCounts.written,
+                               (unsigned long) logCounts.full,
+                               (unsigned long) logCounts.suppressed);
+            break;
+        }
+        case NUM_FAMILIES:
+        {
+            break;
+        }
+    }
+    return used;
+}
+
+/**
+ * Write the metrics in the Prometheus text format, a family at a time:
+ * call this until it returns 0, sending each piece as it's made.
+ *
+ * @param buf Where the next piece goes, a few KB is plenty
+ * @param len The size of buf
+ * @param cursor Where the output is up to, 0 to start it
+ * @return The length of the piece, 0 once they're all written
+ */
+size_t formatMetrics(char* buf, size_t len, uint32_t* cursor)
+{
+    size_t used;
+
+    if(*cursor >= NUM_FAMILIES)
+    {
+        return 0;
+    }
+    used = formatMetricFamily(buf, len, (metricFamily_t) *cursor);
+    (*cursor)++;
+    return (used < len) ? used : len - 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * Metrics.h
+ *
+ *  Counters, gauges and histograms for the whole daemon, served in the
+ *  Prometheus text exposition format
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Plain counters and gauges */
+typedef enum
+{
+    METRIC_HTTP_ACCEPTED = 0, /*!< Connections accepted */
+    METRIC_HTTP_ACTIVE,       /*!< Connections open now, a gauge */
+    METRIC_SERIAL_TX_BYTES,   /*!< Bytes written to the Qik */
+    METRIC_SERIAL_RX_BYTES,   /*!< Bytes read from the Qik */
+    METRIC_QIK_TIMEOUTS,      /*!< Queries that were never answered */
+    METRIC_QIK_SHUTOFFS,      /*!< Motors stopped for want of commands */
+    METRIC_QIK_DROPPED,       /*!< Commands dropped, the port was backed up */
+    METRIC_NUM
+} metricId_t;
+
+/* What an HTTP request was for */
+typedef enum
+{
+    METRIC_ROUTE_OTHER = 0,     /*!< Unparseable, unsupported or unknown */
+    METRIC_ROUTE_FILE,          /*!< Anything served out of htdocs */
+    METRIC_ROUTE_MOTOR_CONTROL, /*!< motor_control.c */
+    METRIC_ROUTE_WEBSOCKET,     /*!< The motor WebSocket upgrade */
+    METRIC_ROUTE_RT_STATS,      /*!< rt_stats.c */
+    METRIC_ROUTE_TRACE,         /*!< trace_stats.c and trace.c */
+    METRIC_ROUTE_METRICS,       /*!< /metrics */
+    METRIC_NUM_ROUTES
+} metricRoute_t;
+
+void metricAdd(metricId_t id, int32_t delta);
+void metricCountRequest(metricRoute_t route, uint16_t status);
+void metricCountCommand(uint8_t command);
+void metricCountErrorBits(uint8_t errorByte);
+void metricObserveResponse(uint32_t usec);
+size_t formatMetrics(char* buf, size_t len, uint32_t* cursor);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,330 @@
+/*
+ * MotionControl.c
+ *
+ *  A control loop woken at a fixed rate by a timerfd. Input handlers only
+ *  set a target speed for each motor of each Qik on the bus. Every tick the
+ *  loop moves each motor's speed toward its target, with its acceleration
+ *  limited and its change in acceleration (jerk) limited too, so the motors
+ *  ramp smoothly instead of jumping. At most one setpoint per motor goes to
+ *  its Qik each tick, and only when the speed changed, so the serial traffic
+ *  is bounded by the rate however fast clients send commands.
+ *
+ *  Speeds are signed, positive is forward, and the arithmetic is fixed
+ *  point with MOTION_FRAC_BITS fractional bits.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "MotionControl.h"
+#include "Qik2s9v1.h"
+#include "RealTime.h"
+#include "Trace.h"
+
+#define MOTION_FRAC_BITS 16 /*!< Fractional bits of the fixed point values */
+#define MOTION_ONE       ((int32_t) 1 << MOTION_FRAC_BITS)
+
+/* A motor's target and the trace of the command that set it share a word,
+ * so the loop always sees the two together */
+#define MOTION_TARGET(command) ((int16_t)((command) & 0xFFFF))
+#define MOTION_TRACE(command)  ((uint16_t)((command) >> 16))
+
+/* One motor's state, all fixed point */
+typedef struct
+{
+    int32_t speed;        /*!< Where the ramp is, speed units */
+    int32_t accel;        /*!< Speed change per tick */
+    int16_t sent;         /*!< The last speed sent to the Qik */
+} motorRamp_t;
+
+/* Set by input handlers, indexed by the device's slot then the motor. The
+ * trace is taken out once a setpoint carries it */
+uint32_t motorTargets[QIK_MAX_BUS_DEVICES][MOTION_NUM_MOTORS];
+
+/* Only touched by the loop once it's running */
+motorRamp_t motorRamps[QIK_MAX_BUS_DEVICES][MOTION_NUM_MOTORS];
+uint8_t motionDeviceIds[QIK_MAX_BUS_DEVICES]; /*!< The Qiks, by slot */
+uint8_t motionNumDevices = 0; /*!< Qiks in motionDeviceIds[] */
+uint32_t motionStopCounts[QIK_MAX_BUS_DEVICES]; /*!< getQikStopCount() each
+    device's ramps agree with */
+uint32_t motionRateHz = 0; /*!< Ticks per second */
+int32_t motionMaxAccel = 0; /*!< Largest speed change per tick */
+int32_t motionMaxJerk = 0; /*!< Largest accel change per tick */
+int32_t motionTimerFd = -1; /*!< timerfd that paces the loop */
+
+/* Function prototypes */
+void rampMotor(motorRamp_t* ramp, int32_t target);
+uint16_t takeMotorTrace(uint32_t* target, uint32_t command);
+
+/**
+ * Set up the control loop for the Qiks on the bus. This must be called
+ * after they're added, before motionControlLoop() starts.
+ *
+ * @param rateHz How many times a second the loop runs
+ * @param accel The most the speed can change in a second
+ * @param jerk The most the acceleration can change in a second, 0 for no
+ *             limit
+ * @return 0 if something failed, 1 for success
+ */
+uint8_t initializeMotionControl(uint32_t rateHz, uint32_t accel, uint32_t jerk)
+{
+    uint8_t slot;
+
+    if(rateHz == 0 || rateHz > 1000 || accel == 0)
+    {
+        return 0;
+    }
+
+    memset(motorRamps, 0, sizeof(motorRamps));
+    memset(motorTargets, 0, sizeof(motorTargets));
+    motionNumDevices = getQikDevices(motionDeviceIds);
+    motionRateHz = rateHz;
+
+    /* Per second limits to per tick, rounding away from zero so a limit
+     * never becomes no movement at all
+     */
+    motionMaxAccel = (int32_t)((((int64_t) accel << MOTION_FRAC_BITS) +
+                                rateHz - 1) / rateHz);
+    motionMaxJerk = (jerk == 0) ? motionMaxAccel :
+                    (int32_t)((((int64_t) jerk << MOTION_FRAC_BITS) +
+                               (int64_t) rateHz * rateHz - 1) /
+                              ((int64_t) rateHz * rateHz));
+
+    motionTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if(motionTimerFd == -1)
+    {
+        return 0;
+    }
+    for(slot = 0; slot < motionNumDevices; slot++)
+    {
+        motionStopCounts[slot] = getQikStopCount(motionDeviceIds[slot]);
+    }
+    return 1;
+}
+
+/**
+ * Set the speed a motor should ramp to. Safe from any thread.
+ *
+ * @param deviceId The Qik the motor is on, ignored if it isn't on the bus
+ * @param motor 0 for M0, 1 for M1
+ * @param speed -MOTION_MAX_SPEED to MOTION_MAX_SPEED, positive is forward
+ * @param trace The trace ID of the command setting it, 0 if none
+ */
+void setMotorTarget(uint8_t deviceId, uint8_t motor, int16_t speed,
+                    uint16_t trace)
+{
+    uint8_t slot;
+
+    for(slot = 0; slot < motionNumDevices; slot++)
+    {
+        if(motionDeviceIds[slot] == deviceId)
+        {
+            break;
+        }
+    }
+    if(slot == motionNumDevices || motor >= MOTION_NUM_MOTORS)
+    {
+        return;
+    }
+    if(speed > MOTION_MAX_SPEED)
+    {
+        speed = MOTION_MAX_SPEED;
+    }
+    else if(speed < -MOTION_MAX_SPEED)
+    {
+        speed = -MOTION_MAX_SPEED;
+    }
+    __atomic_store_n(&motorTargets[slot][motor],
+                     ((uint32_t) trace << 16) | (uint16_t) speed,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * The control loop, run in its own thread
+ *
+ * @param vp unused
+ */
+void* motionControlLoop(__attribute__((unused)) void* vp)
+{
+    struct itimerspec timer;
+    struct timespec now;
+    uint64_t expirations;
+    uint64_t nowNsec, tickNsec, periodNsec;
+    motorRamp_t* ramp;
+    uint32_t stopCount, command;
+    int16_t speed;
+    uint8_t slot, motor;
+
+    periodNsec = 1000000000 / motionRateHz;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_sec = periodNsec / 1000000000;
+    timer.it_interval.tv_nsec = periodNsec % 1000000000;
+    timer.it_value = timer.it_interval;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timerfd_settime(motionTimerFd, 0, &timer, NULL);
+    tickNsec = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec + periodNsec;
+
+    while(1)
+    {
+        /* Missed ticks aren't made up, the ramp just carries on */
+        if(read(motionTimerFd, &expirations, sizeof(expirations)) < 0)
+        {
+            continue;
+        }
+
+        /* The ticks come like clockwork, so how late this one was woken is
+         * the scheduling latency
+         */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        nowNsec = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+        tickNsec += (expirations - 1) * periodNsec;
+        recordSchedulingLatency((nowNsec > tickNsec) ?
+                                (nowNsec - tickNsec) / 1000 : 0,
+                                expirations - 1);
+        tickNsec += periodNsec;
+
+        for(slot = 0; slot < motionNumDevices; slot++)
+        {
+            /* An emergency stop braked the motors behind the ramps' backs.
+             * Start over from a standstill, and stay there until told
+             * otherwise.
+             */
+            stopCount = getQikStopCount(motionDeviceIds[slot]);
+            if(stopCount != motionStopCounts[slot])
+            {
+                motionStopCounts[slot] = stopCount;
+                memset(motorRamps[slot], 0, sizeof(motorRamps[slot]));
+                for(motor = 0; motor < MOTION_NUM_MOTORS; motor++)
+                {
+                    __atomic_store_n(&motorTargets[slot][motor], 0,
+                                     __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+
+            for(motor = 0; motor < MOTION_NUM_MOTORS; motor++)
+            {
+                ramp = &motorRamps[slot][motor];
+                command = __atomic_load_n(&motorTargets[slot][motor],
+                                          __ATOMIC_RELAXED);
+                rampMotor(ramp, (int32_t) MOTION_TARGET(command) * MOTION_ONE);
+
+                /* Round to the nearest whole speed */
+                speed = (int16_t)((ramp->speed + (ramp->speed < 0 ?
+                                                  -MOTION_ONE / 2 :
+                                                  MOTION_ONE / 2)) / MOTION_ONE);
+                if(speed != ramp->sent)
+                {
+                    ramp->sent = speed;
+                    setMotorSpeed(motionDeviceIds[slot], motor, speed,
+                                  takeMotorTrace(&motorTargets[slot][motor],
+                                                 command));
+                }
+                else if(MOTION_TRACE(command) != 0 && ramp->accel == 0 &&
+                        ramp->speed == (int32_t) MOTION_TARGET(command) *
+                        MOTION_ONE)
+                {
+                    /* Already there, nothing will be sent for it */
+                    takeMotorTrace(&motorTargets[slot][motor], command);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Move one tick toward the target. The acceleration builds up and dies
+ * down at no more than the jerk limit, and starts dying down early enough
+ * that the speed lands on the target instead of overshooting it.
+ *
+ * @param ramp The motor's state
+ * @param target The target speed, fixed point
+ */
+void rampMotor(motorRamp_t* ramp, int32_t target)
+{
+    int32_t error = target - ramp->speed;
+    int32_t accel = ramp->accel;
+    int64_t absAccel = (accel < 0) ? -accel : accel;
+    int64_t absError = (error < 0) ? -error : error;
+    int64_t stoppingDistance;
+
+    if(error == 0 && accel == 0)
+    {
+        return;
+    }
+
+    /* How far the speed moves while the acceleration winds down to 0 */
+    stoppingDistance = (absAccel * absAccel / motionMaxJerk + absAccel) / 2;
+
+    if(((accel > 0 && error > 0) || (accel < 0 && error < 0)) &&
+            absError <= stoppingDistance)
+    {
+        /* Ease off so the speed arrives with no acceleration left */
+        if(absAccel <= motionMaxJerk)
+        {
+            accel = 0;
+        }
+        else
+        {
+            accel += (accel > 0) ? -motionMaxJerk : motionMaxJerk;
+        }
+    }
+    else
+    {
+        /* Build up acceleration toward the target */
+        accel += (error > 0) ? motionMaxJerk : -motionMaxJerk;
+        if(accel > motionMaxAccel)
+        {
+            accel = motionMaxAccel;
+        }
+        else if(accel < -motionMaxAccel)
+        {
+            accel = -motionMaxAccel;
+        }
+    }
+
+    /* Never step past the target, or creep when the acceleration ran out
+     * just short of it
+     */
+    absAccel = (accel < 0) ? -accel : accel;
+    if((((accel > 0 && error > 0) || (accel < 0 && error < 0)) &&
+            absAccel >= absError) ||
+            (accel == 0 && absError < motionMaxJerk))
+    {
+        ramp->speed = target;
+        ramp->accel = 0;
+        return;
+    }
+
+    ramp->speed += accel;
+    ramp->accel = accel;
+}
+
+/**
+ * Take the trace out of a motor's target, so only the first setpoint
+ * toward it carries the trace. A newer command may have replaced the
+ * target since it was read, its trace is left for it.
+ *
+ * @param target The motor's entry in motorTargets
+ * @param command What the loop read from it this tick
+ * @return The trace ID to send with the setpoint, 0 if none
+ */
+uint16_t takeMotorTrace(uint32_t* target, uint32_t command)
+{
+    if(MOTION_TRACE(command) == 0 ||
+            !__atomic_compare_exchange_n(target, &command, command & 0xFFFF,
+                                         false, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    traceStamp(MOTION_TRACE(command), TRACE_RAMPED);
+    return MOTION_TRACE(command);
+}
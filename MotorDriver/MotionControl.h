@@ -0,0 +1,20 @@
+/*
+ * MotionControl.h
+ *
+ *  Fixed rate control loop that ramps the motors toward their target speeds
+ */
+
+#ifndef _MOTION_CONTROL_H_
+#define _MOTION_CONTROL_H_
+
+#include <stdint.h>
+
+#define MOTION_NUM_MOTORS 2   /*!< M0 and M1 */
+#define MOTION_MAX_SPEED  255 /*!< Full speed, either way */
+
+uint8_t initializeMotionControl(uint32_t rateHz, uint32_t accel, uint32_t jerk);
+void* motionControlLoop(void* vp);
+void setMotorTarget(uint8_t deviceId, uint8_t motor, int16_t speed,
+                    uint16_t trace);
+
+#endif /* _MOTION_CONTROL_H_ */
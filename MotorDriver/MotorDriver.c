@@ -1,46 +1,90 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <pigpio.h>
 
 #include "SerialPort.h"
 #include "Qik2s9v1.h"
+#include "QikState.h"
+#include "MotionControl.h"
+#include "RealTime.h"
+#include "Log.h"
+#include "FlightRecorder.h"
+#include "Gpio.h"
 #include "httpd.h"
 
 #define ERROR_PIN 4
+#define QIK_SERIAL_TIMEOUT 0x02 /*!< The Qik stops the motors if it hears
+    nothing for 524 ms */
+
+/* Control loop settings, in speed units where 255 is full speed */
+#define MOTION_RATE_HZ 50   /*!< Setpoints per second, at most, per motor */
+#define MOTION_ACCEL   510  /*!< Speed change per second, 0 to full in 0.5s */
+#define MOTION_JERK    4080 /*!< Accel change per second, full in 0.125s */
 
 /* Function declarations */
+void usage(const char* name);
 uint8_t initializeGpio(void);
-void errorFunc(__attribute__((unused)) int gpio, __attribute__((unused)) int level,
-        __attribute__((unused)) uint32_t tick);
+void errorFunc(__attribute__((unused)) uint32_t pin,
+        __attribute__((unused)) uint32_t level);
 
 /**
- * This interrupt is called when the error GPIO goes high and requests
- * the error byte from the Qik
+ * This interrupt is called when the error GPIO goes high. It runs on the GPIO
+ * backend's thread, or in a signal handler for the mock, so it only flags
+ * the error: the dispatcher stops every device's motors and reads each
+ * one's error byte ahead of everything else it has to send
  *
- * @param gpio  unused
+ * @param pin   unused
  * @param level unused
- * @param tick  unused
  */
-void errorFunc(__attribute__((unused)) int gpio, __attribute__((unused)) int level,
-        __attribute__((unused)) uint32_t tick)
+void errorFunc(__attribute__((unused)) uint32_t pin,
+        __attribute__((unused)) uint32_t level)
+{
+    signalQikError();
+}
+
+/**
+ * Print the usage
+ *
+ * @param name The program name
+ */
+void usage(const char* name)
 {
-    getErrorByte(DEFAULT_DEVICE_ID);
+    fprintf(stderr,
+            "Usage: %s [options] [serial port]\n"
+            "  -d id    Drive the Qik with this device ID, once for each Qik\n"
+            "           on the port (%d)\n"
+            "  -p prio  Run the control threads SCHED_FIFO at prio, or at\n"
+            "           serial,dispatch,watchdog,motion, and lock memory\n"
+            "  -c cpu   Pin the control threads to cpu\n"
+            "  -w cpu   Pin the web server to cpu (any but the control cpu)\n"
+            "  -v       Log every request and Qik response too\n",
+            name, DEFAULT_DEVICE_ID);
+    fprintf(stderr,
+            "  -r file  Record the serial traffic in file (%s)\n"
+            "  -s vmin[,vtime]\n"
+            "           Serial read profile, bytes to collect before the\n"
+            "           reader wakes (1,0), see Benchmarks/SerialBench\n",
+            FLIGHT_PATH);
 }
 
 /**
  * The main function. Spin up the serial port in a separate thread and
  * poll the qik for some data
  *
- * @param argc unused
- * @param argv unused
+ * @param argc The number of arguments
+ * @param argv The options, see usage(), and an optional serial port path,
+ *             like the QikEmulator's pty
  * @return 1 for an error, 0 for success
  */
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
+int main(int argc, char** argv)
 {
     /* The path to the serial port on a Raspberry Pi B+ */
-    char serialPortPath[] = "/dev/ttyAMA0";
+    char* serialPortPath = "/dev/ttyAMA0";
+
+    /* Where the serial traffic is recorded */
+    const char* flightPath = FLIGHT_PATH;
 
     /* The port to serve the webpage on */
     uint16_t port = 43742;
@@ -48,6 +92,140 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
     /* Threads */
     pthread_t serialThread;
     pthread_t httpdThread;
+    pthread_t watchdogThread;
+    pthread_t motionThread;
+    pthread_t logThreadId;
+    pthread_t stateThread;
+
+    /* Everything on the default scheduler unless asked */
+    rtConfig_t rtConfig = {{0, 0, 0, 0}, -1, -1};
+    int32_t opt;
+
+    /* The Qiks on the serial port */
+    uint8_t deviceIds[QIK_MAX_BUS_DEVICES];
+    uint8_t numDevices = 0;
+    uint8_t i;
+    unsigned long deviceId;
+    char* end;
+
+    while ((opt = getopt(argc, argv, "d:p:c:w:vr:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+            {
+                /* The whole argument must be an ID a Qik can take */
+                deviceId = strtoul(optarg, &end, 0);
+                if (numDevices == QIK_MAX_BUS_DEVICES || end == optarg ||
+                        *end != '\0' || deviceId > MAX_DEVICE_ID)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                deviceIds[numDevices++] = (uint8_t) deviceId;
+                break;
+            }
+            case 'p':
+            {
+                if (0 == parseRealTimePriorities(optarg, &rtConfig))
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'c':
+            {
+                rtConfig.controlCpu = strtol(optarg, NULL, 10);
+                break;
+            }
+            case 'w':
+            {
+                rtConfig.webCpu = strtol(optarg, NULL, 10);
+                break;
+            }
+            case 'v':
+            {
+                setLogLevel(LOG_LEVEL_DEBUG);
+                break;
+            }
+            case 'r':
+            {
+                flightPath = optarg;
+                break;
+            }
+            case 's':
+            {
+                /* Takes effect when the port is opened below */
+                if (0 == parseSerialReadProfile(optarg))
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            default:
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    /* Use another serial port if one is given */
+    if (optind < argc)
+    {
+        serialPortPath = argv[optind];
+    }
+    if (numDevices == 0)
+    {
+        deviceIds[numDevices++] = DEFAULT_DEVICE_ID;
+    }
+
+    /* Memory is locked before any thread starts, so all of theirs is too */
+    if (0 == initializeRealTime(&rtConfig))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Every other thread logs through this one */
+    if (createRealTimeThread(&logThreadId, RT_LOG, logThread, NULL))
+    {
+        fprintf(stderr, "Error creating log thread\n");
+        return 1;
+    }
+
+    /* The Qik state is saved here, the dispatcher never touches the disk */
+    if (createRealTimeThread(&stateThread, RT_STATE, qikStateWriter, NULL))
+    {
+        fprintf(stderr, "Error creating state thread\n");
+        return 1;
+    }
+
+    /* The command queue has to be ready before the error ISR can fire */
+    if (0 == initializeQikDispatcher())
+    {
+        fprintf(stderr, "Error initializing the Qik dispatcher\n");
+        return 1;
+    }
+
+    /* Each Qik gets its own queue, watchdog and cached state */
+    for (i = 0; i < numDevices; i++)
+    {
+        if (0 == addQikDevice(deviceIds[i]))
+        {
+            fprintf(stderr, "Can't add Qik device %d\n", deviceIds[i]);
+            return 1;
+        }
+    }
+
+    /* Trust what the Qiks said last time until they say otherwise */
+    if (loadQikState(QIK_STATE_PATH))
+    {
+        logMessage(LOG_LEVEL_INFO, "Using the Qik state cached in %s.*",
+                   QIK_STATE_PATH);
+    }
 
     /* Initialize and setup the GPIO */
     if (0 == initializeGpio())
@@ -56,34 +234,68 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
         return 1;
     }
 
+    /* Keep a record of the serial traffic, the motors can run without it */
+    if (0 == openFlightRecorder(flightPath))
+    {
+        logMessage(LOG_LEVEL_WARN, "Can't record the serial traffic in %s",
+                   flightPath);
+    }
+
+    /* Open the port up front so the first commands aren't written to nothing */
+    initializeSerialPort(serialPortPath);
+
     /* Create and start a thread to read from the serial port */
-    if (pthread_create(&serialThread, NULL, readSerial, (void*) serialPortPath))
+    if (createRealTimeThread(&serialThread, RT_SERIAL, readSerial,
+                             (void*) serialPortPath))
     {
         fprintf(stderr, "Error creating serial thread\n");
         return 1;
     }
 
+    /* Create and start a thread to stop the motors if the dispatcher can't */
+    if (createRealTimeThread(&watchdogThread, RT_WATCHDOG, qikWatchdog, NULL))
+    {
+        fprintf(stderr, "Error creating watchdog thread\n");
+        return 1;
+    }
+
+    /* Create and start the thread that ramps the motors */
+    if (0 == initializeMotionControl(MOTION_RATE_HZ, MOTION_ACCEL, MOTION_JERK) ||
+            createRealTimeThread(&motionThread, RT_MOTION, motionControlLoop,
+                                 NULL))
+    {
+        fprintf(stderr, "Error creating motion control thread\n");
+        return 1;
+    }
+
     /* Create and start a thread to do web stuff */
-    if (pthread_create(&httpdThread, NULL, httpdMain, (void*) (&port)))
+    if (createRealTimeThread(&httpdThread, RT_HTTPD, httpdMain, (void*) (&port)))
     {
         fprintf(stderr, "Error creating httpd thread\n");
         return 1;
     }
 
-    /* Get some initial info */
-    getFirmwareVersion(DEFAULT_DEVICE_ID);
-    getConfigurationParameter(DEFAULT_DEVICE_ID, DEVICE_ID);
-    getConfigurationParameter(DEFAULT_DEVICE_ID, PWM_PARAMETER);
-    getConfigurationParameter(DEFAULT_DEVICE_ID, SHUTDOWN_MOTOR_ON_ERROR);
-    getConfigurationParameter(DEFAULT_DEVICE_ID, SERIAL_TIMEOUT);
+    for (i = 0; i < numDevices; i++)
+    {
+        /* Get some initial info, or check the cached info in the background */
+        getFirmwareVersion(deviceIds[i], NULL, NULL);
+        getConfigurationParameter(deviceIds[i], DEVICE_ID, NULL, NULL);
+        getConfigurationParameter(deviceIds[i], PWM_PARAMETER, NULL, NULL);
+
+        /* Have the Qik stop the motors itself if this process dies */
+        enableQikSerialTimeout(deviceIds[i], QIK_SERIAL_TIMEOUT);
+    }
+
+    /* This thread is the dispatcher from here on */
+    configureRealTimeThread(RT_DISPATCH);
 
-    /* Do this forever */
+    /* Send commands as they're queued, sleeping in between */
     while (1)
     {
         processQikState();
     }
 
-    gpioTerminate();
+    closeGpio();
 
     return 0;
 }
@@ -96,32 +308,28 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
 uint8_t initializeGpio(void)
 {
     /* Initialize the GPIO */
-    if (PI_INIT_FAILED == gpioInitialise())
+    if (0 == openGpio())
     {
         return 0;
     }
 
     /* Configure the ERROR_PIN as an input with a pulldown */
-    if (0 != gpioSetMode(ERROR_PIN, PI_INPUT))
-    {
-        return 0;
-    }
-    if (0 != gpioSetPullUpDown(ERROR_PIN, PI_PUD_DOWN))
+    if (0 == setGpioInput(ERROR_PIN))
     {
         return 0;
     }
 
     /* If the ERROR_PIN ever rises, call errorFunc() */
-    if (0 != gpioSetISRFunc(ERROR_PIN, RISING_EDGE, 0, errorFunc))
+    if (0 == watchGpioEdge(ERROR_PIN, GPIO_RISING_EDGE, errorFunc))
     {
         return 0;
     }
 
     /* Check ERROR_PIN before continuing */
-    if(gpioRead(ERROR_PIN) != 0)
+    if(readGpio(ERROR_PIN) > 0)
     {
-        /* Starting out in the error state */
-        getErrorByte(DEFAULT_DEVICE_ID);
+        /* Starting out in the error state, find out which Qik it is */
+        errorFunc(ERROR_PIN, 1);
     }
     return 1;
 }
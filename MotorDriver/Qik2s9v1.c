@@ -1,22 +1,60 @@
-#include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "Qik2s9v1.h"
 #include "SerialPort.h"
+#include "QikQueue.h"
+#include "QikState.h"
+#include "MotionControl.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "Log.h"
 
 /* Definitions */
-#define CMD_TIMEOUT_USEC  100000 /*!< 100ms max wait time for a response */
+#define CMD_TIMEOUT_USEC  100000 /*!< 100ms max wait time for a response, and
+    the wait until the round trip time has been measured */
+#define CMD_MIN_TIMEOUT_USEC 2000 /*!< Shortest wait, for scheduling jitter */
 #define MOTOR_TIMEOUT    2000000 /*!< 2 seconds in microseconds */
 
-#define QIK_ACTION_QUEUE_SIZE 1024
-
 #define START_BYTE 0xAA /*!< Every command starts with this byte to autobaud */
 
+#define QIK_MAX_DEVICES 128 /*!< Device IDs are 7 bits */
+#define QIK_NUM_MOTORS  2   /*!< M0 and M1 */
+#define NUM_SETPOINTS   (QIK_MAX_DEVICES * QIK_NUM_MOTORS)
+#define SETPOINT_PENDING 0x80000000 /*!< A setpoint is waiting to be sent */
+
+#define QIK_MAX_IN_FLIGHT 8   /*!< Queries sent before the first is answered */
+#define QIK_RX_BUFSIZE    256 /*!< Response bytes in transit, a power of two */
+#define QIK_NUM_QUERIES   5   /*!< Room for every query's command byte */
+#define QIK_TX_BUFSIZE    1024 /*!< Bytes waiting to be written, a power of two */
+#define QIK_MAX_TX_TRACES 16  /*!< Traced setpoints waiting to be written, a
+    power of two */
+#define QIK_WATCHDOG_GRACE_USEC 100000 /*!< How late the dispatcher can be
+    with the motor shutoff before the watchdog does it instead */
+#define QIK_HEARTBEAT_FRAME_LEN 3 /*!< A GET_FIRMWARE_VERSION keepalive */
+#define QIK_STOP_FRAME_LEN 8 /*!< M0 and M1 FORWARD at 0 */
+#define QIK_DRR_QUANTUM 32 /*!< Query bytes each device may send per round,
+    enough that draining its answers before the next turn costs little */
+#define QIK_STATE_PATH_LEN 64 /*!< Longest path a device's state is saved at */
+
+/* How long the Qik waits for a command before it times out, from its
+ * SERIAL_TIMEOUT parameter. The units are 262.144 ms. */
+#define QIK_SERIAL_TIMEOUT_USEC(p) \
+    (((uint64_t) 262144 * ((p) & 0x0F)) << (((p) >> 4) & 0x07))
+
+#define QIK_MAX_BACKLOG_USEC (8 * SERIAL_BYTE_USEC) /*!< Motion and queries
+    aren't written while more than this is waiting for the wire, about one
+    M0 and M1 pair, so a stop never waits long behind them */
+
 /* All the different possible commands */
 typedef enum
 {
@@ -36,31 +74,168 @@ typedef enum
     M1_REVERSE_128 = 0x0F
 } QikCommand_t;
 
-volatile QikCommand_t pendingCmd = 0; /*!< Keep track of the current sent command */
-uint64_t cmdSentTimestamp = 0; /*!< Keep track of when the last command was sent */
-uint64_t motorShutoffTime = 0; /*!< The time to shut off the motor if no TCP commands are received */
-pthread_mutex_t qikMutex; /*!< Mutex to make sure outbound serial is kosher */
+/* A query the Qik hasn't answered yet */
+typedef struct
+{
+    qikResponse_t response;         /*!< Completed when the answer arrives */
+    uint8_t slot;                   /*!< The device's slot in qikDevices[] */
+    uint8_t value;                  /*!< The value a SET_CONFIG_PARAM sets */
+    uint64_t sentTime;              /*!< When its last byte should have left */
+    qikResponseCallback_t callback; /*!< Called with the answer, or NULL */
+    void* context;                  /*!< Passed to the callback */
+} qikRequest_t;
+
+/* A round trip time estimator for one kind of query, like TCP's. The
+ * mean and the mean deviation are smoothed in microseconds. */
+typedef struct
+{
+    int32_t srtt;       /*!< Smoothed round trip time */
+    int32_t rttvar;     /*!< Smoothed deviation of the round trip time */
+    uint32_t samples;   /*!< Round trips measured */
+} qikRttEstimator_t;
+
+/* One Qik on the serial bus. The dispatcher owns all of it except the
+ * queue, the shutoff time and the stop count, which any thread may touch */
+typedef struct
+{
+    uint8_t deviceId;           /*!< Its Pololu protocol device ID */
+    qikQueue_t queue;           /*!< Commands waiting for the serial port */
+    qikCommand_t next;          /*!< Taken from the queue, not sent yet */
+    bool hasNext;               /*!< next holds a command */
+    int32_t deficit;            /*!< Query bytes it may still send this round */
+    uint64_t motorShutoffTime;  /*!< The time to shut off its motors if no
+                                     commands are received, 0 if stopped */
+    uint32_t stopCount;         /*!< Stops sent, by the dispatcher or watchdog */
+    uint32_t queueHighWater;    /*!< Most commands ever in queue at once */
+    uint32_t queueFull;         /*!< Commands queue turned away */
+    qikRttEstimator_t rtt[QIK_NUM_QUERIES]; /*!< Indexed by command byte */
+    uint64_t lastFrameTime;     /*!< When the last command to it is sent */
+    uint64_t lastHeartbeat;     /*!< When its last heartbeat was queued */
+    qikStatus_t state;          /*!< The dispatcher's copy of its state, the
+                                     rest see it through QikState.c */
+    bool stateCached;           /*!< state started out from statePath */
+    char statePath[QIK_STATE_PATH_LEN]; /*!< Where state is saved, "" if not */
+} qikDevice_t;
+
+/* Device Variables. Devices are added before the dispatcher starts and never
+ * removed, so any thread can look them up without locks */
+qikDevice_t qikDevices[QIK_MAX_BUS_DEVICES]; /*!< The Qiks on the bus */
+uint32_t qikNumDevices = 0; /*!< Devices in qikDevices[] */
+int8_t qikDeviceSlots[QIK_MAX_DEVICES]; /*!< Slot of each device ID, -1 if
+    it isn't on the bus */
+
+/* Status Variables */
+int32_t qikStatusFd = -1; /*!< eventfd to signal when the status changes */
 
 /* Queue Variables */
-uint8_t qikCommandQueue[QIK_ACTION_QUEUE_SIZE] = {0}; /*!< A circular queue of qik commands */
-int16_t qikCommandQueueHead = 0; /*!< The head index of the qikCommandQueue[] */
-int16_t qikCommandQueueTail = 0; /*!< The tail index of the qikCommandQueue[] */
+int32_t qikWakeFd = -1; /*!< eventfd that wakes the dispatcher when there's work */
+int32_t qikTimerFd = -1; /*!< timerfd for the response and shutoff deadlines */
+int32_t qikWatchdogFd = -1; /*!< timerfd for the watchdog, a late shutoff */
+
+/* Response Variables. The Qiks answer in order, so queries that have been
+ * sent wait in a FIFO to be matched with their answers. Every Qik answers on
+ * the same line, so the FIFO only ever holds one device's queries. Only the
+ * dispatcher touches the FIFO, the serial thread hands it bytes through a
+ * ring */
+qikRequest_t qikInFlight[QIK_MAX_IN_FLIGHT]; /*!< Sent, unanswered queries */
+uint32_t qikInFlightHead = 0; /*!< The oldest query in qikInFlight[] */
+uint32_t qikInFlightCount = 0; /*!< Number of queries in qikInFlight[] */
+uint32_t qikInFlightSlot = 0; /*!< The device they were sent to */
+uint8_t qikRxBuf[QIK_RX_BUFSIZE]; /*!< Bytes from the serial thread */
+uint32_t qikRxHead = 0; /*!< Next byte the dispatcher takes */
+uint32_t qikRxTail = 0; /*!< Next byte the serial thread fills */
+uint64_t qikRxTime[QIK_RX_BUFSIZE]; /*!< When each byte in qikRxBuf came in */
+
+/* Transmit Variables. Commands collect in a ring and each pass of the
+ * dispatcher writes everything in it at once. Only the dispatcher touches
+ * them. */
+uint8_t qikTxBuf[QIK_TX_BUFSIZE]; /*!< Commands that haven't been written */
+uint32_t qikTxHead = 0; /*!< Next byte to write */
+uint32_t qikTxTail = 0; /*!< Next free byte */
+uint32_t qikTxTraceEnds[QIK_MAX_TX_TRACES]; /*!< Where each traced setpoint
+    in qikTxBuf ends, it's stamped once qikTxHead gets there */
+uint16_t qikTxTraces[QIK_MAX_TX_TRACES]; /*!< Their trace IDs */
+uint32_t qikTxTraceHead = 0; /*!< The oldest traced setpoint */
+uint32_t qikTxTraceTail = 0; /*!< Next free trace entry */
+
+/* Timing Variables, only touched by the dispatcher */
+uint64_t qikWireIdleTime = 0; /*!< When everything written should be sent */
+uint64_t qikLastAnswerTime = 0; /*!< When the last answer arrived */
+bool qikLanesDeferred = false; /*!< Something was held back for the backlog */
+qikWatchdogStats_t qikWatchdogStats; /*!< Only touched through __atomic builtins */
+
+/* Scheduler Variables, only touched by the dispatcher. The devices share
+ * the wire by deficit round robin: on its turn a device gets
+ * QIK_DRR_QUANTUM more bytes to send queries with, and what it doesn't use
+ * carries over while it has more waiting. Each gets the same share of the
+ * line whatever its commands' lengths. Motion setpoints take turns too. */
+uint32_t qikSchedSlot = 0; /*!< The device whose turn it is to send queries */
+bool qikSchedFresh = true; /*!< qikSchedSlot hasn't had its quantum yet */
+uint32_t qikMotionSlot = 0; /*!< The device whose setpoints go first */
 
+/* Stop Variables. The top lane, one bit per device that has to stop */
+uint64_t qikStopRequests[QIK_MAX_DEVICES / 64] = {0};
+
+/* Error Variables. The lane under the stops, one bit per device whose error
+ * byte has to be read because the error pin rose. signalQikError() sets the
+ * bits and the edge time, the dispatcher moves them to the pending ones,
+ * which only it touches, and clears those as the queries go out. */
+uint64_t qikErrorRequests[QIK_MAX_DEVICES / 64] = {0};
+uint64_t qikErrorEdgeTime = 0; /*!< When the pin rose, 0 once it's taken */
+uint64_t qikErrorPending[QIK_MAX_DEVICES / 64] = {0}; /*!< Not sent yet */
+uint64_t qikErrorPendingEdge = 0; /*!< The edge the pending ones are for */
+bool qikErrorsWaiting = false; /*!< Some wait on another device's answers */
+qikErrorStats_t qikErrorStats; /*!< Only touched through __atomic builtins */
+
+/* Motion Variables. Each motor has a mailbox holding only its newest
+ * setpoint, packed as SETPOINT_PENDING | trace << 16 | opcode << 8 | speed,
+ * and a dirty bit so the dispatcher only looks at mailboxes that changed */
+uint32_t qikSetpoints[NUM_SETPOINTS] = {0}; /*!< Indexed by deviceId * 2 + motor */
+uint64_t qikSetpointsDirty[NUM_SETPOINTS / 64] = {0}; /*!< One bit per mailbox */
 
 /* Internal function prototypes */
-uint8_t QueueQikCommand(uint8_t * buf, uint8_t len, bool expectResponse);
+qikDevice_t* findQikDevice(uint8_t deviceId);
+uint8_t QueueQikCommand(uint8_t * buf, uint8_t len, bool expectResponse,
+                        qikResponseCallback_t callback, void* context);
+void QueueQikMotion(uint8_t * buf, uint8_t len, uint16_t trace);
+void sendEmergencyStops(void);
+void sendErrorQueries(void);
+void sendHeartbeat(void);
+uint64_t getHeartbeatTime(qikDevice_t* device);
+void armQikWatchdog(void);
+bool extendMotorShutoff(qikDevice_t* device, uint64_t time);
+void setQikWatchdogTimer(uint64_t time);
+void ensureQikConfig(const qikResponse_t* response, void* context);
+void sendMotorSetpoints(void);
+bool serialBacklogged(void);
+void receiveResponses(void);
+void completeRequest(int16_t value, uint64_t arrivalTime);
+void expireRequests(void);
+uint64_t getResponseDeadline(void);
+void sampleRtt(qikRttEstimator_t* estimator, int32_t rtt);
 void DequeueQikCommand(void);
-void sendCommand(uint8_t * buf, size_t len, bool expectResponse);
+void nextQikSchedSlot(void);
+void sendQuery(uint32_t slot, uint8_t * buf, size_t len,
+               qikResponseCallback_t callback, void* context);
+void sendCommand(uint8_t * buf, size_t len);
+void flushTransmit(void);
 uint64_t getCurrentTime(void);
+void updateQikState(uint8_t slot, uint8_t* field, uint8_t value,
+                    uint8_t verifiedBit);
+void notifyQikStatus(void);
+void wakeQikDispatcher(void);
+void armQikTimer(void);
+void waitForQikWork(void);
 
 /**
- * @return The current time in a 64 bit integer
+ * @return The current time in microseconds. The clock is monotonic, so it
+ *         doesn't jump when the wall clock is set.
  */
 uint64_t getCurrentTime(void)
 {
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    return tp.tv_usec + (tp.tv_sec * 1000000);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /**
@@ -69,14 +244,17 @@ uint64_t getCurrentTime(void)
  * version ‘1’ or ‘2’.
  *
  * @param deviceId The device ID to send this command to
+ * @param callback Called with the version when it arrives, may be NULL
+ * @param context Passed to the callback
  */
-void getFirmwareVersion(uint8_t deviceId)
+void getFirmwareVersion(uint8_t deviceId, qikResponseCallback_t callback,
+        void* context)
 {
     uint8_t msg[3];
     msg[0] = START_BYTE;
     msg[1] = deviceId;
     msg[2] = GET_FIRMWARE_VERSION;
-    QueueQikCommand(msg, sizeof(msg), true);
+    QueueQikCommand(msg, sizeof(msg), true, callback, context);
 }
 
 /**
@@ -84,7 +262,7 @@ void getFirmwareVersion(uint8_t deviceId)
  * errors that have been detected since the byte was last read using this
  * command.
  *
- * This error byte will be processed by processResponse().
+ * This error byte will be processed by completeRequest().
  *
  * An error will cause the red LED to light and the ERR pin to drive high until
  * this command is called. Calling this command will clear the error byte, turn
@@ -94,31 +272,37 @@ void getFirmwareVersion(uint8_t deviceId)
  * these errors occurs.
  *
  * @param deviceId The device ID to send this command to
+ * @param callback Called with the error byte when it arrives, may be NULL
+ * @param context Passed to the callback
  */
-void getErrorByte(uint8_t deviceId)
+void getErrorByte(uint8_t deviceId, qikResponseCallback_t callback,
+        void* context)
 {
     uint8_t msg[3];
     msg[0] = START_BYTE;
     msg[1] = deviceId;
     msg[2] = GET_ERROR_BYTE;
-    QueueQikCommand(msg, sizeof(msg), true);
+    QueueQikCommand(msg, sizeof(msg), true, callback, context);
 }
 
 /**
  * Request a single configuration parameter from the qik. The single byte
- * returned by the qik will be processed by processResponse().
+ * returned by the qik will be processed by completeRequest().
  *
  * @param deviceId The device ID to send this command to
  * @param parameter The configuration parameter to fetch
+ * @param callback Called with the value when it arrives, may be NULL
+ * @param context Passed to the callback
  */
-void getConfigurationParameter(uint8_t deviceId, config_parameter_t parameter)
+void getConfigurationParameter(uint8_t deviceId, config_parameter_t parameter,
+        qikResponseCallback_t callback, void* context)
 {
     uint8_t msg[4];
     msg[0] = START_BYTE;
     msg[1] = deviceId;
     msg[2] = GET_CONFIG_PARAM;
     msg[3] = parameter;
-    QueueQikCommand(msg, sizeof(msg), true);
+    QueueQikCommand(msg, sizeof(msg), true, callback, context);
 }
 
 /**
@@ -132,9 +316,11 @@ void getConfigurationParameter(uint8_t deviceId, config_parameter_t parameter)
  * @param deviceId The device ID to send this command to
  * @param parameter The configuration parameter to set
  * @param val The value to set the configuration parameter to
+ * @param callback Called with the status byte when it arrives, may be NULL
+ * @param context Passed to the callback
  */
 void setConfigurationParameter(uint8_t deviceId, config_parameter_t parameter,
-        uint8_t val)
+        uint8_t val, qikResponseCallback_t callback, void* context)
 {
     /* The last two bytes are magic bytes to make sure config parameters
      * don't get accidentally set
@@ -147,7 +333,47 @@ void setConfigurationParameter(uint8_t deviceId, config_parameter_t parameter,
     msg[4] = val;
     msg[5] = 0x55;
     msg[6] = 0x2A;
-    QueueQikCommand(msg, sizeof(msg), true);
+    QueueQikCommand(msg, sizeof(msg), true, callback, context);
+}
+
+/**
+ * Turn on the Qik's own serial timeout, so it stops the motors if this
+ * process dies or stops talking. The Qik's config is read first and only
+ * written if it's different, since it lives in EEPROM. Once the timeout is
+ * on, the dispatcher sends a heartbeat whenever the line has been quiet for
+ * a quarter of it.
+ *
+ * @param deviceId The device ID to send this command to
+ * @param timeoutParam The SERIAL_TIMEOUT parameter to use
+ */
+void enableQikSerialTimeout(uint8_t deviceId, uint8_t timeoutParam)
+{
+    /* The timeout only stops the motors if errors do */
+    getConfigurationParameter(deviceId, SHUTDOWN_MOTOR_ON_ERROR,
+                              ensureQikConfig, (void*)(intptr_t) 1);
+    getConfigurationParameter(deviceId, SERIAL_TIMEOUT,
+                              ensureQikConfig, (void*)(intptr_t) timeoutParam);
+}
+
+/**
+ * Set a config parameter if it isn't already what it should be. Called on
+ * the dispatcher thread when a GET_CONFIG_PARAM is answered.
+ *
+ * @param response The answer
+ * @param context The value the parameter should have
+ */
+void ensureQikConfig(const qikResponse_t* response, void* context)
+{
+    uint8_t value = (uint8_t)(intptr_t) context;
+
+    if(response->value >= 0 && response->value != value)
+    {
+        logMessage(LOG_LEVEL_INFO, "Setting Qik config parameter %d to %d",
+                   response->parameter, value);
+        setConfigurationParameter(response->deviceId,
+                                  (config_parameter_t) response->parameter,
+                                  value, NULL, NULL);
+    }
 }
 
 /**
@@ -162,7 +388,7 @@ void setM0Coast(uint8_t deviceId)
     msg[0] = START_BYTE;
     msg[1] = deviceId;
     msg[2] = M0_COAST;
-    QueueQikCommand(msg, sizeof(msg), false);
+    QueueQikMotion(msg, sizeof(msg), 0);
 }
 
 /**
@@ -181,7 +407,7 @@ void setM0Forward(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M0_FORWARD_128;
         msg[3] = speed - 128;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
     else
     {
@@ -190,7 +416,7 @@ void setM0Forward(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M0_FORWARD;
         msg[3] = speed;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
 }
 
@@ -210,7 +436,7 @@ void setM0Reverse(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M0_REVERSE_128;
         msg[3] = speed - 128;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
     else
     {
@@ -219,7 +445,7 @@ void setM0Reverse(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M0_REVERSE;
         msg[3] = speed;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
 }
 
@@ -235,7 +461,7 @@ void setM1Coast(uint8_t deviceId)
     msg[0] = START_BYTE;
     msg[1] = deviceId;
     msg[2] = M1_COAST;
-    QueueQikCommand(msg, sizeof(msg), false);
+    QueueQikMotion(msg, sizeof(msg), 0);
 }
 
 /**
@@ -254,7 +480,7 @@ void setM1Forward(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M1_FORWARD_128;
         msg[3] = speed - 128;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
     else
     {
@@ -263,7 +489,7 @@ void setM1Forward(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M1_FORWARD;
         msg[3] = speed;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
 }
 
@@ -283,7 +509,7 @@ void setM1Reverse(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M1_REVERSE_128;
         msg[3] = speed - 128;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
     }
     else
     {
@@ -292,31 +518,121 @@ void setM1Reverse(uint8_t deviceId, uint8_t speed)
         msg[1] = deviceId;
         msg[2] = M1_REVERSE;
         msg[3] = speed;
-        QueueQikCommand(msg, sizeof(msg), false);
+        QueueQikMotion(msg, sizeof(msg), 0);
+    }
+}
+
+/**
+ * Set a motor's speed in either direction, for the control loop. The
+ * setpoint carries the trace of the command it's heading toward, so the
+ * dispatcher can stamp it on the way out.
+ *
+ * @param deviceId the device Id to send the command to
+ * @param motor 0 for M0, 1 for M1
+ * @param speed The speed to set the motor to (-255-255), positive is forward
+ * @param trace The trace ID of the command it carries out, 0 if none
+ */
+void setMotorSpeed(uint8_t deviceId, uint8_t motor, int16_t speed,
+                   uint16_t trace)
+{
+    uint8_t msg[4];
+    uint8_t magnitude = (uint8_t)((speed < 0) ? -speed : speed);
+
+    msg[0] = START_BYTE;
+    msg[1] = deviceId;
+    msg[2] = (motor == 0) ? M0_FORWARD : M1_FORWARD;
+    if(speed < 0)
+    {
+        msg[2] += M0_REVERSE - M0_FORWARD;
+    }
+    if(magnitude > 127)
+    {
+        msg[2] += M0_FORWARD_128 - M0_FORWARD;
+        magnitude -= 128;
+    }
+    msg[3] = magnitude;
+    QueueQikMotion(msg, sizeof(msg), trace);
+}
+
+/**
+ * Find the device a motor control command is for
+ *
+ * @param command A command as processMotorControl() takes it
+ * @return The device ID from its "<id>:" prefix, the first device added if
+ *         it has none, or -1 if the prefix is malformed or there are no
+ *         devices
+ */
+int16_t motorControlDevice(const char* command)
+{
+    const char* colon;
+    char* end;
+    unsigned long deviceId;
+
+    if(__atomic_load_n(&qikNumDevices, __ATOMIC_ACQUIRE) == 0)
+    {
+        return -1;
+    }
+
+    colon = strchr(command, ':');
+    if(colon == NULL)
+    {
+        return qikDevices[0].deviceId;
+    }
+
+    deviceId = strtoul(command, &end, 10);
+    if(end != colon || end == command || deviceId > MAX_DEVICE_ID)
+    {
+        return -1;
     }
+    return (int16_t) deviceId;
 }
 
 /**
- * Process a POST to motor_control.c
+ * Process a POST to motor_control.c. This only sets the motors' target
+ * speeds, the control loop ramps them there.
  *
- * @param postContent a string command: (UP|DOWN|LEFT|RIGHT)_(START_STOP)
- * @param contentLength the length of the content
+ * @param postContent a string command:
+ *                    [deviceId:](UP|DOWN|LEFT|RIGHT)_(START_STOP), without
+ *                    a device ID it's for the first device added
+ * @param trace The command's trace ID, 0 if it isn't traced
  */
-void processMotorControl(char* postContent)
+void processMotorControl(char* postContent, uint16_t trace)
 {
-    uint8_t speed;
-    char *dir, *start;
+    qikDevice_t* device;
+    int16_t speed;
+    int16_t deviceId;
+    char *dir, *start, *colon;
     const char delim[2] = "_";
 
+    deviceId = motorControlDevice(postContent);
+    if(deviceId < 0)
+    {
+        return;
+    }
+
+    /* Skip the device, if there is one */
+    colon = strchr(postContent, ':');
+    if(colon != NULL)
+    {
+        postContent = colon + 1;
+    }
+
     /* get the first token */
     dir = strtok(postContent, delim);
     start = strtok(NULL, delim);
 
-    printf("processMotorControl (%s) %s\n", dir, start);
+    /* Ignore malformed commands */
+    if(NULL == dir || NULL == start)
+    {
+        return;
+    }
+
+    logMessage(LOG_LEVEL_DEBUG, "processMotorControl (%d %s) %s", deviceId, dir,
+               start);
 
     if(0 == strcmp(start, "START"))
     {
-        speed = 0xFF;
+        speed = MOTION_MAX_SPEED;
     }
     else if(0 == strcmp(start, "STOP"))
     {
@@ -327,25 +643,39 @@ void processMotorControl(char* postContent)
         return;
     }
 
+    /* Holding a direction is a heartbeat too. Once the ramp reaches the
+     * target nothing more is sent, so only this keeps the shutoff away
+     */
+    device = findQikDevice(deviceId);
+    if(speed != 0 && device != NULL &&
+            extendMotorShutoff(device, getCurrentTime() + MOTOR_TIMEOUT))
+    {
+        armQikWatchdog();
+    }
+
+    /* M1's setpoint always goes out after M0's, so M1 carries the trace to
+     * the last byte of the pair
+     */
+    traceStamp(trace, TRACE_HANDLED);
     if(0 == strcmp(dir, "UP"))
     {
-        setM0Forward(DEFAULT_DEVICE_ID, speed);
-        setM1Forward(DEFAULT_DEVICE_ID, speed);
+        setMotorTarget(deviceId, 0, speed, 0);
+        setMotorTarget(deviceId, 1, speed, trace);
     }
     else if (0 == strcmp(dir, "DOWN"))
     {
-        setM0Reverse(DEFAULT_DEVICE_ID, speed);
-        setM1Reverse(DEFAULT_DEVICE_ID, speed);
+        setMotorTarget(deviceId, 0, -speed, 0);
+        setMotorTarget(deviceId, 1, -speed, trace);
     }
     else if (0 == strcmp(dir, "LEFT"))
     {
-        setM0Forward(DEFAULT_DEVICE_ID, speed);
-        setM1Reverse(DEFAULT_DEVICE_ID, speed);
+        setMotorTarget(deviceId, 0, speed, 0);
+        setMotorTarget(deviceId, 1, -speed, trace);
     }
     else if (0 == strcmp(dir, "RIGHT"))
     {
-        setM0Reverse(DEFAULT_DEVICE_ID, speed);
-        setM1Forward(DEFAULT_DEVICE_ID, speed);
+        setMotorTarget(deviceId, 0, -speed, 0);
+        setMotorTarget(deviceId, 1, speed, trace);
     }
     else
     {
@@ -354,224 +684,1529 @@ void processMotorControl(char* postContent)
 }
 
 /**
- * Queue up an action to send to the qik motor controller. This can be
- * called from any thread and may block if two threads are trying to
- * queue commands at the same time.
+ * Start each device from the state saved by the last run, and keep saving it
+ * as it changes. The cached values are used straight away without waiting
+ * for the Qik, and each one is checked as the answer to its query comes
+ * back. Call this after the devices are added, before processQikState()
+ * starts.
  *
- * @param buf The command to queue
- * @param len The length of the command to queue
- * @param expectResponse Whether or not this command expects a response
+ * @param path The files the state is kept in, each device's has its ID on
+ *             the end
+ * @return The number of devices that had a saved state
  */
-uint8_t QueueQikCommand(uint8_t * buf, uint8_t len, bool expectResponse)
+uint8_t loadQikState(const char* path)
 {
-    size_t i;
-    int16_t sizeUsed;
+    qikDevice_t* device;
+    uint8_t loaded = 0;
+    uint32_t slot;
 
-    /* Request a mutex lock */
-    pthread_mutex_lock(&qikMutex);
+    if(strlen(path) + 5 > QIK_STATE_PATH_LEN)
+    {
+        return 0;
+    }
 
-    /* Figure out how much queue is currently used */
-    sizeUsed = qikCommandQueueTail - qikCommandQueueHead;
-    if(sizeUsed < 0)
+    for(slot = 0; slot < qikNumDevices; slot++)
     {
-        sizeUsed += QIK_ACTION_QUEUE_SIZE;
+        device = &qikDevices[slot];
+        sprintf(device->statePath, "%s.%u", path, device->deviceId);
+        if(qikStateLoad(device->statePath, &device->state))
+        {
+            device->stateCached = true;
+            qikStatePublish(slot, &device->state);
+            loaded++;
+        }
     }
 
-    /* Make sure there is enough space in the queue */
-    if(!(sizeUsed + len + 2 < QIK_ACTION_QUEUE_SIZE))
+    if(loaded != 0)
     {
-        /* Not enough space, return */
-        return 0;
+        notifyQikStatus();
     }
+    return loaded;
+}
+
+/**
+ * Set up the descriptors processQikState() sleeps on. This must be called
+ * before any devices are added.
+ *
+ * @return 0 if something failed, 1 for success
+ */
+uint8_t initializeQikDispatcher(void)
+{
+    memset(qikDeviceSlots, -1, sizeof(qikDeviceSlots));
 
-    /* Add the length byte */
-    qikCommandQueue[qikCommandQueueTail] = len;
-    qikCommandQueueTail = (qikCommandQueueTail + 1) % QIK_ACTION_QUEUE_SIZE;
+    qikWakeFd = eventfd(0, EFD_NONBLOCK);
+    qikTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    qikWatchdogFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if(qikWakeFd == -1 || qikTimerFd == -1 || qikWatchdogFd == -1)
+    {
+        return 0;
+    }
+    return 1;
+}
 
-    /* Add the expected response */
-    qikCommandQueue[qikCommandQueueTail] = expectResponse;
-    qikCommandQueueTail = (qikCommandQueueTail + 1) % QIK_ACTION_QUEUE_SIZE;
+/**
+ * Put a Qik on the bus, with its own command queue, watchdog and cached
+ * state. Only commands for devices on the bus are sent. This must be called
+ * after initializeQikDispatcher(), before processQikState() starts.
+ *
+ * @param deviceId The device's ID
+ * @return 0 if it can't be added, 1 for success
+ */
+uint8_t addQikDevice(uint8_t deviceId)
+{
+    qikDevice_t* device;
 
-    /* Add the payload */
-    for(i = 0; i < len; i++)
+    if(deviceId >= QIK_MAX_DEVICES || qikDeviceSlots[deviceId] != -1 ||
+            qikNumDevices == QIK_MAX_BUS_DEVICES)
     {
-        qikCommandQueue[qikCommandQueueTail] = buf[i];
-        qikCommandQueueTail = (qikCommandQueueTail + 1) % QIK_ACTION_QUEUE_SIZE;
+        return 0;
     }
 
-    /* Unlock the mutex */
-    pthread_mutex_unlock(&qikMutex);
+    device = &qikDevices[qikNumDevices];
+    memset(device, 0, sizeof(qikDevice_t));
+    device->deviceId = deviceId;
+    qikQueueInit(&device->queue);
 
-    /* Command was added, return 1 */
+    qikDeviceSlots[deviceId] = qikNumDevices;
+    __atomic_store_n(&qikNumDevices, qikNumDevices + 1, __ATOMIC_RELEASE);
     return 1;
 }
 
 /**
- * Check the qikCommandQueue[] for any pending commands, and execute
- * one if it exists
+ * Get the IDs of the devices on the bus
+ *
+ * @param deviceIds Filled in with the IDs, in the order they were added. It
+ *                  must have room for QIK_MAX_BUS_DEVICES.
+ * @return The number of devices
  */
-void DequeueQikCommand(void)
+uint8_t getQikDevices(uint8_t* deviceIds)
 {
-    uint8_t i, len, expectsResponse;
-    uint8_t tmpCmd[16] = {0};
+    uint32_t numDevices = __atomic_load_n(&qikNumDevices, __ATOMIC_ACQUIRE);
+    uint32_t slot;
 
-    /* If there's something in the queue */
-    while(qikCommandQueueHead != qikCommandQueueTail)
+    for(slot = 0; slot < numDevices; slot++)
     {
-        /* Pull out the length byte */
-        len = qikCommandQueue[qikCommandQueueHead];
-        qikCommandQueueHead = (qikCommandQueueHead + 1) % QIK_ACTION_QUEUE_SIZE;
-
-        /* Pull out the expects response byte */
-        expectsResponse = qikCommandQueue[qikCommandQueueHead];
-        qikCommandQueueHead = (qikCommandQueueHead + 1) % QIK_ACTION_QUEUE_SIZE;
-
-        /* Pull out the payload */
-        for(i = 0; i < len; i++)
-        {
-            tmpCmd[i] = qikCommandQueue[qikCommandQueueHead];
-            qikCommandQueueHead = (qikCommandQueueHead + 1) % QIK_ACTION_QUEUE_SIZE;
-        }
+        deviceIds[slot] = qikDevices[slot].deviceId;
+    }
+    return numDevices;
+}
 
-        /* Send the serial command */
-        sendCommand(tmpCmd, len, expectsResponse);
+/**
+ * @param deviceId A device ID
+ * @return The device with that ID, or NULL if it isn't on the bus
+ */
+qikDevice_t* findQikDevice(uint8_t deviceId)
+{
+    if(deviceId >= QIK_MAX_DEVICES || qikDeviceSlots[deviceId] == -1)
+    {
+        return NULL;
     }
+    return &qikDevices[(uint8_t) qikDeviceSlots[deviceId]];
 }
 
 /**
- * If there is a current outgoing command, wait for the response to be
- * received. Then send the given command and mark the time and command,
- * if a response is expected
+ * Queue up an action to send to the qik motor controller. Each device has
+ * its own queue. This can be called from any thread, including interrupt
+ * handlers, and never blocks.
  *
- * @param buf A pointer to the command to send
- * @param len The length of the command to send
- * @param expectResponse true if this command expects a response,
- * false otherwise
+ * @param buf The command to queue
+ * @param len The length of the command to queue
+ * @param expectResponse Whether or not this command expects a response
+ * @param callback Called with the response, may be NULL
+ * @param context Passed to the callback
+ * @return 1 if the command was queued, 0 if the queue is full or the device
+ *         isn't on the bus
  */
-void sendCommand(uint8_t * buf, size_t len, bool expectResponse)
+uint8_t QueueQikCommand(uint8_t * buf, uint8_t len, bool expectResponse,
+                        qikResponseCallback_t callback, void* context)
 {
-    /* While there is a pending command that hasn't timed out yet, spin */
-    while ((cmdSentTimestamp + CMD_TIMEOUT_USEC) > getCurrentTime()
-            && pendingCmd != 0)
+    qikCommand_t cmd;
+    qikDevice_t* device = findQikDevice(buf[1]);
+    uint32_t depth, highWater;
+
+    if(len > QIK_MAX_COMMAND_LEN || device == NULL)
+    {
+        return 0;
+    }
+
+    cmd.len = len;
+    cmd.expectResponse = expectResponse;
+    memcpy(cmd.data, buf, len);
+    cmd.callback = callback;
+    cmd.context = context;
+
+    if(!qikQueuePush(&device->queue, &cmd))
     {
-        ; /* You spin me right round, baby right round */
+        __atomic_fetch_add(&device->queueFull, 1, __ATOMIC_RELAXED);
+        return 0;
     }
 
-    if(expectResponse)
+    /* Keep the high-water mark, whichever producer got there */
+    depth = qikQueueDepth(&device->queue);
+    highWater = __atomic_load_n(&device->queueHighWater, __ATOMIC_RELAXED);
+    while(depth > highWater &&
+            !__atomic_compare_exchange_n(&device->queueHighWater, &highWater,
+                                         depth, true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
     {
-        /* Mark the current time and pending command */
-        cmdSentTimestamp = getCurrentTime();
-        pendingCmd = buf[2];
     }
-    else
+
+    wakeQikDispatcher();
+    return 1;
+}
+
+/**
+ * Set a motor's speed or coast it. Motion commands skip the FIFO and go in
+ * the motor's mailbox, replacing any setpoint that hasn't been sent yet, so
+ * a backed up serial port only ever sends the newest one. This can be
+ * called from any thread, including interrupt handlers, and never blocks.
+ *
+ * @param buf A coast or speed command, {START_BYTE, deviceId, opcode[, speed]}
+ * @param len The length of the command, 3 or 4
+ * @param trace The trace ID of the command it carries out, 0 if none
+ */
+void QueueQikMotion(uint8_t * buf, uint8_t len, uint16_t trace)
+{
+    uint32_t motor, index;
+
+    if(findQikDevice(buf[1]) == NULL)
     {
-        pendingCmd = 0;
+        return;
     }
 
-    /* Check if this is a motor command */
-    switch((QikCommand_t)buf[2])
+    motor = (buf[2] == M1_COAST || buf[2] >= M1_FORWARD) ? 1 : 0;
+    index = (buf[1] % QIK_MAX_DEVICES) * QIK_NUM_MOTORS + motor;
+
+    /* Publish the setpoint, then flag it. The dispatcher clears the flag
+     * before it takes the setpoint, so a setpoint is never stranded
+     */
+    __atomic_store_n(&qikSetpoints[index],
+                     SETPOINT_PENDING | ((uint32_t)(trace & TRACE_ID_MASK) << 16) |
+                     (buf[2] << 8) | ((len > 3) ? buf[3] : 0),
+                     __ATOMIC_RELEASE);
+    __atomic_fetch_or(&qikSetpointsDirty[index / 64],
+                      (uint64_t) 1 << (index % 64), __ATOMIC_RELEASE);
+
+    wakeQikDispatcher();
+}
+
+/**
+ * Brake both motors of a device ahead of everything else waiting to be
+ * sent. Setpoints queued before the stop is sent are thrown away. This
+ * never blocks, so it's safe from any thread, and from the GPIO ISR.
+ *
+ * @param deviceId The device to stop
+ */
+void emergencyStop(uint8_t deviceId)
+{
+    deviceId %= QIK_MAX_DEVICES;
+    __atomic_fetch_or(&qikStopRequests[deviceId / 64],
+                      (uint64_t) 1 << (deviceId % 64), __ATOMIC_RELEASE);
+    wakeQikDispatcher();
+}
+
+/**
+ * Send the stops from emergencyStop(). They go out first and ignore the
+ * backlog, so they're only ever behind what's already been written. Only
+ * the thread running processQikState() may call this.
+ */
+void sendEmergencyStops(void)
+{
+    uint64_t requests;
+    uint32_t word, bit, deviceId;
+    qikDevice_t* device;
+    uint8_t msg[4];
+
+    for(word = 0; word < QIK_MAX_DEVICES / 64; word++)
     {
-        case M0_FORWARD:
-        case M0_REVERSE:
-        case M1_FORWARD:
-        case M1_REVERSE:
+        requests = __atomic_exchange_n(&qikStopRequests[word], 0,
+                                       __ATOMIC_ACQUIRE);
+
+        for(bit = 0; requests != 0; bit++, requests >>= 1)
         {
-            if(buf[3] != 0)
+            if(!(requests & 1))
             {
-                /* Set the automatic shutoff if this starts the motor */
-                motorShutoffTime = getCurrentTime() + MOTOR_TIMEOUT;
+                continue;
+            }
+            deviceId = word * 64 + bit;
+
+            /* Don't let an older setpoint start the motors again */
+            __atomic_store_n(&qikSetpoints[deviceId * QIK_NUM_MOTORS], 0,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&qikSetpoints[deviceId * QIK_NUM_MOTORS + 1], 0,
+                             __ATOMIC_RELAXED);
+
+            msg[0] = START_BYTE;
+            msg[1] = deviceId;
+            msg[2] = M0_FORWARD;
+            msg[3] = 0;
+            sendCommand(msg, sizeof(msg));
+            msg[2] = M1_FORWARD;
+            sendCommand(msg, sizeof(msg));
+
+            device = findQikDevice(deviceId);
+            if(device != NULL)
+            {
+                __atomic_fetch_add(&device->stopCount, 1, __ATOMIC_RELEASE);
             }
-            break;
-        }
-        case M0_FORWARD_128:
-        case M0_REVERSE_128:
-        case M1_FORWARD_128:
-        case M1_REVERSE_128:
-        {
-            /* Set the automatic shutoff */
-            motorShutoffTime = getCurrentTime() + MOTOR_TIMEOUT;
-            break;
-        }
-        case GET_CONFIG_PARAM:
-        case SET_CONFIG_PARAM:
-        case GET_ERROR_BYTE:
-        case GET_FIRMWARE_VERSION:
-        case M0_COAST:
-        case M1_COAST:
-        {
-            break;
         }
     }
+}
+
+/**
+ * Stop every device and read their error bytes, for when the error pin
+ * rises. The Qiks share the pin, so there's no telling which one it was.
+ * The stops go in the top lane and the queries in the one under it, ahead
+ * of motion and the queues, so neither waits behind a full queue. This
+ * only touches atomics, the clock and the dispatcher's eventfd, so it's
+ * safe from the GPIO callback and from signal handlers.
+ */
+void signalQikError(void)
+{
+    uint32_t numDevices = __atomic_load_n(&qikNumDevices, __ATOMIC_ACQUIRE);
+    uint64_t expected = 0;
+    uint32_t slot;
+    uint8_t deviceId;
 
-    /* Send the message */
-    writeToSerialPort(buf, len);
+    /* Time from the first edge the dispatcher hasn't picked up yet */
+    __atomic_compare_exchange_n(&qikErrorEdgeTime, &expected, getCurrentTime(),
+                                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    for(slot = 0; slot < numDevices; slot++)
+    {
+        deviceId = qikDevices[slot].deviceId;
+        __atomic_fetch_or(&qikStopRequests[deviceId / 64],
+                          (uint64_t) 1 << (deviceId % 64), __ATOMIC_RELEASE);
+        __atomic_fetch_or(&qikErrorRequests[deviceId / 64],
+                          (uint64_t) 1 << (deviceId % 64), __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&qikErrorStats.edges, 1, __ATOMIC_RELAXED);
+    wakeQikDispatcher();
 }
 
 /**
- * Process a response byte
- *
- * @param byte The byte the Qik sent back
+ * Send the error byte queries from signalQikError(). They ignore the
+ * backlog like the stops, but their answers share the line with every
+ * other query's, so a device's waits until the FIFO holds nothing for
+ * another device. While any wait, DequeueQikCommand() sends no queries, so
+ * the FIFO drains. Only the thread running processQikState() may call this.
  */
-void processResponse(uint8_t byte)
+void sendErrorQueries(void)
 {
-    switch (pendingCmd)
+    uint64_t requests, now;
+    uint32_t word, bit, latency, maxUsec;
+    uint8_t deviceId, slot;
+    uint8_t msg[3];
+
+    for(word = 0; word < QIK_MAX_DEVICES / 64; word++)
     {
-        case GET_FIRMWARE_VERSION:
+        requests = __atomic_exchange_n(&qikErrorRequests[word], 0,
+                                       __ATOMIC_ACQUIRE);
+        if(requests != 0 && qikErrorPendingEdge == 0)
         {
-            printf("GET_FIRMWARE_VERSION %c\n", byte);
-            break;
+            qikErrorPendingEdge = __atomic_exchange_n(&qikErrorEdgeTime, 0,
+                                                      __ATOMIC_RELAXED);
         }
+        qikErrorPending[word] |= requests;
+    }
 
-        case GET_ERROR_BYTE:
+    qikErrorsWaiting = false;
+    for(word = 0; word < QIK_MAX_DEVICES / 64; word++)
+    {
+        for(bit = 0; bit < 64; bit++)
         {
-            printf("GET_ERROR_BYTE %d\n", byte);
-            break;
-        }
+            if(!(qikErrorPending[word] & ((uint64_t) 1 << bit)))
+            {
+                continue;
+            }
+            deviceId = word * 64 + bit;
+            slot = (uint8_t) qikDeviceSlots[deviceId];
 
-        case GET_CONFIG_PARAM:
-        {
-            printf("GET_CONFIGURATION_PARAM %d\n", byte);
-            break;
-        }
+            if(qikInFlightCount == QIK_MAX_IN_FLIGHT ||
+                    (qikInFlightCount != 0 && qikInFlightSlot != slot))
+            {
+                qikErrorsWaiting = true;
+                continue;
+            }
 
-        case SET_CONFIG_PARAM:
-        {
-            printf("SET_CONFIGURATION_PARAM %d\n", byte);
-            break;
-        }
-        /* These commands do not have responses */
-        case M0_COAST:
-        case M1_COAST:
-        case M0_FORWARD:
-        case M0_FORWARD_128:
-        case M0_REVERSE:
-        case M0_REVERSE_128:
-        case M1_FORWARD:
-        case M1_FORWARD_128:
-        case M1_REVERSE:
-        case M1_REVERSE_128:
-        {
-            break;
+            msg[0] = START_BYTE;
+            msg[1] = deviceId;
+            msg[2] = GET_ERROR_BYTE;
+            sendQuery(slot, msg, sizeof(msg), NULL, NULL);
+            qikErrorPending[word] &= ~((uint64_t) 1 << bit);
+
+            /* How long the edge took to become a query on its way out */
+            now = getCurrentTime();
+            latency = (qikErrorPendingEdge != 0 && now > qikErrorPendingEdge) ?
+                      (uint32_t)(now - qikErrorPendingEdge) : 0;
+            __atomic_fetch_add(&qikErrorStats.queries, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&qikErrorStats.sumUsec, latency, __ATOMIC_RELAXED);
+            maxUsec = __atomic_load_n(&qikErrorStats.maxUsec, __ATOMIC_RELAXED);
+            if(latency > maxUsec)
+            {
+                __atomic_store_n(&qikErrorStats.maxUsec, latency,
+                                 __ATOMIC_RELAXED);
+            }
+            logMessage(LOG_LEVEL_WARN,
+                       "Error pin raised, reading device %d's error byte %u us later",
+                       deviceId, latency);
         }
     }
 
-    pendingCmd = 0;
+    if(!qikErrorsWaiting)
+    {
+        qikErrorPendingEdge = 0;
+    }
 }
 
 /**
- * Turn off the motors if it's been 2 seconds without a command
- * Process any queued qik commands
+ * @param deviceId The device
+ * @return How many emergency stops have gone out to the device. Anything
+ *         that keeps its own idea of the motor speeds can watch this to
+ *         know when it's wrong.
  */
-void processQikState(void)
+uint32_t getQikStopCount(uint8_t deviceId)
+{
+    qikDevice_t* device = findQikDevice(deviceId);
+
+    return (device == NULL) ? 0 :
+           __atomic_load_n(&device->stopCount, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * How a device's command queue has been doing. Safe from any thread.
+ *
+ * @param deviceId The device
+ * @param stats Filled in with the queue's numbers
+ * @return 0 if the device isn't on the bus, 1 for success
+ */
+uint8_t getQikQueueStats(uint8_t deviceId, qikQueueStats_t* stats)
 {
-    /* Check if the motor should be automatically stopped */
-    if(motorShutoffTime != 0 && getCurrentTime() > motorShutoffTime)
+    qikDevice_t* device = findQikDevice(deviceId);
+
+    if(device == NULL)
     {
-        motorShutoffTime = 0;
-        setM0Forward(DEFAULT_DEVICE_ID, 0);
-        setM1Forward(DEFAULT_DEVICE_ID, 0);
+        return 0;
     }
+    stats->depth = qikQueueDepth(&device->queue);
+    stats->highWater = __atomic_load_n(&device->queueHighWater,
+                                       __ATOMIC_RELAXED);
+    stats->full = __atomic_load_n(&device->queueFull, __ATOMIC_RELAXED);
+    stats->retries = __atomic_load_n(&device->queue.pushRetries,
+                                     __ATOMIC_RELAXED);
+    return 1;
+}
 
-    /* Deque any pending actions */
-    DequeueQikCommand();
+/**
+ * @param device The device
+ * @return When the dispatcher should send the device a heartbeat, a quarter
+ *         of its serial timeout after the last command to it, or 0 if the
+ *         timeout is off
+ */
+uint64_t getHeartbeatTime(qikDevice_t* device)
+{
+    uint64_t interval =
+        QIK_SERIAL_TIMEOUT_USEC(device->state.config[SERIAL_TIMEOUT]) / 4;
+
+    if(interval == 0)
+    {
+        return 0;
+    }
+    return ((device->lastFrameTime > device->lastHeartbeat) ?
+            device->lastFrameTime : device->lastHeartbeat) + interval;
+}
+
+/**
+ * Send each Qik something harmless if it's gone long enough without a
+ * command for its serial timeout to be at risk. Any other command to it
+ * resets the timeout, so this costs at most one frame per interval, and
+ * nothing at all while motion commands are flowing. Only the thread running
+ * processQikState() may call this.
+ */
+void sendHeartbeat(void)
+{
+    qikDevice_t* device;
+    uint64_t heartbeatTime;
+    uint64_t now = getCurrentTime();
+    uint32_t interval, shortest = 0, slot;
+
+    for(slot = 0; slot < qikNumDevices; slot++)
+    {
+        device = &qikDevices[slot];
+        interval = QIK_SERIAL_TIMEOUT_USEC(device->state.config[SERIAL_TIMEOUT]) / 4;
+        if(interval != 0 && (shortest == 0 || interval < shortest))
+        {
+            shortest = interval;
+        }
+
+        heartbeatTime = getHeartbeatTime(device);
+        if(heartbeatTime != 0 && now >= heartbeatTime)
+        {
+            device->lastHeartbeat = now;
+            getFirmwareVersion(device->deviceId, NULL, NULL);
+            __atomic_fetch_add(&qikWatchdogStats.heartbeats, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&qikWatchdogStats.heartbeatBytes,
+                               QIK_HEARTBEAT_FRAME_LEN, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&qikWatchdogStats.heartbeatUsec, shortest, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return true if more is waiting for the wire than a stop should have to
+ *         wait behind, and motion and queries should hold off
+ */
+bool serialBacklogged(void)
+{
+    if(qikWireIdleTime > getCurrentTime() + QIK_MAX_BACKLOG_USEC)
+    {
+        qikLanesDeferred = true;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Send the newest setpoint of every motor that has one waiting, a device at
+ * a time so a device's M0 and M1 go out together. The devices take turns at
+ * going first. If the serial port is backed up the rest stay in their
+ * mailboxes, where newer setpoints can still replace them, and the device
+ * that was next goes first next time. Only the thread running
+ * processQikState() may call this.
+ */
+void sendMotorSetpoints(void)
+{
+    uint64_t mask, dirty;
+    uint32_t setpoint, start, n, slot, index, motor, tail;
+    uint16_t trace;
+    uint8_t msg[4];
+
+    start = qikMotionSlot;
+    for(n = 0; n < qikNumDevices; n++)
+    {
+        slot = (start + n) % qikNumDevices;
+        index = qikDevices[slot].deviceId * QIK_NUM_MOTORS;
+        mask = (uint64_t) ((1 << QIK_NUM_MOTORS) - 1) << (index % 64);
+
+        if(!(__atomic_load_n(&qikSetpointsDirty[index / 64], __ATOMIC_RELAXED) &
+                mask))
+        {
+            continue;
+        }
+
+        /* Leave this device and the rest for a later pass */
+        if(serialBacklogged())
+        {
+            qikMotionSlot = slot;
+            return;
+        }
+
+        dirty = __atomic_fetch_and(&qikSetpointsDirty[index / 64], ~mask,
+                                   __ATOMIC_ACQUIRE) >> (index % 64);
+
+        for(motor = 0; motor < QIK_NUM_MOTORS; motor++, dirty >>= 1)
+        {
+            if(!(dirty & 1))
+            {
+                continue;
+            }
+
+            setpoint = __atomic_exchange_n(&qikSetpoints[index + motor], 0,
+                                           __ATOMIC_ACQUIRE);
+
+            /* Already sent when an earlier dirty bit was handled */
+            if(!(setpoint & SETPOINT_PENDING))
+            {
+                continue;
+            }
+
+            msg[0] = START_BYTE;
+            msg[1] = qikDevices[slot].deviceId;
+            msg[2] = (setpoint >> 8) & 0xFF;
+            msg[3] = setpoint & 0xFF;
+            trace = (setpoint >> 16) & TRACE_ID_MASK;
+            traceStamp(trace, TRACE_DEQUEUED);
+
+            /* Coasting has no speed byte */
+            tail = qikTxTail;
+            sendCommand(msg, (msg[2] == M0_COAST || msg[2] == M1_COAST) ? 3 : 4);
+
+            /* Stamp it again once flushTransmit() gets it to the UART */
+            if(trace != 0 && qikTxTail != tail &&
+                    qikTxTraceTail - qikTxTraceHead < QIK_MAX_TX_TRACES)
+            {
+                qikTxTraceEnds[qikTxTraceTail % QIK_MAX_TX_TRACES] = qikTxTail;
+                qikTxTraces[qikTxTraceTail % QIK_MAX_TX_TRACES] = trace;
+                qikTxTraceTail++;
+            }
+        }
+
+        /* The one after goes first next time */
+        qikMotionSlot = (slot + 1) % qikNumDevices;
+    }
+}
+
+/**
+ * Send the commands waiting in the devices' queues, taking turns between
+ * the devices by deficit round robin. A device's queries go out back to
+ * back without waiting for each other's answers, up to QIK_MAX_IN_FLIGHT at
+ * a time, but every Qik answers on the same line, so when it's the turn of
+ * another device its queries wait for those answers first. This is the
+ * bottom lane: it only runs after stops and motion, and holds off while the
+ * serial port is backed up, so a stream of motion can starve it but it can
+ * never delay a stop. Only the thread running processQikState() may call
+ * this.
+ */
+void DequeueQikCommand(void)
+{
+    qikDevice_t* device;
+    qikCommand_t* cmd;
+    uint32_t idle = 0;
+
+    /* Two laps without sending anything means there's nothing to send: the
+     * first may pass over devices that have used up their quantum
+     */
+    while(idle < 2 * qikNumDevices && qikInFlightCount < QIK_MAX_IN_FLIGHT &&
+            !qikErrorsWaiting && !serialBacklogged())
+    {
+        device = &qikDevices[qikSchedSlot];
+        cmd = &device->next;
+
+        if(!device->hasNext)
+        {
+            device->hasNext = qikQueuePop(&device->queue, cmd);
+        }
+        if(!device->hasNext)
+        {
+            /* Nothing waiting, so nothing carries over */
+            device->deficit = 0;
+            nextQikSchedSlot();
+            idle++;
+            continue;
+        }
+
+        if(cmd->expectResponse && qikInFlightCount != 0 &&
+                qikInFlightSlot != qikSchedSlot)
+        {
+            /* Wait for the answers, keeping the turn */
+            break;
+        }
+
+        if(qikSchedFresh)
+        {
+            device->deficit += QIK_DRR_QUANTUM;
+            qikSchedFresh = false;
+        }
+        if(cmd->len > device->deficit)
+        {
+            nextQikSchedSlot();
+            idle++;
+            continue;
+        }
+
+        /* Send the serial command */
+        if(cmd->expectResponse)
+        {
+            sendQuery(qikSchedSlot, cmd->data, cmd->len, cmd->callback,
+                      cmd->context);
+        }
+        else
+        {
+            sendCommand(cmd->data, cmd->len);
+        }
+        device->deficit -= cmd->len;
+        device->hasNext = false;
+        idle = 0;
+    }
+}
+
+/**
+ * Pass the turn to send queries on to the next device
+ */
+void nextQikSchedSlot(void)
+{
+    qikSchedSlot = (qikSchedSlot + 1) % qikNumDevices;
+    qikSchedFresh = true;
+}
+
+/**
+ * Send a query and put it in the FIFO to wait for its answer. The FIFO must
+ * have room, and hold nothing but queries to the same device.
+ *
+ * @param slot The device's slot in qikDevices[]
+ * @param buf The query
+ * @param len The length of the query
+ * @param callback Called with the answer, may be NULL
+ * @param context Passed to the callback
+ */
+void sendQuery(uint32_t slot, uint8_t * buf, size_t len,
+               qikResponseCallback_t callback, void* context)
+{
+    qikRequest_t* request = &qikInFlight[(qikInFlightHead + qikInFlightCount) %
+                                         QIK_MAX_IN_FLIGHT];
+
+    /* Remember what the answer will be for */
+    request->response.deviceId = buf[1];
+    request->response.command = buf[2];
+    request->response.parameter = (len > 3) ? buf[3] : 0;
+    request->response.value = -1;
+    request->slot = slot;
+    request->value = (len > 4) ? buf[4] : 0;
+    request->callback = callback;
+    request->context = context;
+
+    sendCommand(buf, len);
+
+    /* Its round trip starts once it's all on the wire */
+    request->sentTime = qikWireIdleTime;
+    qikInFlightSlot = slot;
+    qikInFlightCount++;
+}
+
+/**
+ * Add the given command to the transmit batch, and set the motor shutoff if
+ * it starts a motor. flushTransmit() writes the batch.
+ *
+ * @param buf A pointer to the command to send
+ * @param len The length of the command to send
+ */
+void sendCommand(uint8_t * buf, size_t len)
+{
+    uint64_t now = getCurrentTime();
+    qikDevice_t* device = findQikDevice(buf[1]);
+    bool startsMotor = false;
+    size_t i;
+
+    if(QIK_TX_BUFSIZE - (qikTxTail - qikTxHead) < len)
+    {
+        /* Make room if the port will take some more */
+        flushTransmit();
+        if(QIK_TX_BUFSIZE - (qikTxTail - qikTxHead) < len)
+        {
+            logMessage(LOG_LEVEL_WARN,
+                       "Serial port backed up, dropped command %d", buf[2]);
+            metricAdd(METRIC_QIK_DROPPED, 1);
+            return;
+        }
+    }
+
+    /* Keep track of when the UART will have sent everything */
+    if(qikWireIdleTime < now)
+    {
+        qikWireIdleTime = now;
+    }
+    qikWireIdleTime += len * SERIAL_BYTE_USEC;
+
+    /* Only stops are sent to devices that aren't on the bus */
+    if(device != NULL)
+    {
+        device->lastFrameTime = qikWireIdleTime;
+    }
+
+    /* Check if this is a motor command */
+    switch((QikCommand_t)buf[2])
+    {
+        case M0_FORWARD:
+        case M0_REVERSE:
+        case M1_FORWARD:
+        case M1_REVERSE:
+        {
+            /* Set the automatic shutoff if this starts the motor */
+            startsMotor = (buf[3] != 0);
+            break;
+        }
+        case M0_FORWARD_128:
+        case M0_REVERSE_128:
+        case M1_FORWARD_128:
+        case M1_REVERSE_128:
+        {
+            /* Set the automatic shutoff */
+            startsMotor = true;
+            break;
+        }
+        case GET_CONFIG_PARAM:
+        case SET_CONFIG_PARAM:
+        case GET_ERROR_BYTE:
+        case GET_FIRMWARE_VERSION:
+        case M0_COAST:
+        case M1_COAST:
+        {
+            break;
+        }
+    }
+    if(startsMotor && device != NULL)
+    {
+        __atomic_store_n(&device->motorShutoffTime, now + MOTOR_TIMEOUT,
+                         __ATOMIC_RELAXED);
+        armQikWatchdog();
+    }
+
+    /* Batch the message */
+    for(i = 0; i < len; i++)
+    {
+        qikTxBuf[qikTxTail % QIK_TX_BUFSIZE] = buf[i];
+        qikTxTail++;
+    }
+    metricCountCommand(buf[2]);
+}
+
+/**
+ * Write as much of the transmit batch as the serial port will take, in one
+ * writev() of the one or two pieces of the ring it's in. Whatever doesn't
+ * fit stays for the next pass, which waitForQikWork() starts when the port
+ * has room again.
+ */
+void flushTransmit(void)
+{
+    struct iovec iov[2];
+    uint32_t start;
+    uint32_t pending;
+    ssize_t numWritten;
+    int iovcnt;
+
+    while(qikTxHead != qikTxTail)
+    {
+        start = qikTxHead % QIK_TX_BUFSIZE;
+        pending = qikTxTail - qikTxHead;
+
+        /* The batch may wrap around the end of the ring */
+        iov[0].iov_base = &qikTxBuf[start];
+        iov[0].iov_len = (start + pending > QIK_TX_BUFSIZE) ?
+                         QIK_TX_BUFSIZE - start : pending;
+        iov[1].iov_base = qikTxBuf;
+        iov[1].iov_len = pending - iov[0].iov_len;
+        iovcnt = (iov[1].iov_len != 0) ? 2 : 1;
+
+        numWritten = writevToSerialPort(iov, iovcnt);
+        if(numWritten > 0)
+        {
+            /* Maybe not all of it, go round for the rest */
+            qikTxHead += numWritten;
+            metricAdd(METRIC_SERIAL_TX_BYTES, numWritten);
+
+            /* Stamp the traced setpoints that are all written now */
+            while(qikTxTraceHead != qikTxTraceTail &&
+                    (int32_t)(qikTxHead - qikTxTraceEnds[qikTxTraceHead %
+                                                         QIK_MAX_TX_TRACES]) >= 0)
+            {
+                traceStamp(qikTxTraces[qikTxTraceHead % QIK_MAX_TX_TRACES],
+                           TRACE_WRITTEN);
+                qikTxTraceHead++;
+            }
+        }
+        else if(numWritten < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if(numWritten == 0 || errno == EAGAIN)
+        {
+            /* The port's buffer is full, wait for it to drain */
+            break;
+        }
+        else
+        {
+            /* The port is gone or not open yet, so are the commands */
+            if(errno != EBADF)
+            {
+                perror("Writing to the Qik");
+            }
+            qikTxHead = qikTxTail;
+            qikTxTraceHead = qikTxTraceTail;
+        }
+    }
+}
+
+/**
+ * Hand a batch of bytes read from the Qik to the dispatcher, then wake it
+ * once so it can match them with their queries. Only the serial thread may
+ * call this.
+ *
+ * @param buf The bytes the Qik sent back
+ * @param len The number of bytes
+ */
+void processResponses(const uint8_t * buf, size_t len)
+{
+    uint32_t head = __atomic_load_n(&qikRxHead, __ATOMIC_ACQUIRE);
+    uint32_t tail = qikRxTail;
+    uint64_t now = getCurrentTime();
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        if(tail - head == QIK_RX_BUFSIZE)
+        {
+            /* Far more answers than there are questions, it's noise */
+            logMessage(LOG_LEVEL_WARN, "Dropped %d bytes from the Qik",
+                       (int)(len - i));
+            break;
+        }
+        qikRxBuf[tail % QIK_RX_BUFSIZE] = buf[i];
+        qikRxTime[tail % QIK_RX_BUFSIZE] = now;
+        tail++;
+    }
+    __atomic_store_n(&qikRxTail, tail, __ATOMIC_RELEASE);
+    metricAdd(METRIC_SERIAL_RX_BYTES, len);
+
+    wakeQikDispatcher();
+}
+
+/**
+ * Match every byte the serial thread handed over with the oldest query that
+ * hasn't been answered
+ */
+void receiveResponses(void)
+{
+    uint32_t tail = __atomic_load_n(&qikRxTail, __ATOMIC_ACQUIRE);
+    uint32_t head = qikRxHead;
+
+    while(head != tail)
+    {
+        if(qikInFlightCount == 0)
+        {
+            logMessage(LOG_LEVEL_WARN, "Unexpected byte %d from the Qik",
+                       qikRxBuf[head % QIK_RX_BUFSIZE]);
+        }
+        else
+        {
+            completeRequest(qikRxBuf[head % QIK_RX_BUFSIZE],
+                            qikRxTime[head % QIK_RX_BUFSIZE]);
+        }
+        head++;
+    }
+    __atomic_store_n(&qikRxHead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Give up on queries that have gone unanswered for too long. The Qik
+ * answers in order, so once the oldest has timed out the answers to the
+ * rest can't be trusted to line up either, and they all fail. This lets
+ * the FIFO get back in step after a lost byte.
+ */
+void expireRequests(void)
+{
+    qikRttEstimator_t* estimator;
+    uint8_t command;
+
+    if(qikInFlightCount != 0 && getCurrentTime() >= getResponseDeadline())
+    {
+        logMessage(LOG_LEVEL_WARN, "%d Qik queries timed out", qikInFlightCount);
+        metricAdd(METRIC_QIK_TIMEOUTS, qikInFlightCount);
+
+        /* Back off in case the Qik is just slower than it has been */
+        command = qikInFlight[qikInFlightHead].response.command;
+        if(command < QIK_NUM_QUERIES)
+        {
+            estimator = &qikDevices[qikInFlightSlot].rtt[command];
+            estimator->rttvar = estimator->rttvar * 2 + SERIAL_BYTE_USEC;
+            if(estimator->rttvar > CMD_TIMEOUT_USEC / 4)
+            {
+                estimator->rttvar = CMD_TIMEOUT_USEC / 4;
+            }
+        }
+
+        while(qikInFlightCount != 0)
+        {
+            completeRequest(-1, 0);
+        }
+    }
+}
+
+/**
+ * Work out when to give up on the oldest query. Its answer can't start
+ * coming back until the query is on the wire and the answer before it is
+ * in, and from then it should take about the round trip time measured for
+ * that kind of query to that device. Until there's a measurement, the fixed
+ * CMD_TIMEOUT_USEC is used.
+ *
+ * @return The deadline for the query at the head of the FIFO
+ */
+uint64_t getResponseDeadline(void)
+{
+    qikRequest_t* request = &qikInFlight[qikInFlightHead];
+    uint64_t start = request->sentTime;
+    int32_t timeout = CMD_TIMEOUT_USEC;
+    qikRttEstimator_t* estimator = &qikDevices[request->slot].rtt[0];
+
+    if(qikLastAnswerTime > start)
+    {
+        start = qikLastAnswerTime;
+    }
+
+    if(request->response.command < QIK_NUM_QUERIES &&
+            estimator[request->response.command].samples != 0)
+    {
+        /* The mean plus four deviations, but at least a byte's slack */
+        estimator = &estimator[request->response.command];
+        timeout = estimator->srtt + ((4 * estimator->rttvar > SERIAL_BYTE_USEC) ?
+                                     4 * estimator->rttvar : SERIAL_BYTE_USEC);
+        if(timeout < CMD_MIN_TIMEOUT_USEC)
+        {
+            timeout = CMD_MIN_TIMEOUT_USEC;
+        }
+        else if(timeout > CMD_TIMEOUT_USEC)
+        {
+            timeout = CMD_TIMEOUT_USEC;
+        }
+    }
+
+    return start + timeout;
+}
+
+/**
+ * Fold a measured round trip into an estimator, as in RFC 6298
+ *
+ * @param estimator The estimator for the kind of query that was answered
+ * @param rtt The round trip time in microseconds
+ */
+void sampleRtt(qikRttEstimator_t* estimator, int32_t rtt)
+{
+    int32_t error;
+
+    if(estimator->samples == 0)
+    {
+        estimator->srtt = rtt;
+        estimator->rttvar = rtt / 2;
+    }
+    else
+    {
+        error = rtt - estimator->srtt;
+        estimator->rttvar += ((error < 0 ? -error : error) - estimator->rttvar) / 4;
+        estimator->srtt += error / 8;
+    }
+    estimator->samples++;
+}
+
+/**
+ * Finish the oldest query in the FIFO, record what it found and tell
+ * whoever asked
+ *
+ * @param value The byte the Qik sent back, or -1 if it never did
+ * @param arrivalTime When the byte came in, ignored if it never did
+ */
+void completeRequest(int16_t value, uint64_t arrivalTime)
+{
+    qikRequest_t* request = &qikInFlight[qikInFlightHead];
+    qikDevice_t* device = &qikDevices[request->slot];
+    uint8_t byte = (uint8_t) value;
+    uint64_t start = request->sentTime;
+
+    if(value >= 0)
+    {
+        /* Time the round trip from when the Qik could first have answered */
+        if(qikLastAnswerTime > start)
+        {
+            start = qikLastAnswerTime;
+        }
+        if(request->response.command < QIK_NUM_QUERIES)
+        {
+            sampleRtt(&device->rtt[request->response.command],
+                      (arrivalTime > start) ? (int32_t)(arrivalTime - start) : 0);
+        }
+        metricObserveResponse((arrivalTime > start) ?
+                              (uint32_t)(arrivalTime - start) : 0);
+        qikLastAnswerTime = arrivalTime;
+    }
+
+    request->response.value = value;
+    qikInFlightHead = (qikInFlightHead + 1) % QIK_MAX_IN_FLIGHT;
+    qikInFlightCount--;
+
+    switch(value < 0 ? 0 : request->response.command)
+    {
+        case GET_FIRMWARE_VERSION:
+        {
+            /* Heartbeats ask for this all the time, only say if it's news */
+            if(!(device->state.verified & QIK_VERIFIED_FIRMWARE) ||
+                    device->state.firmwareVersion != byte)
+            {
+                logMessage(LOG_LEVEL_DEBUG, "GET_FIRMWARE_VERSION %c", byte);
+            }
+            updateQikState(request->slot, &device->state.firmwareVersion, byte,
+                           QIK_VERIFIED_FIRMWARE);
+            break;
+        }
+
+        case GET_ERROR_BYTE:
+        {
+            logMessage(LOG_LEVEL_DEBUG, "GET_ERROR_BYTE %d", byte);
+            metricCountErrorBits(byte);
+            device->state.errorByte = byte;
+            qikStatePublish(request->slot, &device->state);
+            notifyQikStatus();
+            break;
+        }
+
+        case GET_CONFIG_PARAM:
+        {
+            logMessage(LOG_LEVEL_DEBUG, "GET_CONFIGURATION_PARAM %d", byte);
+            if (request->response.parameter < NUM_CONFIG_PARAMS)
+            {
+                updateQikState(request->slot,
+                               &device->state.config[request->response.parameter],
+                               byte, QIK_VERIFIED_CONFIG(request->response.parameter));
+            }
+            break;
+        }
+
+        case SET_CONFIG_PARAM:
+        {
+            logMessage(LOG_LEVEL_DEBUG, "SET_CONFIGURATION_PARAM %d", byte);
+
+            /* Write the new value through once the Qik has taken it */
+            if (byte == 0 && request->response.parameter < NUM_CONFIG_PARAMS)
+            {
+                updateQikState(request->slot,
+                               &device->state.config[request->response.parameter],
+                               request->value,
+                               QIK_VERIFIED_CONFIG(request->response.parameter));
+            }
+            break;
+        }
+
+        default:
+        {
+            /* Timed out, or a command that doesn't have a response */
+            break;
+        }
+    }
+
+    if(request->callback != NULL)
+    {
+        request->callback(&request->response, request->context);
+    }
+}
+
+/**
+ * Sleep until there is something to do, then turn off a device's motors if
+ * it's been 2 seconds without a command, give up on a response that's overdue
+ * and send what's waiting, highest lane first: stops, then error byte
+ * queries, then motion setpoints, then queued qik commands. The thread only
+ * wakes when a command is queued, a response arrives, the serial port has
+ * room for a batch it didn't take or a deadline passes.
+ */
+void processQikState(void)
+{
+    qikDevice_t* device;
+    uint64_t shutoffTime;
+    uint32_t slot;
+    bool stopped = false;
+
+    waitForQikWork();
+    qikLanesDeferred = false;
+
+    /* Check if any device's motors should be automatically stopped */
+    for(slot = 0; slot < qikNumDevices; slot++)
+    {
+        device = &qikDevices[slot];
+        shutoffTime = __atomic_load_n(&device->motorShutoffTime, __ATOMIC_RELAXED);
+        if(shutoffTime != 0 && getCurrentTime() >= shutoffTime)
+        {
+            __atomic_store_n(&device->motorShutoffTime, 0, __ATOMIC_RELAXED);
+            emergencyStop(device->deviceId);
+            metricAdd(METRIC_QIK_SHUTOFFS, 1);
+            stopped = true;
+        }
+    }
+    if(stopped)
+    {
+        armQikWatchdog();
+    }
+
+    /* Stops preempt everything */
+    sendEmergencyStops();
+
+    /* Match answers with their queries, and give up on lost ones */
+    receiveResponses();
+    expireRequests();
+
+    /* Find out why the error pin rose before anything else is asked */
+    sendErrorQueries();
+
+    /* Motion doesn't wait on responses, the newest setpoints go next */
+    sendMotorSetpoints();
+
+    /* Keep the Qik's serial timeout from firing while the line is quiet */
+    sendHeartbeat();
+
+    /* Deque any pending actions */
+    DequeueQikCommand();
+
+    /* Write everything in one go */
+    flushTransmit();
+
+    /* And sleep until the next deadline */
+    armQikTimer();
+}
+
+/**
+ * Block until the dispatcher is woken, its timer expires or the serial port
+ * has room for the rest of a batch, and acknowledge whatever woke it
+ */
+void waitForQikWork(void)
+{
+    struct pollfd fds[3];
+    uint64_t count;
+
+    fds[0].fd = qikWakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = qikTimerFd;
+    fds[1].events = POLLIN;
+
+    /* Wake when there's room for a batch the port wouldn't take */
+    fds[2].fd = (qikTxHead != qikTxTail) ? getSerialPortFd() : -1;
+    fds[2].events = POLLOUT;
+
+    if(poll(fds, 3, -1) > 0)
+    {
+        /* Both are non-blocking, so reading one that didn't fire is fine */
+        if(read(qikWakeFd, &count, sizeof(count)) < 0 ||
+                read(qikTimerFd, &count, sizeof(count)) < 0)
+        {
+            ; /* Nothing to acknowledge */
+        }
+    }
+}
+
+/**
+ * Set the dispatcher's timer for whichever comes first, the pending
+ * response's timeout, a motor shutoff, a heartbeat or the end of the
+ * backlog, or disarm it if none are set
+ */
+void armQikTimer(void)
+{
+    struct itimerspec timer;
+    uint64_t deadline = 0;
+    uint64_t shutoffTime, heartbeatTime;
+    uint64_t now = getCurrentTime();
+    uint32_t slot;
+
+    if(qikInFlightCount != 0)
+    {
+        deadline = getResponseDeadline();
+    }
+    for(slot = 0; slot < qikNumDevices; slot++)
+    {
+        shutoffTime = __atomic_load_n(&qikDevices[slot].motorShutoffTime,
+                                      __ATOMIC_RELAXED);
+        if(shutoffTime != 0 && (deadline == 0 || shutoffTime < deadline))
+        {
+            deadline = shutoffTime;
+        }
+        heartbeatTime = getHeartbeatTime(&qikDevices[slot]);
+        if(heartbeatTime != 0 && (deadline == 0 || heartbeatTime < deadline))
+        {
+            deadline = heartbeatTime;
+        }
+    }
+    if(qikLanesDeferred &&
+            (deadline == 0 || qikWireIdleTime - QIK_MAX_BACKLOG_USEC < deadline))
+    {
+        /* Pick up what was held back once the backlog drains */
+        deadline = qikWireIdleTime - QIK_MAX_BACKLOG_USEC;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    if(deadline != 0)
+    {
+        /* A zero it_value disarms the timer, so a passed deadline gets 1ns */
+        deadline = (deadline > now) ? deadline - now : 0;
+        timer.it_value.tv_sec = deadline / 1000000;
+        timer.it_value.tv_nsec = (deadline % 1000000) * 1000;
+        if(deadline == 0)
+        {
+            timer.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(qikTimerFd, 0, &timer, NULL);
+}
+
+/**
+ * Wake the thread sleeping in processQikState(). This is safe from any
+ * thread, and from interrupt handlers.
+ */
+void wakeQikDispatcher(void)
+{
+    uint64_t one = 1;
+
+    if(qikWakeFd != -1)
+    {
+        if(write(qikWakeFd, &one, sizeof(one)) < 0)
+        {
+            ; /* The counter is saturated, the dispatcher is already awake */
+        }
+    }
+}
+
+/**
+ * Push back a device's automatic motor shutoff, if its motors are running.
+ * This lets a client keep the motors it started going without re-sending
+ * the speed, other clients' devices still stop on time.
+ *
+ * @param deviceId The device the client is driving
+ */
+void motorHeartbeat(uint8_t deviceId)
+{
+    qikDevice_t* device = findQikDevice(deviceId);
+
+    if(device != NULL &&
+            extendMotorShutoff(device, getCurrentTime() + MOTOR_TIMEOUT))
+    {
+        armQikWatchdog();
+    }
+}
+
+/**
+ * Push back a device's automatic motor shutoff, if its motors are running.
+ * A shutoff that isn't pending is left alone, so stopped motors stay
+ * stopped. Safe from any thread, the caller re-arms the watchdog.
+ *
+ * @param device The device
+ * @param time The new shutoff time
+ * @return true if the shutoff was pushed back
+ */
+bool extendMotorShutoff(qikDevice_t* device, uint64_t time)
+{
+    uint64_t shutoffTime = __atomic_load_n(&device->motorShutoffTime,
+                                           __ATOMIC_RELAXED);
+
+    return shutoffTime != 0 &&
+           __atomic_compare_exchange_n(&device->motorShutoffTime, &shutoffTime,
+                                       time, false, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED);
+}
+
+/**
+ * Record a value a Qik reported, and publish and save it if it is new
+ *
+ * @param slot The device's slot in qikDevices[]
+ * @param field The field of the device's state to update
+ * @param value The value from the Qik
+ * @param verifiedBit The QIK_VERIFIED_* bit for the field
+ */
+void updateQikState(uint8_t slot, uint8_t* field, uint8_t value,
+                    uint8_t verifiedBit)
+{
+    qikDevice_t* device = &qikDevices[slot];
+    bool changed = (*field != value);
+    bool verified = (device->state.verified & verifiedBit) != 0;
+
+    if(changed && device->stateCached && !verified)
+    {
+        logMessage(LOG_LEVEL_INFO, "The cached state of Qik %d was stale, "
+                   "%d is now %d", device->deviceId, *field, value);
+    }
+
+    /* Heartbeats re-read the firmware version all the time, only tell the
+     * readers when something is new */
+    if(!changed && verified)
+    {
+        return;
+    }
+
+    *field = value;
+    device->state.verified |= verifiedBit;
+    qikStatePublish(slot, &device->state);
+    notifyQikStatus();
+
+    if(changed && device->statePath[0] != '\0')
+    {
+        qikStateRequestSave(slot, device->statePath);
+    }
+}
+
+/**
+ * Set the watchdog to go off a little after the first device's motors
+ * should be shut off, or disarm it if they're all stopped. Safe from any
+ * thread.
+ */
+void armQikWatchdog(void)
+{
+    uint64_t shutoffTime;
+    uint64_t first = 0;
+    uint32_t numDevices = __atomic_load_n(&qikNumDevices, __ATOMIC_ACQUIRE);
+    uint32_t slot;
+
+    for(slot = 0; slot < numDevices; slot++)
+    {
+        shutoffTime = __atomic_load_n(&qikDevices[slot].motorShutoffTime,
+                                      __ATOMIC_RELAXED);
+        if(shutoffTime != 0 && (first == 0 || shutoffTime < first))
+        {
+            first = shutoffTime;
+        }
+    }
+    setQikWatchdogTimer((first == 0) ? 0 : first + QIK_WATCHDOG_GRACE_USEC);
+}
+
+/**
+ * Set the watchdog's timer
+ *
+ * @param time When it goes off, 0 to disarm it
+ */
+void setQikWatchdogTimer(uint64_t time)
+{
+    struct itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = time / 1000000;
+    timer.it_value.tv_nsec = (time % 1000000) * 1000;
+    timerfd_settime(qikWatchdogFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/**
+ * The dead man's switch, run in its own thread. It sleeps on a timerfd that
+ * is armed whenever a motion command starts the motors, and disarmed when
+ * the dispatcher shuts them all off. If it ever goes off the dispatcher is
+ * stuck, so the watchdog writes the stops for every overdue device to the
+ * serial port itself. A stop that cuts into a half written command still
+ * works: the Qik flags a format error and takes the new packet.
+ *
+ * @param vp unused
+ */
+void* qikWatchdog(__attribute__((unused)) void* vp)
+{
+    uint64_t expirations;
+    uint64_t shutoffTime, now;
+    uint8_t msg[QIK_MAX_BUS_DEVICES * QIK_STOP_FRAME_LEN];
+    qikDevice_t* device;
+    struct iovec iov;
+    uint32_t slot, len;
+    bool stopPending;
+
+    while(1)
+    {
+        if(read(qikWatchdogFd, &expirations, sizeof(expirations)) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("Watchdog");
+            return NULL;
+        }
+
+        /* Disarming can race with arming, so check each is really overdue */
+        now = getCurrentTime();
+        len = 0;
+        for(slot = 0; slot < __atomic_load_n(&qikNumDevices, __ATOMIC_ACQUIRE);
+                slot++)
+        {
+            device = &qikDevices[slot];
+            shutoffTime = __atomic_load_n(&device->motorShutoffTime,
+                                          __ATOMIC_RELAXED);
+            stopPending = (__atomic_load_n(&qikStopRequests[device->deviceId / 64],
+                                           __ATOMIC_RELAXED) >>
+                           (device->deviceId % 64)) & 1;
+            if(!stopPending && (shutoffTime == 0 || now < shutoffTime))
+            {
+                continue;
+            }
+
+            msg[len++] = START_BYTE;
+            msg[len++] = device->deviceId;
+            msg[len++] = M0_FORWARD;
+            msg[len++] = 0;
+            msg[len++] = START_BYTE;
+            msg[len++] = device->deviceId;
+            msg[len++] = M1_FORWARD;
+            msg[len++] = 0;
+            __atomic_fetch_add(&device->stopCount, 1, __ATOMIC_RELEASE);
+            metricCountCommand(M0_FORWARD);
+            metricCountCommand(M1_FORWARD);
+        }
+        if(len == 0)
+        {
+            continue;
+        }
+
+        logMessage(LOG_LEVEL_ERROR,
+                   "Watchdog: the dispatcher is stuck, stopping the motors");
+        iov.iov_base = msg;
+        iov.iov_len = len;
+        if(writevToSerialPort(&iov, 1) > 0)
+        {
+            metricAdd(METRIC_SERIAL_TX_BYTES, len);
+        }
+        __atomic_fetch_add(&qikWatchdogStats.watchdogTrips, 1, __ATOMIC_RELAXED);
+
+        /* Say it again now and then if the dispatcher stays stuck */
+        setQikWatchdogTimer(getCurrentTime() + MOTOR_TIMEOUT);
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the watchdog and heartbeat counters
+ *
+ * @param stats Filled in with the counters
+ */
+void getQikWatchdogStats(qikWatchdogStats_t* stats)
+{
+    stats->heartbeats = __atomic_load_n(&qikWatchdogStats.heartbeats,
+                                        __ATOMIC_RELAXED);
+    stats->heartbeatBytes = __atomic_load_n(&qikWatchdogStats.heartbeatBytes,
+                                            __ATOMIC_RELAXED);
+    stats->heartbeatUsec = __atomic_load_n(&qikWatchdogStats.heartbeatUsec,
+                                           __ATOMIC_RELAXED);
+    stats->watchdogTrips = __atomic_load_n(&qikWatchdogStats.watchdogTrips,
+                                           __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the error pin counters
+ *
+ * @param stats Filled in with the counters
+ */
+void getQikErrorStats(qikErrorStats_t* stats)
+{
+    stats->edges = __atomic_load_n(&qikErrorStats.edges, __ATOMIC_RELAXED);
+    stats->queries = __atomic_load_n(&qikErrorStats.queries, __ATOMIC_RELAXED);
+    stats->sumUsec = __atomic_load_n(&qikErrorStats.sumUsec, __ATOMIC_RELAXED);
+    stats->maxUsec = __atomic_load_n(&qikErrorStats.maxUsec, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the last known status of a Qik. This never touches the serial port or
+ * waits on the dispatcher, and the fields are always from one snapshot.
+ *
+ * @param deviceId The device
+ * @param status Filled in with the status
+ * @return 0 if the device isn't on the bus, 1 for success
+ */
+uint8_t getQikStatus(uint8_t deviceId, qikStatus_t* status)
+{
+    if(findQikDevice(deviceId) == NULL)
+    {
+        return 0;
+    }
+    qikStateRead(qikDeviceSlots[deviceId], status);
+    return 1;
+}
+
+/**
+ * Set an eventfd to be signalled whenever the Qik's status changes
+ *
+ * @param fd The eventfd, or -1 to stop signalling
+ */
+void setQikStatusFd(int32_t fd)
+{
+    __atomic_store_n(&qikStatusFd, fd, __ATOMIC_RELEASE);
+}
+
+/**
+ * Signal the status eventfd, if there is one
+ */
+void notifyQikStatus(void)
+{
+    uint64_t one = 1;
+    int32_t fd = __atomic_load_n(&qikStatusFd, __ATOMIC_ACQUIRE);
+
+    if(fd != -1)
+    {
+        if(write(fd, &one, sizeof(one)) < 0)
+        {
+            ; /* The counter is saturated, the listener is already woken */
+        }
+    }
 }
@@ -1,8 +1,14 @@
 #ifndef _QIK_2s9v1_H_
 #define _QIK_2s9v1_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* The default device ID to address the qik at */
 #define DEFAULT_DEVICE_ID 0x09
+#define MAX_DEVICE_ID     0x7F /*!< Highest device ID a Qik can take */
+
+#define QIK_MAX_BUS_DEVICES 8 /*!< Qiks that can share the serial port */
 
 /* Enum for the error bits */
 typedef enum
@@ -112,16 +118,84 @@ typedef enum
 
 } config_parameter_t;
 
+#define NUM_CONFIG_PARAMS 4 /*!< Number of config_parameter_t values */
+
+/* Bits of qikStatus_t.verified */
+#define QIK_VERIFIED_CONFIG(p)  (1 << (p)) /*!< config[p] came from the Qik */
+#define QIK_VERIFIED_FIRMWARE   (1 << NUM_CONFIG_PARAMS) /*!< So did the version */
+
+/* The last known state of the Qik */
+typedef struct
+{
+    uint32_t version;                  /*!< Goes up every time this changes */
+    uint8_t firmwareVersion;           /*!< ASCII version, 0 if unknown */
+    uint8_t errorByte;                 /*!< The last error byte read */
+    uint8_t config[NUM_CONFIG_PARAMS]; /*!< Indexed by config_parameter_t */
+    uint8_t verified;                  /*!< QIK_VERIFIED_* bits for the values
+                                            confirmed since startup, the rest
+                                            are cached from the last run */
+} qikStatus_t;
+
+/* How one device's command queue has been doing */
+typedef struct
+{
+    uint32_t depth;       /*!< Queries waiting now */
+    uint32_t highWater;   /*!< Most ever waiting at once */
+    uint32_t full;        /*!< Queries turned away because it was full */
+    uint32_t retries;     /*!< Times producers raced for a slot and retried */
+} qikQueueStats_t;
+
+/* What the watchdog and the heartbeat have been up to, over every device */
+typedef struct
+{
+    uint32_t heartbeats;      /*!< Keepalives sent to the Qik */
+    uint32_t heartbeatBytes;  /*!< Bytes they took on the wire */
+    uint32_t heartbeatUsec;   /*!< Shortest idle time before a keepalive, 0
+                                   if they're off */
+    uint32_t watchdogTrips;   /*!< Times the watchdog stopped the motors */
+} qikWatchdogStats_t;
+
+/* How the error pin has been answered, over every device */
+typedef struct
+{
+    uint32_t edges;       /*!< Times signalQikError() was called */
+    uint32_t queries;     /*!< GET_ERROR_BYTEs sent for them */
+    uint64_t sumUsec;     /*!< Time from each edge to its queries, summed */
+    uint32_t maxUsec;     /*!< Longest time from an edge to a query */
+} qikErrorStats_t;
+
+/* The answer to a query, handed to its qikResponseCallback_t */
+typedef struct
+{
+    uint8_t deviceId;  /*!< The device the query was sent to */
+    uint8_t command;   /*!< The query's command byte */
+    uint8_t parameter; /*!< The config parameter, for config queries */
+    int16_t value;     /*!< The byte the Qik sent back, -1 if it timed out */
+} qikResponse_t;
+
+/* Called on the dispatcher thread when a query is answered or times out.
+ * It holds up every other command, so it mustn't block. */
+typedef void (*qikResponseCallback_t)(const qikResponse_t* response,
+                                      void* context);
+
 /* Function Prototypes */
 
-void processResponse(uint8_t byte);
+uint8_t initializeQikDispatcher(void);
+uint8_t addQikDevice(uint8_t deviceId);
+uint8_t getQikDevices(uint8_t* deviceIds);
+uint8_t loadQikState(const char* path);
+void processResponses(const uint8_t * buf, size_t len);
 
-void getFirmwareVersion(uint8_t deviceId);
-void getErrorByte(uint8_t deviceId);
+void getFirmwareVersion(uint8_t deviceId, qikResponseCallback_t callback,
+                        void* context);
+void getErrorByte(uint8_t deviceId, qikResponseCallback_t callback,
+                  void* context);
 
-void getConfigurationParameter(uint8_t deviceId, config_parameter_t parameter);
+void getConfigurationParameter(uint8_t deviceId, config_parameter_t parameter,
+                               qikResponseCallback_t callback, void* context);
 void setConfigurationParameter(uint8_t deviceId, config_parameter_t parameter,
-                               uint8_t val);
+                               uint8_t val, qikResponseCallback_t callback,
+                               void* context);
 
 void setM0Coast(uint8_t deviceId);
 void setM1Coast(uint8_t deviceId);
@@ -129,8 +203,23 @@ void setM0Forward(uint8_t deviceId, uint8_t speed);
 void setM0Reverse(uint8_t deviceId, uint8_t speed);
 void setM1Forward(uint8_t deviceId, uint8_t speed);
 void setM1Reverse(uint8_t deviceId, uint8_t speed);
-
-void processMotorControl(char* postContent);
+void setMotorSpeed(uint8_t deviceId, uint8_t motor, int16_t speed,
+                   uint16_t trace);
+void emergencyStop(uint8_t deviceId);
+void signalQikError(void);
+uint32_t getQikStopCount(uint8_t deviceId);
+void enableQikSerialTimeout(uint8_t deviceId, uint8_t timeoutParam);
+void* qikWatchdog(void* vp);
+
+void processMotorControl(char* postContent, uint16_t trace);
+int16_t motorControlDevice(const char* command);
 void processQikState(void);
+void motorHeartbeat(uint8_t deviceId);
+
+uint8_t getQikStatus(uint8_t deviceId, qikStatus_t* status);
+void getQikWatchdogStats(qikWatchdogStats_t* stats);
+void getQikErrorStats(qikErrorStats_t* stats);
+uint8_t getQikQueueStats(uint8_t deviceId, qikQueueStats_t* stats);
+void setQikStatusFd(int32_t fd);
 
 #endif /* _QIK_2s9v1_H_ */
@@ -0,0 +1,135 @@
+/*
+ * QikQueue.c
+ *
+ *  A bounded lock-free MPSC ring, after Dmitry Vyukov's bounded MPMC queue.
+ *  Every slot carries a sequence number. A producer claims a slot by moving
+ *  enqueuePos forward with a CAS, fills it, then publishes it by bumping the
+ *  slot's sequence. There is only one consumer, so it owns dequeuePos
+ *  outright and needs no CAS at all.
+ *
+ *  Producers never block or spin on each other, so HTTP threads, the GPIO
+ *  ISR and the control loop can all queue commands. A full ring is reported
+ *  instead of waited on.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "QikQueue.h"
+
+#define QIK_QUEUE_MASK (QIK_QUEUE_SIZE - 1)
+
+/**
+ * Empty a ring. Nothing else may be using it.
+ *
+ * @param queue The ring to initialize
+ */
+void qikQueueInit(qikQueue_t* queue)
+{
+    uint32_t i;
+
+    memset(queue, 0, sizeof(qikQueue_t));
+    for(i = 0; i < QIK_QUEUE_SIZE; i++)
+    {
+        queue->slots[i].sequence = i;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Add a command to the ring. This is safe to call from any number of
+ * threads at once, and never blocks.
+ *
+ * @param queue The ring
+ * @param cmd   The command to copy into the ring
+ * @return true if the command was queued, false if the ring is full
+ */
+bool qikQueuePush(qikQueue_t* queue, const qikCommand_t* cmd)
+{
+    qikQueueSlot_t* slot;
+    uint32_t pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+    uint32_t sequence;
+    int32_t diff;
+
+    while(1)
+    {
+        slot = &queue->slots[pos & QIK_QUEUE_MASK];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(sequence - pos);
+
+        if(diff == 0)
+        {
+            /* The slot is free, try to claim it. On failure pos is
+             * reloaded with where the winning producer left it
+             */
+            if(__atomic_compare_exchange_n(&queue->enqueuePos, &pos, pos + 1,
+                                           true, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            __atomic_fetch_add(&queue->pushRetries, 1, __ATOMIC_RELAXED);
+        }
+        else if(diff < 0)
+        {
+            /* The consumer hasn't emptied this slot from the last lap */
+            return false;
+        }
+        else
+        {
+            /* Another producer got here first */
+            __atomic_fetch_add(&queue->pushRetries, 1, __ATOMIC_RELAXED);
+            pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->cmd = *cmd;
+
+    /* Publish the command to the consumer */
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Take the oldest command out of the ring. Only one thread may call this.
+ *
+ * @param queue The ring
+ * @param cmd   Filled in with the command
+ * @return true if a command was taken, false if the ring is empty
+ */
+bool qikQueuePop(qikQueue_t* queue, qikCommand_t* cmd)
+{
+    uint32_t pos = queue->dequeuePos;
+    qikQueueSlot_t* slot = &queue->slots[pos & QIK_QUEUE_MASK];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+    /* Empty, or the producer that claimed this slot is still filling it */
+    if((int32_t)(sequence - (pos + 1)) < 0)
+    {
+        return false;
+    }
+
+    *cmd = slot->cmd;
+
+    /* Hand the slot back to the producers for the next lap */
+    __atomic_store_n(&slot->sequence, pos + QIK_QUEUE_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->dequeuePos, pos + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * How many commands are in the ring. Safe from any thread, but it's only a
+ * snapshot while the ring is in use.
+ *
+ * @param queue The ring
+ * @return The number of commands claimed and not yet taken
+ */
+uint32_t qikQueueDepth(qikQueue_t* queue)
+{
+    uint32_t dequeuePos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+    uint32_t enqueuePos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+
+    /* The positions are read apart, so the consumer may look ahead */
+    return ((int32_t)(enqueuePos - dequeuePos) > 0) ? enqueuePos - dequeuePos : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * QikQueue.h
+ *
+ *  Lock-free multi-producer, single-consumer ring of Qik command records
+ */
+
+#ifndef _QIK_QUEUE_H_
+#define _QIK_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Qik2s9v1.h"
+
+#define QIK_QUEUE_SIZE      256 /*!< Slots in the ring, must be a power of two */
+#define QIK_MAX_COMMAND_LEN 10  /*!< Longest command packet a record holds */
+#define CACHE_LINE_SIZE     64  /*!< Keeps producer and consumer state apart */
+
+/* A single command packet waiting to be sent to the Qik */
+typedef struct
+{
+    uint8_t len;                        /*!< Bytes used in data[] */
+    uint8_t expectResponse;             /*!< The Qik will answer this command */
+    uint8_t data[QIK_MAX_COMMAND_LEN];  /*!< The command packet */
+    qikResponseCallback_t callback;     /*!< Called with the response */
+    void* context;                      /*!< Passed to the callback */
+} qikCommand_t;
+
+/* A ring slot. The sequence number says whose turn it is to use the slot */
+typedef struct
+{
+    uint32_t sequence;  /*!< Ticket of the next producer or consumer */
+    qikCommand_t cmd;   /*!< The command in the slot */
+} qikQueueSlot_t;
+
+/* The ring. Producers only touch enqueuePos and pushRetries, and the
+ * consumer only touches dequeuePos, so each side gets its own cache line */
+typedef struct
+{
+    uint32_t enqueuePos __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t pushRetries; /*!< Times a producer lost a slot to another */
+    uint32_t dequeuePos __attribute__((aligned(CACHE_LINE_SIZE)));
+    qikQueueSlot_t slots[QIK_QUEUE_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} qikQueue_t;
+
+void qikQueueInit(qikQueue_t* queue);
+bool qikQueuePush(qikQueue_t* queue, const qikCommand_t* cmd);
+bool qikQueuePop(qikQueue_t* queue, qikCommand_t* cmd);
+uint32_t qikQueueDepth(qikQueue_t* queue);
+
+#endif /* _QIK_QUEUE_H_ */
@@ -0,0 +1,288 @@
+/*
+ * QikState.c
+ *
+ *  Each Qik's last known state, behind a seqlock. There is one writer, the
+ *  dispatcher, which makes the sequence odd while it copies a new snapshot
+ *  in and even again when it's done. Readers copy the snapshot out and try
+ *  again if the sequence was odd or moved underneath them, so they never
+ *  block the writer or each other. Every field is a relaxed atomic, so a
+ *  torn copy is thrown away rather than being a data race.
+ *
+ *  Snapshots are kept by the device's slot on the bus, not its ID.
+ *
+ *  The firmware version and config are also kept on disk, so they can be
+ *  trusted straight away on the next start while the Qik is asked again.
+ *  The dispatcher only flags a snapshot as needing saving, and
+ *  qikStateWriter() saves what was last published on a thread that isn't
+ *  real time.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "QikState.h"
+
+#define QIK_STATE_MAGIC    "QIK1" /*!< Starts the file, bump if it changes */
+#define QIK_STATE_FILE_LEN (4 + 1 + NUM_CONFIG_PARAMS + 1)
+
+/* Odd while a snapshot is being written */
+uint32_t qikStateSequence[QIK_MAX_BUS_DEVICES] = {0};
+
+/* Only touched through __atomic builtins */
+qikStatus_t qikStateSnapshots[QIK_MAX_BUS_DEVICES];
+
+/* Snapshots waiting to be saved, a bit for each slot, and where to */
+uint32_t qikStateDirty = 0;
+const char* qikStatePaths[QIK_MAX_BUS_DEVICES];
+int32_t qikStateWakeFd = -1; /*!< eventfd qikStateWriter() sleeps on */
+
+/* Function prototypes */
+void qikStateSaveDirty(void);
+
+/**
+ * Replace a device's snapshot. Only one thread may call this.
+ *
+ * @param slot The device's slot on the bus
+ * @param status The new state, its version is ignored
+ */
+void qikStatePublish(uint8_t slot, const qikStatus_t* status)
+{
+    uint32_t* sequencePtr = &qikStateSequence[slot];
+    qikStatus_t* snapshot = &qikStateSnapshots[slot];
+    uint32_t sequence = *sequencePtr;
+    uint8_t i;
+
+    __atomic_store_n(sequencePtr, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&snapshot->firmwareVersion, status->firmwareVersion,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->errorByte, status->errorByte,
+                     __ATOMIC_RELAXED);
+    for(i = 0; i < NUM_CONFIG_PARAMS; i++)
+    {
+        __atomic_store_n(&snapshot->config[i], status->config[i],
+                         __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&snapshot->verified, status->verified,
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(sequencePtr, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy a device's snapshot out. This is safe from any thread and never
+ * blocks the writer.
+ *
+ * @param slot The device's slot on the bus
+ * @param status Filled in with the snapshot and its version
+ */
+void qikStateRead(uint8_t slot, qikStatus_t* status)
+{
+    uint32_t* sequencePtr = &qikStateSequence[slot];
+    qikStatus_t* snapshot = &qikStateSnapshots[slot];
+    uint32_t before;
+    uint32_t after;
+    uint8_t i;
+
+    while(1)
+    {
+        before = __atomic_load_n(sequencePtr, __ATOMIC_ACQUIRE);
+        if(before & 1)
+        {
+            /* Mid write, let the writer finish */
+            sched_yield();
+            continue;
+        }
+
+        status->firmwareVersion =
+            __atomic_load_n(&snapshot->firmwareVersion, __ATOMIC_RELAXED);
+        status->errorByte = __atomic_load_n(&snapshot->errorByte,
+                                            __ATOMIC_RELAXED);
+        for(i = 0; i < NUM_CONFIG_PARAMS; i++)
+        {
+            status->config[i] = __atomic_load_n(&snapshot->config[i],
+                                                __ATOMIC_RELAXED);
+        }
+        status->verified = __atomic_load_n(&snapshot->verified,
+                                           __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(sequencePtr, __ATOMIC_RELAXED);
+        if(before == after)
+        {
+            status->version = before / 2;
+            return;
+        }
+    }
+}
+
+/**
+ * Read the firmware version and config saved by qikStateSave(). Nothing
+ * loaded is marked verified.
+ *
+ * @param path The file to read
+ * @param status Filled in with the saved state if it's valid
+ * @return true if the file was there and intact
+ */
+bool qikStateLoad(const char* path, qikStatus_t* status)
+{
+    uint8_t buf[QIK_STATE_FILE_LEN];
+    uint8_t checksum = 0;
+    size_t numRead;
+    uint8_t i;
+    FILE* file = fopen(path, "rb");
+
+    if(file == NULL)
+    {
+        return false;
+    }
+    numRead = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+
+    if(numRead != sizeof(buf) || memcmp(buf, QIK_STATE_MAGIC, 4) != 0)
+    {
+        printf("Ignoring a bad Qik state file %s\n", path);
+        return false;
+    }
+    for(i = 0; i < sizeof(buf) - 1; i++)
+    {
+        checksum ^= buf[i];
+    }
+    if(checksum != buf[sizeof(buf) - 1])
+    {
+        printf("Ignoring a corrupt Qik state file %s\n", path);
+        return false;
+    }
+
+    memset(status, 0, sizeof(qikStatus_t));
+    status->firmwareVersion = buf[4];
+    memcpy(status->config, buf + 5, NUM_CONFIG_PARAMS);
+    return true;
+}
+
+/**
+ * Save the firmware version and config. The file is replaced with a rename
+ * so a crash mid write leaves the old one behind.
+ *
+ * @param path The file to write
+ * @param status The state to save
+ * @return true if it was saved
+ */
+bool qikStateSave(const char* path, const qikStatus_t* status)
+{
+    uint8_t buf[QIK_STATE_FILE_LEN];
+    char tmpPath[256];
+    uint8_t checksum = 0;
+    size_t numWritten;
+    uint8_t i;
+    FILE* file;
+
+    memcpy(buf, QIK_STATE_MAGIC, 4);
+    buf[4] = status->firmwareVersion;
+    memcpy(buf + 5, status->config, NUM_CONFIG_PARAMS);
+    for(i = 0; i < sizeof(buf) - 1; i++)
+    {
+        checksum ^= buf[i];
+    }
+    buf[sizeof(buf) - 1] = checksum;
+
+    if(strlen(path) + 5 > sizeof(tmpPath))
+    {
+        return false;
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+
+    file = fopen(tmpPath, "wb");
+    if(file == NULL)
+    {
+        perror("Saving the Qik state");
+        return false;
+    }
+    numWritten = fwrite(buf, 1, sizeof(buf), file);
+    if(fclose(file) != 0 || numWritten != sizeof(buf) ||
+            rename(tmpPath, path) != 0)
+    {
+        perror("Saving the Qik state");
+        remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Have qikStateWriter() save a device's published snapshot. This never
+ * blocks, so it's safe from the dispatcher.
+ *
+ * @param slot The device's slot on the bus
+ * @param path The file to save to, it must outlive the save
+ */
+void qikStateRequestSave(uint8_t slot, const char* path)
+{
+    uint64_t one = 1;
+    int32_t fd;
+
+    __atomic_store_n(&qikStatePaths[slot], path, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&qikStateDirty, 1u << slot, __ATOMIC_SEQ_CST);
+
+    /* Before the writer is up its first pass picks the bit up */
+    fd = __atomic_load_n(&qikStateWakeFd, __ATOMIC_SEQ_CST);
+    if(fd != -1 && write(fd, &one, sizeof(one)) < 0)
+    {
+        ; /* The counter is saturated, the writer is already awake */
+    }
+}
+
+/**
+ * Save every snapshot that's been flagged since the last pass
+ */
+void qikStateSaveDirty(void)
+{
+    uint32_t dirty = __atomic_exchange_n(&qikStateDirty, 0, __ATOMIC_SEQ_CST);
+    qikStatus_t status;
+    uint8_t slot;
+
+    for(slot = 0; slot < QIK_MAX_BUS_DEVICES; slot++)
+    {
+        if(dirty & (1u << slot))
+        {
+            qikStateRead(slot, &status);
+            qikStateSave(__atomic_load_n(&qikStatePaths[slot],
+                                         __ATOMIC_RELAXED), &status);
+        }
+    }
+}
+
+/**
+ * The state writer, sleeps until qikStateRequestSave() flags a snapshot.
+ * Saves that pile up while it's writing are done in one pass.
+ *
+ * @param vp unused
+ */
+void* qikStateWriter(__attribute__((unused)) void* vp)
+{
+    uint64_t count;
+    int32_t fd = eventfd(0, 0);
+
+    if(fd == -1)
+    {
+        perror("Saving the Qik state");
+        return NULL;
+    }
+    __atomic_store_n(&qikStateWakeFd, fd, __ATOMIC_SEQ_CST);
+
+    while(1)
+    {
+        qikStateSaveDirty();
+        if(read(fd, &count, sizeof(count)) < 0)
+        {
+            ; /* Interrupted, look again */
+        }
+    }
+    return NULL;
+}
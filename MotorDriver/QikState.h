@@ -0,0 +1,26 @@
+/*
+ * QikState.h
+ *
+ *  A snapshot of each Qik's state that any thread can read without locks,
+ *  and that survives restarts. Saving happens on a thread of its own, so the
+ *  dispatcher never waits for the disk.
+ */
+
+#ifndef _QIK_STATE_H_
+#define _QIK_STATE_H_
+
+#include <stdbool.h>
+
+#include "Qik2s9v1.h"
+
+#define QIK_STATE_PATH "qik.state" /*!< Where the snapshots are kept on disk,
+    with the device ID on the end */
+
+void qikStatePublish(uint8_t slot, const qikStatus_t* status);
+void qikStateRead(uint8_t slot, qikStatus_t* status);
+bool qikStateLoad(const char* path, qikStatus_t* status);
+bool qikStateSave(const char* path, const qikStatus_t* status);
+void qikStateRequestSave(uint8_t slot, const char* path);
+void* qikStateWriter(void* vp);
+
+#endif /* _QIK_STATE_H_ */
@@ -0,0 +1,480 @@
+/*
+ * RealTime.c
+ *
+ *  Keeps web traffic from delaying the motors. When it's turned on, the
+ *  control threads (serial RX, Qik dispatch, the watchdog and the motion
+ *  loop) run under SCHED_FIFO, so they preempt the web server the moment
+ *  they're woken, and can be pinned to a CPU of their own while the web
+ *  server is kept off it. All memory is locked so nothing on the control
+ *  path waits for a page to be swapped or faulted in: the threads get small
+ *  stacks, which mlockall() then locks whole, and each one touches the top
+ *  of its stack before it starts work.
+ *
+ *  What each thread actually ended up with is reported along with the
+ *  motion loop's wakeup latency and the page faults taken since the thread
+ *  started, so the configuration can be confirmed on the running daemon.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "RealTime.h"
+
+#define RT_CONTROL_STACK  (256 * 1024)  /*!< Stack for each control thread */
+#define RT_HTTPD_STACK    (1024 * 1024) /*!< Stack for the web server */
+#define RT_PREFAULT_BYTES (64 * 1024)   /*!< Stack touched before starting */
+
+/* One of the daemon's threads */
+typedef struct
+{
+    const char* name;       /*!< What it's reported as */
+    void* (*start)(void*);  /*!< What it runs */
+    void* arg;              /*!< What start() is given */
+    pthread_t thread;       /*!< Valid once tid is set */
+    int32_t tid;            /*!< Kernel thread ID, 0 until it's running */
+    long minorFaults;       /*!< Its faults once it was set up */
+    long majorFaults;
+} rtThread_t;
+
+rtConfig_t rtConfig = {{0, 0, 0, 0}, -1, -1}; /*!< Set by initializeRealTime() */
+uint8_t rtLocked = 0; /*!< Whether mlockall() worked */
+rtThread_t rtThreads[RT_NUM_ROLES] =
+{
+    {"serial", NULL, NULL, 0, 0, 0, 0},
+    {"dispatch", NULL, NULL, 0, 0, 0, 0},
+    {"watchdog", NULL, NULL, 0, 0, 0, 0},
+    {"motion", NULL, NULL, 0, 0, 0, 0},
+    {"httpd", NULL, NULL, 0, 0, 0, 0},
+    {"log", NULL, NULL, 0, 0, 0, 0},
+    {"state", NULL, NULL, 0, 0, 0, 0}
+};
+
+/* Wakeup latency, written by the motion loop, read by anyone */
+uint64_t rtLatencySamples = 0; /*!< Ticks measured */
+uint64_t rtLatencySumUsec = 0; /*!< Their total lateness */
+uint64_t rtLatencyMaxUsec = 0; /*!< The worst of them */
+uint64_t rtMissedTicks = 0; /*!< Ticks that passed with no wakeup at all */
+
+/* Function prototypes */
+uint8_t isRealTime(void);
+void* realTimeThreadMain(void* vp);
+void prefaultStack(void);
+uint8_t readThreadFaults(int32_t tid, long* minorFaults, long* majorFaults);
+
+/**
+ * Parse the priorities from the command line
+ *
+ * @param list One priority, which the others are set around, or a comma
+ *             separated one for each of serial, dispatch, watchdog and
+ *             motion
+ * @param config Where the priorities go
+ * @return 0 if the list is bad, 1 for success
+ */
+uint8_t parseRealTimePriorities(const char* list, rtConfig_t* config)
+{
+    int32_t min = sched_get_priority_min(SCHED_FIFO);
+    int32_t max = sched_get_priority_max(SCHED_FIFO);
+    int32_t priority;
+    char* end;
+    uint8_t i;
+
+    for(i = 0; i < RT_NUM_CONTROL_ROLES; i++)
+    {
+        priority = strtol(list, &end, 10);
+        if(end == list || priority < min || priority > max)
+        {
+            return 0;
+        }
+        config->priority[i] = priority;
+        list = end;
+
+        if(*list == '\0' && i == 0)
+        {
+            /* The watchdog has to be able to preempt a stuck dispatcher,
+             * and the motion loop can wait for both of them
+             */
+            config->priority[RT_SERIAL] = priority;
+            config->priority[RT_DISPATCH] = priority;
+            config->priority[RT_WATCHDOG] = (priority < max) ? priority + 1 : max;
+            config->priority[RT_MOTION] = (priority > min) ? priority - 1 : min;
+            return 1;
+        }
+        if(*list != ((i == RT_NUM_CONTROL_ROLES - 1) ? '\0' : ','))
+        {
+            return 0;
+        }
+        list++;
+    }
+    return 1;
+}
+
+/**
+ * Lock memory if any thread is going to be real time. This must be called
+ * before any thread is created.
+ *
+ * @param config The settings, copied
+ * @return 0 if the settings are bad, 1 for success
+ */
+uint8_t initializeRealTime(const rtConfig_t* config)
+{
+    int32_t numCpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if(config->controlCpu >= numCpus || config->webCpu >= numCpus ||
+            config->controlCpu >= CPU_SETSIZE || config->webCpu >= CPU_SETSIZE)
+    {
+        return 0;
+    }
+    memcpy(&rtConfig, config, sizeof(rtConfig));
+
+    if(isRealTime())
+    {
+        /* Keep freed memory mapped, so it never has to be faulted back in */
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+
+        if(mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        {
+            rtLocked = 1;
+        }
+        else
+        {
+            perror("mlockall");
+        }
+    }
+    return 1;
+}
+
+/**
+ * @return Whether any thread is going to be real time
+ */
+uint8_t isRealTime(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < RT_NUM_CONTROL_ROLES; i++)
+    {
+        if(rtConfig.priority[i] > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create a thread that's scheduled for what it does
+ *
+ * @param thread Filled in like pthread_create() does
+ * @param role What the thread does, only one thread per role
+ * @param start The thread function
+ * @param arg What start() is given
+ * @return 0 for success, an error number otherwise
+ */
+int32_t createRealTimeThread(pthread_t* thread, rtRole_t role,
+                             void* (*start)(void*), void* arg)
+{
+    pthread_attr_t attr;
+    int32_t err;
+
+    rtThreads[role].start = start;
+    rtThreads[role].arg = arg;
+
+    pthread_attr_init(&attr);
+    if(isRealTime())
+    {
+        /* The default 8 MB stacks would all be locked */
+        pthread_attr_setstacksize(&attr, (role == RT_HTTPD) ? RT_HTTPD_STACK :
+                                  RT_CONTROL_STACK);
+    }
+    err = pthread_create(thread, &attr, realTimeThreadMain, &rtThreads[role]);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+/**
+ * Starts every thread made by createRealTimeThread()
+ *
+ * @param vp The thread's rtThread_t
+ */
+void* realTimeThreadMain(void* vp)
+{
+    rtThread_t* rtThread = (rtThread_t*) vp;
+
+    configureRealTimeThread((rtRole_t)(rtThread - rtThreads));
+    return rtThread->start(rtThread->arg);
+}
+
+/**
+ * Schedule and pin the calling thread for its role, and prefault its stack.
+ * Threads that weren't made by createRealTimeThread(), like main(), call
+ * this themselves.
+ *
+ * @param role What the calling thread does
+ */
+void configureRealTimeThread(rtRole_t role)
+{
+    rtThread_t* rtThread = &rtThreads[role];
+    struct sched_param param;
+    struct rusage usage;
+    cpu_set_t cpus;
+    int32_t numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    int32_t err;
+    int32_t i;
+
+    CPU_ZERO(&cpus);
+    if(role < RT_NUM_CONTROL_ROLES && rtConfig.controlCpu >= 0)
+    {
+        CPU_SET(rtConfig.controlCpu, &cpus);
+    }
+    else if(role >= RT_NUM_CONTROL_ROLES && rtConfig.webCpu >= 0)
+    {
+        CPU_SET(rtConfig.webCpu, &cpus);
+    }
+    else if(role >= RT_NUM_CONTROL_ROLES && rtConfig.controlCpu >= 0 &&
+            numCpus > 1)
+    {
+        /* Anywhere but the control threads' CPU */
+        for(i = 0; i < numCpus && i < CPU_SETSIZE; i++)
+        {
+            if(i != rtConfig.controlCpu)
+            {
+                CPU_SET(i, &cpus);
+            }
+        }
+    }
+    if(CPU_COUNT(&cpus) > 0)
+    {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(err != 0)
+        {
+            fprintf(stderr, "Can't pin the %s thread: %s\n", rtThread->name,
+                    strerror(err));
+        }
+    }
+
+    if(role < RT_NUM_CONTROL_ROLES && rtConfig.priority[role] > 0)
+    {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = rtConfig.priority[role];
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(err != 0)
+        {
+            fprintf(stderr, "Can't make the %s thread real time: %s\n",
+                    rtThread->name, strerror(err));
+        }
+    }
+
+    if(isRealTime())
+    {
+        prefaultStack();
+    }
+
+    /* Faults from here on are ones the configuration should have avoided */
+    getrusage(RUSAGE_THREAD, &usage);
+    rtThread->minorFaults = usage.ru_minflt;
+    rtThread->majorFaults = usage.ru_majflt;
+    rtThread->thread = pthread_self();
+    __atomic_store_n(&rtThread->tid, (int32_t) syscall(SYS_gettid),
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * @param tid A kernel thread ID
+ * @return What the thread is called, or NULL if it isn't one of the
+ *         daemon's threads or hasn't been configured yet
+ */
+const char* getRealTimeThreadName(int32_t tid)
+{
+    uint8_t i;
+
+    for(i = 0; i < RT_NUM_ROLES; i++)
+    {
+        if(__atomic_load_n(&rtThreads[i].tid, __ATOMIC_ACQUIRE) == tid)
+        {
+            return rtThreads[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Touch the stack the thread is going to use, so it's mapped before it's
+ * needed. mlockall() only locks what's already mapped of main()'s stack.
+ */
+void prefaultStack(void)
+{
+    volatile uint8_t stack[RT_PREFAULT_BYTES];
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    for(i = 0; i < sizeof(stack); i += pageSize)
+    {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Record how late the motion loop woke up for a tick
+ *
+ * @param lateUsec How long after the tick it ran
+ * @param missedTicks How many ticks before it passed without a wakeup
+ */
+void recordSchedulingLatency(uint64_t lateUsec, uint64_t missedTicks)
+{
+    __atomic_store_n(&rtLatencySamples, rtLatencySamples + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&rtLatencySumUsec, rtLatencySumUsec + lateUsec,
+                     __ATOMIC_RELAXED);
+    if(lateUsec > rtLatencyMaxUsec)
+    {
+        __atomic_store_n(&rtLatencyMaxUsec, lateUsec, __ATOMIC_RELAXED);
+    }
+    if(missedTicks > 0)
+    {
+        __atomic_store_n(&rtMissedTicks, rtMissedTicks + missedTicks,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Read a thread's page fault counts
+ *
+ * @param tid The kernel thread ID
+ * @param minorFaults Filled in with the faults that didn't need I/O
+ * @param majorFaults Filled in with the ones that did
+ * @return 1 if they were read
+ */
+uint8_t readThreadFaults(int32_t tid, long* minorFaults, long* majorFaults)
+{
+    char path[64];
+    char line[512];
+    char* fields;
+    FILE* file;
+
+    sprintf(path, "/proc/self/task/%d/stat", tid);
+    file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return 0;
+    }
+    fields = fgets(line, sizeof(line), file);
+    fclose(file);
+
+    /* The name can hold anything, so start after the last ')' */
+    if(fields == NULL || (fields = strrchr(line, ')')) == NULL)
+    {
+        return 0;
+    }
+    return sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %ld %*u %ld",
+                  minorFaults, majorFaults) == 2;
+}
+
+/**
+ * snprintf() onto the end of a buffer
+ *
+ * @param buf The buffer
+ * @param len Its size
+ * @param used How much of it is already used
+ * @param format The printf() format
+ * @return How much of it is used now
+ */
+size_t appendStats(char* buf, size_t len, size_t used, const char* format, ...)
+{
+    va_list args;
+    int32_t n;
+
+    if(used >= len)
+    {
+        return used;
+    }
+    va_start(args, format);
+    n = vsnprintf(buf + used, len - used, format, args);
+    va_end(args);
+    return (n < 0) ? used : used + n;
+}
+
+/**
+ * Describe how every thread is scheduled, the motion loop's wakeup latency
+ * and the page faults taken, as JSON
+ *
+ * @param buf Where the JSON goes
+ * @param len The size of buf
+ * @return The length of the JSON, which was truncated if it's len or more
+ */
+size_t formatRealTimeStats(char* buf, size_t len)
+{
+    struct sched_param param;
+    struct rusage usage;
+    cpu_set_t cpus;
+    uint64_t samples = __atomic_load_n(&rtLatencySamples, __ATOMIC_RELAXED);
+    uint64_t sumUsec = __atomic_load_n(&rtLatencySumUsec, __ATOMIC_RELAXED);
+    long minorFaults, majorFaults;
+    int32_t policy, tid, cpu;
+    size_t used = 0;
+    uint8_t i, first, firstCpu;
+
+    used = appendStats(buf, len, used, "{\"locked\":%u,\"threads\":[", rtLocked);
+    first = 1;
+    for(i = 0; i < RT_NUM_ROLES; i++)
+    {
+        tid = __atomic_load_n(&rtThreads[i].tid, __ATOMIC_ACQUIRE);
+        if(tid == 0 || pthread_getschedparam(rtThreads[i].thread, &policy,
+                                             &param) != 0)
+        {
+            continue;
+        }
+        if(!readThreadFaults(tid, &minorFaults, &majorFaults))
+        {
+            minorFaults = rtThreads[i].minorFaults;
+            majorFaults = rtThreads[i].majorFaults;
+        }
+
+        used = appendStats(buf, len, used, "%s{\"name\":\"%s\",\"policy\":\"%s\","
+                           "\"priority\":%d,\"cpus\":[", first ? "" : ",",
+                           rtThreads[i].name,
+                           (policy == SCHED_FIFO) ? "fifo" :
+                           (policy == SCHED_RR) ? "rr" : "other",
+                           param.sched_priority);
+        first = 0;
+
+        CPU_ZERO(&cpus);
+        pthread_getaffinity_np(rtThreads[i].thread, sizeof(cpus), &cpus);
+        firstCpu = 1;
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if(CPU_ISSET(cpu, &cpus))
+            {
+                used = appendStats(buf, len, used, "%s%d", firstCpu ? "" : ",",
+                                   cpu);
+                firstCpu = 0;
+            }
+        }
+
+        used = appendStats(buf, len, used, "],\"minorFaults\":%ld,"
+                           "\"majorFaults\":%ld}",
+                           minorFaults - rtThreads[i].minorFaults,
+                           majorFaults - rtThreads[i].majorFaults);
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    used = appendStats(buf, len, used, "],\"latency\":{\"samples\":%lu,"
+                       "\"avgUsec\":%lu,\"maxUsec\":%lu,\"missedTicks\":%lu},"
+                       "\"minorFaults\":%ld,\"majorFaults\":%ld}",
+                       (unsigned long) samples,
+                       (unsigned long)((samples == 0) ? 0 : sumUsec / samples),
+                       (unsigned long) __atomic_load_n(&rtLatencyMaxUsec,
+                                                       __ATOMIC_RELAXED),
+                       (unsigned long) __atomic_load_n(&rtMissedTicks,
+                                                       __ATOMIC_RELAXED),
+                       usage.ru_minflt, usage.ru_majflt);
+    return used;
+}
@@ -0,0 +1,49 @@
+/*
+ * RealTime.h
+ *
+ *  Scheduling, CPU pinning and memory locking for the daemon's threads
+ */
+
+#ifndef _REAL_TIME_H_
+#define _REAL_TIME_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* What each thread does, which decides how it's scheduled */
+typedef enum
+{
+    RT_SERIAL = 0, /*!< Reads responses from the Qik */
+    RT_DISPATCH,   /*!< Sends commands to the Qik, the main thread */
+    RT_WATCHDOG,   /*!< Stops the motors if the dispatcher can't */
+    RT_MOTION,     /*!< Ramps the motors */
+    RT_HTTPD,      /*!< Serves the web page, never real time */
+    RT_LOG,        /*!< Writes out the log, never real time */
+    RT_STATE,      /*!< Saves the Qik state, never real time */
+    RT_NUM_ROLES
+} rtRole_t;
+
+#define RT_NUM_CONTROL_ROLES RT_HTTPD /*!< Roles before this are real time,
+                                            the rest keep off their CPU */
+
+/* The settings, filled in from the command line */
+typedef struct
+{
+    int32_t priority[RT_NUM_CONTROL_ROLES]; /*!< SCHED_FIFO priority, 0 for
+                                                 the default scheduler */
+    int32_t controlCpu; /*!< CPU for the control threads, -1 for any */
+    int32_t webCpu;     /*!< CPU for the web server, -1 for any other */
+} rtConfig_t;
+
+uint8_t parseRealTimePriorities(const char* list, rtConfig_t* config);
+uint8_t initializeRealTime(const rtConfig_t* config);
+int32_t createRealTimeThread(pthread_t* thread, rtRole_t role,
+                             void* (*start)(void*), void* arg);
+void configureRealTimeThread(rtRole_t role);
+const char* getRealTimeThreadName(int32_t tid);
+void recordSchedulingLatency(uint64_t lateUsec, uint64_t missedTicks);
+size_t formatRealTimeStats(char* buf, size_t len);
+size_t appendStats(char* buf, size_t len, size_t used, const char* format, ...);
+
+#endif /* _REAL_TIME_H_ */
@@ -8,8 +8,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/signal.h>
 #include <termios.h>
 #include <ftw.h>
@@ -18,38 +20,159 @@
 
 #include "SerialPort.h"
 #include "Qik2s9v1.h"
+#include "FlightRecorder.h"
 
 #define UART_RX_BUFSIZE 1024
+#define SERIAL_POLL_TIMEOUT_MS 1000 /*!< Longest wait before checking for a stop */
 
-int SerialPortFileDescrptor = -1;  /*!< The opened serial port descriptor */
+int SerialPortFileDescrptor = -1;  /*!< The opened serial port descriptor,
+                                        other threads load it atomically */
 struct termios origAttr;           /*!< The original serial port attributes */
+uint8_t serialVmin = 1;            /*!< Bytes that must arrive before a wakeup */
+uint8_t serialVtime = 0;           /*!< Inter-byte timeout, tenths of a second */
+volatile int serialRunning = 1;    /*!< Cleared to stop readSerial() */
+
+/* Function prototypes */
+void stopAllMotors(void);
 
 /**
- * Spun up in a separate thread, this loops until there is something to be read
- * It reads bytes from the serial port into a buffer
- * This is run on another thread
+ * Spun up in a separate thread, this sleeps in poll() until the serial port
+ * has something to read, then hands everything that was read to
+ * processResponses() in one batch. The wait is bounded so stopSerial() is
+ * noticed.
  *
- * @param vp    unused
+ * @param vp    The path to the serial port, opened here unless
+ *              initializeSerialPort() already opened one
  */
 void* readSerial(void* vp)
 {
-    int i;
     uint8_t incBuf[UART_RX_BUFSIZE];
+    struct pollfd pfd;
+    int numRead;
+    int ready;
+
+    if(SerialPortFileDescrptor == -1)
+    {
+        initializeSerialPort((char*)vp);
+    }
 
-    initializeSerialPort((char*)vp);
+    pfd.fd = SerialPortFileDescrptor;
+    pfd.events = POLLIN;
 
-    while(1)
+    while(serialRunning)
     {
-        int numRead = read(SerialPortFileDescrptor, incBuf, UART_RX_BUFSIZE);
+        ready = poll(&pfd, 1, SERIAL_POLL_TIMEOUT_MS);
+        if(ready < 0 || (ready == 0 && serialVmin == 1))
+        {
+            /* Timed out, or a signal, check if it's time to stop */
+            continue;
+        }
 
-        for (i = 0; i < numRead; i++)
+        /* On a timeout with VMIN > 1, pick up the last few bytes of a batch
+         * that never filled up, poll() won't report them on their own
+         */
+
+        numRead = read(SerialPortFileDescrptor, incBuf, UART_RX_BUFSIZE);
+        if(numRead > 0)
         {
             /* read in received data */
-            processResponse(incBuf[i]);
+            recordSerialRx(incBuf, numRead);
+            processResponses(incBuf, numRead);
+        }
+        else if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            /* The port went away, don't spin on it. Nothing can reach the
+             * Qiks now, their own serial timeout is what stops the motors
+             */
+            fprintf(stderr, "readSerial: SERIAL PORT LOST, the Qiks can't be "
+                    "reached and will stop on their serial timeout\n");
+            cleanUpSerialPort();
+            stopAllMotors();
+            return NULL;
         }
     }
 
     cleanUpSerialPort();
+    return NULL;
+}
+
+/**
+ * Tell every device to stop, so everything that keeps its own idea of the
+ * motors' speeds starts again from 0 if the port comes back
+ */
+void stopAllMotors(void)
+{
+    uint8_t deviceIds[QIK_MAX_BUS_DEVICES];
+    uint8_t numDevices = getQikDevices(deviceIds);
+    uint8_t i;
+
+    for(i = 0; i < numDevices; i++)
+    {
+        emergencyStop(deviceIds[i]);
+    }
+}
+
+/**
+ * Choose how many bytes the serial port collects before readSerial() wakes
+ * up. This must be called before readSerial() opens the port.
+ *
+ * VMIN = 1, VTIME = 0 wakes on every byte, for the lowest latency. A larger
+ * VMIN with VTIME = 0 wakes once per VMIN bytes, for fewer wakeups on bulk
+ * traffic, but the bytes of a batch that never fills up wait for the next
+ * one, or up to SERIAL_POLL_TIMEOUT_MS. The tty's poll() ignores VMIN once
+ * VTIME is set, so a VTIME only matters to blocking reads. SerialBench
+ * measures the profiles.
+ *
+ * @param vmin  Bytes to collect, 1 to 255
+ * @param vtime Inter-byte timeout in tenths of a second, 0 for none
+ */
+void setSerialReadProfile(uint8_t vmin, uint8_t vtime)
+{
+    serialVmin = (vmin == 0) ? 1 : vmin;
+    serialVtime = vtime;
+}
+
+/**
+ * Set the read profile from the command line
+ *
+ * @param profile "vmin" or "vmin,vtime", see setSerialReadProfile()
+ * @return 0 if the profile is bad, 1 for success
+ */
+uint8_t parseSerialReadProfile(const char* profile)
+{
+    unsigned long vmin;
+    unsigned long vtime = 0;
+    char* end;
+
+    vmin = strtoul(profile, &end, 10);
+    if(end == profile || vmin < 1 || vmin > 255)
+    {
+        return 0;
+    }
+    if(*end == ',')
+    {
+        profile = end + 1;
+        vtime = strtoul(profile, &end, 10);
+        if(end == profile || vtime > 255)
+        {
+            return 0;
+        }
+    }
+    if(*end != '\0')
+    {
+        return 0;
+    }
+
+    setSerialReadProfile((uint8_t) vmin, (uint8_t) vtime);
+    return 1;
+}
+
+/**
+ * Make readSerial() close the port and return within its poll timeout
+ */
+void stopSerial(void)
+{
+    serialRunning = 0;
 }
 
 /**
@@ -65,8 +188,7 @@ void initializeSerialPort(char* serialPort)
     /* Attempt to open the serial port */
     SerialPortFileDescrptor = open(serialPort,
       O_RDWR     | /* Read & write */
-      O_NONBLOCK | /* Non-blocking reads */
-      O_ASYNC    | /* Asynchronous operation */
+      O_NONBLOCK | /* Non-blocking reads, poll() does the waiting */
       O_NOCTTY);   /* Dont make this the controlling terminal for the process */
 
     /* If the open fails, report it and exit the program */
@@ -86,7 +208,7 @@ void initializeSerialPort(char* serialPort)
     tcgetattr(SerialPortFileDescrptor, &termAttr);
 
     /* Set Control modes */
-    baudRate = B38400;             /* Set the I/O baud at 38400*/
+    baudRate = B38400;             /* Set the I/O baud at SERIAL_BAUD */
     cfsetispeed(&termAttr, baudRate);
     cfsetospeed(&termAttr, baudRate);
     termAttr.c_cflag &= ~PARENB;            /* Turn off even parity */
@@ -143,32 +265,78 @@ void initializeSerialPort(char* serialPort)
     termAttr.c_oflag &= ~FF1;    /* Select form-feed delays */
     termAttr.c_oflag |=  FF0;
 
-    termAttr.c_cc[VTIME] = 0;    /* Inter-character timer unused */
-    termAttr.c_cc[VMIN]  = 0;    /* Don't wait for a minimum number of chars */
+    /* poll() reports the port readable once VMIN chars are in, or VTIME
+     * after the last one
+     */
+    termAttr.c_cc[VTIME] = serialVtime;
+    termAttr.c_cc[VMIN]  = serialVmin;
 
     /* Set the parameters */
     tcsetattr(SerialPortFileDescrptor, TCSANOW, &termAttr);
 }
 
 /**
- * Close the serial port when we're all done
+ * Close the serial port when we're all done. Writes fail with EBADF from
+ * then on. A thread that loaded the descriptor just before could still use
+ * it, so its number is pointed at /dev/null rather than freed, and can't be
+ * handed to a socket the web server accepts.
  */
 void cleanUpSerialPort(void)
 {
-    tcsetattr(SerialPortFileDescrptor, TCSANOW, &origAttr);
-    close(SerialPortFileDescrptor);
+    int fd = __atomic_exchange_n(&SerialPortFileDescrptor, -1,
+                                 __ATOMIC_ACQ_REL);
+    int devNull;
+
+    if(fd == -1)
+    {
+        return;
+    }
+    tcsetattr(fd, TCSANOW, &origAttr);
+
+    devNull = open("/dev/null", O_RDWR);
+    if(devNull == -1 || dup2(devNull, fd) == -1)
+    {
+        close(fd);
+    }
+    if(devNull != -1)
+    {
+        close(devNull);
+    }
 }
 
 /**
- * Send a buffer of data over the serial port
+ * Send some buffers over the serial port in one go. The port is
+ * non-blocking, so this may send less than asked, or fail with EAGAIN when
+ * the transmit buffer is full.
  *
- * @param buf The buffer of data to send
- * @param len The length of the buffer to send
+ * @param iov The buffers to send, in order
+ * @param iovcnt The number of buffers
+ * @return The number of bytes sent, or -1 with errno set. errno is EBADF
+ *         if the port isn't open, or has been closed.
  */
-void writeToSerialPort(const void * buf, size_t len)
+ssize_t writevToSerialPort(const struct iovec* iov, int iovcnt)
 {
-    if(SerialPortFileDescrptor != -1)
+    int fd = __atomic_load_n(&SerialPortFileDescrptor, __ATOMIC_ACQUIRE);
+    ssize_t numWritten;
+
+    if(fd == -1)
     {
-        write(SerialPortFileDescrptor, buf, len);
+        errno = EBADF;
+        return -1;
     }
+    numWritten = writev(fd, iov, iovcnt);
+    if(numWritten > 0)
+    {
+        recordSerialTx(iov, iovcnt, numWritten);
+    }
+    return numWritten;
+}
+
+/**
+ * @return The serial port's descriptor, to poll() for room to write, or -1
+ *         if it isn't open
+ */
+int32_t getSerialPortFd(void)
+{
+    return __atomic_load_n(&SerialPortFileDescrptor, __ATOMIC_ACQUIRE);
 }
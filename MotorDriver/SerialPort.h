@@ -8,10 +8,23 @@
 #ifndef _SERIALPORT_H_
 #define _SERIALPORT_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SERIAL_BAUD      38400 /*!< Must match the speed_t in SerialPort.c */
+#define SERIAL_BYTE_USEC ((10 * 1000000 + SERIAL_BAUD - 1) / SERIAL_BAUD) /*!<
+    Time to send a byte with its start and stop bits */
+
 /* Function prototypes */
 void* readSerial(void* vp);
 void initializeSerialPort(char*);
 void cleanUpSerialPort(void);
-void writeToSerialPort(const void * buf, size_t len);
+ssize_t writevToSerialPort(const struct iovec* iov, int iovcnt);
+int32_t getSerialPortFd(void);
+void setSerialReadProfile(uint8_t vmin, uint8_t vtime);
+uint8_t parseSerialReadProfile(const char* profile);
+void stopSerial(void);
 
 #endif /* _SERIALPORT_H_ */
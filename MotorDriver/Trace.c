@@ -0,0 +1,293 @@
+/*
+ * Trace.c
+ *
+ *  Follows motor commands from the web server to the UART. A command is
+ *  given a trace ID when it's parsed, and the ID rides along with it: in
+ *  the motor target it sets, then in the setpoint the control loop sends
+ *  toward it, then in the dispatcher's transmit buffer. Each thread that
+ *  moves the command on stamps its span with the monotonic time, so the
+ *  time spent in every stage can be told apart.
+ *
+ *  The spans live in a ring indexed by the trace ID. Starting a span and
+ *  stamping it are single atomic stores with no locks, so any thread can
+ *  do it. Readers copy a span and check its ID didn't change underneath
+ *  them. The oldest spans are overwritten as new commands come in.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Trace.h"
+#include "RealTime.h"
+
+#define TRACE_RING_MASK   (TRACE_RING_SIZE - 1)
+#define TRACE_NUM_BUCKETS 21 /*!< Powers of two of microseconds, to ~1s */
+#define TRACE_MAX_EVENT   128 /*!< Longest Chrome trace event */
+
+/* One command's timestamps */
+typedef struct
+{
+    uint16_t id;                        /*!< The trace using it, 0 while it's
+                                             being reset */
+    uint64_t stamps[TRACE_NUM_STAGES];  /*!< Microseconds, 0 if not reached */
+} traceSpan_t;
+
+/* What the time between one stage and the next is called */
+const char* traceIntervalNames[TRACE_NUM_STAGES] =
+{
+    "total", "parse", "handle", "ramp", "queue", "write"
+};
+
+traceSpan_t traceRing[TRACE_RING_SIZE]; /*!< Spans, by trace ID */
+uint32_t traceNextId = 0; /*!< The last trace ID handed out */
+
+/* Only the web server formats the stats, so they're sorted here */
+uint32_t traceSamples[TRACE_RING_SIZE];
+
+/* Function prototypes */
+uint8_t readTraceSpan(uint32_t index, traceSpan_t* span);
+int compareTraceSamples(const void* a, const void* b);
+
+/**
+ * @return The monotonic time in microseconds, the clock spans are stamped
+ *         with
+ */
+uint64_t traceTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start tracing a command that was just parsed. Safe from any thread.
+ *
+ * @param receivedTime When its connection was accepted or its bytes were
+ *                     read, 0 if it isn't known
+ * @return The trace ID to stamp the command's stages with
+ */
+uint16_t traceBegin(uint64_t receivedTime)
+{
+    traceSpan_t* span;
+    uint64_t now = traceTime();
+    uint16_t id;
+    uint32_t i;
+
+    do
+    {
+        id = __atomic_add_fetch(&traceNextId, 1, __ATOMIC_RELAXED) &
+             TRACE_ID_MASK;
+    }
+    while(id == 0);
+
+    /* Take the span away from readers and late stamps while it's reset */
+    span = &traceRing[id & TRACE_RING_MASK];
+    __atomic_store_n(&span->id, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(i = 0; i < TRACE_NUM_STAGES; i++)
+    {
+        __atomic_store_n(&span->stamps[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&span->stamps[TRACE_RECEIVED],
+                     (receivedTime != 0) ? receivedTime : now,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&span->stamps[TRACE_PARSED], now, __ATOMIC_RELAXED);
+    __atomic_store_n(&span->id, id, __ATOMIC_RELEASE);
+    return id;
+}
+
+/**
+ * Stamp a command's span with the current time. Safe from any thread.
+ *
+ * @param trace The command's trace ID, 0 does nothing
+ * @param stage The stage it just reached
+ */
+void traceStamp(uint16_t trace, traceStage_t stage)
+{
+    traceSpan_t* span = &traceRing[trace & TRACE_RING_MASK];
+
+    /* The span may have been handed to a newer command already */
+    if(trace == 0 || __atomic_load_n(&span->id, __ATOMIC_ACQUIRE) != trace)
+    {
+        return;
+    }
+    __atomic_store_n(&span->stamps[stage], traceTime(), __ATOMIC_RELAXED);
+}
+
+/**
+ * Copy a span out of the ring, if it's in use and isn't reset meanwhile
+ *
+ * @param index Its place in the ring
+ * @param span Filled in with it
+ * @return 1 if span holds a command's stamps
+ */
+uint8_t readTraceSpan(uint32_t index, traceSpan_t* span)
+{
+    traceSpan_t* source = &traceRing[index];
+    uint32_t i;
+
+    span->id = __atomic_load_n(&source->id, __ATOMIC_ACQUIRE);
+    for(i = 0; i < TRACE_NUM_STAGES; i++)
+    {
+        span->stamps[i] = __atomic_load_n(&source->stamps[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return span->id != 0 &&
+           __atomic_load_n(&source->id, __ATOMIC_RELAXED) == span->id;
+}
+
+/**
+ * qsort() comparison for interval samples
+ */
+int compareTraceSamples(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Describe how long commands spent in each stage, as JSON. Each interval
+ * runs from the stage before to the one it's named for, and "total" from
+ * TRACE_RECEIVED to TRACE_WRITTEN. Only commands that reached both ends
+ * of an interval count toward it. The log2Usec histogram counts the
+ * intervals under 2, 4, 8... microseconds, the last bucket takes the rest.
+ *
+ * @param buf Where the JSON goes
+ * @param len The size of buf
+ * @return The length of the JSON, which was truncated if it's len or more
+ */
+size_t formatTraceStats(char* buf, size_t len)
+{
+    traceSpan_t span;
+    uint32_t buckets[TRACE_NUM_BUCKETS];
+    uint32_t spans = 0;
+    uint32_t complete = 0;
+    uint32_t count, i, b;
+    uint64_t from, to;
+    size_t used = 0;
+    uint8_t stage;
+
+    for(i = 0; i < TRACE_RING_SIZE; i++)
+    {
+        if(readTraceSpan(i, &span))
+        {
+            spans++;
+            complete += (span.stamps[TRACE_WRITTEN] != 0);
+        }
+    }
+    used = appendStats(buf, len, used, "{\"spans\":%u,\"complete\":%u,"
+                       "\"intervals\":[", spans, complete);
+
+    for(stage = 0; stage < TRACE_NUM_STAGES; stage++)
+    {
+        count = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for(i = 0; i < TRACE_RING_SIZE; i++)
+        {
+            if(!readTraceSpan(i, &span))
+            {
+                continue;
+            }
+            from = span.stamps[(stage == 0) ? TRACE_RECEIVED : stage - 1];
+            to = span.stamps[(stage == 0) ? TRACE_WRITTEN : stage];
+            if(from == 0 || to == 0 || to < from)
+            {
+                continue;
+            }
+
+            traceSamples[count] = (uint32_t)(to - from);
+            b = 0;
+            while(b < TRACE_NUM_BUCKETS - 1 &&
+                    traceSamples[count] >= ((uint32_t) 2 << b))
+            {
+                b++;
+            }
+            buckets[b]++;
+            count++;
+        }
+        qsort(traceSamples, count, sizeof(uint32_t), compareTraceSamples);
+
+        used = appendStats(buf, len, used, "%s{\"name\":\"%s\",\"count\":%u,"
+                           "\"p50Usec\":%u,\"p99Usec\":%u,\"maxUsec\":%u,"
+                           "\"log2Usec\":[", (stage == 0) ? "" : ",",
+                           traceIntervalNames[stage], count,
+                           (count == 0) ? 0 : traceSamples[count / 2],
+                           (count == 0) ? 0 : traceSamples[count * 99 / 100],
+                           (count == 0) ? 0 : traceSamples[count - 1]);
+        for(b = 0; b < TRACE_NUM_BUCKETS; b++)
+        {
+            used = appendStats(buf, len, used, "%s%u", (b == 0) ? "" : ",",
+                               buckets[b]);
+        }
+        used = appendStats(buf, len, used, "]}");
+    }
+    used = appendStats(buf, len, used, "]}");
+    return used;
+}
+
+/**
+ * Dump the spans in the Chrome trace event format, for chrome://tracing or
+ * Perfetto. Each command gets a row of its own, named by its trace ID,
+ * with a complete event for every interval it got through. The dump is
+ * longer than any sensible buffer, so it's made a piece at a time: call
+ * this until it returns 0, sending each piece as it's made.
+ *
+ * @param buf Where the next piece goes
+ * @param len The size of buf, room for a few events at least
+ * @param cursor Where the dump is up to, 0 to start it
+ * @return The length of the piece, 0 once the dump is finished
+ */
+size_t formatChromeTrace(char* buf, size_t len, uint32_t* cursor)
+{
+    traceSpan_t span;
+    size_t used = 0;
+    uint8_t stage;
+
+    if(*cursor > TRACE_RING_SIZE)
+    {
+        return 0;
+    }
+    if(*cursor == 0)
+    {
+        /* Every event after this one starts with its separating comma */
+        used = appendStats(buf, len, used, "{\"displayTimeUnit\":\"ms\","
+                           "\"traceEvents\":[{\"name\":\"process_name\","
+                           "\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":"
+                           "\"MotorDriver commands\"}}");
+    }
+
+    for(; *cursor < TRACE_RING_SIZE &&
+            used + TRACE_NUM_STAGES * TRACE_MAX_EVENT < len; (*cursor)++)
+    {
+        if(!readTraceSpan(*cursor, &span))
+        {
+            continue;
+        }
+        for(stage = TRACE_PARSED; stage < TRACE_NUM_STAGES; stage++)
+        {
+            if(span.stamps[stage - 1] == 0 || span.stamps[stage] == 0 ||
+                    span.stamps[stage] < span.stamps[stage - 1])
+            {
+                continue;
+            }
+            /* The timestamps outgrow a 32 bit long, a double holds them */
+            used = appendStats(buf, len, used, ",{\"name\":\"%s\",\"ph\":\"X\","
+                               "\"pid\":1,\"tid\":%u,\"ts\":%.0f,\"dur\":%lu}",
+                               traceIntervalNames[stage], span.id,
+                               (double) span.stamps[stage - 1],
+                               (unsigned long)(span.stamps[stage] -
+                                               span.stamps[stage - 1]));
+        }
+    }
+
+    if(*cursor == TRACE_RING_SIZE && used + TRACE_MAX_EVENT < len)
+    {
+        used = appendStats(buf, len, used, "]}");
+        (*cursor)++;
+    }
+    return used;
+}
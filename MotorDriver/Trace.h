@@ -0,0 +1,35 @@
+/*
+ * Trace.h
+ *
+ *  Timestamps of each motor command on its way from the web server to the
+ *  UART, kept in a lock-free ring
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_RING_SIZE 1024   /*!< Commands remembered, a power of two */
+#define TRACE_ID_MASK   0x7FFF /*!< Trace IDs fit in 15 bits, 0 is no trace */
+
+/* The points a command is stamped at, in the order it passes them */
+typedef enum
+{
+    TRACE_RECEIVED = 0, /*!< Its connection was accepted, or its bytes read */
+    TRACE_PARSED,       /*!< The request was parsed and routed */
+    TRACE_HANDLED,      /*!< processMotorControl() set the motor targets */
+    TRACE_RAMPED,       /*!< The control loop sent a setpoint toward them */
+    TRACE_DEQUEUED,     /*!< The dispatcher took the setpoint */
+    TRACE_WRITTEN,      /*!< The setpoint's last byte was written to the UART */
+    TRACE_NUM_STAGES
+} traceStage_t;
+
+uint64_t traceTime(void);
+uint16_t traceBegin(uint64_t receivedTime);
+void traceStamp(uint16_t trace, traceStage_t stage);
+size_t formatTraceStats(char* buf, size_t len);
+size_t formatChromeTrace(char* buf, size_t len, uint32_t* cursor);
+
+#endif /* _TRACE_H_ */
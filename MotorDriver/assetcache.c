@@ -0,0 +1,590 @@
+/*
+ * assetcache.c
+ *
+ *  In-memory cache of the files under htdocs. Files are read once at
+ *  startup, gzip'd once, and served straight out of memory afterwards.
+ *  The cache is only touched from the httpd event loop, so it has no locks.
+ *
+ *  inotify watches every directory under the root. When a file changes its
+ *  entry is dropped, and the next request for it loads it again.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+
+#include "assetcache.h"
+#include "webpages.h"
+
+#define ASSET_BUCKETS 64  /*!< Hash buckets, htdocs is small */
+#define MAX_WATCHES   64  /*!< Directories under htdocs that can be watched */
+
+/* inotify events that mean a cached file may be out of date */
+#define ASSET_WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+                          IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* A watched directory */
+typedef struct
+{
+    int32_t wd;  /*!< inotify watch descriptor, -1 if unused */
+    char* path;  /*!< The directory's path */
+} assetWatch_t;
+
+asset_t* assetBuckets[ASSET_BUCKETS] = {0}; /*!< The cached files */
+size_t assetCacheBytes = 0;                 /*!< Bytes held by the cache */
+int32_t assetInotifyFd = -1;                /*!< inotify instance */
+assetWatch_t assetWatches[MAX_WATCHES];     /*!< Watched directories */
+
+/* Internal function prototypes */
+uint32_t assetHash(const char* path);
+asset_t* assetLoad(const char* path);
+void assetCompress(asset_t* asset);
+void assetBuildHeaders(asset_t* asset, const char* contentType);
+void assetInvalidate(const char* path);
+void assetInvalidateAll(void);
+void assetFree(asset_t* asset);
+void assetWatchDirectory(const char* path);
+uint8_t assetWatched(const char* path);
+int assetVisit(const char* path, const struct stat* st, int type,
+               struct FTW* ftw);
+
+/**
+ * Load every file under the root into the cache and start watching it
+ *
+ * @param root The directory to cache, e.g. "htdocs"
+ * @return The inotify descriptor for the event loop to poll, -1 if changes
+ *         can't be watched
+ */
+int32_t assetCacheInit(const char* root)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_WATCHES; i++)
+    {
+        assetWatches[i].wd = -1;
+        assetWatches[i].path = NULL;
+    }
+
+    assetInotifyFd = inotify_init();
+    if (assetInotifyFd == -1)
+    {
+        perror("inotify_init");
+    }
+    else
+    {
+        fcntl(assetInotifyFd, F_SETFL, O_NONBLOCK);
+    }
+
+    nftw(root, assetVisit, 8, FTW_PHYS);
+
+    printf("Cached %lu bytes from %s\n", (unsigned long) assetCacheBytes, root);
+
+    return assetInotifyFd;
+}
+
+/**
+ * Read everything pending on the inotify descriptor and drop the entries
+ * for files that changed
+ */
+void assetCacheHandleEvents(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[512];
+    const struct inotify_event* event;
+    ssize_t len;
+    char* ptr;
+    uint32_t i;
+
+    while ((len = read(assetInotifyFd, buf, sizeof(buf))) > 0)
+    {
+        for (ptr = buf; ptr < buf + len;
+                ptr += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event*) ptr;
+
+            /* Events were lost, nothing in the cache can be trusted */
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                assetInvalidateAll();
+                continue;
+            }
+
+            for (i = 0; i < MAX_WATCHES; i++)
+            {
+                if (assetWatches[i].wd == event->wd)
+                {
+                    break;
+                }
+            }
+            if (i == MAX_WATCHES)
+            {
+                continue;
+            }
+
+            /* The directory itself went away */
+            if (event->mask & IN_IGNORED)
+            {
+                assetWatches[i].wd = -1;
+                free(assetWatches[i].path);
+                assetWatches[i].path = NULL;
+                continue;
+            }
+
+            if (event->len == 0)
+            {
+                continue;
+            }
+
+            sprintf(path, "%.255s/%.255s", assetWatches[i].path, event->name);
+
+            if ((event->mask & IN_ISDIR) &&
+                    (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                /* Watch new directories, their files load on demand */
+                assetWatchDirectory(path);
+            }
+            else
+            {
+                assetInvalidate(path);
+            }
+        }
+    }
+}
+
+/**
+ * Find a file in the cache, loading it if it isn't there. Only files
+ * directly in a watched directory are loaded, anything else couldn't be
+ * invalidated when it changes. The asset must be handed back with
+ * assetRelease() when the response is done with it.
+ *
+ * @param path The file's path, e.g. "htdocs/index.html"
+ * @return The cached file, or NULL if it can't be cached
+ */
+asset_t* assetCacheLookup(const char* path)
+{
+    asset_t* asset;
+    uint32_t bucket = assetHash(path);
+
+    for (asset = assetBuckets[bucket]; asset != NULL; asset = asset->next)
+    {
+        if (strcmp(asset->path, path) == 0)
+        {
+            break;
+        }
+    }
+
+    if (asset == NULL && assetWatched(path))
+    {
+        asset = assetLoad(path);
+    }
+
+    if (asset != NULL)
+    {
+        asset->refCount++;
+    }
+    return asset;
+}
+
+/**
+ * Give back an asset from assetCacheLookup(). Assets dropped from the cache
+ * while a response was still sending them are freed here.
+ *
+ * @param asset The asset to release
+ */
+void assetRelease(asset_t* asset)
+{
+    asset->refCount--;
+    if (asset->stale && asset->refCount == 0)
+    {
+        assetFree(asset);
+    }
+}
+
+/**
+ * Check a path for ".." segments, which could climb out of htdocs
+ *
+ * @param path The path to check
+ * @return 1 if it has one, 0 if not
+ */
+uint8_t assetPathEscapes(const char* path)
+{
+    const char* segment = path;
+
+    while (segment != NULL)
+    {
+        if (segment[0] == '.' && segment[1] == '.' &&
+                (segment[2] == '/' || segment[2] == '\0'))
+        {
+            return 1;
+        }
+        segment = strchr(segment, '/');
+        if (segment != NULL)
+        {
+            segment++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check that a file is directly in a directory inotify is watching
+ *
+ * @param path The file's path
+ * @return 1 if its changes will be seen, 0 if not
+ */
+uint8_t assetWatched(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    size_t length;
+    uint32_t i;
+
+    if (slash == NULL || assetPathEscapes(path))
+    {
+        return 0;
+    }
+
+    length = (size_t)(slash - path);
+    for (i = 0; i < MAX_WATCHES; i++)
+    {
+        if (assetWatches[i].wd != -1 &&
+                strlen(assetWatches[i].path) == length &&
+                strncmp(assetWatches[i].path, path, length) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * djb2 hash of a path
+ *
+ * @param path The path to hash
+ * @return A bucket index
+ */
+uint32_t assetHash(const char* path)
+{
+    uint32_t hash = 5381;
+
+    while (*path != '\0')
+    {
+        hash = (hash * 33) ^ (uint8_t) *path++;
+    }
+    return hash % ASSET_BUCKETS;
+}
+
+/**
+ * Read a file into a new cache entry
+ *
+ * @param path The file to load
+ * @return The new entry, or NULL if the file is missing, too big, or the
+ *         cache is full
+ */
+asset_t* assetLoad(const char* path)
+{
+    asset_t* asset;
+    struct stat st;
+    int32_t fd;
+    ssize_t numRead;
+    size_t total = 0;
+    uint32_t bucket;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            st.st_size > ASSET_MAX_SIZE ||
+            assetCacheBytes + st.st_size > ASSET_CACHE_SIZE)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    asset = calloc(1, sizeof(asset_t));
+    if (asset == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    asset->path = malloc(strlen(path) + 1);
+    asset->data = malloc(st.st_size + 1);
+    if (asset->path == NULL || asset->data == NULL)
+    {
+        close(fd);
+        assetFree(asset);
+        return NULL;
+    }
+    strcpy(asset->path, path);
+
+    while (total < (size_t) st.st_size)
+    {
+        numRead = read(fd, asset->data + total, st.st_size - total);
+        if (numRead > 0)
+        {
+            total += numRead;
+        }
+        else if (numRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
+    }
+    close(fd);
+    asset->size = total;
+
+    /* The ETag is the content's CRC and length, a different representation
+     * gets a different ETag
+     */
+    sprintf(asset->etag, "\"%08lx-%lx\"",
+            crc32(0L, asset->data, asset->size), (unsigned long) asset->size);
+    sprintf(asset->gzEtag, "\"%08lx-%lx-gz\"",
+            crc32(0L, asset->data, asset->size), (unsigned long) asset->size);
+
+    assetCompress(asset);
+    assetBuildHeaders(asset, content_type(path));
+    if (asset->header == NULL || (asset->gzData && asset->gzHeader == NULL))
+    {
+        assetFree(asset);
+        return NULL;
+    }
+
+    bucket = assetHash(path);
+    asset->next = assetBuckets[bucket];
+    assetBuckets[bucket] = asset;
+    assetCacheBytes += asset->size + asset->gzSize;
+
+    return asset;
+}
+
+/**
+ * Make the gzip variant of an asset. It's only kept if it's smaller.
+ *
+ * @param asset The asset to compress
+ */
+void assetCompress(asset_t* asset)
+{
+    z_stream strm;
+    uLong bound;
+
+    memset(&strm, 0, sizeof(strm));
+
+    /* 16 + MAX_WBITS asks zlib for a gzip wrapper */
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return;
+    }
+
+    bound = deflateBound(&strm, asset->size);
+    asset->gzData = malloc(bound);
+    if (asset->gzData != NULL)
+    {
+        strm.next_in = asset->data;
+        strm.avail_in = asset->size;
+        strm.next_out = asset->gzData;
+        strm.avail_out = bound;
+
+        if (deflate(&strm, Z_FINISH) == Z_STREAM_END &&
+                strm.total_out < asset->size)
+        {
+            asset->gzSize = strm.total_out;
+        }
+        else
+        {
+            free(asset->gzData);
+            asset->gzData = NULL;
+        }
+    }
+
+    deflateEnd(&strm);
+}
+
+/**
+ * Build the header blocks for both variants of an asset. The status line
+ * and the blank line ending the headers are left off so the server can add
+ * its own.
+ *
+ * @param asset       The asset
+ * @param contentType The asset's MIME type
+ */
+void assetBuildHeaders(asset_t* asset, const char* contentType)
+{
+    char buf[512];
+
+    sprintf(buf,
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "ETag: %s\r\n"
+            "Vary: Accept-Encoding\r\n",
+            contentType, (unsigned long) asset->size, asset->etag);
+    asset->headerLen = strlen(buf);
+    asset->header = malloc(asset->headerLen + 1);
+    if (asset->header != NULL)
+    {
+        strcpy(asset->header, buf);
+    }
+
+    if (asset->gzData != NULL)
+    {
+        sprintf(buf,
+                "Content-Type: %s\r\n"
+                "Content-Length: %lu\r\n"
+                "Content-Encoding: gzip\r\n"
+                "ETag: %s\r\n"
+                "Vary: Accept-Encoding\r\n",
+                contentType, (unsigned long) asset->gzSize, asset->gzEtag);
+        asset->gzHeaderLen = strlen(buf);
+        asset->gzHeader = malloc(asset->gzHeaderLen + 1);
+        if (asset->gzHeader != NULL)
+        {
+            strcpy(asset->gzHeader, buf);
+        }
+    }
+}
+
+/**
+ * Drop a file from the cache
+ *
+ * @param path The file that changed
+ */
+void assetInvalidate(const char* path)
+{
+    asset_t** link = &assetBuckets[assetHash(path)];
+    asset_t* asset;
+
+    while ((asset = *link) != NULL)
+    {
+        if (strcmp(asset->path, path) == 0)
+        {
+            *link = asset->next;
+            assetCacheBytes -= asset->size + asset->gzSize;
+
+            /* Responses may still be sending it */
+            asset->stale = 1;
+            if (asset->refCount == 0)
+            {
+                assetFree(asset);
+            }
+            return;
+        }
+        link = &asset->next;
+    }
+}
+
+/**
+ * Drop every file from the cache
+ */
+void assetInvalidateAll(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < ASSET_BUCKETS; i++)
+    {
+        while (assetBuckets[i] != NULL)
+        {
+            assetInvalidate(assetBuckets[i]->path);
+        }
+    }
+}
+
+/**
+ * Free an asset and everything it holds
+ *
+ * @param asset The asset to free
+ */
+void assetFree(asset_t* asset)
+{
+    free(asset->path);
+    free(asset->data);
+    free(asset->gzData);
+    free(asset->header);
+    free(asset->gzHeader);
+    free(asset);
+}
+
+/**
+ * Start watching a directory for changes
+ *
+ * @param path The directory
+ */
+void assetWatchDirectory(const char* path)
+{
+    int32_t wd;
+    uint32_t i;
+
+    if (assetInotifyFd == -1)
+    {
+        return;
+    }
+
+    wd = inotify_add_watch(assetInotifyFd, path, ASSET_WATCH_MASK);
+    if (wd == -1)
+    {
+        perror("inotify_add_watch");
+        return;
+    }
+
+    for (i = 0; i < MAX_WATCHES; i++)
+    {
+        /* Re-adding a path returns its existing watch */
+        if (assetWatches[i].wd == wd)
+        {
+            return;
+        }
+    }
+
+    for (i = 0; i < MAX_WATCHES; i++)
+    {
+        if (assetWatches[i].wd == -1)
+        {
+            assetWatches[i].path = malloc(strlen(path) + 1);
+            if (assetWatches[i].path != NULL)
+            {
+                strcpy(assetWatches[i].path, path);
+                assetWatches[i].wd = wd;
+                return;
+            }
+            break;
+        }
+    }
+
+    fprintf(stderr, "Too many directories to watch, %s won't be\n", path);
+    inotify_rm_watch(assetInotifyFd, wd);
+}
+
+/**
+ * nftw() callback, caches files and watches directories
+ *
+ * @param path The path being visited
+ * @param st   unused
+ * @param type What the path is
+ * @param ftw  unused
+ * @return 0 to keep walking
+ */
+int assetVisit(const char* path, __attribute__((unused)) const struct stat* st,
+               int type, __attribute__((unused)) struct FTW* ftw)
+{
+    if (type == FTW_D)
+    {
+        assetWatchDirectory(path);
+    }
+    else if (type == FTW_F)
+    {
+        assetLoad(path);
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * assetcache.h
+ *
+ *  In-memory cache of the files under htdocs. Every file is loaded at
+ *  startup along with a gzip variant, an ETag and a prebuilt header block,
+ *  and inotify drops entries when the files change on disk.
+ */
+
+#ifndef _ASSETCACHE_H_
+#define _ASSETCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASSET_MAX_SIZE   (1024 * 1024)     /*!< Bigger files use sendfile() */
+#define ASSET_CACHE_SIZE (8 * 1024 * 1024) /*!< Total bytes that are cached */
+
+/* A cached file */
+typedef struct asset
+{
+    char* path;          /*!< e.g. "htdocs/index.html" */
+    uint8_t* data;       /*!< The raw file */
+    size_t size;         /*!< Length of data */
+    uint8_t* gzData;     /*!< gzip of the file, NULL if it doesn't shrink */
+    size_t gzSize;       /*!< Length of gzData */
+    char etag[32];       /*!< Quoted strong ETag of the raw file */
+    char gzEtag[36];     /*!< Quoted strong ETag of the gzip variant */
+    char* header;        /*!< Headers for the raw file, no status line */
+    size_t headerLen;    /*!< Length of header */
+    char* gzHeader;      /*!< Headers for the gzip variant, no status line */
+    size_t gzHeaderLen;  /*!< Length of gzHeader */
+    uint32_t refCount;   /*!< Responses still sending from this asset */
+    uint8_t stale;       /*!< Dropped from the cache, free when unreferenced */
+    struct asset* next;  /*!< Next asset in the same hash bucket */
+} asset_t;
+
+int32_t assetCacheInit(const char* root);
+void assetCacheHandleEvents(void);
+asset_t* assetCacheLookup(const char* path);
+void assetRelease(asset_t* asset);
+uint8_t assetPathEscapes(const char* path);
+
+#endif /* _ASSETCACHE_H_ */
@@ -11,71 +11,1369 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <unistd.h>
-#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
-#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "httpd.h"
 #include "webpages.h"
+#include "httpparser.h"
+#include "assetcache.h"
+#include "websocket.h"
 #include "Qik2s9v1.h"
+#include "RealTime.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "Log.h"
+
+#define MAX_CONNECTIONS  4096 /*!< Highest client fd the event loop will track */
+#define MAX_EPOLL_EVENTS 64   /*!< Events handled per epoll_wait() call */
+#define CONN_IN_BUFSIZE  4096 /*!< Per-connection request buffer size */
+#define IDLE_TIMEOUT_SEC 15   /*!< Close connections quiet for this long */
+#define WS_MOTOR_PATH    "/motor_ws" /*!< Where the motor WebSocket lives */
+#define WS_MAX_COMMAND   32   /*!< Longest motor command accepted over it */
+#define METRICS_PATH     "/metrics" /*!< Where Prometheus scrapes from */
+
+/* The states a client connection moves through */
+typedef enum
+{
+    CONN_READING, /*!< Waiting for a complete request */
+    CONN_WRITING, /*!< Flushing the response out to the client */
+    CONN_WEBSOCKET, /*!< Upgraded, exchanging WebSocket frames */
+    CONN_CLOSING  /*!< Done, close the socket */
+} connState_t;
+
+/* Everything the event loop knows about a single client */
+typedef struct httpConnection
+{
+    int32_t fd;                   /*!< The client socket */
+    connState_t state;            /*!< Where this connection is */
+    uint32_t epollEvents;         /*!< Events currently registered */
+    uint8_t keepAlive;            /*!< Reuse the connection after this request */
+    uint8_t http11;               /*!< The request was HTTP/1.1 */
+    uint8_t chunked;              /*!< The response body is chunk encoded */
+    uint8_t peerClosed;           /*!< The client won't send anything else */
+    uint8_t upgrade;              /*!< Switch to WebSocket after this response */
+    uint8_t wsPingSent;           /*!< An idle WebSocket was pinged */
+    char wsDirection[12];         /*!< Direction the WebSocket started, with
+                                       any "<id>:" prefix, or "" */
+    int16_t wsDeviceId;           /*!< Device the WebSocket started, -1 if
+                                       none, its heartbeats are for it */
+    time_t lastActive;            /*!< Monotonic second of the last activity */
+    uint64_t receivedTime;        /*!< traceTime() the request or frame being
+                                       read started to arrive, 0 if none */
+    uint16_t status;              /*!< Status code of the response being
+                                       built, 0 until there is one */
+    metricRoute_t route;          /*!< What the request being answered is for */
+    struct httpConnection* prev;  /*!< Less recently active connection */
+    struct httpConnection* next;  /*!< More recently active connection */
+    char inBuf[CONN_IN_BUFSIZE];  /*!< Bytes received from the client */
+    size_t inLen;                 /*!< Number of valid bytes in inBuf */
+    httpRequest_t request;        /*!< The request parsed out of inBuf */
+    char* outBuf;                 /*!< Response waiting to be sent */
+    size_t outLen;                /*!< Number of valid bytes in outBuf */
+    size_t outSent;               /*!< Number of bytes already sent */
+    size_t outCap;                /*!< Allocated size of outBuf */
+    int32_t fileFd;               /*!< File to sendfile() after outBuf, or -1 */
+    off_t fileOffset;             /*!< Next byte of fileFd to send */
+    off_t fileSize;               /*!< Total size of fileFd */
+    asset_t* asset;               /*!< Cached file being sent, or NULL */
+    const uint8_t* body;          /*!< Body to send after outBuf, or NULL */
+    size_t bodyLen;               /*!< Length of body */
+    size_t bodySent;              /*!< Number of body bytes already sent */
+} httpConnection_t;
+
+int32_t epollFd = -1; /*!< The httpd event loop's epoll instance */
+int32_t assetFd = -1; /*!< inotify descriptor for the htdocs cache */
+int32_t idleTimerFd = -1; /*!< Ticks once a second to reap idle clients */
+int32_t statusFd = -1; /*!< eventfd the Qik signals when its status changes */
+httpConnection_t* connections[MAX_CONNECTIONS] = {0}; /*!< Clients, by fd */
+httpConnection_t* idleHead = NULL; /*!< Least recently active connection */
+httpConnection_t* idleTail = NULL; /*!< Most recently active connection */
+
+int32_t startup(uint16_t*);
+void accept_connections(int32_t server_sock);
+void handle_connection(httpConnection_t* conn, uint32_t events);
+int32_t read_request(httpConnection_t* conn);
+void start_request(httpConnection_t* conn);
+void finish_request(httpConnection_t* conn);
+void reject_request(httpConnection_t* conn);
+void watch_connection(httpConnection_t* conn, uint32_t events);
+void touch_connection(httpConnection_t* conn);
+void reap_idle_connections(void);
+time_t monotonic_seconds(void);
+httpConnection_t* find_connection(int32_t client);
+void http_connection_header(int32_t client);
+int32_t flush_connection(httpConnection_t* conn);
+void close_connection(httpConnection_t* conn);
+int32_t set_nonblocking(int32_t fd);
+void accept_request(httpConnection_t* conn);
+void execute_cgi(httpConnection_t*, const char*, const char*);
+void serve_file(httpConnection_t*, const char*);
+void serve_asset(httpConnection_t*, asset_t*);
+void serve_metrics(httpConnection_t* conn);
+void upgrade_websocket(httpConnection_t* conn);
+int32_t handle_websocket(httpConnection_t* conn);
+void websocket_command(httpConnection_t* conn, char* command);
+void websocket_send(httpConnection_t* conn, wsOpcode_t opcode,
+                    const void* payload, size_t len);
+int32_t websocket_flush(httpConnection_t* conn);
+void websocket_status(httpConnection_t* conn);
+void broadcast_status(void);
+void error_die(const char*);
+
+/**
+ * Initialize the httpd server and run the event loop. A single epoll
+ * instance owns the listening socket and every client connection, and each
+ * connection is driven through connState_t as its socket becomes readable
+ * or writable. No threads are created per request.
+ *
+ * @param vp A pointer to the uint16_t port to use
+ */
+void* httpdMain(void* vp)
+{
+    int32_t server_sock = -1;
+    int32_t numEvents, i;
+    uint16_t port = *((uint16_t*)vp);
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct rlimit fdLimit;
+
+    /* Allow as many descriptors as the connection table can track */
+    if (0 == getrlimit(RLIMIT_NOFILE, &fdLimit))
+    {
+        fdLimit.rlim_cur = (fdLimit.rlim_max < MAX_CONNECTIONS) ?
+                           fdLimit.rlim_max : MAX_CONNECTIONS;
+        setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+
+    server_sock = startup(&port);
+    logMessage(LOG_LEVEL_INFO, "httpd running on port %d", port);
+
+    epollFd = epoll_create(MAX_EPOLL_EVENTS);
+    if (epollFd == -1)
+    {
+        error_die("epoll_create");
+    }
+
+    /* Tick once a second to close idle keep-alive connections */
+    idleTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (idleTimerFd != -1)
+    {
+        struct itimerspec tick;
+
+        memset(&tick, 0, sizeof(tick));
+        tick.it_interval.tv_sec = 1;
+        tick.it_value.tv_sec = 1;
+        timerfd_settime(idleTimerFd, 0, &tick, NULL);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = idleTimerFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, idleTimerFd, &ev) == -1)
+        {
+            error_die("epoll_ctl");
+        }
+    }
+
+    /* Load htdocs into memory and watch it for changes */
+    assetFd = assetCacheInit("htdocs");
+    if (assetFd != -1)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = assetFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, assetFd, &ev) == -1)
+        {
+            error_die("epoll_ctl");
+        }
+    }
+
+    /* Push Qik status changes out to WebSocket clients */
+    statusFd = eventfd(0, EFD_NONBLOCK);
+    if (statusFd != -1)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = statusFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, statusFd, &ev) == -1)
+        {
+            error_die("epoll_ctl");
+        }
+        setQikStatusFd(statusFd);
+    }
+
+    /* Watch the listening socket for new connections */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+    {
+        error_die("epoll_ctl");
+    }
+
+    /* Spin around forever, waiting for socket events */
+    while (1)
+    {
+        numEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+
+        if (numEvents == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_die("epoll_wait");
+        }
+
+        for (i = 0; i < numEvents; i++)
+        {
+            if (events[i].data.fd == server_sock)
+            {
+                accept_connections(server_sock);
+            }
+            else if (events[i].data.fd == assetFd)
+            {
+                assetCacheHandleEvents();
+            }
+            else if (events[i].data.fd == idleTimerFd)
+            {
+                reap_idle_connections();
+            }
+            else if (events[i].data.fd == statusFd)
+            {
+                broadcast_status();
+            }
+            else if (connections[events[i].data.fd] != NULL)
+            {
+                handle_connection(connections[events[i].data.fd],
+                                  events[i].events);
+            }
+        }
+    }
+
+    close(epollFd);
+    close(server_sock);
+
+    return (0);
+}
+
+/**
+ * Accept every pending connection on the listening socket, make each one
+ * non-blocking and register it with the event loop
+ *
+ * @param server_sock The listening socket
+ */
+void accept_connections(int32_t server_sock)
+{
+    int32_t client_sock;
+    struct sockaddr_in client_name;
+    socklen_t client_name_len;
+    struct epoll_event ev;
+    httpConnection_t* conn;
+
+    while (1)
+    {
+        client_name_len = sizeof(client_name);
+        client_sock = accept(server_sock, (struct sockaddr*) &client_name,
+                             &client_name_len);
+
+        if (client_sock == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+            }
+            return;
+        }
+
+        /* The connection table is indexed by fd, so it must fit */
+        if (client_sock >= MAX_CONNECTIONS || set_nonblocking(client_sock))
+        {
+            close(client_sock);
+            continue;
+        }
+
+        conn = calloc(1, sizeof(httpConnection_t));
+        if (conn == NULL)
+        {
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->receivedTime = traceTime();
+        conn->state = CONN_READING;
+        conn->epollEvents = EPOLLIN;
+        conn->fileFd = -1;
+        conn->wsDeviceId = -1;
+        httpParserInit(&conn->request);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = client_sock;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, client_sock, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            free(conn);
+            close(client_sock);
+            continue;
+        }
+
+        connections[client_sock] = conn;
+        touch_connection(conn);
+        metricAdd(METRIC_HTTP_ACCEPTED, 1);
+        metricAdd(METRIC_HTTP_ACTIVE, 1);
+    }
+}
+
+/**
+ * Advance a connection's state machine after epoll reported activity on it.
+ * Pipelined requests that are already buffered are handled back to back,
+ * each response is fully sent before the next request is looked at so
+ * responses always go out in order.
+ *
+ * @param conn   The connection with activity
+ * @param events The epoll event mask
+ */
+void handle_connection(httpConnection_t* conn, uint32_t events)
+{
+    if (events & EPOLLERR)
+    {
+        conn->state = CONN_CLOSING;
+    }
+
+    if ((conn->state == CONN_READING || conn->state == CONN_WEBSOCKET) &&
+            (events & (EPOLLIN | EPOLLHUP)))
+    {
+        if (read_request(conn))
+        {
+            conn->state = CONN_CLOSING;
+        }
+    }
+
+    touch_connection(conn);
+
+    while (conn->state != CONN_CLOSING)
+    {
+        if (conn->state == CONN_READING)
+        {
+            /* Parse whatever is new in the buffer */
+            switch (httpParse(&conn->request, conn->inBuf, conn->inLen,
+                              sizeof(conn->inBuf)))
+            {
+                case PARSE_DONE:
+                {
+                    /* Build the whole response, then start sending it */
+                    start_request(conn);
+                    accept_request(conn);
+                    metricCountRequest(conn->route, conn->status);
+                    conn->state = CONN_WRITING;
+                    break;
+                }
+                case PARSE_ERROR:
+                {
+                    /* Framing is lost, nothing after this can be trusted */
+                    conn->keepAlive = 0;
+                    reject_request(conn);
+                    metricCountRequest(conn->route, conn->status);
+                    conn->state = CONN_WRITING;
+                    break;
+                }
+                case PARSE_REQUEST_LINE:
+                case PARSE_HEADERS:
+                case PARSE_BODY:
+                {
+                    /* Wait for more bytes, unless none are coming */
+                    if (conn->peerClosed)
+                    {
+                        conn->state = CONN_CLOSING;
+                    }
+                    break;
+                }
+            }
+
+            if (conn->state == CONN_READING)
+            {
+                break;
+            }
+        }
+
+        if (conn->state == CONN_WRITING)
+        {
+            if (flush_connection(conn))
+            {
+                conn->state = CONN_CLOSING;
+            }
+            else if (conn->outSent < conn->outLen || conn->fileFd != -1 ||
+                     conn->bodySent < conn->bodyLen)
+            {
+                /* The socket is full, wait until it drains */
+                break;
+            }
+            else if (conn->upgrade)
+            {
+                /* The 101 is out, frames follow it on this connection */
+                finish_request(conn);
+                conn->state = CONN_WEBSOCKET;
+                websocket_status(conn);
+            }
+            else if (conn->keepAlive)
+            {
+                /* Move on to the next request on this connection */
+                finish_request(conn);
+                conn->state = CONN_READING;
+            }
+            else
+            {
+                conn->state = CONN_CLOSING;
+            }
+        }
+
+        if (conn->state == CONN_WEBSOCKET)
+        {
+            /* Handle every buffered frame, then wait for more */
+            if (handle_websocket(conn) || websocket_flush(conn))
+            {
+                conn->state = CONN_CLOSING;
+            }
+            break;
+        }
+    }
+
+    if (conn->state == CONN_CLOSING)
+    {
+        close_connection(conn);
+    }
+    else if (conn->state != CONN_WEBSOCKET)
+    {
+        watch_connection(conn, (conn->state == CONN_WRITING) ?
+                         EPOLLOUT : EPOLLIN);
+    }
+}
+
+/**
+ * A request has been parsed, decide if the connection stays open after it
+ *
+ * @param conn The connection
+ */
+void start_request(httpConnection_t* conn)
+{
+    const char* version = conn->request.version;
+    const char* connection = httpHeader(&conn->request, HDR_CONNECTION);
+
+    conn->http11 = (strcmp(version, "HTTP/1.1") == 0);
+
+    if (conn->http11)
+    {
+        /* Persistent unless the client opts out */
+        conn->keepAlive = !httpHasToken(connection, "close");
+    }
+    else
+    {
+        /* HTTP/1.0 clients have to ask */
+        conn->keepAlive = httpHasToken(connection, "keep-alive");
+    }
+
+    if (conn->peerClosed)
+    {
+        conn->keepAlive = 0;
+    }
+}
+
+/**
+ * A response has been sent. Drop the request from the buffer, keeping any
+ * pipelined bytes behind it, and get ready for the next one.
+ *
+ * @param conn The connection
+ */
+void finish_request(httpConnection_t* conn)
+{
+    size_t used = conn->request.requestLen;
+
+    memmove(conn->inBuf, conn->inBuf + used, conn->inLen - used);
+    conn->inLen -= used;
+    conn->receivedTime = (conn->inLen > 0) ? traceTime() : 0;
+    httpParserInit(&conn->request);
+
+    conn->outLen = 0;
+    conn->outSent = 0;
+    conn->body = NULL;
+    conn->bodyLen = 0;
+    conn->bodySent = 0;
+    conn->chunked = 0;
+    conn->http11 = 0;
+    conn->status = 0;
+    conn->route = METRIC_ROUTE_OTHER;
+}
+
+/**
+ * Change the events epoll reports for a connection, if they changed
+ *
+ * @param conn   The connection
+ * @param events EPOLLIN while reading, EPOLLOUT while writing
+ */
+void watch_connection(httpConnection_t* conn, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (conn->epollEvents != events)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = conn->fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->epollEvents = events;
+    }
+}
+
+/**
+ * Mark a connection as active by moving it to the end of the idle list
+ *
+ * @param conn The connection
+ */
+void touch_connection(httpConnection_t* conn)
+{
+    conn->lastActive = monotonic_seconds();
+
+    if (idleTail == conn)
+    {
+        return;
+    }
+
+    /* Unlink it, if it's linked */
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else if (idleHead == conn)
+    {
+        idleHead = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    /* And put it at the end */
+    conn->prev = idleTail;
+    conn->next = NULL;
+    if (idleTail != NULL)
+    {
+        idleTail->next = conn;
+    }
+    idleTail = conn;
+    if (idleHead == NULL)
+    {
+        idleHead = conn;
+    }
+}
+
+/**
+ * Close every connection that hasn't done anything in IDLE_TIMEOUT_SEC. The
+ * idle list is in order of activity, so only expired connections are looked
+ * at.
+ */
+void reap_idle_connections(void)
+{
+    uint64_t expirations;
+    time_t now = monotonic_seconds();
+    httpConnection_t* conn;
+
+    /* Acknowledge the tick */
+    if (read(idleTimerFd, &expirations, sizeof(expirations)) < 0)
+    {
+        return;
+    }
+
+    while (idleHead != NULL && now - idleHead->lastActive >= IDLE_TIMEOUT_SEC)
+    {
+        conn = idleHead;
+
+        /* WebSockets are long lived, ping a quiet one before giving up on
+         * it. The pong, or anything else, marks it active again.
+         */
+        if (conn->state == CONN_WEBSOCKET && !conn->wsPingSent)
+        {
+            conn->wsPingSent = 1;
+            touch_connection(conn);
+            websocket_send(conn, WS_PING, NULL, 0);
+            if (websocket_flush(conn))
+            {
+                close_connection(conn);
+            }
+        }
+        else
+        {
+            close_connection(conn);
+        }
+    }
+}
+
+/**
+ * @return Seconds on a clock that never jumps
+ */
+time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Read whatever the socket has into the connection's request buffer with a
+ * single bulk recv(). Level-triggered epoll reports the socket again if more
+ * is waiting.
+ *
+ * @param conn The connection to read from
+ * @return 0 if the connection is still good, 1 if it should be closed
+ */
+int32_t read_request(httpConnection_t* conn)
+{
+    ssize_t numRead;
+
+    /* A full buffer is reported by the parser */
+    if (conn->inLen == sizeof(conn->inBuf))
+    {
+        return 0;
+    }
+
+    do
+    {
+        numRead = recv(conn->fd, conn->inBuf + conn->inLen,
+                       sizeof(conn->inBuf) - conn->inLen, 0);
+    }
+    while (numRead == -1 && errno == EINTR);
+
+    if (numRead > 0)
+    {
+        if (conn->receivedTime == 0)
+        {
+            conn->receivedTime = traceTime();
+        }
+        conn->inLen += numRead;
+        return 0;
+    }
+    else if (numRead == 0)
+    {
+        /* The client is done sending, but may still want responses to
+         * what it already sent
+         */
+        conn->peerClosed = 1;
+        return 0;
+    }
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+}
+
+/**
+ * Answer a request the parser couldn't accept
+ *
+ * @param conn The connection with the bad request
+ */
+void reject_request(httpConnection_t* conn)
+{
+    logMessage(LOG_LEVEL_INFO, "Rejected a request (%d)",
+               conn->request.errorStatus);
+
+    switch (conn->request.errorStatus)
+    {
+        case 413:
+        {
+            payload_too_large(conn->fd);
+            break;
+        }
+        case 431:
+        {
+            headers_too_large(conn->fd);
+            break;
+        }
+        case 501:
+        {
+            unimplemented(conn->fd);
+            break;
+        }
+        default:
+        {
+            bad_request(conn->fd);
+            break;
+        }
+    }
+}
+
+/**
+ * Send as much of the pending response as the socket will take. The buffered
+ * headers and any cached body go out together in one sendmsg(), then the
+ * body of any file is handed to sendfile() so it never gets copied through
+ * user space.
+ *
+ * @param conn The connection to send on
+ * @return 0 if the connection is still good, 1 if it should be closed
+ */
+int32_t flush_connection(httpConnection_t* conn)
+{
+    ssize_t numSent;
+    size_t fromOut;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    while (conn->outSent < conn->outLen || conn->bodySent < conn->bodyLen)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+
+        if (conn->outSent < conn->outLen)
+        {
+            iov[msg.msg_iovlen].iov_base = conn->outBuf + conn->outSent;
+            iov[msg.msg_iovlen].iov_len = conn->outLen - conn->outSent;
+            msg.msg_iovlen++;
+        }
+        if (conn->bodySent < conn->bodyLen)
+        {
+            iov[msg.msg_iovlen].iov_base = (void*)(conn->body + conn->bodySent);
+            iov[msg.msg_iovlen].iov_len = conn->bodyLen - conn->bodySent;
+            msg.msg_iovlen++;
+        }
+
+        /* Hold back a partial packet if a file body follows the headers */
+        numSent = sendmsg(conn->fd, &msg,
+                          MSG_NOSIGNAL | ((conn->fileFd != -1) ? MSG_MORE : 0));
+
+        if (numSent >= 0)
+        {
+            fromOut = conn->outLen - conn->outSent;
+            if ((size_t) numSent < fromOut)
+            {
+                fromOut = numSent;
+            }
+            conn->outSent += fromOut;
+            conn->bodySent += numSent - fromOut;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+        }
+    }
+
+    while (conn->fileFd != -1 && conn->fileOffset < conn->fileSize)
+    {
+        numSent = sendfile(conn->fd, conn->fileFd, &conn->fileOffset,
+                           conn->fileSize - conn->fileOffset);
+
+        if (numSent > 0)
+        {
+            continue;
+        }
+        else if (numSent == 0)
+        {
+            /* The file shrank underneath us, the response can't be saved */
+            return 1;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+        }
+    }
+
+    /* The whole file went out */
+    if (conn->fileFd != -1)
+    {
+        close(conn->fileFd);
+        conn->fileFd = -1;
+    }
+
+    /* And so did the cached body */
+    if (conn->asset != NULL)
+    {
+        assetRelease(conn->asset);
+        conn->asset = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Remove a connection from the event loop and free it
+ *
+ * @param conn The connection to close
+ */
+void close_connection(httpConnection_t* conn)
+{
+    char discard[512];
+    char stop[sizeof(conn->wsDirection) + 8];
+
+    /* A WebSocket that drops mid-drive mustn't leave the motors running */
+    if (conn->wsDirection[0] != '\0')
+    {
+        sprintf(stop, "%s_STOP", conn->wsDirection);
+        processMotorControl(stop, 0);
+    }
+
+    /* Drop anything unread so close() doesn't reset the connection before
+     * the client has read the response
+     */
+    while (recv(conn->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+    {
+        ;
+    }
+    shutdown(conn->fd, SHUT_WR);
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    connections[conn->fd] = NULL;
+    metricAdd(METRIC_HTTP_ACTIVE, -1);
+
+    /* Take it out of the idle list */
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        idleHead = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    else
+    {
+        idleTail = conn->prev;
+    }
+    if (conn->fileFd != -1)
+    {
+        close(conn->fileFd);
+    }
+    if (conn->asset != NULL)
+    {
+        assetRelease(conn->asset);
+    }
+    free(conn->outBuf);
+    free(conn);
+}
+
+/**
+ * Put a descriptor into non-blocking mode
+ *
+ * @param fd The descriptor
+ * @return 0 for success, -1 for an error
+ */
+int32_t set_nonblocking(int32_t fd)
+{
+    int32_t flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue bytes of a response for a client. Nothing is written to the socket
+ * here, the event loop flushes the response when the socket is writable.
+ *
+ * @param client The client socket
+ * @param buf    The bytes to send
+ * @param len    The number of bytes to send
+ */
+void http_send(int32_t client, const void* buf, size_t len)
+{
+    httpConnection_t* conn;
+    char* newBuf;
+    size_t newCap;
+
+    conn = find_connection(client);
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    /* Grow the response buffer if it's too small */
+    if (conn->outLen + len > conn->outCap)
+    {
+        newCap = (conn->outCap == 0) ? 1024 : conn->outCap;
+        while (newCap < conn->outLen + len)
+        {
+            newCap *= 2;
+        }
+
+        newBuf = realloc(conn->outBuf, newCap);
+        if (newBuf == NULL)
+        {
+            return;
+        }
+        conn->outBuf = newBuf;
+        conn->outCap = newCap;
+    }
+
+    memcpy(conn->outBuf + conn->outLen, buf, len);
+    conn->outLen += len;
+}
+
+/**
+ * Start a response with its status line
+ *
+ * @param client The client socket
+ * @param status The status code and reason, e.g. "200 OK"
+ */
+void http_status(int32_t client, const char* status)
+{
+    httpConnection_t* conn = find_connection(client);
+    char buf[128];
+
+    /* Remember the code, the request is counted by it */
+    if (conn != NULL)
+    {
+        conn->status = (uint16_t) atoi(status);
+    }
+
+    sprintf(buf, "HTTP/1.1 %.64s\r\n" SERVER_STRING, status);
+    http_send(client, buf, strlen(buf));
+}
+
+/**
+ * Finish a response's headers. Every response carries its length, or says
+ * it has no body, so the connection can be reused for the next request.
+ *
+ * @param client        The client socket
+ * @param contentLength The length of the body, or -1 for a response that
+ *                      never has one, like a 304
+ */
+void http_end_headers(int32_t client, long contentLength)
+{
+    char buf[128];
+
+    buf[0] = '\0';
+    if (contentLength >= 0)
+    {
+        sprintf(buf, "Content-Length: %ld\r\n", contentLength);
+    }
+    http_send(client, buf, strlen(buf));
+    http_connection_header(client);
+    http_send(client, "\r\n", 2);
+}
+
+/**
+ * Finish a response's headers for a body whose length isn't known up front.
+ * HTTP/1.1 clients get it chunked, anyone else gets it ended by a close.
+ * Send the body with http_send_chunk() and end it with http_end_chunks().
+ *
+ * @param client The client socket
+ */
+void http_end_headers_chunked(int32_t client)
+{
+    httpConnection_t* conn = find_connection(client);
+    const char* encoding = "Transfer-Encoding: chunked\r\n";
+
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    if (conn->http11)
+    {
+        conn->chunked = 1;
+        http_send(client, encoding, strlen(encoding));
+    }
+    else
+    {
+        conn->keepAlive = 0;
+    }
+    http_connection_header(client);
+    http_send(client, "\r\n", 2);
+}
 
-int32_t startup(uint16_t*);
-void* accept_request(void* clientPtr);
-void execute_cgi(int32_t, const char*, const char*, const char*);
-void serve_file(int32_t, const char*);
-int32_t get_line(int32_t, char*, int32_t);
-void error_die(const char*);
+/**
+ * Send part of a body started with http_end_headers_chunked()
+ *
+ * @param client The client socket
+ * @param buf    The bytes to send
+ * @param len    The number of bytes, 0 is ignored
+ */
+void http_send_chunk(int32_t client, const void* buf, size_t len)
+{
+    httpConnection_t* conn = find_connection(client);
+    char size[24];
+
+    if (conn == NULL || len == 0)
+    {
+        return;
+    }
+
+    if (conn->chunked)
+    {
+        sprintf(size, "%lx\r\n", (unsigned long) len);
+        http_send(client, size, strlen(size));
+        http_send(client, buf, len);
+        http_send(client, "\r\n", 2);
+    }
+    else
+    {
+        http_send(client, buf, len);
+    }
+}
 
 /**
- * Initialize the httpd server and spin around waiting for incoming
- * connections. If there is a connection, create a thread to handle
- * it, and keep listening for connections
+ * End a body started with http_end_headers_chunked()
  *
- * @param vp A pointer to the uint16_t port to use
+ * @param client The client socket
  */
-void* httpdMain(void* vp)
+void http_end_chunks(int32_t client)
 {
-    int32_t server_sock = -1;
-    int32_t client_sock = -1;
-    uint16_t port = *((uint16_t*)vp);
+    httpConnection_t* conn = find_connection(client);
 
-    struct sockaddr_in client_name;
-    uint32_t client_name_len = sizeof(client_name);
+    if (conn != NULL && conn->chunked)
+    {
+        http_send(client, "0\r\n\r\n", 5);
+    }
+}
+
+/**
+ * Send a Connection header if the client needs to be told whether the
+ * connection stays open
+ *
+ * @param client The client socket
+ */
+void http_connection_header(int32_t client)
+{
+    httpConnection_t* conn = find_connection(client);
+    const char* header = NULL;
 
-    pthread_t accept_request_thread;
+    if (conn == NULL)
+    {
+        return;
+    }
 
-    server_sock = startup(&port);
-    printf("httpd running on port %d\n", port);
+    if (!conn->keepAlive)
+    {
+        header = "Connection: close\r\n";
+    }
+    else if (!conn->http11)
+    {
+        header = "Connection: keep-alive\r\n";
+    }
 
-    /* Spin around forever, waiting for incoming requests */
-    while (1)
+    if (header != NULL)
     {
-        /* wait for a request, this is blocking */
-        client_sock = accept(server_sock, (struct sockaddr*) &client_name, &client_name_len);
+        http_send(client, header, strlen(header));
+    }
+}
 
-        if (client_sock == -1)
+/**
+ * Look up a client's connection
+ *
+ * @param client The client socket
+ * @return The connection, or NULL if the socket isn't a client
+ */
+httpConnection_t* find_connection(int32_t client)
+{
+    if (client < 0 || client >= MAX_CONNECTIONS)
+    {
+        return NULL;
+    }
+    return connections[client];
+}
+
+/**
+ * Answer a request for the motor WebSocket. A valid handshake gets a 101,
+ * and the connection switches to frames once it has been sent.
+ *
+ * @param conn The connection asking to upgrade
+ */
+void upgrade_websocket(httpConnection_t* conn)
+{
+    const char* key = httpHeader(&conn->request, HDR_SEC_WEBSOCKET_KEY);
+    const char* version = httpHeader(&conn->request, HDR_SEC_WEBSOCKET_VERSION);
+    char accept[WS_ACCEPT_KEY_LEN + 1];
+    char buf[128];
+
+    if (strcasecmp(conn->request.method, "GET") || !conn->http11 ||
+            !httpHasToken(httpHeader(&conn->request, HDR_UPGRADE), "websocket") ||
+            !httpHasToken(httpHeader(&conn->request, HDR_CONNECTION), "upgrade") ||
+            key == NULL || version == NULL || strcmp(version, "13"))
+    {
+        bad_request(conn->fd);
+        return;
+    }
+
+    wsAcceptKey(key, accept);
+
+    http_status(conn->fd, "101 Switching Protocols");
+    sprintf(buf, "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    http_send(conn->fd, buf, strlen(buf));
+
+    conn->upgrade = 1;
+    conn->keepAlive = 1;
+}
+
+/**
+ * Handle every complete frame in a WebSocket's receive buffer. Replies are
+ * queued, not sent.
+ *
+ * @param conn The WebSocket connection
+ * @return 0 if the connection is still good, 1 if it should be closed
+ */
+int32_t handle_websocket(httpConnection_t* conn)
+{
+    wsFrame_t frame;
+    size_t used = 0;
+    char command[WS_MAX_COMMAND + 1];
+    int32_t closing = 0;
+
+    while (!closing)
+    {
+        switch (wsParseFrame((uint8_t*) conn->inBuf + used, conn->inLen - used,
+                             &frame))
         {
-            error_die("accept");
+            case WS_FRAME_INCOMPLETE:
+            {
+                /* A frame that can never fit is as good as an error */
+                if (used == 0 && conn->inLen == sizeof(conn->inBuf))
+                {
+                    return 1;
+                }
+                closing = conn->peerClosed;
+                memmove(conn->inBuf, conn->inBuf + used, conn->inLen - used);
+                conn->inLen -= used;
+                if (conn->inLen == 0)
+                {
+                    conn->receivedTime = 0;
+                }
+                return closing;
+            }
+            case WS_FRAME_ERROR:
+            {
+                return 1;
+            }
+            case WS_FRAME_OK:
+            {
+                break;
+            }
         }
 
-        /* Accept the request, create a thread to handle it, go back to waiting
-         * TODO is it kosher to reuse the thread handle?
-         */
-        if (pthread_create(&accept_request_thread, NULL, accept_request, (void*) (&client_sock)) != 0)
+        used += frame.frameLen;
+        conn->wsPingSent = 0;
+
+        switch (frame.opcode)
         {
-            perror("pthread_create");
+            case WS_TEXT:
+            {
+                /* Commands are short and always sent in a single frame */
+                if (frame.fin && frame.payloadLen <= WS_MAX_COMMAND)
+                {
+                    memcpy(command, frame.payload, frame.payloadLen);
+                    command[frame.payloadLen] = '\0';
+                    websocket_command(conn, command);
+                }
+                break;
+            }
+            case WS_PING:
+            {
+                websocket_send(conn, WS_PONG, frame.payload, frame.payloadLen);
+                break;
+            }
+            case WS_CLOSE:
+            {
+                /* Echo the status code back and hang up */
+                websocket_send(conn, WS_CLOSE, frame.payload,
+                               (frame.payloadLen >= 2) ? 2 : 0);
+                closing = 1;
+                break;
+            }
+            default:
+            {
+                /* Pongs, and binary or continuation frames, are ignored */
+                break;
+            }
         }
     }
 
-    close(server_sock);
+    /* Get the close frame out before the connection goes away */
+    websocket_flush(conn);
+    return 1;
+}
 
-    return (0);
+/**
+ * Act on a text command from the motor WebSocket. These are the same
+ * "DIR_START" and "DIR_STOP" commands motor_control.c takes, plus
+ * "HEARTBEAT" to keep running motors going.
+ *
+ * @param conn    The WebSocket connection
+ * @param command The null terminated command
+ */
+void websocket_command(httpConnection_t* conn, char* command)
+{
+    char* underscore;
+
+    if (strcmp(command, "HEARTBEAT") == 0)
+    {
+        if (conn->wsDeviceId >= 0)
+        {
+            motorHeartbeat((uint8_t) conn->wsDeviceId);
+        }
+        return;
+    }
+
+    /* Remember which way this client is driving, so it can be stopped if the
+     * connection drops
+     */
+    underscore = strchr(command, '_');
+    if (underscore != NULL &&
+            (size_t)(underscore - command) < sizeof(conn->wsDirection))
+    {
+        if (strcmp(underscore, "_START") == 0)
+        {
+            memcpy(conn->wsDirection, command, underscore - command);
+            conn->wsDirection[underscore - command] = '\0';
+            conn->wsDeviceId = motorControlDevice(command);
+        }
+        else if (strcmp(underscore, "_STOP") == 0)
+        {
+            conn->wsDirection[0] = '\0';
+            conn->wsDeviceId = -1;
+        }
+    }
+
+    processMotorControl(command, traceBegin(conn->receivedTime));
+}
+
+/**
+ * Queue a single unfragmented frame on a WebSocket
+ *
+ * @param conn    The WebSocket connection
+ * @param opcode  The frame's opcode
+ * @param payload The payload, may be NULL if len is 0
+ * @param len     The length of the payload
+ */
+void websocket_send(httpConnection_t* conn, wsOpcode_t opcode,
+                    const void* payload, size_t len)
+{
+    uint8_t header[WS_MAX_HEADER_LEN];
+
+    http_send(conn->fd, header, wsFrameHeader(header, opcode, len));
+    if (len > 0)
+    {
+        http_send(conn->fd, payload, len);
+    }
+}
+
+/**
+ * Send whatever frames are queued on a WebSocket and wait for the socket to
+ * drain if they don't all fit
+ *
+ * @param conn The WebSocket connection
+ * @return 0 if the connection is still good, 1 if it should be closed
+ */
+int32_t websocket_flush(httpConnection_t* conn)
+{
+    if (flush_connection(conn))
+    {
+        return 1;
+    }
+
+    if (conn->outSent < conn->outLen)
+    {
+        watch_connection(conn, EPOLLIN | EPOLLOUT);
+    }
+    else
+    {
+        /* Everything went out, reuse the buffer from the start */
+        conn->outLen = 0;
+        conn->outSent = 0;
+        watch_connection(conn, EPOLLIN);
+    }
+    return 0;
+}
+
+/**
+ * Queue the status of each Qik on the bus on a WebSocket, one JSON text
+ * frame per device
+ *
+ * @param conn The WebSocket connection
+ */
+void websocket_status(httpConnection_t* conn)
+{
+    qikStatus_t status;
+    qikWatchdogStats_t stats;
+    uint8_t deviceIds[QIK_MAX_BUS_DEVICES];
+    uint8_t numDevices;
+    uint8_t i;
+    char json[256];
+    char firmware[2];
+
+    numDevices = getQikDevices(deviceIds);
+    getQikWatchdogStats(&stats);
+
+    for (i = 0; i < numDevices; i++)
+    {
+        getQikStatus(deviceIds[i], &status);
+
+        firmware[0] = (char) status.firmwareVersion;
+        firmware[1] = '\0';
+        sprintf(json, "{\"id\":%u,\"version\":%lu,\"firmware\":\"%s\","
+                "\"error\":%u,\"config\":[%u,%u,%u,%u],\"verified\":%u,"
+                "\"heartbeatMs\":%lu,\"watchdogTrips\":%lu}",
+                deviceIds[i], (unsigned long) status.version,
+                (status.firmwareVersion >= '0' &&
+                 status.firmwareVersion <= '9') ? firmware : "",
+                status.errorByte, status.config[0], status.config[1],
+                status.config[2], status.config[3], status.verified,
+                (unsigned long) stats.heartbeatUsec / 1000,
+                (unsigned long) stats.watchdogTrips);
+
+        websocket_send(conn, WS_TEXT, json, strlen(json));
+    }
+}
+
+/**
+ * A Qik's status changed, push them all to every WebSocket client
+ */
+void broadcast_status(void)
+{
+    uint64_t changes;
+    httpConnection_t* conn;
+    httpConnection_t* next;
+
+    /* Acknowledge the change, however many there were */
+    if (read(statusFd, &changes, sizeof(changes)) < 0)
+    {
+        return;
+    }
+
+    for (conn = idleHead; conn != NULL; conn = next)
+    {
+        next = conn->next;
+        if (conn->state == CONN_WEBSOCKET)
+        {
+            websocket_status(conn);
+            if (websocket_flush(conn))
+            {
+                close_connection(conn);
+            }
+        }
+    }
 }
 
 /**********************************************************************/
@@ -110,7 +1408,7 @@ int32_t startup(uint16_t* port)
      */
     while (bind(httpdSocket, (struct sockaddr*) &name, sizeof(name)) < 0)
     {
-        printf("error binding\n");
+        logMessage(LOG_LEVEL_WARN, "error binding");
         sleep(1);
     }
 
@@ -118,7 +1416,7 @@ int32_t startup(uint16_t* port)
     if (*port == 0)
     {
         /* Get the port the system assigned */
-        uint32_t namelen = sizeof(name);
+        socklen_t namelen = sizeof(name);
         if (getsockname(httpdSocket, (struct sockaddr*) &name, &namelen) == -1)
         {
             error_die("getsockname");
@@ -129,71 +1427,71 @@ int32_t startup(uint16_t* port)
     }
 
     /* Enable the socket socket to accept connections */
-    if (listen(httpdSocket, 5) < 0)
+    if (listen(httpdSocket, SOMAXCONN) < 0)
     {
         error_die("listen");
     }
 
+    /* The event loop must never block in accept() */
+    if (set_nonblocking(httpdSocket))
+    {
+        error_die("fcntl");
+    }
+
     /* Return the socket */
     return (httpdSocket);
 }
 
 /**********************************************************************/
-/* A request has caused a call to accept() on the server port to
- * return.  Process the request appropriately.
- * Parameters: the socket connected to the client */
+/* A complete request has been buffered for a connection.  Process the
+ * request appropriately and queue up the response.
+ * Parameters: the connection to the client */
 /**********************************************************************/
-void* accept_request(void* clientPtr)
+void accept_request(httpConnection_t* conn)
 {
-    char buf[1024];
-    int32_t numchars;
-    char method[255];
+    const char* method = conn->request.method;
     char url[255];
     char path[512];
-    size_t i, j;
     struct stat st;
     int32_t cgi = 0; /* becomes true if server decides this is a CGI program */
     char* query_string = NULL;
-    int32_t client = *((int32_t*) clientPtr);
-
-    /* Get a line from the client */
-    numchars = get_line(client, buf, sizeof(buf));
-    i = 0;
-    j = 0;
+    int32_t client = conn->fd;
+    asset_t* asset;
 
-    /* Copy the first part, up until whitespace, into method[] */
-    while (!isspace(buf[j]) && (i < sizeof(method) - 1))
-    {
-        method[i] = buf[j];
-        i++;
-        j++;
-    }
-    method[i] = '\0';
+    memset(&st, 0, sizeof(st));
 
-    printf("Accepted a %s\n", method);
+    logMessage(LOG_LEVEL_DEBUG, "Accepted a %s", method);
 
     /* If this isn't a GET or POST, it's not supported, so return */
     if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
     {
         unimplemented(client);
-        return 0;
+        return;
+    }
+
+    /* Copy the requested URL, it gets split up below */
+    if (strlen(conn->request.url) >= sizeof(url))
+    {
+        bad_request(client);
+        return;
     }
+    strcpy(url, conn->request.url);
 
-    /* Skip over whitespace */
-    while (isspace(buf[j]) && (j < sizeof(buf)))
+    /* The motor control WebSocket */
+    if (strcmp(url, WS_MOTOR_PATH) == 0)
     {
-        j++;
+        conn->route = METRIC_ROUTE_WEBSOCKET;
+        upgrade_websocket(conn);
+        return;
     }
 
-    /* Read the requested URL out of the buffer */
-    i = 0;
-    while (!isspace(buf[j]) && (i < sizeof(url) - 1) && (j < sizeof(buf)))
+    /* The Prometheus scrape */
+    if (strcmp(url, METRICS_PATH) == 0 && strcasecmp(method, "GET") == 0)
     {
-        url[i] = buf[j];
-        i++;
-        j++;
+        conn->route = METRIC_ROUTE_METRICS;
+        serve_metrics(conn);
+        return;
     }
-    url[i] = '\0';
 
     if (strcasecmp(method, "POST") == 0)
     {
@@ -229,17 +1527,26 @@ void* accept_request(void* clientPtr)
         strcat(path, "index.html");
     }
 
+    /* Nothing outside htdocs is served */
+    if (assetPathEscapes(path))
+    {
+        not_found(client);
+        return;
+    }
+
+    /* Serve plain files out of memory when they're cached */
+    if (!cgi && (asset = assetCacheLookup(path)) != NULL)
+    {
+        conn->route = METRIC_ROUTE_FILE;
+        serve_asset(conn, asset);
+        return;
+    }
+
     /* If the path does not end in .c, and the file doesn't exist */
     if (!(path[strlen(path) - 2] == '.' && path[strlen(path) - 1] == 'c') &&
             stat(path, &st) == -1)
     {
-        /* read & discard headers */
-        while ((numchars > 0) && strcmp("\n", buf))
-        {
-            numchars = get_line(client, buf, sizeof(buf));
-        }
-
-        /* Then 404 the client */
+        /* 404 the client */
         not_found(client);
     }
     else
@@ -254,20 +1561,24 @@ void* accept_request(void* clientPtr)
             cgi = 1;
         }
 
+        /* Paths ending in .c are C code, whether there's a query or not */
+        if (path[strlen(path) - 2] == '.' && path[strlen(path) - 1] == 'c')
+        {
+            cgi = 1;
+        }
+
         if (!cgi)
         {
             /* If this isn't Common Gateway Interface, serve the file to the client */
-            serve_file(client, path);
+            conn->route = METRIC_ROUTE_FILE;
+            serve_file(conn, path);
         }
         else
         {
             /* Otherwise, execute the CGI script */
-            execute_cgi(client, path, method, query_string);
+            execute_cgi(conn, path, query_string);
         }
     }
-
-    close(client);
-    return 0;
 }
 
 /**********************************************************************/
@@ -276,199 +1587,193 @@ void* accept_request(void* clientPtr)
  * Parameters: client socket descriptor
  *             path to the CGI script */
 /**********************************************************************/
-void execute_cgi(int32_t client, const char* path, const char* method,
+void execute_cgi(httpConnection_t* conn, const char* path,
         const char* query_string)
 {
-    char buf[1024];
-    int32_t i;
-    int32_t numchars = 1;
-    int32_t content_length = -1;
-    char postContent[1024];
+    char buf[4096];
+    const char* method = conn->request.method;
+    int32_t client = conn->fd;
+    char postContent[HTTP_MAX_BODY + 1];
+    size_t statsLen;
+    uint32_t cursor = 0;
 
-    buf[0] = 'A';
-    buf[1] = '\0';
+    memset(postContent, 0, sizeof(postContent));
 
-    if (strcasecmp(method, "GET") == 0)
-    {
-        /* read & discard headers */
-        while ((numchars > 0) && strcmp("\n", buf))
-        {
-            numchars = get_line(client, buf, sizeof(buf));
-        }
-    }
-    else if (strcasecmp(method, "POST") == 0)
+    /* The parser already bounded the body, but it has to be given */
+    if (strcasecmp(method, "POST") == 0 && conn->request.contentLength == -1)
     {
-        numchars = get_line(client, buf, sizeof(buf));
-
-        while ((numchars > 0) && strcmp("\n", buf))
-        {
-            buf[15] = '\0';
-
-            if (strcasecmp(buf, "Content-Length:") == 0)
-            {
-                content_length = atoi(&(buf[16]));
-            }
-
-            numchars = get_line(client, buf, sizeof(buf));
-        }
-
-        if (content_length == -1)
-        {
-            bad_request(client);
-            return;
-        }
+        bad_request(client);
+        return;
     }
 
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-
     if (path[strlen(path) - 2] == '.' && path[strlen(path) - 1] == 'c')
     {
         /* If the path ends in .c, don't process it as a script
          * Instead run some C code!
          */
+        http_status(client, "200 OK");
+        sprintf(buf, "Content-Type: text/plain\r\n");
+        http_send(client, buf, strlen(buf));
+
+        /* What the C code will send isn't known until it runs */
+        http_end_headers_chunked(client);
 
         if (strcasecmp(method, "GET") == 0)
         {
-            printf("C GET: %s\n", query_string);
+            logMessage(LOG_LEVEL_DEBUG, "C GET: %s", query_string);
         }
         else if (strcasecmp(method, "POST") == 0)
         {
-            /* Get the post content */
-            memset(postContent, 0, sizeof(postContent));
-            for (i = 0; i < content_length; i++)
-            {
-                recv(client, &postContent[i], 1, 0);
-            }
+            /* Get the post content, it was parsed with the request */
+            memcpy(postContent, conn->request.body, conn->request.bodyLen);
         }
 
         if (0 == strcasecmp(path, "htdocs/motor_control.c"))
         {
-            processMotorControl(postContent);
+            conn->route = METRIC_ROUTE_MOTOR_CONTROL;
+            processMotorControl(postContent, traceBegin(conn->receivedTime));
         }
-    }
-    else
-    {
-        /* If the path doesn't end in .c, process it as a script */
-        char meth_env[255];
-        char query_env[255];
-        char length_env[255];
-
-        sprintf(meth_env, "REQUEST_METHOD=%s", method);
-        putenv(meth_env);
-
-        if (strcasecmp(method, "GET") == 0)
+        else if (0 == strcasecmp(path, "htdocs/rt_stats.c"))
         {
-            sprintf(query_env, "QUERY_STRING=%s", query_string);
-            putenv(query_env);
+            /* How the threads are scheduled, and how well it's working */
+            conn->route = METRIC_ROUTE_RT_STATS;
+            statsLen = formatRealTimeStats(buf, sizeof(buf));
+            http_send_chunk(client, buf, (statsLen < sizeof(buf)) ?
+                            statsLen : sizeof(buf) - 1);
         }
-        else if (strcasecmp(method, "POST") == 0)
+        else if (0 == strcasecmp(path, "htdocs/trace_stats.c"))
         {
-            sprintf(length_env, "CONTENT_LENGTH=%d", content_length);
-            putenv(length_env);
+            /* Where the time went between a motor command arriving and its
+             * setpoint reaching the UART
+             */
+            conn->route = METRIC_ROUTE_TRACE;
+            statsLen = formatTraceStats(buf, sizeof(buf));
+            http_send_chunk(client, buf, (statsLen < sizeof(buf)) ?
+                            statsLen : sizeof(buf) - 1);
+        }
+        else if (0 == strcasecmp(path, "htdocs/trace.c"))
+        {
+            /* The same spans for chrome://tracing, a piece at a time */
+            conn->route = METRIC_ROUTE_TRACE;
+            while ((statsLen = formatChromeTrace(buf, sizeof(buf),
+                                                 &cursor)) > 0)
+            {
+                http_send_chunk(client, buf, statsLen);
+            }
         }
 
-        execl(path, path, NULL);
-        exit(0);
+        http_end_chunks(client);
+    }
+    else
+    {
+        /* Scripts used to be exec'd here, which replaced the whole daemon.
+         * Forking a child would stall the event loop, so refuse instead
+         */
+        (void) query_string;
+        cannot_execute(client);
     }
 }
 
 /**********************************************************************/
 /* Send a regular file to the client.  Use headers, and report
- * errors to client if they occur.
- * Parameters: a pointer to a file structure produced from the socket
- *              file descriptor
+ * errors to client if they occur.  Only the headers are buffered, the
+ * file itself is sent with sendfile() as the socket drains.
+ * Parameters: the connection to the client
  *             the name of the file to serve */
 /**********************************************************************/
-void serve_file(int32_t client, const char* filename)
+void serve_file(httpConnection_t* conn, const char* filename)
 {
-    FILE* resource = NULL;
-    int32_t numchars = 1;
-    char buf[1024];
-
-    buf[0] = 'A';
-    buf[1] = '\0';
-
-    printf("Serve file %s to %d\n", filename, client);
+    int32_t client = conn->fd;
+    int32_t resource;
+    struct stat st;
 
-    while ((numchars > 0) && strcmp("\n", buf))   /* read & discard headers */
-    {
-        numchars = get_line(client, buf, sizeof(buf));
-    }
+    logMessage(LOG_LEVEL_DEBUG, "Serve file %s to %d", filename, client);
 
-    resource = fopen(filename, "r");
+    resource = open(filename, O_RDONLY);
 
-    if (resource == NULL)
+    if (resource == -1 || fstat(resource, &st) == -1 || !S_ISREG(st.st_mode))
     {
+        if (resource != -1)
+        {
+            close(resource);
+        }
         not_found(client);
     }
     else
     {
-        headers(client, filename);
-
-        fgets(buf, sizeof(buf), resource);
+        headers(client, filename, st.st_size);
 
-        while (!feof(resource))
-        {
-            send(client, buf, strlen(buf), 0);
-            fgets(buf, sizeof(buf), resource);
-        }
+        conn->fileFd = resource;
+        conn->fileOffset = 0;
+        conn->fileSize = st.st_size;
     }
-
-    fclose(resource);
 }
 
 /**********************************************************************/
-/* Get a line from a socket, whether the line ends in a newline,
- * carriage return, or a CRLF combination.  Terminates the string read
- * with a null character.  If no newline indicator is found before the
- * end of the buffer, the string is terminated with a null.  If any of
- * the above three line terminators is read, the last character of the
- * string will be a linefeed and the string will be terminated with a
- * null character.
- * Parameters: the socket descriptor
- *             the buffer to save the data in
- *             the size of the buffer
- * Returns: the number of bytes stored (excluding null) */
+/* Send a file out of the asset cache.  The gzip variant goes to
+ * clients that accept it, and clients that already have the file get a
+ * 304 instead.
+ * Parameters: the connection to the client
+ *             the cached file, released when the response is done */
 /**********************************************************************/
-int32_t get_line(int32_t sock, char* buf, int32_t size)
+void serve_asset(httpConnection_t* conn, asset_t* asset)
 {
-    int32_t i = 0;
-    char c = '\0';
-    int32_t n;
-
-    while ((i < size - 1) && (c != '\n'))
+    const char* ifNoneMatch = httpHeader(&conn->request, HDR_IF_NONE_MATCH);
+    int32_t gzip = (asset->gzData != NULL) &&
+                   httpAcceptsEncoding(&conn->request, "gzip");
+
+    if (ifNoneMatch != NULL &&
+            (strstr(ifNoneMatch, asset->etag) != NULL ||
+             strstr(ifNoneMatch, asset->gzEtag) != NULL ||
+             strcmp(ifNoneMatch, "*") == 0))
     {
-        n = recv(sock, &c, 1, 0);
+        not_modified(conn->fd, gzip ? asset->gzEtag : asset->etag);
+        assetRelease(asset);
+        return;
+    }
 
-        if (n > 0)
-        {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
+    http_status(conn->fd, "200 OK");
+    if (gzip)
+    {
+        http_send(conn->fd, asset->gzHeader, asset->gzHeaderLen);
+        conn->body = asset->gzData;
+        conn->bodyLen = asset->gzSize;
+    }
+    else
+    {
+        http_send(conn->fd, asset->header, asset->headerLen);
+        conn->body = asset->data;
+        conn->bodyLen = asset->size;
+    }
+    http_connection_header(conn->fd);
+    http_send(conn->fd, "\r\n", 2);
 
-                if ((n > 0) && (c == '\n'))
-                {
-                    recv(sock, &c, 1, 0);
-                }
-                else
-                {
-                    c = '\n';
-                }
-            }
+    conn->bodySent = 0;
+    conn->asset = asset;
+}
 
-            buf[i] = c;
-            i++;
-        }
-        else
-        {
-            c = '\n';
-        }
-    }
+/**********************************************************************/
+/* Send every metric in the Prometheus text format.  It's formatted a
+ * family at a time straight into chunks, only this thread scrapes.
+ * Parameters: the connection to the client */
+/**********************************************************************/
+void serve_metrics(httpConnection_t* conn)
+{
+    char buf[4096];
+    const char* type = "Content-Type: text/plain; version=0.0.4\r\n";
+    uint32_t cursor = 0;
+    size_t len;
 
-    buf[i] = '\0';
+    http_status(conn->fd, "200 OK");
+    http_send(conn->fd, type, strlen(type));
+    http_end_headers_chunked(conn->fd);
 
-    return (i);
+    while ((len = formatMetrics(buf, sizeof(buf), &cursor)) > 0)
+    {
+        http_send_chunk(conn->fd, buf, (len < sizeof(buf)) ?
+                        len : sizeof(buf) - 1);
+    }
+    http_end_chunks(conn->fd);
 }
 
 /**********************************************************************/
@@ -1,6 +1,15 @@
 #ifndef _HTTPD_H_
 #define _HTTPD_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 void* httpdMain(void*);
+void http_send(int32_t client, const void* buf, size_t len);
+void http_status(int32_t client, const char* status);
+void http_end_headers(int32_t client, long contentLength);
+void http_end_headers_chunked(int32_t client);
+void http_send_chunk(int32_t client, const void* buf, size_t len);
+void http_end_chunks(int32_t client);
 
 #endif /* _HTTPD_H_ */
@@ -0,0 +1,421 @@
+/*
+ * httpparser.c
+ *
+ *  Incremental HTTP request parser. httpParse() is called every time more
+ *  bytes land in a connection's receive buffer and picks up scanning where
+ *  it left off. Lines are null terminated in place, so the request line and
+ *  headers can be used as C strings straight out of the buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "httpparser.h"
+
+/* Header names, in the same order as httpHeaderId_t */
+const char* knownHeaderNames[NUM_KNOWN_HEADERS] =
+{
+    "Content-Length",
+    "Content-Type",
+    "Connection",
+    "Upgrade",
+    "Host",
+    "Transfer-Encoding",
+    "Accept-Encoding",
+    "If-None-Match",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Version"
+};
+
+/* Internal function prototypes */
+int32_t parseRequestLine(httpRequest_t* req, char* line);
+int32_t parseHeaderLine(httpRequest_t* req, char* line);
+int32_t finishHeaders(httpRequest_t* req);
+char* nextToken(char** cursor);
+
+/**
+ * Reset a request so a new one can be parsed
+ *
+ * @param req The request to reset
+ */
+void httpParserInit(httpRequest_t* req)
+{
+    uint32_t i;
+
+    memset(req, 0, sizeof(httpRequest_t));
+    req->state = PARSE_REQUEST_LINE;
+    req->contentLength = -1;
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++)
+    {
+        req->known[i] = -1;
+    }
+}
+
+/**
+ * Continue parsing a request. Only bytes that haven't been seen before are
+ * scanned. The buffer is modified in place.
+ *
+ * @param req     The request being parsed
+ * @param buf     The receive buffer, starting at the request
+ * @param len     The number of valid bytes in buf
+ * @param bufSize The capacity of buf, a request that can't fit is an error
+ * @return The parser's state, PARSE_DONE when a full request is ready
+ */
+httpParseState_t httpParse(httpRequest_t* req, char* buf, size_t len,
+                           size_t bufSize)
+{
+    char* newline;
+    char* line;
+    size_t lineEnd;
+
+    while ((req->state == PARSE_REQUEST_LINE || req->state == PARSE_HEADERS)
+            && req->pos < len)
+    {
+        /* Find the end of the current line */
+        newline = memchr(buf + req->pos, '\n', len - req->pos);
+        if (newline == NULL)
+        {
+            req->pos = len;
+            break;
+        }
+
+        /* Terminate the line, dropping the '\r' of a CRLF */
+        lineEnd = newline - buf;
+        line = buf + req->lineStart;
+        *newline = '\0';
+        if (lineEnd > req->lineStart && buf[lineEnd - 1] == '\r')
+        {
+            buf[lineEnd - 1] = '\0';
+        }
+        req->pos = lineEnd + 1;
+        req->lineStart = req->pos;
+
+        if (req->state == PARSE_REQUEST_LINE)
+        {
+            /* Tolerate blank lines between pipelined requests */
+            if (line[0] != '\0' && parseRequestLine(req, line))
+            {
+                req->state = PARSE_ERROR;
+                req->errorStatus = 400;
+            }
+        }
+        else if (line[0] == '\0')
+        {
+            /* A blank line ends the headers */
+            if (finishHeaders(req))
+            {
+                req->state = PARSE_ERROR;
+            }
+        }
+        else if (parseHeaderLine(req, line))
+        {
+            req->state = PARSE_ERROR;
+        }
+    }
+
+    if (req->state == PARSE_BODY &&
+            len - req->pos >= (size_t) req->contentLength)
+    {
+        req->body = buf + req->pos;
+        req->bodyLen = req->contentLength;
+        req->requestLen = req->pos + req->contentLength;
+        req->state = PARSE_DONE;
+    }
+
+    /* A request that fills the whole buffer can never complete */
+    if (req->state != PARSE_DONE && req->state != PARSE_ERROR &&
+            len >= bufSize)
+    {
+        req->errorStatus = (req->state == PARSE_BODY) ? 413 : 431;
+        req->state = PARSE_ERROR;
+    }
+
+    return req->state;
+}
+
+/**
+ * Look up one of the indexed headers
+ *
+ * @param req The parsed request
+ * @param id  The header to find
+ * @return The header's value, or NULL if the client didn't send it
+ */
+const char* httpHeader(const httpRequest_t* req, httpHeaderId_t id)
+{
+    if (id >= NUM_KNOWN_HEADERS || req->known[id] < 0)
+    {
+        return NULL;
+    }
+    return req->headers[req->known[id]].value;
+}
+
+/**
+ * Check the Accept-Encoding header for a content coding the client takes
+ *
+ * @param req    The parsed request
+ * @param coding The coding to look for, e.g. "gzip"
+ * @return 1 if the client accepts the coding, 0 if it doesn't
+ */
+int32_t httpAcceptsEncoding(const httpRequest_t* req, const char* coding)
+{
+    const char* list = httpHeader(req, HDR_ACCEPT_ENCODING);
+    const char* token;
+    const char* params;
+    size_t codingLen = strlen(coding);
+    size_t tokenLen;
+
+    if (list == NULL)
+    {
+        return 0;
+    }
+
+    while (*list != '\0')
+    {
+        /* Find the next coding in the comma separated list */
+        while (*list == ' ' || *list == '\t' || *list == ',')
+        {
+            list++;
+        }
+        token = list;
+        while (*list != '\0' && *list != ',' && *list != ';' &&
+                *list != ' ' && *list != '\t')
+        {
+            list++;
+        }
+        tokenLen = list - token;
+
+        /* Its parameters run to the next comma */
+        params = list;
+        while (*list != '\0' && *list != ',')
+        {
+            list++;
+        }
+
+        if ((tokenLen == codingLen && strncasecmp(token, coding, tokenLen) == 0)
+                || (tokenLen == 1 && token[0] == '*'))
+        {
+            /* "q=0" means the coding is not acceptable */
+            params = strstr(params, "q=");
+            if (params == NULL || params > list || strtod(params + 2, NULL) > 0)
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Check a comma separated header value, like Connection or Upgrade, for a
+ * token. The comparison is case insensitive.
+ *
+ * @param list  The header value, may be NULL
+ * @param token The token to look for, e.g. "close"
+ * @return 1 if the token is in the list, 0 if it isn't
+ */
+int32_t httpHasToken(const char* list, const char* token)
+{
+    size_t tokenLen = strlen(token);
+    const char* start;
+
+    if (list == NULL)
+    {
+        return 0;
+    }
+
+    while (*list != '\0')
+    {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+        {
+            list++;
+        }
+        start = list;
+        while (*list != '\0' && *list != ',' && *list != ' ' && *list != '\t')
+        {
+            list++;
+        }
+
+        if ((size_t)(list - start) == tokenLen &&
+                strncasecmp(start, token, tokenLen) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Split "METHOD URL VERSION" into its parts
+ *
+ * @param req  The request being parsed
+ * @param line The null terminated request line
+ * @return 0 for success, 1 if the line is malformed
+ */
+int32_t parseRequestLine(httpRequest_t* req, char* line)
+{
+    char* cursor = line;
+
+    req->method = nextToken(&cursor);
+    req->url = nextToken(&cursor);
+    req->version = nextToken(&cursor);
+
+    if (req->method[0] == '\0' || req->url[0] == '\0')
+    {
+        return 1;
+    }
+
+    if (req->version[0] == '\0')
+    {
+        /* HTTP/0.9 requests don't have headers */
+        req->requestLen = req->pos;
+        req->state = PARSE_DONE;
+    }
+    else
+    {
+        req->state = PARSE_HEADERS;
+    }
+    return 0;
+}
+
+/**
+ * Split a "Name: value" header and index it if it's a known one
+ *
+ * @param req  The request being parsed
+ * @param line The null terminated header line
+ * @return 0 for success, 1 for an error with req->errorStatus set
+ */
+int32_t parseHeaderLine(httpRequest_t* req, char* line)
+{
+    char* colon;
+    char* value;
+    char* end;
+    uint32_t i;
+
+    /* Folded headers are obsolete, and a colon is mandatory */
+    colon = strchr(line, ':');
+    if (isspace((unsigned char) line[0]) || colon == NULL || colon == line)
+    {
+        req->errorStatus = 400;
+        return 1;
+    }
+
+    if (req->numHeaders == HTTP_MAX_HEADERS)
+    {
+        req->errorStatus = 431;
+        return 1;
+    }
+
+    /* Trim whitespace around the value */
+    *colon = '\0';
+    value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+    {
+        value++;
+    }
+    end = value + strlen(value);
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        end--;
+    }
+    *end = '\0';
+
+    req->headers[req->numHeaders].name = line;
+    req->headers[req->numHeaders].value = value;
+
+    for (i = 0; i < NUM_KNOWN_HEADERS; i++)
+    {
+        if (strcasecmp(line, knownHeaderNames[i]) == 0)
+        {
+            req->known[i] = req->numHeaders;
+            break;
+        }
+    }
+
+    req->numHeaders++;
+    return 0;
+}
+
+/**
+ * All headers are in, figure out how much body to expect
+ *
+ * @param req The request being parsed
+ * @return 0 for success, 1 for an error with req->errorStatus set
+ */
+int32_t finishHeaders(httpRequest_t* req)
+{
+    const char* lengthStr = httpHeader(req, HDR_CONTENT_LENGTH);
+    char* end;
+
+    /* Chunked request bodies aren't supported */
+    if (httpHeader(req, HDR_TRANSFER_ENCODING) != NULL)
+    {
+        req->errorStatus = 501;
+        return 1;
+    }
+
+    if (lengthStr != NULL)
+    {
+        if (!isdigit((unsigned char) lengthStr[0]))
+        {
+            req->errorStatus = 400;
+            return 1;
+        }
+
+        req->contentLength = strtol(lengthStr, &end, 10);
+        if (*end != '\0')
+        {
+            req->errorStatus = 400;
+            return 1;
+        }
+
+        /* Refuse oversized bodies before reading any of them */
+        if (req->contentLength > HTTP_MAX_BODY)
+        {
+            req->errorStatus = 413;
+            return 1;
+        }
+    }
+
+    if (req->contentLength > 0)
+    {
+        req->state = PARSE_BODY;
+    }
+    else
+    {
+        req->requestLen = req->pos;
+        req->state = PARSE_DONE;
+    }
+    return 0;
+}
+
+/**
+ * Pull the next space separated token out of a line
+ *
+ * @param cursor Where to start, advanced past the token
+ * @return The null terminated token, "" if there are none left
+ */
+char* nextToken(char** cursor)
+{
+    char* token;
+
+    while (**cursor == ' ' || **cursor == '\t')
+    {
+        (*cursor)++;
+    }
+
+    token = *cursor;
+    while (**cursor != '\0' && **cursor != ' ' && **cursor != '\t')
+    {
+        (*cursor)++;
+    }
+
+    if (**cursor != '\0')
+    {
+        **cursor = '\0';
+        (*cursor)++;
+    }
+    return token;
+}
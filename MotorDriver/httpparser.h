@@ -0,0 +1,78 @@
+/*
+ * httpparser.h
+ *
+ *  Incremental HTTP request parser. Requests are parsed in place in a
+ *  connection's receive buffer as bytes arrive, so nothing is re-scanned
+ *  and nothing is copied.
+ */
+
+#ifndef _HTTPPARSER_H_
+#define _HTTPPARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_MAX_HEADERS  32   /*!< Headers kept per request */
+#define HTTP_MAX_BODY     1024 /*!< Largest request body that is accepted */
+
+/* Headers the server cares about, indexed for O(1) lookup */
+typedef enum
+{
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_CONNECTION,
+    HDR_UPGRADE,
+    HDR_HOST,
+    HDR_TRANSFER_ENCODING,
+    HDR_ACCEPT_ENCODING,
+    HDR_IF_NONE_MATCH,
+    HDR_SEC_WEBSOCKET_KEY,
+    HDR_SEC_WEBSOCKET_VERSION,
+    NUM_KNOWN_HEADERS
+} httpHeaderId_t;
+
+/* Where the parser is in the request */
+typedef enum
+{
+    PARSE_REQUEST_LINE, /*!< Waiting for the request line */
+    PARSE_HEADERS,      /*!< Reading header lines */
+    PARSE_BODY,         /*!< Waiting for Content-Length bytes of body */
+    PARSE_DONE,         /*!< A complete request is available */
+    PARSE_ERROR         /*!< The request is malformed, see errorStatus */
+} httpParseState_t;
+
+/* A single header, both strings point into the receive buffer */
+typedef struct
+{
+    char* name;
+    char* value;
+} httpHeader_t;
+
+/* A request being parsed. All strings point into the receive buffer and are
+ * null terminated in place */
+typedef struct
+{
+    httpParseState_t state;   /*!< Where the parser is */
+    size_t pos;               /*!< Next buffer byte to scan */
+    size_t lineStart;         /*!< Start of the line being scanned */
+    char* method;             /*!< e.g. "GET" */
+    char* url;                /*!< The request target, query string included */
+    char* version;            /*!< e.g. "HTTP/1.1", "" for HTTP/0.9 */
+    httpHeader_t headers[HTTP_MAX_HEADERS]; /*!< Every header received */
+    uint32_t numHeaders;      /*!< Number of valid headers[] */
+    int32_t known[NUM_KNOWN_HEADERS]; /*!< headers[] index, or -1 */
+    long contentLength;       /*!< Body length, -1 if not given */
+    char* body;               /*!< The request body, not null terminated */
+    size_t bodyLen;           /*!< Length of the body */
+    size_t requestLen;        /*!< Bytes consumed by the whole request */
+    int32_t errorStatus;      /*!< HTTP status to reply with on PARSE_ERROR */
+} httpRequest_t;
+
+void httpParserInit(httpRequest_t* req);
+httpParseState_t httpParse(httpRequest_t* req, char* buf, size_t len,
+                           size_t bufSize);
+const char* httpHeader(const httpRequest_t* req, httpHeaderId_t id);
+int32_t httpAcceptsEncoding(const httpRequest_t* req, const char* coding);
+int32_t httpHasToken(const char* list, const char* token);
+
+#endif /* _HTTPPARSER_H_ */
@@ -1,11 +1,12 @@
 #include <stdint.h>
 #include <stdio.h>
-#include <sys/socket.h>
 #include <string.h>
+#include <strings.h>
 
 #include "webpages.h"
+#include "httpd.h"
 
-#define SERVER_STRING "Server: jdbhttpd/0.1.0\r\n"
+void html_page(int32_t, const char*, const char*);
 
 /**********************************************************************/
 /* Inform the client that a request it has made has a problem.
@@ -13,18 +14,9 @@
 /**********************************************************************/
 void bad_request(int32_t client)
 {
-    char buf[1024];
-
-    sprintf(buf, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "<P>Your browser sent a bad request, ");
-    send(client, buf, sizeof(buf), 0);
-    sprintf(buf, "such as a POST without a Content-Length.\r\n");
-    send(client, buf, sizeof(buf), 0);
+    html_page(client, "400 BAD REQUEST",
+              "<P>Your browser sent a bad request, "
+              "such as a POST without a Content-Length.\r\n");
 }
 
 /**********************************************************************/
@@ -33,36 +25,109 @@ void bad_request(int32_t client)
 /**********************************************************************/
 void cannot_execute(int32_t client)
 {
-    char buf[1024];
+    html_page(client, "500 Internal Server Error",
+              "<P>Error prohibited CGI execution.\r\n");
+}
+
+/**********************************************************************/
+/* Pick a Content-Type from a file's extension.
+ * Parameters: the name of the file
+ * Returns: the MIME type, application/octet-stream if it's unknown */
+/**********************************************************************/
+const char* content_type(const char* filename)
+{
+    /* Extension to MIME type, the first match wins */
+    static const char* const types[][2] =
+    {
+        {".html", "text/html"},
+        {".htm",  "text/html"},
+        {".css",  "text/css"},
+        {".js",   "application/javascript"},
+        {".json", "application/json"},
+        {".txt",  "text/plain"},
+        {".png",  "image/png"},
+        {".jpg",  "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif",  "image/gif"},
+        {".svg",  "image/svg+xml"},
+        {".ico",  "image/x-icon"},
+        {".mp4",  "video/mp4"},
+        {".webm", "video/webm"}
+    };
+    const char* extension = strrchr(filename, '.');
+    size_t i;
 
-    sprintf(buf, "HTTP/1.0 500 Internal Server Error\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<P>Error prohibited CGI execution.\r\n");
-    send(client, buf, strlen(buf), 0);
+    if (extension != NULL)
+    {
+        for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        {
+            if (strcasecmp(extension, types[i][0]) == 0)
+            {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
 }
 
 /**********************************************************************/
 /* Return the informational HTTP headers about a file. */
 /* Parameters: the socket to print32_t the headers on
- *             the name of the file */
+ *             the name of the file
+ *             the size of the file */
+/**********************************************************************/
+void headers(int32_t client, const char* filename, off_t size)
+{
+    char buf[1024];
+
+    http_status(client, "200 OK");
+    sprintf(buf, "Content-Type: %s\r\n", content_type(filename));
+    http_send(client, buf, strlen(buf));
+    http_end_headers(client, (long) size);
+}
+
+/**********************************************************************/
+/* Inform the client that the request headers were too large to buffer.
+ * Parameter: the client socket */
+/**********************************************************************/
+void headers_too_large(int32_t client)
+{
+    html_page(client, "431 Request Header Fields Too Large",
+              "<P>The request headers were too large.\r\n");
+}
+
+/**********************************************************************/
+/* Send a complete HTML response with its length.
+ * Parameters: the client socket
+ *             the status code and reason
+ *             the page */
 /**********************************************************************/
-void headers(int32_t client, const char* filename)
+void html_page(int32_t client, const char* status, const char* body)
 {
     char buf[1024];
-    (void) filename; /* could use filename to determine file type */
 
-    strcpy(buf, "HTTP/1.0 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-    strcpy(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
+    http_status(client, status);
     sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    strcpy(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
+    http_send(client, buf, strlen(buf));
+    http_end_headers(client, (long) strlen(body));
+    http_send(client, body, strlen(body));
+}
+
+/**********************************************************************/
+/* Tell the client its cached copy of a file is still good.
+ * Parameters: the client socket
+ *             the ETag of the file */
+/**********************************************************************/
+void not_modified(int32_t client, const char* etag)
+{
+    char buf[1024];
+
+    http_status(client, "304 Not Modified");
+    sprintf(buf, "ETag: %.256s\r\n", etag);
+    http_send(client, buf, strlen(buf));
+    sprintf(buf, "Vary: Accept-Encoding\r\n");
+    http_send(client, buf, strlen(buf));
+    http_end_headers(client, -1);
 }
 
 /**********************************************************************/
@@ -70,26 +135,23 @@ void headers(int32_t client, const char* filename)
 /**********************************************************************/
 void not_found(int32_t client)
 {
-    char buf[1024];
+    html_page(client, "404 NOT FOUND",
+              "<HTML><TITLE>Not Found</TITLE>\r\n"
+              "<BODY><P>The server could not fulfill\r\n"
+              "your request because the resource specified\r\n"
+              "is unavailable or nonexistent.\r\n"
+              "</BODY></HTML>\r\n");
+}
 
-    sprintf(buf, "HTTP/1.0 404 NOT FOUND\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><TITLE>Not Found</TITLE>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>The server could not fulfill\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "your request because the resource specified\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "is unavailable or nonexistent.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+/**********************************************************************/
+/* Inform the client that the request body was larger than the server
+ * is willing to accept.
+ * Parameter: the client socket */
+/**********************************************************************/
+void payload_too_large(int32_t client)
+{
+    html_page(client, "413 Payload Too Large",
+              "<P>The request body was too large.\r\n");
 }
 
 /**********************************************************************/
@@ -99,22 +161,9 @@ void not_found(int32_t client)
 /**********************************************************************/
 void unimplemented(int32_t client)
 {
-    char buf[1024];
-
-    sprintf(buf, "HTTP/1.0 501 Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "Content-Type: text/html\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<HTML><HEAD><TITLE>Method Not Implemented\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</TITLE></HEAD>\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "<BODY><P>HTTP request method not supported.\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "</BODY></HTML>\r\n");
-    send(client, buf, strlen(buf), 0);
+    html_page(client, "501 Method Not Implemented",
+              "<HTML><HEAD><TITLE>Method Not Implemented\r\n"
+              "</TITLE></HEAD>\r\n"
+              "<BODY><P>HTTP request method not supported.\r\n"
+              "</BODY></HTML>\r\n");
 }
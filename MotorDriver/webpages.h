@@ -8,10 +8,18 @@
 #ifndef WEBPAGES_H_
 #define WEBPAGES_H_
 
+#include <sys/types.h>
+
+#define SERVER_STRING "Server: jdbhttpd/0.1.0\r\n"
+
 void bad_request(int32_t);
 void cannot_execute(int32_t);
-void headers(int32_t, const char*);
+const char* content_type(const char*);
+void headers(int32_t, const char*, off_t);
+void headers_too_large(int32_t);
 void not_found(int32_t);
+void not_modified(int32_t, const char*);
+void payload_too_large(int32_t);
 void unimplemented(int32_t);
 
 #endif /* WEBPAGES_H_ */
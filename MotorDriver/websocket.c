@@ -0,0 +1,310 @@
+/*
+ * websocket.c
+ *
+ *  RFC 6455 handshake and framing for the motor control WebSocket. The
+ *  connection handling lives in httpd.c, this is just the protocol.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "websocket.h"
+
+/* Appended to the client's key before hashing, from RFC 6455 */
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* Internal function prototypes */
+void sha1(const uint8_t* data, size_t len, uint8_t digest[20]);
+void sha1Block(uint32_t state[5], const uint8_t block[64]);
+void base64Encode(const uint8_t* data, size_t len, char* out);
+
+/**
+ * Compute the Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key
+ *
+ * @param clientKey The client's key
+ * @param acceptKey Filled in with the null terminated accept value, must
+ *                  hold WS_ACCEPT_KEY_LEN + 1 bytes
+ */
+void wsAcceptKey(const char* clientKey, char* acceptKey)
+{
+    uint8_t keyAndGuid[128];
+    uint8_t digest[20];
+    size_t keyLen = strlen(clientKey);
+
+    /* Keys are 24 characters, anything wildly longer is bogus */
+    if (keyLen > sizeof(keyAndGuid) - strlen(WS_GUID))
+    {
+        keyLen = sizeof(keyAndGuid) - strlen(WS_GUID);
+    }
+
+    memcpy(keyAndGuid, clientKey, keyLen);
+    memcpy(keyAndGuid + keyLen, WS_GUID, strlen(WS_GUID));
+    sha1(keyAndGuid, keyLen + strlen(WS_GUID), digest);
+    base64Encode(digest, sizeof(digest), acceptKey);
+}
+
+/**
+ * Parse a client frame at the start of a buffer and unmask its payload in
+ * place. Client frames must be masked.
+ *
+ * @param buf   The receive buffer
+ * @param len   The number of valid bytes in buf
+ * @param frame Filled in when a frame is parsed
+ * @return WS_FRAME_OK if frame was filled in, WS_FRAME_INCOMPLETE if more
+ *         bytes are needed, WS_FRAME_ERROR for a protocol violation
+ */
+wsParseResult_t wsParseFrame(uint8_t* buf, size_t len, wsFrame_t* frame)
+{
+    size_t headerLen = 2;
+    uint64_t payloadLen;
+    uint8_t* mask;
+    size_t i;
+
+    if (len < 2)
+    {
+        return WS_FRAME_INCOMPLETE;
+    }
+
+    /* No extensions were negotiated, so the RSV bits must be clear, and
+     * clients always mask
+     */
+    if ((buf[0] & 0x70) || !(buf[1] & 0x80))
+    {
+        return WS_FRAME_ERROR;
+    }
+
+    payloadLen = buf[1] & 0x7F;
+    if (payloadLen == 126)
+    {
+        headerLen += 2;
+        if (len < headerLen)
+        {
+            return WS_FRAME_INCOMPLETE;
+        }
+        payloadLen = ((uint64_t) buf[2] << 8) | buf[3];
+    }
+    else if (payloadLen == 127)
+    {
+        headerLen += 8;
+        if (len < headerLen)
+        {
+            return WS_FRAME_INCOMPLETE;
+        }
+        payloadLen = 0;
+        for (i = 2; i < 10; i++)
+        {
+            payloadLen = (payloadLen << 8) | buf[i];
+        }
+    }
+
+    /* Then the masking key */
+    headerLen += 4;
+    if (len < headerLen || len - headerLen < payloadLen)
+    {
+        return WS_FRAME_INCOMPLETE;
+    }
+
+    frame->fin = (buf[0] & 0x80) != 0;
+    frame->opcode = buf[0] & 0x0F;
+    frame->payload = buf + headerLen;
+    frame->payloadLen = (size_t) payloadLen;
+    frame->frameLen = headerLen + frame->payloadLen;
+
+    /* Control frames can't be fragmented or long */
+    if ((frame->opcode & 0x08) && (!frame->fin || frame->payloadLen > 125))
+    {
+        return WS_FRAME_ERROR;
+    }
+
+    mask = buf + headerLen - 4;
+    for (i = 0; i < frame->payloadLen; i++)
+    {
+        frame->payload[i] ^= mask[i % 4];
+    }
+
+    return WS_FRAME_OK;
+}
+
+/**
+ * Build the header for an unmasked, unfragmented server frame
+ *
+ * @param header     Filled in with the header, must hold WS_MAX_HEADER_LEN
+ * @param opcode     The frame's opcode
+ * @param payloadLen The length of the payload that follows the header
+ * @return The length of the header
+ */
+size_t wsFrameHeader(uint8_t* header, wsOpcode_t opcode, size_t payloadLen)
+{
+    size_t i;
+
+    header[0] = 0x80 | opcode;
+
+    if (payloadLen < 126)
+    {
+        header[1] = (uint8_t) payloadLen;
+        return 2;
+    }
+    else if (payloadLen <= 0xFFFF)
+    {
+        header[1] = 126;
+        header[2] = (uint8_t)(payloadLen >> 8);
+        header[3] = (uint8_t) payloadLen;
+        return 4;
+    }
+
+    header[1] = 127;
+    for (i = 0; i < 8; i++)
+    {
+        header[9 - i] = (uint8_t)((uint64_t) payloadLen >> (8 * i));
+    }
+    return 10;
+}
+
+/**
+ * SHA-1, only used for the handshake
+ *
+ * @param data   The bytes to hash
+ * @param len    The number of bytes
+ * @param digest Filled in with the 20 byte digest
+ */
+void sha1(const uint8_t* data, size_t len, uint8_t digest[20])
+{
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                         0xC3D2E1F0
+                        };
+    uint8_t block[64];
+    uint64_t bitLen = (uint64_t) len * 8;
+    size_t remaining;
+    size_t i;
+
+    /* Whole blocks */
+    for (i = 0; i + 64 <= len; i += 64)
+    {
+        sha1Block(state, data + i);
+    }
+
+    /* The tail, a 1 bit, padding and the length */
+    remaining = len - i;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + i, remaining);
+    block[remaining] = 0x80;
+    if (remaining >= 56)
+    {
+        sha1Block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    for (i = 0; i < 8; i++)
+    {
+        block[63 - i] = (uint8_t)(bitLen >> (8 * i));
+    }
+    sha1Block(state, block);
+
+    for (i = 0; i < 20; i++)
+    {
+        digest[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+/**
+ * Run one 64 byte block through SHA-1
+ *
+ * @param state The hash state
+ * @param block The block
+ */
+void sha1Block(uint32_t state[5], const uint8_t block[64])
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, temp;
+    uint32_t i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t) block[4 * i] << 24) |
+               ((uint32_t) block[4 * i + 1] << 16) |
+               ((uint32_t) block[4 * i + 2] << 8) |
+               ((uint32_t) block[4 * i + 3]);
+    }
+    for (i = 16; i < 80; i++)
+    {
+        temp = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = (temp << 1) | (temp >> 31);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/**
+ * Base64 encode some bytes
+ *
+ * @param data The bytes to encode
+ * @param len  The number of bytes
+ * @param out  Filled in with the null terminated encoding, must hold
+ *             4 * ((len + 2) / 3) + 1 bytes
+ */
+void base64Encode(const uint8_t* data, size_t len, char* out)
+{
+    const char* alphabet =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t triple;
+    size_t i;
+
+    for (i = 0; i < len; i += 3)
+    {
+        triple = (uint32_t) data[i] << 16;
+        if (i + 1 < len)
+        {
+            triple |= (uint32_t) data[i + 1] << 8;
+        }
+        if (i + 2 < len)
+        {
+            triple |= data[i + 2];
+        }
+
+        *out++ = alphabet[(triple >> 18) & 0x3F];
+        *out++ = alphabet[(triple >> 12) & 0x3F];
+        *out++ = (i + 1 < len) ? alphabet[(triple >> 6) & 0x3F] : '=';
+        *out++ = (i + 2 < len) ? alphabet[triple & 0x3F] : '=';
+    }
+    *out = '\0';
+}
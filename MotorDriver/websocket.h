@@ -0,0 +1,49 @@
+/*
+ * websocket.h
+ *
+ *  RFC 6455 handshake and framing for the motor control WebSocket
+ */
+
+#ifndef _WEBSOCKET_H_
+#define _WEBSOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WS_ACCEPT_KEY_LEN 28 /*!< Length of a Sec-WebSocket-Accept value */
+#define WS_MAX_HEADER_LEN 10 /*!< Longest unmasked frame header */
+
+/* Frame opcodes */
+typedef enum
+{
+    WS_CONTINUATION = 0x0,
+    WS_TEXT         = 0x1,
+    WS_BINARY       = 0x2,
+    WS_CLOSE        = 0x8,
+    WS_PING         = 0x9,
+    WS_PONG         = 0xA
+} wsOpcode_t;
+
+/* What wsParseFrame() found */
+typedef enum
+{
+    WS_FRAME_INCOMPLETE, /*!< More bytes are needed */
+    WS_FRAME_OK,         /*!< A frame was parsed */
+    WS_FRAME_ERROR       /*!< The client broke the protocol */
+} wsParseResult_t;
+
+/* A parsed frame, the payload points into the receive buffer */
+typedef struct
+{
+    uint8_t fin;        /*!< This is the last frame of a message */
+    uint8_t opcode;     /*!< A wsOpcode_t */
+    uint8_t* payload;   /*!< The unmasked payload */
+    size_t payloadLen;  /*!< Length of the payload */
+    size_t frameLen;    /*!< Bytes the whole frame took up in the buffer */
+} wsFrame_t;
+
+void wsAcceptKey(const char* clientKey, char* acceptKey);
+wsParseResult_t wsParseFrame(uint8_t* buf, size_t len, wsFrame_t* frame);
+size_t wsFrameHeader(uint8_t* header, wsOpcode_t opcode, size_t payloadLen);
+
+#endif /* _WEBSOCKET_H_ */
@@ -0,0 +1,789 @@
+/*
+ * QikEmulator.c
+ *
+ *  Emulates a Pololu Qik 2s9v1 behind a pseudo-terminal, so MotorDriver can
+ *  be run and measured without a Raspberry Pi or a Qik. Point MotorDriver at
+ *  the printed pty (or the -l symlink) instead of /dev/ttyAMA0.
+ *
+ *  Both the compact and Pololu protocols are understood, with the full
+ *  command set, configuration parameters and error byte. Bytes are paced at
+ *  the baud rate in both directions, and frame, format and timeout errors
+ *  and slow or lost responses can be injected. All randomness comes from a
+ *  seeded generator, so a run can be repeated exactly.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#define DEFAULT_BAUD       38400
+#define DEFAULT_DEVICE_ID  0x09
+#define FIRMWARE_VERSION   '2'
+#define BYTE_QUEUE_SIZE    4096  /*!< Bytes in flight in either direction */
+#define START_BYTE         0xAA  /*!< Starts a Pololu protocol packet */
+#define MAX_DATA_BYTES     4     /*!< SET_CONFIG_PARAM has the most */
+#define TIMEOUT_UNIT_USEC  262144 /*!< Serial timeout resolution, 0.262 s */
+
+/* Commands, as sent in the Pololu protocol */
+typedef enum
+{
+    GET_FIRMWARE_VERSION = 0x01,
+    GET_ERROR_BYTE = 0x02,
+    GET_CONFIG_PARAM = 0x03,
+    SET_CONFIG_PARAM = 0x04,
+    M0_COAST = 0x06,
+    M1_COAST = 0x07,
+    M0_FORWARD = 0x08,
+    M0_FORWARD_128 = 0x09,
+    M0_REVERSE = 0x0A,
+    M0_REVERSE_128 = 0x0B,
+    M1_FORWARD = 0x0C,
+    M1_FORWARD_128 = 0x0D,
+    M1_REVERSE = 0x0E,
+    M1_REVERSE_128 = 0x0F
+} qikCommand_t;
+
+/* Error byte bits */
+typedef enum
+{
+    DATA_OVERRUN_ERROR = 0x08,
+    FRAME_ERROR        = 0x10,
+    CRC_ERROR          = 0x20,
+    FORMAT_ERROR       = 0x40,
+    TIMEOUT_ERROR      = 0x80
+} errorBit_t;
+
+/* Configuration parameters */
+typedef enum
+{
+    DEVICE_ID = 0,
+    PWM_PARAMETER = 1,
+    SHUTDOWN_MOTOR_ON_ERROR = 2,
+    SERIAL_TIMEOUT = 3,
+    NUM_CONFIG_PARAMS
+} configParameter_t;
+
+/* A byte on the wire, and when its last bit has been clocked */
+typedef struct
+{
+    uint64_t due;
+    uint8_t byte;
+} timedByte_t;
+
+/* A ring of bytes waiting on the wire */
+typedef struct
+{
+    timedByte_t bytes[BYTE_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t lastDue; /*!< When the newest byte finishes */
+} byteQueue_t;
+
+/* Options */
+uint32_t baud = DEFAULT_BAUD;           /*!< Bytes are paced at this rate */
+double frameErrorRate = 0;              /*!< Chance a byte arrives garbled */
+double formatErrorRate = 0;             /*!< Chance a packet is refused */
+double dropRate = 0;                    /*!< Chance a response is lost */
+uint64_t responseDelay = 0;             /*!< Extra microseconds per response */
+uint32_t seed = 1;                      /*!< Fault injection random seed */
+int32_t quiet = 0;                      /*!< Only log errors */
+
+/* Emulated Qik state */
+uint8_t config[NUM_CONFIG_PARAMS] = {DEFAULT_DEVICE_ID, 0, 1, 0};
+uint8_t errorByte = 0;                  /*!< Errors since the last read */
+int32_t motorSpeed[2] = {0, 0};         /*!< -255 to 255, 0 is brake */
+int32_t motorCoasting[2] = {1, 1};      /*!< Outputs are high impedance */
+uint64_t lastPacketTime = 0;            /*!< For the serial timeout */
+
+/* Packet parser state */
+uint8_t packet[3 + MAX_DATA_BYTES];     /*!< The packet being received */
+uint32_t packetLen = 0;                 /*!< Bytes of it received so far */
+uint32_t packetNeeded = 0;              /*!< Bytes it will have, 0 if idle */
+int32_t pololuProtocol = 0;             /*!< It started with START_BYTE */
+
+int32_t masterFd = -1;                  /*!< Our end of the pty */
+byteQueue_t rxQueue;                    /*!< Bytes being received */
+byteQueue_t txQueue;                    /*!< Bytes being transmitted */
+uint64_t startTime = 0;                 /*!< For log timestamps */
+
+/* Function prototypes */
+uint64_t nowUsec(void);
+double randomUnit(void);
+uint64_t byteTime(void);
+void logEvent(const char* format, ...);
+void queueByte(byteQueue_t* queue, uint8_t byte, uint64_t earliest);
+void receiveBytes(void);
+void processByte(uint8_t byte);
+int32_t dataBytesFor(uint8_t command);
+void executePacket(void);
+void setMotor(uint32_t motor, int32_t speed);
+void respond(uint8_t byte);
+void raiseError(errorBit_t error);
+void checkSerialTimeout(uint64_t now);
+uint64_t serialTimeoutUsec(void);
+int32_t openPty(const char* linkPath);
+void usage(const char* name);
+
+/**
+ * @return Microseconds on the monotonic clock
+ */
+uint64_t nowUsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * A deterministic uniform random number, so fault runs can be repeated
+ *
+ * @return A number in [0, 1)
+ */
+double randomUnit(void)
+{
+    /* Numerical Recipes LCG, plenty for fault injection */
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) / 16777216.0;
+}
+
+/**
+ * @return Microseconds one byte takes on the wire, 8N1 is 10 bits
+ */
+uint64_t byteTime(void)
+{
+    return (10 * 1000000 + baud - 1) / baud;
+}
+
+/**
+ * Print a timestamped line
+ *
+ * @param format A printf format, followed by its arguments
+ */
+void logEvent(const char* format, ...)
+{
+    uint64_t elapsed = nowUsec() - startTime;
+    va_list args;
+
+    printf("%6lu.%06lu ", (unsigned long)(elapsed / 1000000),
+           (unsigned long)(elapsed % 1000000));
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+/**
+ * Put a byte on the wire. It finishes one byte time after the byte before
+ * it, or after earliest, whichever is later.
+ *
+ * @param queue    The direction it travels
+ * @param byte     The byte
+ * @param earliest When it could start, in microseconds
+ */
+void queueByte(byteQueue_t* queue, uint8_t byte, uint64_t earliest)
+{
+    uint32_t next = (queue->tail + 1) % BYTE_QUEUE_SIZE;
+
+    if (next == queue->head)
+    {
+        /* Nothing is listening fast enough, like a real UART FIFO */
+        raiseError(DATA_OVERRUN_ERROR);
+        return;
+    }
+
+    if (queue->lastDue > earliest)
+    {
+        earliest = queue->lastDue;
+    }
+    queue->lastDue = earliest + byteTime();
+    queue->bytes[queue->tail].due = queue->lastDue;
+    queue->bytes[queue->tail].byte = byte;
+    queue->tail = next;
+}
+
+/**
+ * Move whatever MotorDriver wrote into the receive queue
+ */
+void receiveBytes(void)
+{
+    uint8_t buf[256];
+    ssize_t numRead, i;
+    uint64_t now = nowUsec();
+
+    numRead = read(masterFd, buf, sizeof(buf));
+    for (i = 0; i < numRead; i++)
+    {
+        queueByte(&rxQueue, buf[i], now);
+    }
+}
+
+/**
+ * Feed one received byte to the packet parser
+ *
+ * @param byte The byte
+ */
+void processByte(uint8_t byte)
+{
+    /* A byte garbled on the wire aborts the packet it was part of */
+    if (frameErrorRate > 0 && randomUnit() < frameErrorRate)
+    {
+        packetNeeded = 0;
+        raiseError(FRAME_ERROR);
+        return;
+    }
+
+    if (byte & 0x80)
+    {
+        /* A command or start byte in the middle of a packet interrupts it */
+        if (packetNeeded != 0)
+        {
+            packetNeeded = 0;
+            raiseError(FORMAT_ERROR);
+        }
+
+        if (byte == START_BYTE)
+        {
+            /* Pololu protocol, a device ID and the command follow */
+            pololuProtocol = 1;
+            packet[0] = byte;
+            packetLen = 1;
+            packetNeeded = 3;
+            return;
+        }
+
+        /* Compact protocol, the command has its MSB set */
+        if (dataBytesFor(byte & 0x7F) < 0)
+        {
+            raiseError(FORMAT_ERROR);
+            return;
+        }
+        pololuProtocol = 0;
+        packet[0] = START_BYTE;
+        packet[1] = config[DEVICE_ID];
+        packet[2] = byte & 0x7F;
+        packetLen = 3;
+        packetNeeded = 3 + dataBytesFor(byte & 0x7F);
+    }
+    else if (packetNeeded == 0)
+    {
+        /* Data with no command, ignore it */
+        return;
+    }
+    else
+    {
+        packet[packetLen++] = byte;
+
+        if (pololuProtocol && packetLen == 3)
+        {
+            /* The command byte, now the length is known */
+            if (dataBytesFor(byte) < 0)
+            {
+                packetNeeded = 0;
+                if (packet[1] == config[DEVICE_ID])
+                {
+                    raiseError(FORMAT_ERROR);
+                }
+                return;
+            }
+            packetNeeded = 3 + dataBytesFor(byte);
+        }
+    }
+
+    if (packetLen == packetNeeded)
+    {
+        packetNeeded = 0;
+
+        /* Pololu packets for other devices are ignored */
+        if (packet[1] == config[DEVICE_ID])
+        {
+            executePacket();
+        }
+    }
+}
+
+/**
+ * @param command A command byte, without its MSB
+ * @return The number of data bytes it takes, -1 if it's not a command
+ */
+int32_t dataBytesFor(uint8_t command)
+{
+    switch (command)
+    {
+        case GET_FIRMWARE_VERSION:
+        case GET_ERROR_BYTE:
+        case M0_COAST:
+        case M1_COAST:
+        {
+            return 0;
+        }
+        case GET_CONFIG_PARAM:
+        case M0_FORWARD:
+        case M0_FORWARD_128:
+        case M0_REVERSE:
+        case M0_REVERSE_128:
+        case M1_FORWARD:
+        case M1_FORWARD_128:
+        case M1_REVERSE:
+        case M1_REVERSE_128:
+        {
+            return 1;
+        }
+        case SET_CONFIG_PARAM:
+        {
+            return 4;
+        }
+        default:
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Carry out a complete packet addressed to this device
+ */
+void executePacket(void)
+{
+    uint8_t command = packet[2];
+    uint8_t* data = packet + 3;
+    int32_t speed;
+
+    lastPacketTime = nowUsec();
+
+    /* Injected format errors, as if the packet were nonsense */
+    if (formatErrorRate > 0 && randomUnit() < formatErrorRate)
+    {
+        raiseError(FORMAT_ERROR);
+        return;
+    }
+
+    switch (command)
+    {
+        case GET_FIRMWARE_VERSION:
+        {
+            respond(FIRMWARE_VERSION);
+            break;
+        }
+        case GET_ERROR_BYTE:
+        {
+            /* Reading the error byte clears it and drops the ERR line */
+            respond(errorByte);
+            if (errorByte != 0 && !quiet)
+            {
+                logEvent("ERR low");
+            }
+            errorByte = 0;
+            break;
+        }
+        case GET_CONFIG_PARAM:
+        {
+            if (data[0] < NUM_CONFIG_PARAMS)
+            {
+                respond(config[data[0]]);
+            }
+            else
+            {
+                raiseError(FORMAT_ERROR);
+            }
+            break;
+        }
+        case SET_CONFIG_PARAM:
+        {
+            /* The two magic bytes guard against accidental writes */
+            if (data[2] != 0x55 || data[3] != 0x2A)
+            {
+                raiseError(FORMAT_ERROR);
+            }
+            else if (data[0] >= NUM_CONFIG_PARAMS)
+            {
+                respond(1);
+            }
+            else if ((data[0] == PWM_PARAMETER && data[1] > 5) ||
+                     (data[0] == SHUTDOWN_MOTOR_ON_ERROR && data[1] > 1))
+            {
+                respond(2);
+            }
+            else
+            {
+                config[data[0]] = data[1];
+                respond(0);
+                if (!quiet)
+                {
+                    logEvent("Config parameter %d = %d", data[0], data[1]);
+                }
+            }
+            break;
+        }
+        case M0_COAST:
+        case M1_COAST:
+        {
+            motorCoasting[command - M0_COAST] = 1;
+            motorSpeed[command - M0_COAST] = 0;
+            if (!quiet)
+            {
+                logEvent("M%d coast", command - M0_COAST);
+            }
+            break;
+        }
+        default:
+        {
+            /* The speeds. In the 8 bit PWM modes the _128 variants add 128
+             * to the speed byte. In the 7 bit modes they're the same as the
+             * plain ones, and the speed is scaled to match the 8 bit range
+             */
+            speed = data[0];
+            if (config[PWM_PARAMETER] & 0x01)
+            {
+                speed += (command & 0x01) ? 128 : 0;
+            }
+            else
+            {
+                speed *= 2;
+            }
+            if (command & 0x02)
+            {
+                speed = -speed;
+            }
+            setMotor((command >= M1_FORWARD) ? 1 : 0, speed);
+            break;
+        }
+    }
+}
+
+/**
+ * Drive a motor
+ *
+ * @param motor 0 or 1
+ * @param speed -255 to 255, negative is reverse
+ */
+void setMotor(uint32_t motor, int32_t speed)
+{
+    motorCoasting[motor] = 0;
+    motorSpeed[motor] = speed;
+    if (!quiet)
+    {
+        logEvent("M%u speed %d", motor, speed);
+    }
+}
+
+/**
+ * Send a response byte, unless it's been chosen to be lost or delayed
+ *
+ * @param byte The response
+ */
+void respond(uint8_t byte)
+{
+    if (dropRate > 0 && randomUnit() < dropRate)
+    {
+        logEvent("Command 0x%02x response %d dropped", packet[2], byte);
+        return;
+    }
+
+    if (!quiet)
+    {
+        logEvent("Command 0x%02x answered %d", packet[2], byte);
+    }
+
+    /* The Qik starts answering once the whole command is in */
+    queueByte(&txQueue, byte, nowUsec() + responseDelay);
+}
+
+/**
+ * Record an error. The ERR line goes high until the error byte is read,
+ * and the motors stop if the Qik is configured to.
+ *
+ * @param error The error bit
+ */
+void raiseError(errorBit_t error)
+{
+    const char* name = (error == FRAME_ERROR) ? "frame" :
+                       (error == FORMAT_ERROR) ? "format" :
+                       (error == TIMEOUT_ERROR) ? "timeout" :
+                       (error == DATA_OVERRUN_ERROR) ? "data overrun" : "CRC";
+
+    if (errorByte == 0)
+    {
+        logEvent("ERR high, %s error", name);
+    }
+    else
+    {
+        logEvent("%s error", name);
+    }
+    errorByte |= error;
+
+    if (config[SHUTDOWN_MOTOR_ON_ERROR] &&
+            (motorSpeed[0] != 0 || motorSpeed[1] != 0))
+    {
+        motorSpeed[0] = 0;
+        motorSpeed[1] = 0;
+        logEvent("Motors stopped on error");
+    }
+}
+
+/**
+ * @return The serial timeout period, 0 if it's disabled. The low 4 bits of
+ *         the parameter are multiplied by 2 to the power of the high 3 bits
+ */
+uint64_t serialTimeoutUsec(void)
+{
+    uint8_t param = config[SERIAL_TIMEOUT];
+
+    return (uint64_t) TIMEOUT_UNIT_USEC * (param & 0x0F) << ((param >> 4) & 0x07);
+}
+
+/**
+ * Raise a timeout error if no packet has come in within the serial timeout
+ *
+ * @param now The current time
+ */
+void checkSerialTimeout(uint64_t now)
+{
+    uint64_t period = serialTimeoutUsec();
+
+    /* A packet may have been stamped after now was read */
+    if (period != 0 && now > lastPacketTime && now - lastPacketTime >= period)
+    {
+        raiseError(TIMEOUT_ERROR);
+        lastPacketTime = now;
+    }
+}
+
+/**
+ * Open a pty for MotorDriver to use as its serial port
+ *
+ * @param linkPath If not NULL, a symlink to create to the pty
+ * @return 0 for success, -1 for an error
+ */
+int32_t openPty(const char* linkPath)
+{
+    struct termios attr;
+    char* slavePath;
+    int32_t slaveFd;
+
+    masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (masterFd == -1 || grantpt(masterFd) || unlockpt(masterFd) ||
+            (slavePath = ptsname(masterFd)) == NULL)
+    {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    /* Hold the slave open, or the master hangs up whenever MotorDriver
+     * isn't connected. It also gets a raw line discipline
+     */
+    slaveFd = open(slavePath, O_RDWR | O_NOCTTY);
+    if (slaveFd == -1 || tcgetattr(slaveFd, &attr))
+    {
+        perror(slavePath);
+        return -1;
+    }
+    cfmakeraw(&attr);
+    tcsetattr(slaveFd, TCSANOW, &attr);
+
+    fcntl(masterFd, F_SETFL, fcntl(masterFd, F_GETFL, 0) | O_NONBLOCK);
+
+    printf("Qik 2s9v1 emulator on %s\n", slavePath);
+    if (linkPath != NULL)
+    {
+        unlink(linkPath);
+        if (symlink(slavePath, linkPath))
+        {
+            perror(linkPath);
+            return -1;
+        }
+        printf("Linked from %s\n", linkPath);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Print the usage
+ *
+ * @param name The program name
+ */
+void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -l path  Symlink the pty to path\n"
+            "  -b baud  Baud rate to pace bytes at (%d)\n"
+            "  -i id    Device ID (%d)\n"
+            "  -t param Initial SERIAL_TIMEOUT parameter (0, disabled)\n"
+            "  -f rate  Chance of a frame error per byte received\n"
+            "  -F rate  Chance of a format error per packet\n"
+            "  -D rate  Chance of dropping a response\n"
+            "  -d usec  Extra delay before every response\n"
+            "  -s seed  Fault injection random seed (1)\n"
+            "  -q       Only log errors\n",
+            name, DEFAULT_BAUD, DEFAULT_DEVICE_ID);
+}
+
+/**
+ * Run the emulator until it's killed
+ *
+ * @param argc The number of arguments
+ * @param argv The options, see usage()
+ * @return 1 for an error
+ */
+int main(int argc, char** argv)
+{
+    const char* linkPath = NULL;
+    struct pollfd pfd;
+    struct timespec timeout;
+    uint64_t now, next;
+    timedByte_t* due;
+    int32_t opt;
+
+    while ((opt = getopt(argc, argv, "l:b:i:t:f:F:D:d:s:q")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+            {
+                linkPath = optarg;
+                break;
+            }
+            case 'b':
+            {
+                baud = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'i':
+            {
+                config[DEVICE_ID] = strtoul(optarg, NULL, 0) & 0x7F;
+                break;
+            }
+            case 't':
+            {
+                config[SERIAL_TIMEOUT] = strtoul(optarg, NULL, 0) & 0x7F;
+                break;
+            }
+            case 'f':
+            {
+                frameErrorRate = strtod(optarg, NULL);
+                break;
+            }
+            case 'F':
+            {
+                formatErrorRate = strtod(optarg, NULL);
+                break;
+            }
+            case 'D':
+            {
+                dropRate = strtod(optarg, NULL);
+                break;
+            }
+            case 'd':
+            {
+                responseDelay = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 's':
+            {
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'q':
+            {
+                quiet = 1;
+                break;
+            }
+            default:
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    if (baud == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Writes to a pty nobody has open shouldn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (openPty(linkPath))
+    {
+        return 1;
+    }
+
+    startTime = nowUsec();
+    lastPacketTime = startTime;
+    pfd.fd = masterFd;
+    pfd.events = POLLIN;
+
+    while (1)
+    {
+        now = nowUsec();
+
+        /* Clock received bytes into the parser as their last bit arrives */
+        while (rxQueue.head != rxQueue.tail &&
+                rxQueue.bytes[rxQueue.head].due <= now)
+        {
+            processByte(rxQueue.bytes[rxQueue.head].byte);
+            rxQueue.head = (rxQueue.head + 1) % BYTE_QUEUE_SIZE;
+        }
+
+        /* And hand responses over as their last bit leaves */
+        while (txQueue.head != txQueue.tail &&
+                txQueue.bytes[txQueue.head].due <= now)
+        {
+            due = &txQueue.bytes[txQueue.head];
+            if (write(masterFd, &due->byte, 1) < 0 && errno == EAGAIN)
+            {
+                break;
+            }
+            txQueue.head = (txQueue.head + 1) % BYTE_QUEUE_SIZE;
+        }
+
+        checkSerialTimeout(now);
+
+        /* Sleep until the next byte is due, or something is written */
+        next = 0;
+        if (rxQueue.head != rxQueue.tail)
+        {
+            next = rxQueue.bytes[rxQueue.head].due;
+        }
+        if (txQueue.head != txQueue.tail &&
+                (next == 0 || txQueue.bytes[txQueue.head].due < next))
+        {
+            next = txQueue.bytes[txQueue.head].due;
+        }
+        if (serialTimeoutUsec() != 0 &&
+                (next == 0 || lastPacketTime + serialTimeoutUsec() < next))
+        {
+            next = lastPacketTime + serialTimeoutUsec();
+        }
+
+        now = nowUsec();
+        if (next == 0)
+        {
+            next = now + 1000000;
+        }
+        next = (next > now) ? next - now : 0;
+        timeout.tv_sec = next / 1000000;
+        timeout.tv_nsec = (next % 1000000) * 1000;
+
+        if (ppoll(&pfd, 1, &timeout, NULL) > 0 && (pfd.revents & POLLIN))
+        {
+            receiveBytes();
+        }
+    }
+
+    return 0;
+}